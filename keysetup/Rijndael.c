@@ -364,4 +364,37 @@ void Decrypt256_256( const word8 in[ 32 ], word8 out[ 32 ], const word8 key[ 32
 	ROUNDS = numrounds[ KC - 4 ][ BC - 4 ];
 
 	_Decrypt( in, out, key );
+}
+
+/*!
+	\brief Decrypts \p numBlocks blocks with the same key, expanding the key only once.
+*/
+void DecryptBlocks256_256( const word8 ( *in )[ 32 ], word8 ( *out )[ 32 ], const unsigned numBlocks, const word8 key[ 32 ] )
+{
+	KC = 8;
+	BC = 8;
+	ROUNDS = numrounds[ KC - 4 ][ BC - 4 ];
+
+	word8 a[ 4 ][ MAXBC ];
+	word8 rk[ MAXROUNDS + 1 ][ 4 ][ MAXBC ];
+	word8 sk[ 4 ][ MAXKC ];
+
+	for( unsigned col = 0; col < KC; ++col )
+		for( unsigned row = 0; row < 4; ++row )
+			sk[ row ][ col ] = key[ col * 4 + row ];
+
+	KeyExpansion( sk, rk );
+
+	for( unsigned u = 0; u < numBlocks; ++u )
+	{
+		for( unsigned col = 0; col < BC; ++col )
+			for( unsigned row = 0; row < 4; ++row )
+				a[ row ][ col ] = in[ u ][ col * 4 + row ];
+
+		Decrypt( a, rk );
+
+		for( unsigned col = 0; col < BC; ++col )
+			for( unsigned row = 0; row < 4; ++row )
+				out[ u ][ col * 4 + row ] = a[ row ][ col ];
+	}
 }
\ No newline at end of file
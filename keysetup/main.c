@@ -2,12 +2,26 @@
 	pem [key id]
 	wrap [key id] [key]
 	unwrap [key id] [key]
+	batch [key id] [wrap|unwrap] [file]
+	genkeys [key id] [count] [directory]
 */
 
+#ifdef WIN32
+#	define _CRT_RAND_S	//Needed for rand_s
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#ifdef WIN32
+#	include <io.h>
+#	include <windows.h>
+#else
+#	include <unistd.h>
+#	include <sys/random.h>
+#endif
 #include <ykpiv/pkcs11y.h>
 #include <loadkey/loadkey.h>
 #include "Rijndael.h"
@@ -17,6 +31,16 @@
 #	define stricmp	strcasecmp
 #endif
 
+#define BATCH_MAX_LINE	8192
+#define GENKEYS_MAX		4096
+
+typedef struct batchentry_s
+{
+	block256_t ymmKey;
+	char *szDataset;
+	char *szPath;
+} batchentry_t;
+
 static bool ReadKey( block256_t *const ymmKey, const char *sz )
 {
 	if( strlen( sz ) != 64 )
@@ -39,6 +63,200 @@ static bool ReadKey( block256_t *const ymmKey, const char *sz )
 	return true;
 }
 
+/*!
+	\brief Clears key material before its memory is released. Unlike memset, this can't be dropped as dead store.
+*/
+static void WipeKeys( block256_t *const aKeys, const size_t numKeys )
+{
+#ifdef WIN32
+	SecureZeroMemory( aKeys, numKeys * sizeof( block256_t ) );
+#else
+	explicit_bzero( aKeys, numKeys * sizeof( block256_t ) );
+#endif
+}
+
+static void FreeBatch( batchentry_t *const aEntries, const size_t numEntries )
+{
+	for( size_t u = 0; u < numEntries; ++u )
+	{
+		WipeKeys( &aEntries[ u ].ymmKey, 1 );
+		free( aEntries[ u ].szDataset );
+		free( aEntries[ u ].szPath );
+	}
+	free( aEntries );
+}
+
+/*!
+	\brief Reads lines of "dataset key [path]" from \p szFile ("-" for stdin). Empty lines and lines starting with '#' are skipped.
+	\details Lines longer than BATCH_MAX_LINE are rejected. After reading stdin, it is reopened on the terminal, where YK_ReadPIN reads the PIN from.
+		If no path is given, it defaults to "/" followed by the dataset with '/' replaced by '_' and the extension ".key".
+*/
+static batchentry_t *ReadBatch( const char *const szFile, size_t *const pnumEntries )
+{
+	FILE *const f = strcmp( szFile, "-" ) ? fopen( szFile, "re" ) : stdin;
+	if( !f )
+	{
+		fprintf( stderr, "Failed to open \"%s\".\n", szFile );
+		return NULL;
+	}
+
+	batchentry_t *aEntries = NULL;
+	size_t numEntries = 0;
+	char szLine[ BATCH_MAX_LINE ];
+	for( unsigned uLine = 1; fgets( szLine, sizeof( szLine ), f ); ++uLine )
+	{
+		if( !strchr( szLine, '\n' ) && !feof( f ) )
+		{
+			fprintf( stderr, "Line %u: Longer than %d characters.\n", uLine, BATCH_MAX_LINE - 2 );
+			goto ERROR_AFTER_ENTRIES;
+		}
+
+		const char *const szDataset = strtok( szLine, " \t\r\n" );
+		if( !szDataset || szDataset[ 0 ] == '#' )
+			continue;
+
+		const char *const szKey = strtok( NULL, " \t\r\n" );
+		const char *const szPath = strtok( NULL, "\r\n" );
+		if( !szKey )
+		{
+			fprintf( stderr, "Line %u: Missing key.\n", uLine );
+			goto ERROR_AFTER_ENTRIES;
+		}
+
+		batchentry_t *const p = realloc( aEntries, ( numEntries + 1 ) * sizeof( batchentry_t ) );
+		if( !p )
+			goto ERROR_ALLOC;
+		aEntries = p;
+
+		batchentry_t *const pEntry = &aEntries[ numEntries++ ];
+		pEntry->szDataset = strdup( szDataset );
+		pEntry->szPath = NULL;
+		if( !pEntry->szDataset )
+			goto ERROR_ALLOC;
+
+		if( !ReadKey( &pEntry->ymmKey, szKey ) )
+		{
+			fprintf( stderr, "Line %u: Invalid key.\n", uLine );
+			goto ERROR_AFTER_ENTRIES;
+		}
+
+		if( szPath && szPath[ strspn( szPath, " \t" ) ] )
+			pEntry->szPath = strdup( szPath + strspn( szPath, " \t" ) );
+		else if( pEntry->szPath = malloc( strlen( szDataset ) + sizeof( "/.key" ) ) )
+		{
+			char *pOut = pEntry->szPath;
+			*pOut++ = '/';
+			for( const char *pIn = szDataset; *pIn; ++pIn )
+				*pOut++ = *pIn == '/' ? '_' : *pIn;
+			strcpy( pOut, ".key" );
+		}
+
+		if( !pEntry->szPath )
+			goto ERROR_ALLOC;
+	}
+
+	if( ferror( f ) )
+	{
+		fprintf( stderr, "Failed to read \"%s\".\n", szFile );
+		goto ERROR_AFTER_ENTRIES;
+	}
+
+	if( f != stdin )
+		fclose( f );
+	else if( !freopen( "/dev/tty", "re", stdin ) )
+	{
+		//Otherwise YK_ReadPIN would wait for digits at the end of the batch forever
+		fputs( "Reading the batch from stdin requires a terminal to enter the PIN.\n", stderr );
+		FreeBatch( aEntries, numEntries );
+		return NULL;
+	}
+
+	if( !numEntries )
+	{
+		fputs( "No dataset keys provided.\n", stderr );
+		return NULL;
+	}
+
+	*pnumEntries = numEntries;
+	return aEntries;
+
+ERROR_ALLOC:
+	fputs( "Failed to allocate memory for dataset keys.\n", stderr );
+ERROR_AFTER_ENTRIES:
+	FreeBatch( aEntries, numEntries );
+	if( f != stdin )
+		fclose( f );
+	return NULL;
+}
+
+/*!
+	\brief Fills \p aKeys with \p numKeys keys from the system's cryptographically secure random number generator.
+*/
+static bool GenerateKeys( block256_t *const aKeys, const unsigned numKeys )
+{
+#ifdef WIN32
+	for( unsigned u = 0; u < numKeys; ++u )
+		for( unsigned uWord = 0; uWord < sizeof( aKeys[ u ].ab ) / sizeof( unsigned ); ++uWord )
+		{
+			unsigned uRandom;
+			if( rand_s( &uRandom ) )
+			{
+				fputs( "Failed to generate random keys.\n", stderr );
+				return false;
+			}
+			memcpy( &aKeys[ u ].ab[ uWord * sizeof( unsigned ) ], &uRandom, sizeof( unsigned ) );
+		}
+#else
+	for( unsigned u = 0; u < numKeys; ++u )
+		for( size_t numDone = 0; numDone < sizeof( aKeys[ u ].ab ); )
+		{
+			const ssize_t numRead = getrandom( aKeys[ u ].ab + numDone, sizeof( aKeys[ u ].ab ) - numDone, 0 );
+			if( numRead < 0 )
+			{
+				if( errno == EINTR )
+					continue;
+				fputs( "Failed to generate random keys.\n", stderr );
+				return false;
+			}
+			numDone += (size_t) numRead;
+		}
+#endif
+
+	return true;
+}
+
+/*!
+	\brief Writes \p pymmKey as raw keyfile (keyformat=raw) to \p szPath. Existing files are never overwritten.
+*/
+static bool WriteKeyFile( const char *const szPath, const block256_t *const pymmKey )
+{
+#ifdef WIN32
+	const int fd = open( szPath, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600 );
+#else
+	const int fd = open( szPath, O_WRONLY | O_CREAT | O_EXCL, 0600 );
+#endif
+	if( fd < 0 )
+	{
+		fprintf( stderr, "Failed to create keyfile \"%s\".\n", szPath );
+		return false;
+	}
+
+	if( write( fd, pymmKey->ab, sizeof( pymmKey->ab ) ) != sizeof( pymmKey->ab ) )
+	{
+		fprintf( stderr, "Failed to write keyfile \"%s\".\n", szPath );
+		close( fd );
+		return false;
+	}
+
+	if( close( fd ) < 0 )
+	{
+		fprintf( stderr, "Failed to close keyfile \"%s\".\n", szPath );
+		return false;
+	}
+
+	return true;
+}
+
 int main( int argc, char *argv[ ] )
 {
 	enum
@@ -47,8 +265,14 @@ int main( int argc, char *argv[ ] )
 		CMD_WRAP,
 		CMD_UNWRAP,
 		CMD_CWRAP,
-		CMD_CUNWRAP
+		CMD_CUNWRAP,
+		CMD_BATCH,
+		CMD_GENKEYS
 	} eCmd;
+	bool fBatchWrap;
+	unsigned numGenKeys;
+	batchentry_t *aBatch = NULL;
+	size_t numBatch = 0;
 
 	//Initialize syslog for loadkey
 	openlog( "keysetup", LOG_CONS | LOG_PERROR, LOG_USER );
@@ -78,10 +302,31 @@ int main( int argc, char *argv[ ] )
 			eCmd = CMD_CWRAP;
 		else if( !stricmp( argv[ 1 ], "cunwrap" ) )
 			eCmd = CMD_CUNWRAP;
+		else if( !stricmp( argv[ 1 ], "batch" ) && ( !stricmp( argv[ 3 ], "wrap" ) || !stricmp( argv[ 3 ], "unwrap" ) ) )
+		{
+			eCmd = CMD_BATCH;
+			fBatchWrap = !stricmp( argv[ 3 ], "wrap" );
+		}
+		else if( !stricmp( argv[ 1 ], "genkeys" ) )
+		{
+			char *szEnd;
+			const unsigned long u = strtoul( argv[ 3 ], &szEnd, 10 );
+			if( szEnd[ 0 ] || !u || u > GENKEYS_MAX )
+			{
+				fprintf( stderr, "Key count \"%s\" must be a number between 1 and %u.\n", argv[ 3 ], GENKEYS_MAX );
+				iRet = EXIT_FAILURE;
+				goto ERROR_AFTER_LOG;
+			}
+
+			eCmd = CMD_GENKEYS;
+			numGenKeys = (unsigned) u;
+		}
 		else
 		{
 PRINT_ARGS:
-			fputs( "Arguments are:\n\tpem [key id]\n\twrap [key id] [key]\n\tunwrap [key id] [key]\n\tcwrap [kek] [key]\n\tcunwrap [kek] [key]\n", stderr );
+			fputs( "Arguments are:\n\tpem [key id]\n\twrap [key id] [key]\n\tunwrap [key id] [key]\n\tcwrap [kek] [key]\n\tcunwrap [kek] [key]\n\tbatch [key id] [wrap|unwrap] [file]\n\tgenkeys [key id] [count] [directory]\n"
+				"Batch mode reads lines of \"dataset key [path]\" from the file (or stdin if omitted or \"-\", the PIN is then read from the terminal) and performs all operations with a single login.\n"
+				"Genkeys creates random keys as raw keyfiles 1.key to [count].key in the directory (default: current) and prints each file's wrapped key.\n", stderr );
 			iRet = EXIT_FAILURE;
 			goto ERROR_AFTER_LOG;
 		}
@@ -127,6 +372,13 @@ PRINT_ARGS:
 		idKey = (unsigned char) u;
 	}
 
+	//Read all input before asking for the PIN
+	if( eCmd == CMD_BATCH && !( aBatch = ReadBatch( argc > 4 ? argv[ 4 ] : "-", &numBatch ) ) )
+	{
+		iRet = EXIT_FAILURE;
+		goto ERROR_AFTER_LOG;
+	}
+
 	if( !YK_StartPCSCD( ) )
 	{
 		iRet = EXIT_FAILURE;
@@ -162,6 +414,89 @@ PRINT_ARGS:
 			printf( "%02X", pem.ab[ u ] );
 		puts( "" );
 	}
+	else if( eCmd == CMD_GENKEYS )
+	{
+		if( !YK_LoadKEK( &session, idKey, &pem, &ymmKEK ) )
+		{
+			iRet = EXIT_FAILURE;
+			goto ERROR_AFTER_LOGIN;
+		}
+
+		block256_t *const aKeys = malloc( 2 * numGenKeys * sizeof( block256_t ) );
+		if( !aKeys )
+		{
+			fputs( "Failed to allocate memory for keys.\n", stderr );
+			iRet = EXIT_FAILURE;
+			goto ERROR_AFTER_LOGIN;
+		}
+		block256_t *const aWrapped = aKeys + numGenKeys;
+
+		if( !GenerateKeys( aKeys, numGenKeys ) )
+			iRet = EXIT_FAILURE;
+		else
+		{
+			//Wrap all keys using a single key expansion of the KEK
+			DecryptBlocks256_256( (const word8 ( * )[ 32 ]) aKeys, (word8 ( * )[ 32 ]) aWrapped, numGenKeys, ymmKEK.ab );
+
+			const char *const szDirectory = argc > 4 ? argv[ 4 ] : ".";
+			char szPath[ 4096 ];
+			for( unsigned uKey = 0; uKey < numGenKeys; ++uKey )
+			{
+				snprintf( szPath, sizeof( szPath ), "%s/%u.key", szDirectory, uKey + 1 );
+				if( !WriteKeyFile( szPath, &aKeys[ uKey ] ) )
+				{
+					iRet = EXIT_FAILURE;
+					break;
+				}
+
+				printf( "%s ", szPath );
+				for( unsigned u = 0; u < 32; ++u )
+					printf( "%02X", aWrapped[ uKey ].ab[ u ] );
+				puts( "" );
+			}
+		}
+
+		WipeKeys( aKeys, numGenKeys );
+		free( aKeys );
+	}
+	else if( eCmd == CMD_BATCH )
+	{
+		if( !YK_LoadKEK( &session, idKey, &pem, &ymmKEK ) )
+		{
+			iRet = EXIT_FAILURE;
+			goto ERROR_AFTER_LOGIN;
+		}
+
+		//Wrapping results in a DATASETS string, unwrapping in one "dataset key" line per entry
+		if( fBatchWrap )
+			fputs( "DATASETS: ", stdout );
+		for( size_t uEntry = 0; uEntry < numBatch; ++uEntry )
+		{
+			block256_t ymmOut;
+			if( fBatchWrap )
+			{
+				Decrypt256_256( aBatch[ uEntry ].ymmKey.ab, ymmOut.ab, ymmKEK.ab );
+				printf( "%s%s;", uEntry ? ";" : "", aBatch[ uEntry ].szDataset );
+			}
+			else
+			{
+				Encrypt256_256( aBatch[ uEntry ].ymmKey.ab, ymmOut.ab, ymmKEK.ab );
+				printf( "%s ", aBatch[ uEntry ].szDataset );
+			}
+
+			for( unsigned u = 0; u < 32; ++u )
+				printf( "%02X", ymmOut.ab[ u ] );
+
+			WipeKeys( &ymmOut, 1 );
+
+			if( fBatchWrap )
+				printf( ";%s", aBatch[ uEntry ].szPath );
+			else
+				puts( "" );
+		}
+		if( fBatchWrap )
+			puts( "" );
+	}
 	else
 	{
 		if( !ReadKey( &ymmKey, argv[ 3 ]) )
@@ -197,6 +532,7 @@ WRAP_UNWRAP_KEY:
 		for( unsigned u = 0; u < 32; ++u )
 			printf( "%02X", ymmOut.ab[ u ] );
 		puts( "" );
+		WipeKeys( &ymmOut, 1 );
 	}
 
 ERROR_AFTER_LOGIN:
@@ -206,6 +542,10 @@ ERROR_AFTER_PCSCD:
 	if( eCmd != CMD_CWRAP && eCmd != CMD_CUNWRAP )
 		YK_StopPCSCD( );
 ERROR_AFTER_LOG:
+	//Every exit passes here, also those before the keys were read
+	WipeKeys( &ymmKEK, 1 );
+	WipeKeys( &ymmKey, 1 );
+	FreeBatch( aBatch, numBatch );
 	closelog( );
 	return iRet;
 }
\ No newline at end of file
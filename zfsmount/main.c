@@ -1,8 +1,16 @@
+#include <stdio.h>
 #include <stdlib.h>
-#include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <loadkey/loadkey.h>
 #include <zfstools/zfstools.h>
 
@@ -11,16 +19,255 @@
 
 static const pem_t g_PEM = { PEM };
 
-#define DATASET( szDataset, ymmKey, szPath )	if( !LoadWrappedKey( ymmKEK, szDataset, ymmKey ) ) goto ERROR_AFTER_FD;
+//The vdevs are known at build time, so their label reads need neither a scan of POOL_VDEVS nor any allocation
+static const char *const g_aszVDevs[ ] =
+{
+#	define VDEV( szVDev )	szVDev,
+#	include <shared/vdevs.h>
+#	undef VDEV
+};
+ZT_VDEV_READS( g_VDevReads, XSTR( POOL_VDEVS ), g_aszVDevs );
+
+#define DATASET( szDataset, ymmKey, szPath )	if( !LoadWrappedKey( pContext, ymmKEK, szDataset, ymmKey ) ) goto ERROR_AFTER_CONTEXT;
 
-static inline bool LoadWrappedKey( const block256_t ymmKEK, const char *const szDataset, block256_t ymmKey )
+static inline bool LoadWrappedKey( zt_context_t *const pContext, const block256_t ymmKEK, const char *const szDataset, block256_t ymmKey )
 {
 	YK_Unwrap( &ymmKey, ymmKEK );
-	return LoadPoolKey( szDataset, ymmKey.ab );
+	return LoadPoolKey( pContext, szDataset, ymmKey.ab );
+}
+
+typedef struct keymapentry_s
+{
+	block256_t ymmKey;	//Wrapped
+	char *szDataset;
+} keymapentry_t;
+
+/*!
+	\brief Wrapped keys of encryption roots, read at runtime so new encryption roots don't require a rebuild.
+*/
+typedef struct keymap_s
+{
+	keymapentry_t *aEntries;
+	size_t numEntries;
+	block256_t ymmKEK;
+} keymap_t;
+
+static bool ParseKey( block256_t *const pymmKey, const char *const sz )
+{
+	if( strlen( sz ) != 64 )
+		return false;
+
+	unsigned uValue;
+	for( unsigned u = 0; u < 32; ++u )
+	{
+		if( sscanf( &sz[ u * 2 ], "%2x", &uValue ) != 1 )
+			return false;
+		pymmKey->ab[ u ] = (unsigned char) uValue;
+	}
+
+	return true;
+}
+
+static void FreeKeyMap( keymap_t *const pMap )
+{
+	for( size_t u = 0; u < pMap->numEntries; ++u )
+		free( pMap->aEntries[ u ].szDataset );
+	free( pMap->aEntries );
+	pMap->aEntries = NULL;
+	pMap->numEntries = 0;
+}
+
+/*!
+	\brief Reads the key map at \p szPath. Each line holds an encryption root and its wrapped key (64 hexadecimal characters), separated by whitespace. Lines starting with '#' are ignored.
+	\details A missing file is treated as an empty map.
+*/
+static bool LoadKeyMap( const char *const szPath, keymap_t *const pMap )
+{
+	FILE *const f = fopen( szPath, "re" );
+	if( !f )
+	{
+		if( errno == ENOENT )
+			return true;
+
+		syslog( LOG_ERR, "Failed to open key map \"%s\".", szPath );
+		return false;
+	}
+
+	char *szLine = NULL;
+	size_t numAllocated = 0;
+	for( unsigned uLine = 1; getline( &szLine, &numAllocated, f ) > 0; ++uLine )
+	{
+		char *szSave;
+		const char *const szDataset = strtok_r( szLine, " \t\n", &szSave );
+		if( !szDataset || szDataset[ 0 ] == '#' )
+			continue;
+
+		keymapentry_t entry;
+		const char *const szKey = strtok_r( NULL, " \t\n", &szSave );
+		if( !szKey || !ParseKey( &entry.ymmKey, szKey ) )
+		{
+			syslog( LOG_WARNING, "Ignoring invalid line %u of key map \"%s\".", uLine, szPath );
+			continue;
+		}
+
+		keymapentry_t *const p = realloc( pMap->aEntries, ( pMap->numEntries + 1 ) * sizeof( keymapentry_t ) );
+		if( !p || !( entry.szDataset = strdup( szDataset ) ) )
+		{
+			syslog( LOG_ERR, "Failed to allocate memory for key map." );
+			if( p )
+				pMap->aEntries = p;
+			free( szLine );
+			fclose( f );
+			FreeKeyMap( pMap );
+			return false;
+		}
+
+		pMap->aEntries = p;
+		pMap->aEntries[ pMap->numEntries++ ] = entry;
+	}
+
+	free( szLine );
+	fclose( f );
+	return true;
+}
+
+static bool LoadMappedKey( zt_context_t *const pContext, const char *const szEncryptionRoot, void *const pUser )
+{
+	const keymap_t *const pMap = pUser;
+	for( size_t u = 0; u < pMap->numEntries; ++u )
+		if( !strcmp( pMap->aEntries[ u ].szDataset, szEncryptionRoot ) )
+			return LoadWrappedKey( pContext, pMap->ymmKEK, szEncryptionRoot, pMap->aEntries[ u ].ymmKey );
+
+	syslog( LOG_WARNING, "No wrapped key for encryption root \"%s\" in key map \"%s\".", szEncryptionRoot, XSTR( KEY_MAP_PATH ) );
+	return false;
+}
+
+#ifdef PREPARE_MOUNTPOINTS
+static void *PrepareMountPoints( void *pArg )
+{
+	(void) CreatePoolMountPoints( pArg, XSTR( POOL_VDEVS ), XSTR( POOL_NAME ), POOL_ID );
+	return NULL;
 }
+#endif
+
+#ifdef MOUNT_NOTIFY_PATH
+/*!
+	\brief Opens the FIFO or unix datagram socket at \p szPath for the readiness notifications of the mounted datasets.
+	\return The handle, or -1 if there is no listener. Writes never block, so a stalled listener can't hold up the boot.
+*/
+static int OpenMountNotify( const char *const szPath )
+{
+	struct stat st;
+	if( stat( szPath, &st ) )
+	{
+		syslog( LOG_WARNING, "No listener for mount notifications at \"%s\".", szPath );
+		return -1;
+	}
+
+	if( S_ISFIFO( st.st_mode ) )
+	{
+		const int fd = open( szPath, O_WRONLY | O_NONBLOCK | O_CLOEXEC );
+		if( fd < 0 )
+			syslog( LOG_WARNING, "Failed to open mount notification FIFO \"%s\".", szPath );
+		return fd;
+	}
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if( !S_ISSOCK( st.st_mode ) || strlen( szPath ) >= sizeof( addr.sun_path ) )
+	{
+		syslog( LOG_WARNING, "Mount notification path \"%s\" is neither a FIFO nor a unix socket.", szPath );
+		return -1;
+	}
+	strcpy( addr.sun_path, szPath );
+
+	const int fd = socket( AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	if( fd < 0 || connect( fd, (const struct sockaddr*) &addr, sizeof( addr ) ) )
+	{
+		syslog( LOG_WARNING, "Failed to connect to mount notification socket \"%s\".", szPath );
+		if( fd >= 0 )
+			(void) close( fd );
+		return -1;
+	}
+
+	return fd;
+}
+
+/*!
+	\brief Sends "dataset<TAB>mountpoint<LF>" for a mounted dataset, as a single datagram or an atomic write to the FIFO.
+*/
+static void NotifyMountListener( const char *const szDataset, const char *const szMountPoint, void *const pUser )
+{
+	const int fd = *(const int*) pUser;
+	char szMessage[ PIPE_BUF ];
+	const int lenMessage = snprintf( szMessage, sizeof( szMessage ), "%s\t%s\n", szDataset, szMountPoint );
+	if( lenMessage < 0 || (size_t) lenMessage >= sizeof( szMessage ) )
+		syslog( LOG_WARNING, "Mount notification for dataset \"%s\" is too long.", szDataset );
+	else if( write( fd, szMessage, (size_t) lenMessage ) != lenMessage )
+		syslog( LOG_WARNING, "Failed to send mount notification for dataset \"%s\".", szDataset );
+}
+#endif
 
 int main( int argc, char *argv[ ] )
 {
+	enum
+	{
+		MODE_MOUNT,
+		MODE_DUMP_CONFIG,
+		MODE_DUMP_LABELS,
+		MODE_EXPORT
+	} eMode = MODE_MOUNT;
+	dumpformat_t eFormat = DUMP_TEXT;
+	bool fLazy = false;
+	bool fBackground = false;
+
+	for( int i = 1; i < argc; ++i )
+	{
+		if( !strcmp( argv[ i ], "--dump-config" ) )
+			eMode = MODE_DUMP_CONFIG;
+		else if( !strcmp( argv[ i ], "--dump-labels" ) )
+			eMode = MODE_DUMP_LABELS;
+		else if( !strcmp( argv[ i ], "--export" ) )
+			eMode = MODE_EXPORT;
+		else if( !strcmp( argv[ i ], "--json" ) )
+			eFormat = DUMP_JSON;
+		else if( !strcmp( argv[ i ], "--lazy" ) )
+			fLazy = true;
+		else if( !strcmp( argv[ i ], "--background" ) )
+			fBackground = true;
+		else
+		{
+			fprintf( stderr, "Unknown argument \"%s\". Arguments are:\n\t--dump-config\tPrint the pool configuration assembled from the vdev labels\n\t--dump-labels\tPrint the label configuration of each vdev\n\t--export\tUnmount all datasets and export the pool\n\t--json\t\tUse JSON instead of text for dumps\n\t--lazy\t\tMount datasets on first access, except for those with org.zfstools:eager=on\n\t--background\tExit once datasets with a positive org.zfstools:mountpriority are mounted, mount the rest in the background\n", argv[ i ] );
+			return EXIT_FAILURE;
+		}
+	}
+
+	//Export only needs the ZFS device, no key
+	if( eMode == MODE_EXPORT )
+	{
+		openlog( "zfsmount", LOG_CONS | LOG_PERROR, LOG_DAEMON );
+
+		zt_context_t *const pContext = ZT_ContextCreate( NULL );
+		const bool fSuccess = pContext && ExportPool( pContext, XSTR( POOL_NAME ), false );
+		ZT_ContextDestroy( pContext );
+		closelog( );
+		return fSuccess ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	//Diagnostic modes only read the vdev labels. Neither a key nor the ZFS device is needed.
+	if( eMode != MODE_MOUNT )
+	{
+		openlog( "zfsmount", LOG_CONS | LOG_PERROR, LOG_USER );
+
+		zt_context_t *const pContext = ZT_ContextCreate( &(zt_options_t) { .fdZFS = -1, .fNoDevice = true } );
+		const bool fSuccess = pContext && ( eMode == MODE_DUMP_CONFIG
+			? DumpPoolConfig( pContext, STDOUT_FILENO, XSTR( POOL_VDEVS ), XSTR( POOL_NAME ), POOL_ID, eFormat )
+			: DumpVDevLabels( pContext, STDOUT_FILENO, XSTR( POOL_VDEVS ), eFormat ) );
+
+		ZT_ContextDestroy( pContext );
+		closelog( );
+		return fSuccess ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	openlog( "zfsmount", LOG_CONS, LOG_DAEMON );
 
 	//Load KEK
@@ -51,39 +298,89 @@ ERROR_AFTER_PCSCD:
 		YK_StopPCSCD( );
 	}
 	
-	if( libzfs_core_init( ) )
-	{
-		syslog( LOG_ERR, "Failed to initialize ZFS core." );
-		goto ERROR_AFTER_LOG;
-	}
+#ifdef MOUNT_NOTIFY_PATH
+	//Tell dependent services about each dataset as soon as it is mounted, instead of only once the whole pool is
+	(void) signal( SIGPIPE, SIG_IGN );
+	int fdNotify = OpenMountNotify( XSTR( MOUNT_NOTIFY_PATH ) );
+	zt_context_t *const pContext = ZT_ContextCreate( fdNotify < 0 ? NULL : &(zt_options_t) { .fdZFS = -1, .pfnMounted = NotifyMountListener, .pMountedUser = &fdNotify } );
+#else
+	zt_context_t *const pContext = ZT_ContextCreate( NULL );
+#endif
+	if( !pContext )
+		goto ERROR_AFTER_NOTIFY;
 
-	//This is basically what libzfs_core_init also does, except that libzfs_core does not expose g_fd.
-	const int fdZFS = open( ZFS_DEV, O_RDWR | O_CLOEXEC );
-	if( fdZFS < 0 )
+#ifdef PREPARE_MOUNTPOINTS
+	//Read the dataset tree from the vdevs to create mountpoints while the kernel imports the pool
+	pthread_t threadPrepare;
+	const bool fPreparing = !pthread_create( &threadPrepare, NULL, PrepareMountPoints, pContext );
+	if( !fPreparing )
+		syslog( LOG_WARNING, "Failed to start thread preparing mountpoints." );
+
+	const bool fImported = ImportPoolStatic( pContext, &g_VDevReads, XSTR( POOL_NAME ), POOL_ID );
+	if( fPreparing )
+		pthread_join( threadPrepare, NULL );
+#else
+	const bool fImported = ImportPoolStatic( pContext, &g_VDevReads, XSTR( POOL_NAME ), POOL_ID );
+#endif
+	if( !fImported )
 	{
-		syslog( LOG_ERR, "Failed to open handle to ZFS device." );
-		goto ERROR_AFTER_INIT;
+		(void) ReportVDevTimings( pContext, NULL );
+		goto ERROR_AFTER_CONTEXT;
 	}
 
-	if( !ImportPool( fdZFS, XSTR( POOL_VDEVS ), XSTR( POOL_NAME ), POOL_ID ) )
-		goto ERROR_AFTER_FD;
-
 	//Automatically generated DATASET calls
 #	include <shared/datasets.h>
 
-	if( !MountPool( fdZFS, XSTR( POOL_NAME ) ) )
-		goto ERROR_AFTER_FD;
+	//Discover and unlock the remaining encryption roots using the runtime key map.
+	//Without any mapped key there is nothing to unlock, so the pool isn't enumerated ahead of mounting. Datasets still locked then fail to mount by name.
+	{
+		keymap_t map = { .ymmKEK = ymmKEK };
+		if( !LoadKeyMap( XSTR( KEY_MAP_PATH ), &map ) )
+			goto ERROR_AFTER_CONTEXT;
+
+		const bool fUnlocked = !map.numEntries || LoadPoolKeys( pContext, XSTR( POOL_NAME ), LoadMappedKey, &map );
+		FreeKeyMap( &map );
+		if( !fUnlocked )
+			goto ERROR_AFTER_CONTEXT;
+	}
+
+#ifdef MOUNT_PLAN_PATH
+	const char *const szPlanPath = XSTR( MOUNT_PLAN_PATH );
+#else
+	const char *const szPlanPath = NULL;
+#endif
+	if( fLazy ? !MountPoolLazy( pContext, XSTR( POOL_NAME ) )
+		: fBackground ? !MountPoolBackground( pContext, XSTR( POOL_NAME ), szPlanPath )
+		: szPlanPath ? !MountPoolCached( pContext, XSTR( POOL_NAME ), szPlanPath ) : !MountPool( pContext, XSTR( POOL_NAME ) ) )
+		goto ERROR_AFTER_CONTEXT;
+
+	//Name vdevs that slowed down the label scan. The statistics usually live on the pool, so they are updated once it is mounted.
+#ifdef VDEV_STATS_PATH
+	(void) ReportVDevTimings( pContext, XSTR( VDEV_STATS_PATH ) );
+#else
+	(void) ReportVDevTimings( pContext, NULL );
+#endif
 
-	(void) close( fdZFS );
-	libzfs_core_fini( );
+#ifdef PREWARM_DEPTH
+	//Warm the metadata cache before dependent services start. Not being able to is no reason to fail the boot.
+	(void) PrewarmPool( pContext, XSTR( POOL_NAME ), &(zt_prewarmoptions_t) { .uDepth = PREWARM_DEPTH, .numMaxBytes = (uint64_t) PREWARM_MAX_MB << 20, .uMaxMilliseconds = PREWARM_MAX_MS }, NULL );
+#endif
 
+	ZT_ContextDestroy( pContext );
+#ifdef MOUNT_NOTIFY_PATH
+	if( fdNotify >= 0 )
+		(void) close( fdNotify );
+#endif
 	closelog( );
 	return EXIT_SUCCESS;
 
-ERROR_AFTER_FD:
-	(void) close( fdZFS );
-ERROR_AFTER_INIT:
-	libzfs_core_fini( );
+ERROR_AFTER_CONTEXT:
+	ZT_ContextDestroy( pContext );
+ERROR_AFTER_NOTIFY:
+#ifdef MOUNT_NOTIFY_PATH
+	if( fdNotify >= 0 )
+		(void) close( fdNotify );
+#endif
 ERROR_AFTER_LOG:
 	closelog( );
 	return EXIT_FAILURE;
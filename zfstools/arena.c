@@ -0,0 +1,138 @@
+#include "internal.h"
+#include <stdlib.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <syslog.h>
+
+/*
+	Bump allocator for libnvpair. Nvlists are carved from large blocks and nv_ao_free is a no-op,
+	so a whole import or enumeration phase is released at once using nv_alloc_reset (keeping the first block) or nv_alloc_fini.
+*/
+
+#define ARENA_ALIGNMENT	alignof( max_align_t )
+
+typedef struct arenablock_s
+{
+	struct arenablock_s *pNext;
+	size_t numSize;
+	size_t numUsed;
+	alignas( max_align_t ) unsigned char ab[ ];
+} arenablock_t;
+
+typedef struct arena_s
+{
+	arenablock_t *pBlocks;	//Most recent block first
+	size_t numBlockSize;
+} arena_t;
+
+static arenablock_t *ArenaAddBlock( arena_t *const pArena, const size_t numSize )
+{
+	arenablock_t *const pBlock = malloc( sizeof( arenablock_t ) + numSize );
+	if( !pBlock )
+		return NULL;
+
+	pBlock->pNext = pArena->pBlocks;
+	pBlock->numSize = numSize;
+	pBlock->numUsed = 0;
+	pArena->pBlocks = pBlock;
+	return pBlock;
+}
+
+static int ArenaOpInit( nv_alloc_t *const nva, va_list valist )
+{
+	arena_t *const pArena = malloc( sizeof( arena_t ) );
+	if( !pArena )
+		return ENOMEM;
+
+	pArena->pBlocks = NULL;
+	pArena->numBlockSize = va_arg( valist, size_t );
+	if( !ArenaAddBlock( pArena, pArena->numBlockSize ) )
+	{
+		free( pArena );
+		return ENOMEM;
+	}
+
+	nva->nva_arg = pArena;
+	return 0;
+}
+
+static void *ArenaOpAlloc( nv_alloc_t *const nva, const size_t numSize )
+{
+	arena_t *const pArena = nva->nva_arg;
+	const size_t numAligned = ( numSize + ARENA_ALIGNMENT - 1 ) & ~( ARENA_ALIGNMENT - 1 );
+
+	arenablock_t *pBlock = pArena->pBlocks;
+	if( pBlock->numSize - pBlock->numUsed < numAligned )
+	{
+		//Oversized requests get a block of their own
+		if( !( pBlock = ArenaAddBlock( pArena, numAligned > pArena->numBlockSize ? numAligned : pArena->numBlockSize ) ) )
+			return NULL;
+	}
+
+	void *const p = pBlock->ab + pBlock->numUsed;
+	pBlock->numUsed += numAligned;
+	return p;
+}
+
+static void ArenaOpFree( nv_alloc_t *const nva, void *const p, const size_t numSize )
+{
+	//Released with the arena
+	(void) nva;
+	(void) p;
+	(void) numSize;
+}
+
+static void ArenaOpReset( nv_alloc_t *const nva )
+{
+	arena_t *const pArena = nva->nva_arg;
+
+	//Keep the oldest block, which has the default size
+	arenablock_t *pBlock = pArena->pBlocks;
+	while( pBlock->pNext )
+	{
+		arenablock_t *const pNext = pBlock->pNext;
+		free( pBlock );
+		pBlock = pNext;
+	}
+
+	pBlock->numUsed = 0;
+	pArena->pBlocks = pBlock;
+}
+
+static void ArenaOpFini( nv_alloc_t *const nva )
+{
+	arena_t *const pArena = nva->nva_arg;
+	for( arenablock_t *pBlock = pArena->pBlocks; pBlock; )
+	{
+		arenablock_t *const pNext = pBlock->pNext;
+		free( pBlock );
+		pBlock = pNext;
+	}
+
+	free( pArena );
+	nva->nva_arg = NULL;
+}
+
+static const nv_alloc_ops_t g_ArenaOps =
+{
+	.nv_ao_init = ArenaOpInit,
+	.nv_ao_fini = ArenaOpFini,
+	.nv_ao_alloc = ArenaOpAlloc,
+	.nv_ao_free = ArenaOpFree,
+	.nv_ao_reset = ArenaOpReset
+};
+
+/*!
+	\brief Initializes \p nva as arena allocating in blocks of \p numBlockSize bytes. Release using nv_alloc_fini.
+*/
+bool ArenaInit( nv_alloc_t *const nva, const size_t numBlockSize )
+{
+	if( nv_alloc_init( nva, &g_ArenaOps, numBlockSize ) )
+	{
+		Log( LOG_ERR, "Failed to allocate nvlist arena." );
+		return false;
+	}
+
+	return true;
+}
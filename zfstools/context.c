@@ -0,0 +1,159 @@
+#include "internal.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+
+/*
+	The context a library call runs for is tracked per thread, so messages deep inside the implementation reach the logger of that context
+	without every helper taking it as parameter. Worker threads started by the library inherit it (see CONTEXT_SCOPE).
+*/
+
+#define LOG_MESSAGE_MAX	1024
+
+static _Thread_local const zt_context_t *t_pContext;
+
+/*!
+	\brief Creates a context. \p pOptions may be \c NULL for the defaults: open the ZFS device and log via syslog.
+	\return The context, to be released using ZT_ContextDestroy, or \c NULL on error.
+*/
+zt_context_t *ZT_ContextCreate( const zt_options_t *const pOptions )
+{
+	const zt_options_t options = pOptions ? *pOptions : (zt_options_t) { .fdZFS = -1 };
+	zt_context_t *const pContext = calloc( 1, sizeof( zt_context_t ) );
+	if( !pContext )
+	{
+		syslog( LOG_ERR, "Failed to allocate memory for context." );
+		return NULL;
+	}
+
+	pContext->pfnLog = options.pfnLog;
+	pContext->pLogUser = options.pLogUser;
+	pContext->pfnMounted = options.pfnMounted;
+	pContext->pMountedUser = options.pMountedUser;
+	const zt_context_t *const pPrevious = ContextEnter( pContext );
+
+	pContext->fdZFS = options.fdZFS;
+	if( pContext->fdZFS < 0 && !options.fNoDevice )
+	{
+		if( ( pContext->fdZFS = open( ZFS_DEV, O_RDWR | O_CLOEXEC ) ) < 0 )
+		{
+			Log( LOG_ERR, "Failed to open handle to ZFS device." );
+			goto ERROR_AFTER_CONTEXT;
+		}
+		pContext->fOwnFD = true;
+	}
+
+	if( !ArenaInit( &pContext->nva, ARENA_BLOCK_SIZE ) )
+		goto ERROR_AFTER_FD;
+
+	ContextLeave( &pPrevious );
+	return pContext;
+
+ERROR_AFTER_FD:
+	if( pContext->fOwnFD )
+		(void) close( pContext->fdZFS );
+ERROR_AFTER_CONTEXT:
+	ContextLeave( &pPrevious );
+	free( pContext );
+	return NULL;
+}
+
+void ZT_ContextDestroy( zt_context_t *const pContext )
+{
+	if( !pContext )
+		return;
+
+	for( unsigned u = 0; u < pContext->numWorkerArenas; ++u )
+		nv_alloc_fini( &pContext->anvaWorkers[ u ] );
+	nv_alloc_fini( &pContext->nva );
+	free( pContext->aVDevTimings );
+	if( pContext->fOwnFD )
+		(void) close( pContext->fdZFS );
+	free( pContext );
+}
+
+/*!
+	\brief Returns the scratch arena of unpack thread \p uWorker, 0 being the calling thread which uses the context's own arena.
+	\return The arena, or \c NULL if it could not be created.
+	\note Not thread-safe. Arenas are created before the threads using them are started.
+*/
+nv_alloc_t *ContextWorkerArena( zt_context_t *const pContext, const unsigned uWorker )
+{
+	if( !uWorker )
+		return &pContext->nva;
+
+	assert( uWorker < UNPACK_MAX_THREADS );
+	while( pContext->numWorkerArenas < uWorker )
+	{
+		if( !ArenaInit( &pContext->anvaWorkers[ pContext->numWorkerArenas ], ARENA_BLOCK_SIZE ) )
+			return NULL;
+		++pContext->numWorkerArenas;
+	}
+
+	return &pContext->anvaWorkers[ uWorker - 1 ];
+}
+
+/*!
+	\brief Releases all scratch memory of \p pContext, at the end of the calls using it.
+*/
+void ContextResetScratch( zt_context_t *const pContext )
+{
+	nv_alloc_reset( &pContext->nva );
+	for( unsigned u = 0; u < pContext->numWorkerArenas; ++u )
+		nv_alloc_reset( &pContext->anvaWorkers[ u ] );
+}
+
+/*!
+	\brief Makes \p pContext the context of the calling thread.
+	\return The previous context, to be restored using ContextLeave.
+*/
+const zt_context_t *ContextEnter( const zt_context_t *const pContext )
+{
+	const zt_context_t *const pPrevious = t_pContext;
+	t_pContext = pContext;
+	return pPrevious;
+}
+
+void ContextLeave( const zt_context_t *const *const ppPrevious )
+{
+	t_pContext = *ppPrevious;
+}
+
+const zt_context_t *ContextCurrent( void )
+{
+	return t_pContext;
+}
+
+/*!
+	\brief Reports a message to the logger of the calling thread's context. Without a context or logger, the message goes to syslog.
+*/
+void Log( const int iPriority, const char *const szFormat, ... )
+{
+	va_list valist;
+	va_start( valist, szFormat );
+
+	const zt_context_t *const pContext = t_pContext;
+	if( !pContext || !pContext->pfnLog )
+		vsyslog( iPriority, szFormat, valist );
+	else
+	{
+		char szMessage[ LOG_MESSAGE_MAX ];
+		(void) vsnprintf( szMessage, sizeof( szMessage ), szFormat, valist );
+		pContext->pfnLog( iPriority, szMessage, pContext->pLogUser );
+	}
+
+	va_end( valist );
+}
+
+/*!
+	\brief Tells the mount callback of the calling thread's context that \p szDataset is available at \p szMountPoint.
+*/
+void NotifyMounted( const char *const szDataset, const char *const szMountPoint )
+{
+	const zt_context_t *const pContext = t_pContext;
+	if( pContext && pContext->pfnMounted )
+		pContext->pfnMounted( szDataset, szMountPoint, pContext->pMountedUser );
+}
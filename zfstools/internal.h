@@ -0,0 +1,185 @@
+#pragma once
+#include "zfstools.h"
+#include <stddef.h>
+#include <assert.h>
+#include <sys/types.h>
+
+/*
+	Declarations shared between the translation units of the zfstools library. Not installed.
+*/
+
+#define MNTTYPE_ZFS	"zfs"
+#define CONFIG_BUF_MINSIZE	262144
+
+#define	VDEV_LABELS			4
+#define	VDEV_PHYS_SIZE		( 112 << 10 )
+#define	VDEV_PAD_SIZE		( 8 << 10 )
+#define	VDEV_UBERBLOCK_RING	( 128 << 10 )
+
+#define	ZEC_MAGIC	0x210da7ab10c7a11ULL
+
+typedef struct zio_cksum
+{
+	uint64_t zc_word[ 4 ];
+} zio_cksum_t;
+
+typedef struct zio_eck
+{
+	uint64_t zec_magic;		//For validation, endianness
+	zio_cksum_t zec_cksum;	//256-bit checksum
+} zio_eck_t;
+
+typedef struct vdev_phys
+{
+	char vp_nvlist[ VDEV_PHYS_SIZE - sizeof( zio_eck_t ) ];
+	zio_eck_t vp_zbt;
+} vdev_phys_t;
+
+typedef struct vdev_boot_envblock
+{
+	uint64_t vbe_version;
+	char vbe_bootenv[ VDEV_PAD_SIZE - sizeof( uint64_t ) - sizeof( zio_eck_t ) ];
+	zio_eck_t vbe_zbt;
+} vdev_boot_envblock_t;
+static_assert( sizeof( vdev_boot_envblock_t ) == VDEV_PAD_SIZE );
+
+typedef struct vdev_label
+{
+	char vl_pad1[ VDEV_PAD_SIZE ];				//8K
+	vdev_boot_envblock_t vl_be;					//8K
+	vdev_phys_t vl_vdev_phys;					//112K
+	char vl_uberblock[ VDEV_UBERBLOCK_RING ];	//128K
+} vdev_label_t;
+static_assert( sizeof( vdev_label_t ) == 262144 );
+
+/*!
+	\brief The uberblock a multihost activity check settled on. Passed to the kernel in the load_info of the config, so it doesn't repeat the check.
+*/
+typedef struct mmpcheck_s
+{
+	uint64_t uTxg;			//0 if no check was needed
+	uint64_t uTimestamp;
+	uint16_t uSeq;
+} mmpcheck_t;
+
+bool CheckPoolActivity( const char *szzVDevs, const char *szPool, mmpcheck_t *pCheck );
+
+typedef struct mountentry_s
+{
+	char *szDataset;
+	char *szMountPoint;
+} mountentry_t;
+
+/*!
+	\brief A growable list of mounted datasets, in the order they were mounted.
+*/
+typedef struct mountlist_s
+{
+	mountentry_t *aEntries;
+	size_t numEntries;
+	size_t numAllocated;
+} mountlist_t;
+
+bool MountListAdd( mountlist_t *pList, const char *szDataset, const char *szMountPoint );
+void MountListFree( mountlist_t *pList );
+bool UnmountList( const mountlist_t *pList, int iFlags );
+
+/*!
+	\brief The datasets of a pool that were already mounted when a mount operation started, hashed by dataset name.
+*/
+typedef struct mountset_s
+{
+	mountlist_t list;
+	size_t *auSlots;	//Index into list plus one, 0 for empty slots
+	size_t numSlots;	//Power of two
+} mountset_t;
+
+bool MountSetLoad( const char *szPool, mountset_t *pSet );
+const char *MountSetFind( const mountset_t *pSet, const char *szDataset );
+void MountSetFree( mountset_t *pSet );
+
+/*!
+	\brief Callback for WalkPool. Returning \c false stops the walk.
+*/
+typedef bool ( *pfnwalk_t )( const char *szDataset, nvlist_t *nvl, void *pUser );
+
+bool WalkPool( zt_context_t *pContext, const char *szPool, pfnwalk_t pfnDataset, void *pUser );
+int MakePath( char *szPath, mode_t mode );
+bool GetMountPoint( const char *szDataset, nvlist_t *nvl, const char *szAlternateRoot, size_t lenAlternateRoot, char **pszMountPoint );
+bool MountAt( const char *szDataset, char *szMountPoint, bool fReadonly, const mountset_t *pExisting, mountlist_t *pMounted );
+bool MountPoolOrdered( zt_context_t *pContext, const char *szPool, const char *szPlanPath, bool fBackground );
+void WaitForVDevReapers( void );
+
+#define ARENA_BLOCK_SIZE	( 256 * 1024 )
+
+bool ArenaInit( nv_alloc_t *nva, size_t numBlockSize );
+
+#define UNPACK_MAX_THREADS	16	//Threads unpacking vdev labels, including the calling thread
+
+struct zt_context_s
+{
+	int fdZFS;
+	bool fOwnFD;
+	pfnlog_t pfnLog;
+	void *pLogUser;
+	pfnmounted_t pfnMounted;
+	void *pMountedUser;
+	nv_alloc_t nva;	//Scratch arena, reset at the end of each call using it
+	nv_alloc_t anvaWorkers[ UNPACK_MAX_THREADS - 1 ];	//Scratch arenas of the label unpack threads, created on first use
+	unsigned numWorkerArenas;
+	zt_vdevtiming_t *aVDevTimings;	//Of the last label scan, followed by szzTimedVDevs in the same allocation
+	const char *szzTimedVDevs;
+	unsigned numTimedVDevs;
+};
+
+nv_alloc_t *ContextWorkerArena( zt_context_t *pContext, unsigned uWorker );
+void ContextResetScratch( zt_context_t *pContext );
+const zt_context_t *ContextEnter( const zt_context_t *pContext );
+void ContextLeave( const zt_context_t *const *ppPrevious );
+const zt_context_t *ContextCurrent( void );
+void Log( int iPriority, const char *szFormat, ... ) __attribute__(( format( printf, 2, 3 ) ));
+void NotifyMounted( const char *szDataset, const char *szMountPoint );
+
+/*!
+	\brief Makes \p pContext the context of the calling thread until the end of the enclosing scope. Used by every public entry point and worker thread.
+*/
+#define CONTEXT_SCOPE( pContext )	const zt_context_t *const pPreviousContext __attribute__(( cleanup( ContextLeave ), unused )) = ContextEnter( pContext )
+
+/*!
+	\brief Writes an NV_ENCODE_NATIVE nvlist stream sequentially. With a \c NULL buffer, the calls only sum up the size of the stream.
+	\note Every list (the top-level one, those of NVPackNVList and each element of NVPackNVListArray) is closed with NVPackListEnd.
+*/
+typedef struct nvpacker_s
+{
+	char *pBuffer;
+	size_t numUsed;
+} nvpacker_t;
+
+void NVPackHeader( nvpacker_t *pPacker );
+void NVPackListBegin( nvpacker_t *pPacker );
+void NVPackListEnd( nvpacker_t *pPacker );
+void NVPackUInt16( nvpacker_t *pPacker, const char *szName, uint16_t u );
+void NVPackUInt64( nvpacker_t *pPacker, const char *szName, uint64_t u );
+void NVPackString( nvpacker_t *pPacker, const char *szName, const char *sz );
+void NVPackUInt8Array( nvpacker_t *pPacker, const char *szName, const uint8_t *au, uint_t num );
+void NVPackUInt64Array( nvpacker_t *pPacker, const char *szName, const uint64_t *au, uint_t num );
+void NVPackNVList( nvpacker_t *pPacker, const char *szName );
+void NVPackNVListArray( nvpacker_t *pPacker, const char *szName, uint_t num );
+bool NVPackEmbedded( nvpacker_t *pPacker, nvlist_t *nvl, size_t numPacked );
+#ifndef NDEBUG
+bool NVPackVerify( const char *pBuffer, size_t numSize );
+#endif
+
+/*!
+	\brief Position of an nvlist within a packed NV_ENCODE_NATIVE buffer, for lookups without unpacking.
+*/
+typedef struct nvscan_s
+{
+	const char *p;
+	const char *pEnd;
+} nvscan_t;
+
+bool NVScanOpen( nvscan_t *pScan, const void *pBuffer, size_t numSize );
+bool NVScanLookupUInt64( const nvscan_t *pScan, const char *szName, uint64_t *pu );
+bool NVScanLookupString( const nvscan_t *pScan, const char *szName, const char **psz );
+bool NVScanLookupNVList( const nvscan_t *pScan, const char *szName, nvscan_t *pList );
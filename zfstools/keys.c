@@ -0,0 +1,161 @@
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zfs_cmd.h>
+#include <syslog.h>
+
+#define KEYLOAD_MAX_THREADS	8
+
+/*
+	Each encryption root has its own wrapping key, independent of its ancestors, so all roots can be unlocked in parallel.
+	An encryption root is a dataset whose encryptionroot property names itself. Enumeration is parents first, so a root is always seen before the datasets inheriting its key.
+*/
+
+typedef struct keyjobs_s
+{
+	pthread_mutex_t mutex;
+	char **aszRoots;
+	bool *afLoaded;
+	size_t numRoots;
+	size_t numAllocated;
+	size_t uNext;
+	zt_context_t *pContext;
+	pfnloadkey_t pfnLoadKey;
+	void *pUser;
+} keyjobs_t;
+
+static bool CollectEncryptionRoot( const char *const szDataset, nvlist_t *const nvl, void *const pUser )
+{
+	keyjobs_t *const pJobs = pUser;
+
+	nvlist_t *nvlProp;
+	const char *szEncryptionRoot;
+	if( nvlist_lookup_nvlist( nvl, "encryptionroot", &nvlProp ) || nvlist_lookup_string( nvlProp, ZPROP_VALUE, &szEncryptionRoot ) || strcmp( szEncryptionRoot, szDataset ) )
+		return true;	//Not encrypted or inheriting its key
+
+	uint64_t eKeyStatus;
+	if( nvlist_lookup_nvlist( nvl, "keystatus", &nvlProp ) || nvlist_lookup_uint64( nvlProp, ZPROP_VALUE, &eKeyStatus ) )
+	{
+		Log( LOG_ERR, "Failed to find keystatus of encryption root \"%s\".", szDataset );
+		return false;
+	}
+
+	if( eKeyStatus != ZFS_KEYSTATUS_UNAVAILABLE )
+		return true;	//Already loaded (e.g. using LoadPoolKey)
+
+	if( pJobs->numRoots == pJobs->numAllocated )
+	{
+		const size_t numAllocated = pJobs->numAllocated ? pJobs->numAllocated * 2 : 16;
+		char **const p = realloc( pJobs->aszRoots, numAllocated * sizeof( char * ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for encryption root list." );
+			return false;
+		}
+
+		pJobs->aszRoots = p;
+		pJobs->numAllocated = numAllocated;
+	}
+
+	if( !( pJobs->aszRoots[ pJobs->numRoots ] = strdup( szDataset ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for encryption root list." );
+		return false;
+	}
+
+	++pJobs->numRoots;
+	return true;
+}
+
+static void *KeyLoadWorker( void *pArg )
+{
+	keyjobs_t *const pJobs = pArg;
+	CONTEXT_SCOPE( pJobs->pContext );
+	for( ;; )
+	{
+		pthread_mutex_lock( &pJobs->mutex );
+		const size_t u = pJobs->uNext < pJobs->numRoots ? pJobs->uNext++ : SIZE_MAX;
+		pthread_mutex_unlock( &pJobs->mutex );
+		if( u == SIZE_MAX )
+			return NULL;
+
+		pJobs->afLoaded[ u ] = pJobs->pfnLoadKey( pJobs->pContext, pJobs->aszRoots[ u ], pJobs->pUser );
+	}
+}
+
+/*!
+	\brief Discovers all encryption roots of the imported pool \p szPool whose key is not loaded yet and calls \p pfnLoadKey for each, in parallel.
+	\return \c true if all encryption roots of the pool are unlocked afterwards.
+	\details Roots for which \p pfnLoadKey fails are reported, but don't stop the others from being loaded.
+*/
+bool LoadPoolKeys( zt_context_t *const pContext, const char *const szPool, const pfnloadkey_t pfnLoadKey, void *const pUser )
+{
+	CONTEXT_SCOPE( pContext );
+	keyjobs_t jobs = { .pContext = pContext, .pfnLoadKey = pfnLoadKey, .pUser = pUser };
+	bool fSuccess = false;
+	if( !WalkPool( pContext, szPool, CollectEncryptionRoot, &jobs ) )
+		goto ERROR_AFTER_ROOTS;
+
+	if( !jobs.numRoots )
+	{
+		fSuccess = true;
+		goto ERROR_AFTER_ROOTS;
+	}
+
+	if( !( jobs.afLoaded = calloc( jobs.numRoots, sizeof( bool ) ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for encryption root list." );
+		goto ERROR_AFTER_ROOTS;
+	}
+
+	pthread_mutex_init( &jobs.mutex, NULL );
+
+	long numThreads = sysconf( _SC_NPROCESSORS_ONLN );
+	if( numThreads < 1 )
+		numThreads = 1;
+	if( numThreads > KEYLOAD_MAX_THREADS )
+		numThreads = KEYLOAD_MAX_THREADS;
+	if( numThreads > jobs.numRoots )
+		numThreads = (long) jobs.numRoots;
+
+	pthread_t athread[ KEYLOAD_MAX_THREADS ];
+	long numStarted = 0;
+	for( ; numStarted < numThreads; ++numStarted )
+		if( pthread_create( &athread[ numStarted ], NULL, KeyLoadWorker, &jobs ) )
+		{
+			Log( LOG_WARNING, "Failed to start key loading thread. Continuing with %ld threads.", numStarted );
+			break;
+		}
+
+	//Without any worker thread, do the work on the calling thread
+	if( !numStarted )
+		(void) KeyLoadWorker( &jobs );
+
+	for( long i = 0; i < numStarted; ++i )
+		pthread_join( athread[ i ], NULL );
+
+	pthread_mutex_destroy( &jobs.mutex );
+
+	size_t numLocked = 0;
+	for( size_t u = 0; u < jobs.numRoots; ++u )
+		if( !jobs.afLoaded[ u ] )
+		{
+			Log( LOG_WARNING, "Encryption root \"%s\" remains locked.", jobs.aszRoots[ u ] );
+			++numLocked;
+		}
+
+	if( numLocked )
+		Log( LOG_ERR, "%zu of %zu encryption roots of pool \"%s\" could not be unlocked.", numLocked, jobs.numRoots, szPool );
+	else
+		Log( LOG_INFO, "Unlocked %zu encryption roots of pool \"%s\".", jobs.numRoots, szPool );
+	fSuccess = !numLocked;
+
+	free( jobs.afLoaded );
+ERROR_AFTER_ROOTS:
+	for( size_t u = 0; u < jobs.numRoots; ++u )
+		free( jobs.aszRoots[ u ] );
+	free( jobs.aszRoots );
+	return fSuccess;
+}
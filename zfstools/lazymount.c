@@ -0,0 +1,390 @@
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/auto_fs.h>
+#include <zfs_cmd.h>
+#include <syslog.h>
+
+#define PROP_EAGER			"org.zfstools:eager"
+#define MNTTYPE_AUTOFS		"autofs"
+#define NO_DATASET			SIZE_MAX
+
+/*
+	Lazy mounting places an autofs direct mount (a trigger) on the mountpoint of each dataset that is not needed right away.
+	A daemon forked off zfsmount receives the kernel's request on first access, mounts the dataset over the trigger and places
+	the triggers of the dataset's own lazy children, which would have been hidden by the mount before.
+	Datasets with PROP_EAGER set to "on", their ancestors and the pool's root dataset are mounted before MountPoolLazy returns.
+	Datasets with nothing to mount (canmount=off, mountpoint=none) neither get a trigger nor make their ancestors eager. Their children
+	are activated together with the closest ancestor that is mounted.
+*/
+
+typedef struct lazydataset_s
+{
+	char *szDataset;
+	char *szMountPoint;	//NULL if the dataset is not to be mounted
+	size_t iParent;
+	size_t iFirstChild;
+	size_t iNextSibling;
+	bool fEager;
+} lazydataset_t;
+
+typedef struct lazypool_s
+{
+	lazydataset_t *aDatasets;
+	size_t numDatasets;
+	size_t numAllocated;
+} lazypool_t;
+
+typedef struct trigger_s
+{
+	size_t iDataset;
+	int fdIoctl;
+	uint32_t uDev;	//Device of the autofs mount, encoded like in the autofs packets
+} trigger_t;
+
+typedef struct triggerlist_s
+{
+	trigger_t *aTriggers;
+	size_t numTriggers;
+	size_t numAllocated;
+	int fdPipe;		//Write end handed to the kernel for each trigger
+} triggerlist_t;
+
+static bool IsEager( nvlist_t *const nvl )
+{
+	nvlist_t *nvlEager;
+	const char *szValue;
+	return !nvlist_lookup_nvlist( nvl, PROP_EAGER, &nvlEager ) && !nvlist_lookup_string( nvlEager, ZPROP_VALUE, &szValue ) && !strcmp( szValue, "on" );
+}
+
+static bool CollectDataset( const char *const szDataset, nvlist_t *const nvl, void *const pUser )
+{
+	lazypool_t *const pPool = pUser;
+	if( pPool->numDatasets == pPool->numAllocated )
+	{
+		const size_t numAllocated = pPool->numAllocated ? pPool->numAllocated * 2 : 64;
+		lazydataset_t *const p = realloc( pPool->aDatasets, numAllocated * sizeof( lazydataset_t ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for dataset list." );
+			return false;
+		}
+
+		pPool->aDatasets = p;
+		pPool->numAllocated = numAllocated;
+	}
+
+	lazydataset_t *const pDataset = &pPool->aDatasets[ pPool->numDatasets ];
+	*pDataset = (lazydataset_t) { .iParent = NO_DATASET, .iFirstChild = NO_DATASET, .iNextSibling = NO_DATASET, .fEager = IsEager( nvl ) };
+	if( !( pDataset->szDataset = strdup( szDataset ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for dataset list." );
+		return false;
+	}
+
+	if( !GetMountPoint( szDataset, nvl, NULL, 0, &pDataset->szMountPoint ) )
+	{
+		free( pDataset->szDataset );
+		return false;
+	}
+
+	//Datasets are walked parents first, so the parent is the closest preceding ancestor
+	const char *const pSlash = strrchr( szDataset, '/' );
+	if( pSlash )
+	{
+		const size_t lenParent = (size_t) ( pSlash - szDataset );
+		for( size_t i = pPool->numDatasets; i--; )
+		{
+			const lazydataset_t *const pParent = &pPool->aDatasets[ i ];
+			if( !strncmp( pParent->szDataset, szDataset, lenParent ) && pParent->szDataset[ lenParent ] == '\0' )
+			{
+				pDataset->iParent = i;
+				pDataset->iNextSibling = pParent->iFirstChild;
+				pPool->aDatasets[ i ].iFirstChild = pPool->numDatasets;
+				break;
+			}
+		}
+	}
+	else
+		pDataset->fEager = true;	//The root dataset is always mounted
+
+	++pPool->numDatasets;
+	return true;
+}
+
+static void FreeLazyPool( lazypool_t *const pPool )
+{
+	for( size_t i = 0; i < pPool->numDatasets; ++i )
+	{
+		free( pPool->aDatasets[ i ].szDataset );
+		free( pPool->aDatasets[ i ].szMountPoint );
+	}
+
+	free( pPool->aDatasets );
+	*pPool = (lazypool_t) { 0 };
+}
+
+/*!
+	\brief Encodes \p dev the way the kernel reports it in autofs packets (new_encode_dev).
+*/
+static uint32_t EncodeDev( const dev_t dev )
+{
+	const uint32_t uMajor = major( dev );
+	const uint32_t uMinor = minor( dev );
+	return ( uMinor & 0xff ) | ( uMajor << 8 ) | ( ( uMinor & ~0xffu ) << 12 );
+}
+
+/*!
+	\brief Places an autofs direct mount on the mountpoint of \p pDataset.
+*/
+static bool AddTrigger( triggerlist_t *const pList, const lazydataset_t *const pDataset, const size_t iDataset )
+{
+	if( pList->numTriggers == pList->numAllocated )
+	{
+		const size_t numAllocated = pList->numAllocated ? pList->numAllocated * 2 : 32;
+		trigger_t *const p = realloc( pList->aTriggers, numAllocated * sizeof( trigger_t ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for trigger list." );
+			return false;
+		}
+
+		pList->aTriggers = p;
+		pList->numAllocated = numAllocated;
+	}
+
+	//MakePath shortens the path on error, keep the original for the fallback
+	char *const szPath = strdupa( pDataset->szMountPoint );
+	if( MakePath( szPath, 0755 ) && errno != EEXIST )
+	{
+		Log( LOG_ERR, "Failed to create path for mountpoint: \"%s\".", szPath );
+		return false;
+	}
+
+	char szOptions[ 128 ];
+	snprintf( szOptions, sizeof( szOptions ), "fd=%d,pgrp=%d,minproto=5,maxproto=5,direct", pList->fdPipe, (int) getpgrp( ) );
+	if( mount( pDataset->szDataset, pDataset->szMountPoint, MNTTYPE_AUTOFS, 0, szOptions ) )
+	{
+		Log( LOG_ERR, "Failed to place automount trigger for dataset \"%s\".", pDataset->szDataset );
+		return false;
+	}
+
+	//Opening the trigger does not fire it, as this process is in the trigger's process group
+	const int fdIoctl = open( pDataset->szMountPoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+	struct stat st;
+	if( fdIoctl < 0 )
+	{
+		Log( LOG_ERR, "Failed to open automount trigger for dataset \"%s\".", pDataset->szDataset );
+		goto ERROR_AFTER_MOUNT;
+	}
+
+	unsigned long uTimeout = 0;	//Never expire, the dataset stays mounted
+	if( ioctl( fdIoctl, AUTOFS_IOC_SETTIMEOUT, &uTimeout ) || fstat( fdIoctl, &st ) )
+	{
+		Log( LOG_ERR, "Failed to set up automount trigger for dataset \"%s\".", pDataset->szDataset );
+		(void) close( fdIoctl );
+ERROR_AFTER_MOUNT:
+		(void) umount2( pDataset->szMountPoint, MNT_DETACH );
+		return false;
+	}
+
+	pList->aTriggers[ pList->numTriggers++ ] = (trigger_t) { .iDataset = iDataset, .fdIoctl = fdIoctl, .uDev = EncodeDev( st.st_dev ) };
+	Log( LOG_INFO, "Dataset \"%s\" will be mounted at \"%s\" on first access.", pDataset->szDataset, pDataset->szMountPoint );
+	return true;
+}
+
+/*!
+	\brief Places the triggers for the lazy children of the (now mounted) dataset \p iDataset.
+	\details Children whose trigger cannot be placed are mounted right away instead, followed by their own children.
+		Children with nothing to mount (e.g. canmount=off) get no trigger, their own children are activated in their place.
+*/
+static void ActivateChildren( const lazypool_t *const pPool, triggerlist_t *const pList, const size_t iDataset )
+{
+	for( size_t i = pPool->aDatasets[ iDataset ].iFirstChild; i != NO_DATASET; i = pPool->aDatasets[ i ].iNextSibling )
+	{
+		const lazydataset_t *const pChild = &pPool->aDatasets[ i ];
+		if( pChild->fEager )
+			continue;	//Already mounted
+
+		if( !pChild->szMountPoint )
+		{
+			ActivateChildren( pPool, pList, i );
+			continue;
+		}
+
+		if( AddTrigger( pList, pChild, i ) )
+			continue;
+
+		Log( LOG_WARNING, "Falling back to mounting dataset \"%s\" right away.", pChild->szDataset );
+		if( MountAt( pChild->szDataset, pChild->szMountPoint, false, NULL, NULL ) )
+			ActivateChildren( pPool, pList, i );
+	}
+}
+
+/*!
+	\brief Serves the automount requests until all triggers are resolved. Never returns.
+	\param fdHandshake	Receives a single byte once the initial triggers are in place.
+*/
+static _Noreturn void LazyMountDaemon( const lazypool_t *const pPool, const int fdHandshake )
+{
+	(void) setsid( );
+	(void) signal( SIGPIPE, SIG_IGN );
+
+	int afdPipe[ 2 ];
+	if( pipe2( afdPipe, O_CLOEXEC ) )
+	{
+		Log( LOG_ERR, "Failed to create automount pipe." );
+		_exit( EXIT_FAILURE );
+	}
+
+	triggerlist_t triggers = { .fdPipe = afdPipe[ 1 ] };
+	for( size_t i = 0; i < pPool->numDatasets; ++i )
+		if( pPool->aDatasets[ i ].fEager )
+			ActivateChildren( pPool, &triggers, i );
+
+	const char bReady = 1;
+	(void) write( fdHandshake, &bReady, 1 );
+	(void) close( fdHandshake );
+
+	while( triggers.numTriggers )
+	{
+		union autofs_v5_packet_union packet;
+		const ssize_t numRead = read( afdPipe[ 0 ], &packet, sizeof( packet.v5_packet ) );
+		if( numRead < 0 && errno == EINTR )
+			continue;
+		if( numRead != sizeof( packet.v5_packet ) )
+		{
+			Log( LOG_ERR, "Failed to read automount request." );
+			break;
+		}
+
+		size_t uTrigger = 0;
+		while( uTrigger < triggers.numTriggers && triggers.aTriggers[ uTrigger ].uDev != packet.v5_packet.dev )
+			++uTrigger;
+		if( uTrigger == triggers.numTriggers )
+			continue;	//Stale request for a trigger that was already resolved
+
+		trigger_t *const pTrigger = &triggers.aTriggers[ uTrigger ];
+		const lazydataset_t *const pDataset = &pPool->aDatasets[ pTrigger->iDataset ];
+		if( packet.hdr.type != autofs_ptype_missing_direct || !MountAt( pDataset->szDataset, pDataset->szMountPoint, false, NULL, NULL ) )
+		{
+			(void) ioctl( pTrigger->fdIoctl, AUTOFS_IOC_FAIL, packet.v5_packet.wait_queue_token );
+			continue;
+		}
+
+		(void) ioctl( pTrigger->fdIoctl, AUTOFS_IOC_READY, packet.v5_packet.wait_queue_token );
+		(void) close( pTrigger->fdIoctl );
+
+		//Remove the trigger before activating the children, which may grow the list
+		const size_t iDataset = pTrigger->iDataset;
+		triggers.aTriggers[ uTrigger ] = triggers.aTriggers[ --triggers.numTriggers ];
+		ActivateChildren( pPool, &triggers, iDataset );
+	}
+
+	_exit( triggers.numTriggers ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
+/*!
+	\brief Mounts the eager datasets of \p szPool and leaves the rest to a background daemon, mounting each on first access.
+	\details A dataset is eager if its PROP_EAGER user property is "on", if it is an ancestor of an eager dataset, or if it is the pool's root dataset.
+		If mounting any eager dataset fails, all eager datasets mounted so far are unmounted again.
+		Triggers that cannot be placed fall back to mounting the dataset right away.
+*/
+bool MountPoolLazy( zt_context_t *const pContext, const char *const szPool )
+{
+	CONTEXT_SCOPE( pContext );
+	mountset_t existing;
+	if( !MountSetLoad( szPool, &existing ) )
+		return false;
+
+	lazypool_t pool = { 0 };
+	if( !WalkPool( pContext, szPool, CollectDataset, &pool ) )
+		goto ERROR_AFTER_POOL;
+
+	//Datasets mounted by a previous run need no trigger. Treating them as eager keeps their ancestors mounted, and MountAt skips them.
+	for( size_t i = 0; i < pool.numDatasets; ++i )
+		if( MountSetFind( &existing, pool.aDatasets[ i ].szDataset ) )
+			pool.aDatasets[ i ].fEager = true;
+
+	//A dataset can only be reached through its ancestors. Datasets with nothing to mount don't need theirs.
+	for( size_t i = 0; i < pool.numDatasets; ++i )
+		if( pool.aDatasets[ i ].fEager && pool.aDatasets[ i ].szMountPoint )
+			for( size_t iParent = pool.aDatasets[ i ].iParent; iParent != NO_DATASET && !pool.aDatasets[ iParent ].fEager; iParent = pool.aDatasets[ iParent ].iParent )
+				pool.aDatasets[ iParent ].fEager = true;
+
+	//Parents precede their children, so mounting in list order is safe
+	mountlist_t mounted = { 0 };
+	size_t numLazy = 0;
+	for( size_t i = 0; i < pool.numDatasets; ++i )
+	{
+		const lazydataset_t *const pDataset = &pool.aDatasets[ i ];
+		if( !pDataset->szMountPoint )
+			continue;	//Nothing to mount, its children are activated through it
+		if( !pDataset->fEager )
+			++numLazy;
+		else if( !MountAt( pDataset->szDataset, pDataset->szMountPoint, false, &existing, &mounted ) )
+			goto ERROR_AFTER_MOUNTED;
+	}
+
+	if( numLazy )
+	{
+		int afdHandshake[ 2 ];
+		if( pipe2( afdHandshake, O_CLOEXEC ) )
+		{
+			Log( LOG_ERR, "Failed to create handshake pipe for lazy mounting." );
+			goto ERROR_AFTER_MOUNTED;
+		}
+
+		const pid_t pid = fork( );
+		if( pid < 0 )
+		{
+			Log( LOG_ERR, "Failed to start lazy mount daemon." );
+			(void) close( afdHandshake[ 0 ] );
+			(void) close( afdHandshake[ 1 ] );
+			goto ERROR_AFTER_MOUNTED;
+		}
+
+		if( !pid )
+		{
+			(void) close( afdHandshake[ 0 ] );
+			(void) close( pContext->fdZFS );
+			LazyMountDaemon( &pool, afdHandshake[ 1 ] );
+		}
+
+		//Wait for the initial triggers, so accessing a lazy dataset right after returning works
+		(void) close( afdHandshake[ 1 ] );
+		char bReady = 0;
+		while( read( afdHandshake[ 0 ], &bReady, 1 ) < 0 && errno == EINTR );
+		(void) close( afdHandshake[ 0 ] );
+		if( !bReady )
+			Log( LOG_WARNING, "Lazy mount daemon of pool \"%s\" exited early.", szPool );
+		else
+			Log( LOG_INFO, "Mounted %zu datasets of pool \"%s\", %zu more on first access.", mounted.numEntries, szPool, numLazy );
+	}
+
+	MountListFree( &mounted );
+	FreeLazyPool( &pool );
+	MountSetFree( &existing );
+	return true;
+
+ERROR_AFTER_MOUNTED:
+	if( mounted.numEntries )
+	{
+		Log( LOG_WARNING, "Rolling back %zu mounted datasets of pool \"%s\".", mounted.numEntries, szPool );
+		(void) UnmountList( &mounted, 0 );
+	}
+	MountListFree( &mounted );
+ERROR_AFTER_POOL:
+	FreeLazyPool( &pool );
+	MountSetFree( &existing );
+	return false;
+}
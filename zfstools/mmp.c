@@ -0,0 +1,342 @@
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <aio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <syslog.h>
+
+/*
+	A multihost pool that was not exported may still be in use by another host. Like the kernel's activity check, the uberblock rings of all
+	vdevs are sampled for as long as the other host needs to notice its MMP writes failing, and any change of the best uberblock means the pool is active.
+	Doing this before TRYIMPORT allows polling at a fraction of the pool's mmp_interval, so activity is reported as soon as it is visible,
+	and the wait is derived from the mmp_interval and mmp_fail_intervals stored in the uberblock.
+	The uberblock found is handed to the kernel in the load_info of the config, the way zpool passes the result of TRYIMPORT on to IMPORT.
+	The kernel only skips its own check if it settles on exactly this uberblock.
+*/
+
+#define UBERBLOCK_MAGIC	0x00bab10cULL
+#define UBERBLOCK_SHIFT	10	//Smallest uberblock slot in the ring, larger ashifts use larger slots
+#define MMP_MAGIC		0xa11cea11ULL
+
+typedef struct uberblock
+{
+	uint64_t ub_magic;
+	uint64_t ub_version;
+	uint64_t ub_txg;
+	uint64_t ub_guid_sum;
+	uint64_t ub_timestamp;			//UTC time of last sync
+	uint64_t ub_rootbp[ 16 ];		//blkptr_t, not interpreted
+	uint64_t ub_software_version;
+	uint64_t ub_mmp_magic;
+	uint64_t ub_mmp_delay;			//Nanoseconds since the last MMP write
+	uint64_t ub_mmp_config;			//Interval, sequence and fail intervals, each with a valid bit
+	uint64_t ub_checkpoint_txg;
+} uberblock_t;
+
+#define MMP_INTERVAL_VALID_BIT	0x01
+#define MMP_SEQ_VALID_BIT		0x02
+#define MMP_FAIL_INT_VALID_BIT	0x04
+
+#define MMP_VALID( pub )			( ( pub )->ub_magic == UBERBLOCK_MAGIC && ( pub )->ub_mmp_magic == MMP_MAGIC )
+#define MMP_INTERVAL_VALID( pub )	( MMP_VALID( pub ) && ( ( pub )->ub_mmp_config & MMP_INTERVAL_VALID_BIT ) )
+#define MMP_SEQ_VALID( pub )		( MMP_VALID( pub ) && ( ( pub )->ub_mmp_config & MMP_SEQ_VALID_BIT ) )
+#define MMP_FAIL_INT_VALID( pub )	( MMP_VALID( pub ) && ( ( pub )->ub_mmp_config & MMP_FAIL_INT_VALID_BIT ) )
+#define MMP_INTERVAL( pub )			( ( ( pub )->ub_mmp_config & 0x00000000FFFFFF00ULL ) >> 8 )
+#define MMP_SEQ( pub )				( ( ( pub )->ub_mmp_config & 0x0000FFFF00000000ULL ) >> 32 )
+#define MMP_FAIL_INT( pub )			( ( ( pub )->ub_mmp_config & 0xFFFF000000000000ULL ) >> 48 )
+
+#define MMP_DEFAULT_INTERVAL			1000	//Milliseconds, the default of zfs_multihost_interval
+#define MMP_MIN_INTERVAL				100
+#define MMP_DEFAULT_IMPORT_INTERVALS	20		//The default of zfs_multihost_import_intervals
+#define MMP_IMPORT_SAFETY_FACTOR		200		//Percent
+#define MMP_POLL_MIN					25		//Milliseconds
+#define MMP_POLL_MAX					1000
+
+/*!
+	\brief Reads of the uberblock rings of all labels of all vdevs that could be opened, submitted together for each sample.
+*/
+typedef struct ubsampler_s
+{
+	struct aiocb *aaiocb;
+	struct aiocb **apaiocb;	//For lio_listio
+	char *pRings;			//VDEV_UBERBLOCK_RING per read
+	int *afd;
+	unsigned numFDs;
+	unsigned numReads;
+} ubsampler_t;
+
+static uint64_t ElapsedMilliseconds( const struct timespec *const ptsStart )
+{
+	struct timespec tsNow;
+	clock_gettime( CLOCK_MONOTONIC, &tsNow );
+	return (uint64_t) ( tsNow.tv_sec - ptsStart->tv_sec ) * 1000 + (uint64_t) ( ( tsNow.tv_nsec - ptsStart->tv_nsec ) / 1000000 );
+}
+
+static uint64_t ReadModuleParameter( const char *const szName, const uint64_t uDefault )
+{
+	char szPath[ 128 ];
+	(void) snprintf( szPath, sizeof( szPath ), "/sys/module/zfs/parameters/%s", szName );
+	FILE *const f = fopen( szPath, "re" );
+	if( !f )
+		return uDefault;
+
+	uint64_t u;
+	if( fscanf( f, "%" SCNu64, &u ) != 1 )
+		u = uDefault;
+	fclose( f );
+	return u;
+}
+
+/*!
+	\brief Orders uberblocks the way the kernel picks the best one: by txg, timestamp, then MMP sequence.
+*/
+static int CompareUberblocks( const uberblock_t *const pA, const uberblock_t *const pB )
+{
+	if( pA->ub_txg != pB->ub_txg )
+		return pA->ub_txg < pB->ub_txg ? -1 : 1;
+	if( pA->ub_timestamp != pB->ub_timestamp )
+		return pA->ub_timestamp < pB->ub_timestamp ? -1 : 1;
+
+	const uint64_t uSeqA = MMP_SEQ_VALID( pA ) ? MMP_SEQ( pA ) : 0;
+	const uint64_t uSeqB = MMP_SEQ_VALID( pB ) ? MMP_SEQ( pB ) : 0;
+	return ( uSeqA > uSeqB ) - ( uSeqA < uSeqB );
+}
+
+/*!
+	\brief Determines how long the uberblocks must stay unchanged, in milliseconds. Matches spa_activity_check_duration of the kernel.
+*/
+static uint64_t ActivityCheckDuration( const uberblock_t *const pub )
+{
+	uint64_t numImportIntervals = ReadModuleParameter( "zfs_multihost_import_intervals", MMP_DEFAULT_IMPORT_INTERVALS );
+	if( !numImportIntervals )
+		numImportIntervals = 1;
+	uint64_t numInterval = ReadModuleParameter( "zfs_multihost_interval", MMP_DEFAULT_INTERVAL );
+	if( numInterval < MMP_MIN_INTERVAL )
+		numInterval = MMP_MIN_INTERVAL;
+
+	uint64_t numDelay = numImportIntervals * numInterval;
+	if( numDelay < 1000 )
+		numDelay = 1000;
+
+	//The other host suspends the pool once its MMP writes failed for this long
+	if( MMP_INTERVAL_VALID( pub ) && MMP_FAIL_INT_VALID( pub ) && MMP_FAIL_INT( pub ) > 0 )
+		return MMP_FAIL_INT( pub ) * MMP_INTERVAL( pub ) * MMP_IMPORT_SAFETY_FACTOR / 100;
+
+	//Otherwise it never suspends the pool, so wait longer
+	uint64_t numRemote = numDelay;
+	if( MMP_INTERVAL_VALID( pub ) )
+		numRemote = ( MMP_INTERVAL( pub ) + pub->ub_mmp_delay / 1000000 ) * numImportIntervals;
+	else if( MMP_VALID( pub ) )
+		numRemote = ( numInterval + pub->ub_mmp_delay / 1000000 ) * numImportIntervals;
+
+	return numRemote > numDelay ? numRemote : numDelay;
+}
+
+static void CloseSampler( ubsampler_t *const pSampler )
+{
+	for( unsigned u = 0; u < pSampler->numFDs; ++u )
+		(void) close( pSampler->afd[ u ] );
+	free( pSampler->pRings );
+	free( pSampler->aaiocb );
+}
+
+/*!
+	\brief Opens the vdevs of \p szzVDevs and prepares the reads of their uberblock rings.
+	\details Vdevs that can't be opened are left out. The pool config may have been complete without them, and the kernel can't read them either.
+*/
+static bool OpenSampler( ubsampler_t *const pSampler, const char *const szzVDevs )
+{
+	unsigned numVDevs = 0;
+	for( const char *sz = szzVDevs; *sz; sz += strlen( sz ) + 1 )
+		++numVDevs;
+
+	*pSampler = (ubsampler_t) { 0 };
+	const size_t numReads = (size_t) numVDevs * VDEV_LABELS;
+	pSampler->aaiocb = calloc( 1, numReads * ( sizeof( struct aiocb ) + sizeof( struct aiocb * ) ) + numVDevs * sizeof( int ) );
+	if( !pSampler->aaiocb || posix_memalign( (void **) &pSampler->pRings, (size_t) sysconf( _SC_PAGESIZE ), numReads * VDEV_UBERBLOCK_RING ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for the activity check." );
+		free( pSampler->aaiocb );
+		return false;
+	}
+	pSampler->apaiocb = (struct aiocb **) &pSampler->aaiocb[ numReads ];
+	pSampler->afd = (int *) &pSampler->apaiocb[ numReads ];
+
+	for( const char *szVDev = szzVDevs; *szVDev; szVDev += strlen( szVDev ) + 1 )
+	{
+		//The page cache would hide writes of the other host
+		int fd = open( szVDev, O_RDONLY | O_DIRECT | O_CLOEXEC );
+		if( fd < 0 && errno == EINVAL )
+			fd = open( szVDev, O_RDONLY | O_CLOEXEC );
+		if( fd < 0 )
+		{
+			Log( LOG_WARNING, "Failed to open vdev \"%s\" for the activity check.", szVDev );
+			continue;
+		}
+
+		struct stat64 statbuf;
+		uint64_t size = 0;
+		bool fSize = !fstat64( fd, &statbuf );
+		if( fSize && S_ISBLK( statbuf.st_mode ) )
+			fSize = !ioctl( fd, BLKGETSIZE64, &size );
+		else if( fSize )
+			size = (uint64_t) statbuf.st_size;
+
+		if( !fSize )
+		{
+			Log( LOG_WARNING, "Failed to get size of vdev \"%s\" for the activity check.", szVDev );
+			(void) close( fd );
+			continue;
+		}
+
+		size &= ~(uint64_t) ( sizeof( vdev_label_t ) - 1 );
+		if( size < VDEV_LABELS * sizeof( vdev_label_t ) )
+		{
+			(void) close( fd );
+			continue;
+		}
+
+		pSampler->afd[ pSampler->numFDs++ ] = fd;
+		for( unsigned uLabel = 0; uLabel < VDEV_LABELS; ++uLabel )
+		{
+			struct aiocb *const aiocb = &pSampler->aaiocb[ pSampler->numReads ];
+			aiocb->aio_fildes = fd;
+			aiocb->aio_offset = (off_t) ( ( uLabel < VDEV_LABELS / 2 ? uLabel * sizeof( vdev_label_t ) : size - ( VDEV_LABELS - uLabel ) * sizeof( vdev_label_t ) ) + offsetof( vdev_label_t, vl_uberblock ) );
+			aiocb->aio_buf = pSampler->pRings + (size_t) pSampler->numReads * VDEV_UBERBLOCK_RING;
+			aiocb->aio_nbytes = VDEV_UBERBLOCK_RING;
+			aiocb->aio_lio_opcode = LIO_READ;
+			pSampler->apaiocb[ pSampler->numReads++ ] = aiocb;
+		}
+	}
+
+	if( !pSampler->numReads )
+	{
+		Log( LOG_ERR, "None of the vdevs could be opened for the activity check." );
+		CloseSampler( pSampler );
+		return false;
+	}
+
+	return true;
+}
+
+/*!
+	\brief Reads the uberblock rings of all vdevs in parallel and finds the best uberblock among them.
+	\details Labels that fail to read are skipped, like the kernel does. Uberblock checksums are not verified: a torn or corrupt uberblock
+		either changes between samples, which fails the check, or differs from the one the kernel picks, which then runs its own check.
+*/
+static bool SampleUberblocks( ubsampler_t *const pSampler, uberblock_t *const pBest )
+{
+	if( lio_listio( LIO_WAIT, pSampler->apaiocb, (int) pSampler->numReads, NULL ) && errno != EIO && errno != EINTR )
+	{
+		//A portion of the requests may have been submitted. Let them finish before the buffers are used again.
+		Log( LOG_ERR, "Failed to read uberblocks for the activity check. Error code %d.", errno );
+		for( unsigned u = 0; u < pSampler->numReads; ++u )
+			while( aio_error( pSampler->apaiocb[ u ] ) == EINPROGRESS )
+				(void) aio_suspend( (const struct aiocb *const *) &pSampler->apaiocb[ u ], 1, NULL );
+		return false;
+	}
+
+	memset( pBest, 0, sizeof( uberblock_t ) );
+	for( unsigned u = 0; u < pSampler->numReads; ++u )
+	{
+		struct aiocb *const aiocb = pSampler->apaiocb[ u ];
+		while( aio_error( aiocb ) == EINPROGRESS )
+			(void) aio_suspend( (const struct aiocb *const *) &aiocb, 1, NULL );
+		if( aio_error( aiocb ) )
+			continue;
+
+		//Slots are at least 1 << UBERBLOCK_SHIFT bytes and padded with zeros, so scanning at that step finds the uberblocks of any ashift
+		const size_t numRead = (size_t) aio_return( aiocb );
+		const char *const pRing = (const char *) aiocb->aio_buf;
+		for( size_t uOffset = 0; uOffset + sizeof( uberblock_t ) <= numRead; uOffset += (size_t) 1 << UBERBLOCK_SHIFT )
+		{
+			const uberblock_t *const pub = (const uberblock_t *) ( pRing + uOffset );
+			if( pub->ub_magic == UBERBLOCK_MAGIC && CompareUberblocks( pub, pBest ) > 0 )
+				*pBest = *pub;
+		}
+	}
+
+	return true;
+}
+
+/*!
+	\brief Waits until the multihost pool \p szPool can be assumed not to be in use by another host, polling its uberblocks.
+	\param pCheck	Receives the uberblock checked, or a zero txg if the pool doesn't use multihost.
+	\return \c false if the pool is active or the uberblocks could not be read.
+	\note Only to be called if the pool was last imported by another host and not exported. Otherwise the kernel doesn't check either.
+*/
+bool CheckPoolActivity( const char *const szzVDevs, const char *const szPool, mmpcheck_t *const pCheck )
+{
+	*pCheck = (mmpcheck_t) { 0 };
+	ubsampler_t sampler;
+	if( !OpenSampler( &sampler, szzVDevs ) )
+		return false;
+
+	bool fInactive = false;
+	struct timespec tsStart;
+	clock_gettime( CLOCK_MONOTONIC, &tsStart );
+
+	uberblock_t ub;
+	if( !SampleUberblocks( &sampler, &ub ) )
+		goto ERROR_AFTER_SAMPLER;
+
+	if( ub.ub_magic != UBERBLOCK_MAGIC )
+	{
+		Log( LOG_ERR, "No uberblock found on the vdevs of pool \"%s\".", szPool );
+		goto ERROR_AFTER_SAMPLER;
+	}
+
+	//The uberblock was written with multihost disabled
+	if( ub.ub_mmp_magic == MMP_MAGIC && !ub.ub_mmp_delay )
+	{
+		fInactive = true;
+		goto ERROR_AFTER_SAMPLER;
+	}
+
+	//Like the kernel, add up to 25% so hosts importing at the same time don't finish their checks at the same time
+	uint64_t numDelay = ActivityCheckDuration( &ub );
+	numDelay += numDelay * (uint64_t) ( tsStart.tv_nsec % 250 ) / 1000;
+
+	//Each leaf vdev of an active pool is written about once per mmp_interval
+	uint64_t numPoll = ( MMP_INTERVAL_VALID( &ub ) ? MMP_INTERVAL( &ub ) : MMP_DEFAULT_INTERVAL ) / 4;
+	if( numPoll < MMP_POLL_MIN )
+		numPoll = MMP_POLL_MIN;
+	if( numPoll > MMP_POLL_MAX )
+		numPoll = MMP_POLL_MAX;
+
+	Log( LOG_INFO, "Checking multihost pool \"%s\" for activity of other hosts for %" PRIu64 " ms.", szPool, numDelay );
+
+	//The last sample is started only after the full duration has passed
+	for( uint64_t numElapsed = 0; numElapsed < numDelay; )
+	{
+		const uint64_t numSleep = numDelay - numElapsed < numPoll ? numDelay - numElapsed : numPoll;
+		const struct timespec tsSleep = { .tv_sec = (time_t) ( numSleep / 1000 ), .tv_nsec = (long) ( numSleep % 1000 ) * 1000000 };
+		(void) nanosleep( &tsSleep, NULL );
+
+		numElapsed = ElapsedMilliseconds( &tsStart );
+		uberblock_t ubSample;
+		if( !SampleUberblocks( &sampler, &ubSample ) )
+			goto ERROR_AFTER_SAMPLER;
+
+		if( CompareUberblocks( &ubSample, &ub ) )
+		{
+			Log( LOG_ERR, "Pool \"%s\" is in use by another host. Its uberblock changed after %" PRIu64 " ms.", szPool, numElapsed );
+			goto ERROR_AFTER_SAMPLER;
+		}
+	}
+
+	*pCheck = (mmpcheck_t) { .uTxg = ub.ub_txg, .uTimestamp = ub.ub_timestamp, .uSeq = (uint16_t) ( MMP_SEQ_VALID( &ub ) ? MMP_SEQ( &ub ) : 0 ) };
+	fInactive = true;
+
+ERROR_AFTER_SAMPLER:
+	CloseSampler( &sampler );
+	return fInactive;
+}
@@ -0,0 +1,1209 @@
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <limits.h>
+#include <syslog.h>
+
+/*
+	Read-only access to the meta object set (MOS) of a pool directly from its vdevs, without importing it.
+	Starting at the active uberblock, the DSL directory tree is followed to name each dataset and resolve its mountpoint and encryption root.
+	This allows preparing mounts while ZFS_IOC_POOL_IMPORT is still running. The kernel's view after the import stays authoritative.
+
+	Only what is needed for the MOS is supported: top-level vdevs of type disk, file or mirror, native byte order, lzjb or lz4 compression and no gang or embedded blocks.
+	Fletcher checksums are verified; blocks with other checksums are used unverified. Anything else makes the reader fail cleanly.
+*/
+
+#define	VDEV_BOOT_SIZE			( 7ULL << 19 )
+#define	VDEV_LABEL_START_SIZE	( 2 * sizeof( vdev_label_t ) + VDEV_BOOT_SIZE )
+
+#define	UBERBLOCK_MAGIC		0x00bab10cULL
+#define	UBERBLOCK_SHIFT		10
+#define	MAX_UBERBLOCK_SHIFT	13
+
+#define	SPA_MINBLOCKSHIFT	9
+#define	SPA_BLKPTRSHIFT		7
+#define	SPA_DVAS_PER_BP		3
+#define	DNODE_SHIFT			9
+#define	DNODE_SIZE			( 1 << DNODE_SHIFT )
+
+#define	ZFS_HOST_BYTEORDER	( __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ )
+
+#define	ZIO_CHECKSUM_FLETCHER_2	6
+#define	ZIO_CHECKSUM_FLETCHER_4	7
+
+#define	ZIO_COMPRESS_OFF	2
+#define	ZIO_COMPRESS_LZJB	3
+#define	ZIO_COMPRESS_LZ4	15
+
+#define	DMU_OT_OBJSET			11
+#define	DMU_OT_DSL_DIR			12
+#define	DMU_OT_NEWTYPE			0x80
+#define	DMU_OT_BYTESWAP_MASK	0x1f
+#define	DMU_BSWAP_ZAP			4
+
+#define	DMU_POOL_DIRECTORY_OBJECT	1
+#define	DMU_POOL_ROOT_DATASET		"root_dataset"
+#define	DD_FIELD_CRYPTO_KEY_OBJ		"com.datto:crypto_key_obj"
+#define	DSL_CRYPTO_KEY_ROOT_DDOBJ	"DSL_CRYPTO_ROOT_DDOBJ"
+
+#define	ZBT_LEAF				( ( 1ULL << 63 ) + 0 )
+#define	ZBT_HEADER				( ( 1ULL << 63 ) + 1 )
+#define	ZBT_MICRO				( ( 1ULL << 63 ) + 3 )
+#define	MZAP_NAME_LEN			50
+#define	ZAP_LEAF_MAGIC			0x2AB1EAF
+#define	ZAP_LEAF_CHUNKSIZE		24
+#define	ZAP_LEAF_ARRAY_BYTES	( ZAP_LEAF_CHUNKSIZE - 3 )
+#define	ZAP_CHUNK_ARRAY			251
+#define	ZAP_CHUNK_ENTRY			252
+#define	ZAP_MAXNAMELEN			256
+#define	ZAP_MAXVALUELEN			( 1024 * 8 )
+
+#define	LZJB_MATCH_BITS		6
+#define	LZJB_MATCH_MIN		3
+#define	LZJB_OFFSET_MASK	( ( 1 << ( 16 - LZJB_MATCH_BITS ) ) - 1 )
+
+#define	MOS_MAX_DEPTH	( ZFS_MAX_DATASET_NAME_LEN / 2 )
+
+typedef struct dva
+{
+	uint64_t dva_word[ 2 ];
+} dva_t;
+
+typedef struct blkptr
+{
+	dva_t blk_dva[ SPA_DVAS_PER_BP ];	//Data virtual addresses
+	uint64_t blk_prop;					//Size, compression, type, etc.
+	uint64_t blk_pad[ 2 ];
+	uint64_t blk_phys_birth;
+	uint64_t blk_birth;
+	uint64_t blk_fill;
+	zio_cksum_t blk_cksum;				//256-bit checksum
+} blkptr_t;
+static_assert( sizeof( blkptr_t ) == 1 << SPA_BLKPTRSHIFT );
+
+#define	DVA_GET_ASIZE( dva )	( ( ( dva )->dva_word[ 0 ] & 0xffffffULL ) << SPA_MINBLOCKSHIFT )
+#define	DVA_GET_VDEV( dva )		( ( dva )->dva_word[ 0 ] >> 32 )
+#define	DVA_GET_OFFSET( dva )	( ( ( dva )->dva_word[ 1 ] & ~( 1ULL << 63 ) ) << SPA_MINBLOCKSHIFT )
+#define	DVA_GET_GANG( dva )		( ( dva )->dva_word[ 1 ] >> 63 )
+
+#define	BP_GET_LSIZE( bp )		( ( ( ( bp )->blk_prop & 0xffff ) + 1 ) << SPA_MINBLOCKSHIFT )
+#define	BP_GET_PSIZE( bp )		( ( ( ( ( bp )->blk_prop >> 16 ) & 0xffff ) + 1 ) << SPA_MINBLOCKSHIFT )
+#define	BP_GET_COMPRESS( bp )	( (unsigned) ( ( bp )->blk_prop >> 32 ) & 0x7f )
+#define	BP_IS_EMBEDDED( bp )	( ( ( bp )->blk_prop >> 39 ) & 1 )
+#define	BP_GET_CHECKSUM( bp )	( (unsigned) ( ( bp )->blk_prop >> 40 ) & 0xff )
+#define	BP_GET_TYPE( bp )		( (unsigned) ( ( bp )->blk_prop >> 48 ) & 0xff )
+#define	BP_USES_CRYPT( bp )		( ( ( bp )->blk_prop >> 61 ) & 1 )
+#define	BP_GET_BYTEORDER( bp )	( ( bp )->blk_prop >> 63 )
+#define	BP_IS_HOLE( bp )		( !BP_IS_EMBEDDED( bp ) && !( bp )->blk_dva[ 0 ].dva_word[ 0 ] && !( bp )->blk_dva[ 0 ].dva_word[ 1 ] )
+
+typedef struct uberblock
+{
+	uint64_t ub_magic;
+	uint64_t ub_version;
+	uint64_t ub_txg;
+	uint64_t ub_guid_sum;
+	uint64_t ub_timestamp;
+	blkptr_t ub_rootbp;		//MOS objset_phys_t
+} uberblock_t;	//Leading part only
+
+typedef struct dnode_phys
+{
+	uint8_t dn_type;
+	uint8_t dn_indblkshift;
+	uint8_t dn_nlevels;
+	uint8_t dn_nblkptr;
+	uint8_t dn_bonustype;
+	uint8_t dn_checksum;
+	uint8_t dn_compress;
+	uint8_t dn_flags;
+	uint16_t dn_datablkszsec;
+	uint16_t dn_bonuslen;
+	uint8_t dn_extra_slots;
+	uint8_t dn_pad2[ 3 ];
+	uint64_t dn_maxblkid;
+	uint64_t dn_used;
+	uint64_t dn_pad3[ 4 ];
+	union
+	{
+		blkptr_t dn_blkptr[ 3 ];
+		uint8_t dn_tail[ DNODE_SIZE - 64 ];	//Block pointers, followed by the bonus buffer
+	};
+} dnode_phys_t;
+static_assert( sizeof( dnode_phys_t ) == DNODE_SIZE );
+
+typedef struct dsl_dir_phys
+{
+	uint64_t dd_creation_time;
+	uint64_t dd_head_dataset_obj;
+	uint64_t dd_parent_obj;
+	uint64_t dd_origin_obj;
+	uint64_t dd_child_dir_zapobj;
+	uint64_t dd_used_bytes;
+	uint64_t dd_compressed_bytes;
+	uint64_t dd_uncompressed_bytes;
+	uint64_t dd_quota;
+	uint64_t dd_reserved;
+	uint64_t dd_props_zapobj;
+} dsl_dir_phys_t;	//Leading part only
+
+typedef struct mzap_ent_phys
+{
+	uint64_t mze_value;
+	uint32_t mze_cd;
+	uint16_t mze_pad;
+	char mze_name[ MZAP_NAME_LEN ];
+} mzap_ent_phys_t;
+static_assert( sizeof( mzap_ent_phys_t ) == 64 );
+
+typedef struct zap_leaf_header
+{
+	uint64_t lh_block_type;
+	uint64_t lh_pad1;
+	uint64_t lh_prefix;
+	uint32_t lh_magic;
+	uint16_t lh_nfree;
+	uint16_t lh_nentries;
+	uint16_t lh_prefix_len;
+	uint16_t lh_freelist;
+	uint8_t lh_flags;
+	uint8_t lh_pad2[ 11 ];
+} zap_leaf_header_t;
+static_assert( sizeof( zap_leaf_header_t ) == 48 );
+
+typedef struct zap_leaf_entry
+{
+	uint8_t le_type;
+	uint8_t le_value_intlen;
+	uint16_t le_next;
+	uint16_t le_name_chunk;
+	uint16_t le_name_numints;
+	uint16_t le_value_chunk;
+	uint16_t le_value_numints;
+	uint32_t le_cd;
+	uint64_t le_hash;
+} zap_leaf_entry_t;
+
+typedef struct zap_leaf_array
+{
+	uint8_t la_type;
+	uint8_t la_array[ ZAP_LEAF_ARRAY_BYTES ];
+	uint16_t la_next;
+} zap_leaf_array_t;
+
+typedef union zap_leaf_chunk
+{
+	zap_leaf_entry_t l_entry;
+	zap_leaf_array_t l_array;
+} zap_leaf_chunk_t;
+static_assert( sizeof( zap_leaf_chunk_t ) == ZAP_LEAF_CHUNKSIZE );
+
+typedef struct mosreader_s
+{
+	int *afdTopLevel;		//Per top-level vdev, a leaf vdev holding a complete copy of its data, or -1
+	uint64_t numTopLevel;
+	uberblock_t ub;			//Active uberblock
+	dnode_phys_t dnMeta;	//Meta dnode of the MOS, holding all other dnodes
+	uint8_t *pCache;		//Most recently read block of the meta dnode
+	uint64_t idCached;
+} mosreader_t;
+
+/*!
+	\brief Callback for ZapForEach. Integer values are in host byte order. Returning \c false stops the iteration.
+*/
+typedef bool ( *pfnzapentry_t )( const char *szName, unsigned numIntLength, uint64_t numInts, const void *pValue, void *pUser );
+
+static bool ChecksumMatches( const blkptr_t *const pbp, const void *const p, const size_t numSize )
+{
+	uint64_t au[ 4 ] = { 0 };
+	switch( BP_GET_CHECKSUM( pbp ) )
+	{
+	case ZIO_CHECKSUM_FLETCHER_2:
+	{
+		const uint64_t *const aWords = p;
+		for( size_t u = 0; u + 1 < numSize / sizeof( uint64_t ); u += 2 )
+		{
+			au[ 0 ] += aWords[ u ];
+			au[ 1 ] += aWords[ u + 1 ];
+			au[ 2 ] += au[ 0 ];
+			au[ 3 ] += au[ 1 ];
+		}
+		break;
+	}
+	case ZIO_CHECKSUM_FLETCHER_4:
+	{
+		const uint32_t *const aWords = p;
+		for( size_t u = 0; u < numSize / sizeof( uint32_t ); ++u )
+		{
+			au[ 0 ] += aWords[ u ];
+			au[ 1 ] += au[ 0 ];
+			au[ 2 ] += au[ 1 ];
+			au[ 3 ] += au[ 2 ];
+		}
+		break;
+	}
+	default:
+		//Verified by the kernel on import
+		return true;
+	}
+
+	return !memcmp( au, pbp->blk_cksum.zc_word, sizeof( au ) );
+}
+
+static bool DecompressLZJB( const uint8_t *pSrc, const size_t numSrc, uint8_t *pDst, const size_t numDst )
+{
+	const uint8_t *const pSrcEnd = pSrc + numSrc;
+	uint8_t *const pDstStart = pDst;
+	uint8_t *const pDstEnd = pDst + numDst;
+	unsigned uCopyMap = 0;
+	unsigned uCopyMask = 1 << 7;
+	while( pDst < pDstEnd )
+	{
+		if( ( uCopyMask <<= 1 ) == 1 << 8 )
+		{
+			if( pSrc >= pSrcEnd )
+				return false;
+			uCopyMask = 1;
+			uCopyMap = *pSrc++;
+		}
+
+		if( !( uCopyMap & uCopyMask ) )
+		{
+			if( pSrc >= pSrcEnd )
+				return false;
+			*pDst++ = *pSrc++;
+			continue;
+		}
+
+		if( pSrcEnd - pSrc < 2 )
+			return false;
+
+		int iLength = ( pSrc[ 0 ] >> ( 8 - LZJB_MATCH_BITS ) ) + LZJB_MATCH_MIN;
+		const size_t numOffset = ( ( pSrc[ 0 ] << 8 ) | pSrc[ 1 ] ) & LZJB_OFFSET_MASK;
+		pSrc += 2;
+		if( numOffset > (size_t) ( pDst - pDstStart ) )
+			return false;
+
+		for( const uint8_t *pCopy = pDst - numOffset; --iLength >= 0 && pDst < pDstEnd; )
+			*pDst++ = *pCopy++;
+	}
+
+	return true;
+}
+
+static bool ReadLZ4Length( const uint8_t **const pp, const uint8_t *const pEnd, size_t *const pnumLength )
+{
+	unsigned uByte;
+	do
+	{
+		if( *pp >= pEnd )
+			return false;
+		*pnumLength += uByte = *( *pp )++;
+	} while( uByte == 255 );
+
+	return true;
+}
+
+/*!
+	\details ZFS prefixes the LZ4 block with its compressed length as big endian 32 bit integer.
+*/
+static bool DecompressLZ4( const uint8_t *const pSrc, const size_t numSrc, uint8_t *const pDst, const size_t numDst )
+{
+	if( numSrc < sizeof( uint32_t ) )
+		return false;
+
+	const size_t numCompressed = (size_t) pSrc[ 0 ] << 24 | (size_t) pSrc[ 1 ] << 16 | (size_t) pSrc[ 2 ] << 8 | pSrc[ 3 ];
+	if( numCompressed > numSrc - sizeof( uint32_t ) )
+		return false;
+
+	const uint8_t *p = pSrc + sizeof( uint32_t );
+	const uint8_t *const pEnd = p + numCompressed;
+	uint8_t *pOut = pDst;
+	uint8_t *const pOutEnd = pDst + numDst;
+	while( p < pEnd )
+	{
+		const unsigned uToken = *p++;
+
+		size_t numLiterals = uToken >> 4;
+		if( numLiterals == 15 && !ReadLZ4Length( &p, pEnd, &numLiterals ) )
+			return false;
+		if( numLiterals > (size_t) ( pEnd - p ) || numLiterals > (size_t) ( pOutEnd - pOut ) )
+			return false;
+
+		memcpy( pOut, p, numLiterals );
+		p += numLiterals;
+		pOut += numLiterals;
+
+		//The last sequence only consists of literals
+		if( p == pEnd )
+			break;
+
+		if( pEnd - p < 2 )
+			return false;
+
+		const size_t numOffset = p[ 0 ] | (size_t) p[ 1 ] << 8;
+		p += 2;
+		if( !numOffset || numOffset > (size_t) ( pOut - pDst ) )
+			return false;
+
+		size_t numMatch = uToken & 15;
+		if( numMatch == 15 && !ReadLZ4Length( &p, pEnd, &numMatch ) )
+			return false;
+		numMatch += 4;
+		if( numMatch > (size_t) ( pOutEnd - pOut ) )
+			return false;
+
+		//Matches may overlap their own output
+		for( const uint8_t *pMatch = pOut - numOffset; numMatch; --numMatch )
+			*pOut++ = *pMatch++;
+	}
+
+	return true;
+}
+
+/*!
+	\brief Reads the block \p pbp points to from any of its copies, verifies and decompresses it.
+	\return The logical block contents (to be released using free), or \c NULL on error.
+*/
+static void *ReadBlock( const mosreader_t *const pReader, const blkptr_t *const pbp, size_t *const pnumSize )
+{
+	const size_t numLogical = BP_GET_LSIZE( pbp );
+	*pnumSize = numLogical;
+
+	//Holes read as zeros
+	if( BP_IS_HOLE( pbp ) )
+	{
+		void *const p = calloc( 1, numLogical );
+		if( !p )
+			Log( LOG_ERR, "Failed to allocate memory for MOS block." );
+		return p;
+	}
+
+	if( BP_IS_EMBEDDED( pbp ) || BP_USES_CRYPT( pbp ) || BP_GET_BYTEORDER( pbp ) != ZFS_HOST_BYTEORDER )
+	{
+		Log( LOG_ERR, "MOS block pointer is embedded, encrypted or of foreign byte order, which is not supported." );
+		return NULL;
+	}
+
+	const unsigned eCompress = BP_GET_COMPRESS( pbp );
+	if( eCompress != ZIO_COMPRESS_OFF && eCompress != ZIO_COMPRESS_LZJB && eCompress != ZIO_COMPRESS_LZ4 )
+	{
+		Log( LOG_ERR, "MOS block compression %u is not supported.", eCompress );
+		return NULL;
+	}
+
+	const size_t numPhysical = BP_GET_PSIZE( pbp );
+	if( eCompress == ZIO_COMPRESS_OFF && numPhysical != numLogical )
+	{
+		Log( LOG_ERR, "Invalid size of uncompressed MOS block." );
+		return NULL;
+	}
+
+	uint8_t *const pPhysical = malloc( numPhysical );
+	if( !pPhysical )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for MOS block." );
+		return NULL;
+	}
+
+	uint8_t *pLogical = NULL;
+	if( eCompress != ZIO_COMPRESS_OFF && !( pLogical = calloc( 1, numLogical ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for MOS block." );
+		goto ERROR_AFTER_PHYSICAL;
+	}
+
+	for( unsigned uDVA = 0; uDVA < SPA_DVAS_PER_BP; ++uDVA )
+	{
+		const dva_t *const pDVA = &pbp->blk_dva[ uDVA ];
+		if( !DVA_GET_ASIZE( pDVA ) || DVA_GET_GANG( pDVA ) )
+			continue;
+
+		const uint64_t idTopLevel = DVA_GET_VDEV( pDVA );
+		if( idTopLevel >= pReader->numTopLevel || pReader->afdTopLevel[ idTopLevel ] < 0 )
+			continue;
+
+		if( pread( pReader->afdTopLevel[ idTopLevel ], pPhysical, numPhysical, VDEV_LABEL_START_SIZE + DVA_GET_OFFSET( pDVA ) ) != (ssize_t) numPhysical )
+			continue;
+
+		if( !ChecksumMatches( pbp, pPhysical, numPhysical ) )
+			continue;
+
+		if( eCompress == ZIO_COMPRESS_OFF )
+			return pPhysical;
+
+		if( eCompress == ZIO_COMPRESS_LZ4 ? DecompressLZ4( pPhysical, numPhysical, pLogical, numLogical ) : DecompressLZJB( pPhysical, numPhysical, pLogical, numLogical ) )
+		{
+			free( pPhysical );
+			return pLogical;
+		}
+	}
+
+	Log( LOG_ERR, "Failed to read MOS block born in txg %" PRIu64 " from any of its copies.", pbp->blk_birth );
+	free( pLogical );
+ERROR_AFTER_PHYSICAL:
+	free( pPhysical );
+	return NULL;
+}
+
+/*!
+	\brief Reads the data block \p idBlock of the object described by \p pdn, following its indirect blocks.
+	\return The block contents (to be released using free), or \c NULL on error.
+*/
+static void *ReadObjectBlock( const mosreader_t *const pReader, const dnode_phys_t *const pdn, const uint64_t idBlock, size_t *const pnumSize )
+{
+	if( !pdn->dn_nlevels || !pdn->dn_nblkptr || pdn->dn_nblkptr > 3 || idBlock > pdn->dn_maxblkid || pdn->dn_indblkshift <= SPA_BLKPTRSHIFT )
+	{
+		Log( LOG_ERR, "Invalid MOS dnode." );
+		return NULL;
+	}
+
+	//Each level of indirection selects uShift bits of the block id
+	const unsigned uShift = pdn->dn_indblkshift - SPA_BLKPTRSHIFT;
+	if( uShift * ( pdn->dn_nlevels - 1 ) >= 64 || idBlock >> ( uShift * ( pdn->dn_nlevels - 1 ) ) >= pdn->dn_nblkptr )
+	{
+		Log( LOG_ERR, "Invalid MOS dnode." );
+		return NULL;
+	}
+
+	blkptr_t bp = pdn->dn_blkptr[ idBlock >> ( uShift * ( pdn->dn_nlevels - 1 ) ) ];
+	for( unsigned uLevel = pdn->dn_nlevels - 1; uLevel; --uLevel )
+	{
+		size_t numSize;
+		blkptr_t *const abp = ReadBlock( pReader, &bp, &numSize );
+		if( !abp )
+			return NULL;
+
+		const uint64_t uIndex = ( idBlock >> ( uShift * ( uLevel - 1 ) ) ) & ( ( 1ULL << uShift ) - 1 );
+		if( ( uIndex + 1 ) * sizeof( blkptr_t ) > numSize )
+		{
+			Log( LOG_ERR, "Invalid MOS indirect block." );
+			free( abp );
+			return NULL;
+		}
+
+		bp = abp[ uIndex ];
+		free( abp );
+	}
+
+	return ReadBlock( pReader, &bp, pnumSize );
+}
+
+static bool ReadDnode( mosreader_t *const pReader, const uint64_t idObject, dnode_phys_t *const pdn )
+{
+	const size_t numBlockSize = (size_t) pReader->dnMeta.dn_datablkszsec << SPA_MINBLOCKSHIFT;
+	const uint64_t numPerBlock = numBlockSize / DNODE_SIZE;
+	const uint64_t idBlock = idObject / numPerBlock;
+	if( !pReader->pCache || pReader->idCached != idBlock )
+	{
+		free( pReader->pCache );
+
+		size_t numSize;
+		if( !( pReader->pCache = ReadObjectBlock( pReader, &pReader->dnMeta, idBlock, &numSize ) ) )
+			return false;
+
+		if( numSize != numBlockSize )
+		{
+			Log( LOG_ERR, "Invalid size of MOS dnode block." );
+			free( pReader->pCache );
+			pReader->pCache = NULL;
+			return false;
+		}
+
+		pReader->idCached = idBlock;
+	}
+
+	memcpy( pdn, pReader->pCache + ( idObject % numPerBlock ) * DNODE_SIZE, sizeof( dnode_phys_t ) );
+	if( !pdn->dn_type )
+	{
+		Log( LOG_ERR, "MOS object %" PRIu64 " is not allocated.", idObject );
+		return false;
+	}
+
+	return true;
+}
+
+static const void *GetBonus( const dnode_phys_t *const pdn, const size_t numSize )
+{
+	const size_t uOffset = pdn->dn_nblkptr * sizeof( blkptr_t );
+	if( pdn->dn_bonuslen < numSize || uOffset + pdn->dn_bonuslen > sizeof( pdn->dn_tail ) )
+		return NULL;
+
+	return pdn->dn_tail + uOffset;
+}
+
+static bool ZapLeafArrayRead( const zap_leaf_chunk_t *const aChunks, const unsigned numChunks, unsigned idChunk, uint8_t *pOut, size_t numBytes )
+{
+	while( numBytes )
+	{
+		if( idChunk >= numChunks || aChunks[ idChunk ].l_array.la_type != ZAP_CHUNK_ARRAY )
+			return false;
+
+		const size_t num = numBytes < ZAP_LEAF_ARRAY_BYTES ? numBytes : ZAP_LEAF_ARRAY_BYTES;
+		memcpy( pOut, aChunks[ idChunk ].l_array.la_array, num );
+		pOut += num;
+		numBytes -= num;
+		idChunk = aChunks[ idChunk ].l_array.la_next;
+	}
+
+	return true;
+}
+
+/*!
+	\brief Calls \p pfnEntry for each entry in the fat ZAP leaf \p pLeaf. Blocks which are no leaf (e.g. pointer tables) are skipped.
+	\details Only string names and values of bytes or 64 bit integers are supported; other entries are skipped.
+*/
+static bool ZapLeafForEach( const uint8_t *const pLeaf, const size_t numSize, const pfnzapentry_t pfnEntry, void *const pUser, bool *const pfStopped )
+{
+	const zap_leaf_header_t *const pHeader = (const zap_leaf_header_t *) pLeaf;
+	if( numSize < 512 || numSize & ( numSize - 1 ) || pHeader->lh_block_type != ZBT_LEAF || pHeader->lh_magic != ZAP_LEAF_MAGIC )
+		return true;
+
+	//The hash table has one 16 bit entry per 32 bytes of leaf, the chunks follow it
+	const size_t numHash = numSize / 32;
+	const zap_leaf_chunk_t *const aChunks = (const zap_leaf_chunk_t *) ( pLeaf + sizeof( zap_leaf_header_t ) + numHash * sizeof( uint16_t ) );
+	const unsigned numChunks = (unsigned) ( ( numSize - numHash * sizeof( uint16_t ) ) / ZAP_LEAF_CHUNKSIZE - 2 );
+
+	char szName[ ZAP_MAXNAMELEN ];
+	uint64_t auValue[ ZAP_MAXVALUELEN / sizeof( uint64_t ) ];
+	for( unsigned u = 0; u < numChunks; ++u )
+	{
+		const zap_leaf_entry_t *const pEntry = &aChunks[ u ].l_entry;
+		if( pEntry->le_type != ZAP_CHUNK_ENTRY )
+			continue;
+
+		const unsigned numIntLength = pEntry->le_value_intlen;
+		if( !pEntry->le_name_numints || pEntry->le_name_numints > sizeof( szName ) || ( numIntLength != 1 && numIntLength != sizeof( uint64_t ) ) || (size_t) numIntLength * pEntry->le_value_numints > sizeof( auValue ) )
+			continue;
+
+		if( !ZapLeafArrayRead( aChunks, numChunks, pEntry->le_name_chunk, (uint8_t *) szName, pEntry->le_name_numints ) || !ZapLeafArrayRead( aChunks, numChunks, pEntry->le_value_chunk, (uint8_t *) auValue, (size_t) numIntLength * pEntry->le_value_numints ) )
+		{
+			Log( LOG_ERR, "Invalid MOS ZAP leaf." );
+			return false;
+		}
+
+		if( szName[ pEntry->le_name_numints - 1 ] )
+			continue;
+
+		//Fat ZAP leaves store integers big endian
+		if( numIntLength == sizeof( uint64_t ) )
+			for( unsigned uInt = 0; uInt < pEntry->le_value_numints; ++uInt )
+				auValue[ uInt ] = be64toh( auValue[ uInt ] );
+
+		if( !pfnEntry( szName, numIntLength, pEntry->le_value_numints, auValue, pUser ) )
+		{
+			*pfStopped = true;
+			return true;
+		}
+	}
+
+	return true;
+}
+
+/*!
+	\brief Calls \p pfnEntry for each entry of the ZAP object \p idObject, which may be a micro or a fat ZAP.
+*/
+static bool ZapForEach( mosreader_t *const pReader, const uint64_t idObject, const pfnzapentry_t pfnEntry, void *const pUser )
+{
+	dnode_phys_t dn;
+	if( !ReadDnode( pReader, idObject, &dn ) )
+		return false;
+
+	size_t numSize;
+	uint64_t *const pBlock = ReadObjectBlock( pReader, &dn, 0, &numSize );
+	if( !pBlock )
+		return false;
+
+	bool fSuccess = false;
+	if( numSize >= sizeof( mzap_ent_phys_t ) && pBlock[ 0 ] == ZBT_MICRO )
+	{
+		//The first entry is taken by the header
+		const mzap_ent_phys_t *const aEntries = (const mzap_ent_phys_t *) pBlock;
+		char szName[ MZAP_NAME_LEN + 1 ] = { 0 };
+		for( size_t u = 1; u < numSize / sizeof( mzap_ent_phys_t ); ++u )
+		{
+			if( !aEntries[ u ].mze_name[ 0 ] )
+				continue;
+
+			memcpy( szName, aEntries[ u ].mze_name, MZAP_NAME_LEN );
+			if( !pfnEntry( szName, sizeof( uint64_t ), 1, &aEntries[ u ].mze_value, pUser ) )
+				break;
+		}
+
+		fSuccess = true;
+	}
+	else if( numSize >= sizeof( uint64_t ) && pBlock[ 0 ] == ZBT_HEADER )
+	{
+		//Leaves are referenced from a pointer table, but identify themselves. Simply visit all blocks.
+		bool fStopped = false;
+		fSuccess = true;
+		for( uint64_t idBlock = 1; fSuccess && !fStopped && idBlock <= dn.dn_maxblkid; ++idBlock )
+		{
+			size_t numLeaf;
+			uint8_t *const pLeaf = ReadObjectBlock( pReader, &dn, idBlock, &numLeaf );
+			fSuccess = pLeaf && ZapLeafForEach( pLeaf, numLeaf, pfnEntry, pUser, &fStopped );
+			free( pLeaf );
+		}
+	}
+	else
+		Log( LOG_ERR, "MOS object %" PRIu64 " is not a ZAP.", idObject );
+
+	free( pBlock );
+	return fSuccess;
+}
+
+typedef struct zaplookup_s
+{
+	const char *szName;
+	unsigned numIntLength;
+	void *pValue;
+	size_t numSize;
+	bool fFound;
+} zaplookup_t;
+
+static bool ZapLookupEntry( const char *const szName, const unsigned numIntLength, const uint64_t numInts, const void *const pValue, void *const pUser )
+{
+	zaplookup_t *const pLookup = pUser;
+	if( strcmp( szName, pLookup->szName ) )
+		return true;
+
+	if( numIntLength == pLookup->numIntLength && numIntLength * numInts <= pLookup->numSize )
+	{
+		memcpy( pLookup->pValue, pValue, numIntLength * numInts );
+		pLookup->fFound = true;
+	}
+
+	return false;
+}
+
+/*!
+	\brief Looks up \p szName in the ZAP object \p idObject. Entries of a different integer length or larger than \p numSize bytes are treated as missing.
+*/
+static bool ZapLookup( mosreader_t *const pReader, const uint64_t idObject, const char *const szName, const unsigned numIntLength, void *const pValue, const size_t numSize, bool *const pfFound )
+{
+	zaplookup_t lookup = { .szName = szName, .numIntLength = numIntLength, .pValue = pValue, .numSize = numSize };
+	if( !ZapForEach( pReader, idObject, ZapLookupEntry, &lookup ) )
+		return false;
+
+	*pfFound = lookup.fFound;
+	return true;
+}
+
+/*!
+	\brief Checks the label \p pLabel of \p szVDev against the pool, collects its most recent uberblock and registers \p fd as source of its top-level vdev, if supported.
+	\return \c true if the label belongs to the pool.
+*/
+static bool ScanLabel( mosreader_t *const pReader, const char *const szVDev, const vdev_label_t *const pLabel, const char *const szPool, const uint64_t idPool, const int fd, bool *const pfKeep )
+{
+	if( pLabel->vl_vdev_phys.vp_zbt.zec_magic != ZEC_MAGIC )
+		return false;
+
+	nvlist_t *nvl;
+	if( nvlist_unpack( (char *) pLabel->vl_vdev_phys.vp_nvlist, sizeof( pLabel->vl_vdev_phys.vp_nvlist ), &nvl, 0 ) )
+		return false;
+
+	bool fMember = false;
+	const char *szVDevPool;
+	const char *szType;
+	uint64_t idVDevPool;
+	uint64_t idTopLevel;
+	uint64_t uAShift;
+	nvlist_t *nvlTree;
+	if( nvlist_lookup_string( nvl, ZPOOL_CONFIG_POOL_NAME, &szVDevPool ) || nvlist_lookup_uint64( nvl, ZPOOL_CONFIG_POOL_GUID, &idVDevPool ) || nvlist_lookup_nvlist( nvl, ZPOOL_CONFIG_VDEV_TREE, &nvlTree )
+		|| nvlist_lookup_string( nvlTree, ZPOOL_CONFIG_TYPE, &szType ) || nvlist_lookup_uint64( nvlTree, ZPOOL_CONFIG_ID, &idTopLevel ) || nvlist_lookup_uint64( nvlTree, ZPOOL_CONFIG_ASHIFT, &uAShift ) )
+	{
+		Log( LOG_WARNING, "Incomplete label on vdev \"%s\".", szVDev );
+		goto ERROR_AFTER_NVL;
+	}
+
+#ifdef DISABLE_ID_CHECK
+	(void) idPool;
+	if( strcmp( szVDevPool, szPool ) )
+#else
+	if( strcmp( szVDevPool, szPool ) || idVDevPool != idPool )
+#endif
+	{
+		Log( LOG_WARNING, "VDev \"%s\" is not a member of pool \"%s\".", szVDev, szPool );
+		goto ERROR_AFTER_NVL;
+	}
+
+	fMember = true;
+
+	//Find the most recent uberblock. Slots are sized by the vdev's ashift.
+	{
+		const unsigned uShift = uAShift < UBERBLOCK_SHIFT ? UBERBLOCK_SHIFT : uAShift > MAX_UBERBLOCK_SHIFT ? MAX_UBERBLOCK_SHIFT : (unsigned) uAShift;
+		for( size_t uOffset = 0; uOffset < VDEV_UBERBLOCK_RING; uOffset += (size_t) 1 << uShift )
+		{
+			const uberblock_t *const pub = (const uberblock_t *) &pLabel->vl_uberblock[ uOffset ];
+			if( pub->ub_magic != UBERBLOCK_MAGIC )
+				continue;
+
+			if( pub->ub_txg > pReader->ub.ub_txg || ( pub->ub_txg == pReader->ub.ub_txg && pub->ub_timestamp > pReader->ub.ub_timestamp ) )
+				pReader->ub = *pub;
+		}
+	}
+
+	//Each leaf of a disk, file or mirror top-level vdev holds all of its data at the same offsets
+	//Raidz and draid spread blocks across their leaves. Pools of them are common and simply can't be read this way, which is no reason to warn on every boot.
+	if( strcmp( szType, VDEV_TYPE_DISK ) && strcmp( szType, VDEV_TYPE_FILE ) && strcmp( szType, VDEV_TYPE_MIRROR ) )
+	{
+		Log( !strcmp( szType, VDEV_TYPE_RAIDZ ) || !strcmp( szType, VDEV_TYPE_DRAID ) ? LOG_INFO : LOG_WARNING, "Top-level vdev %" PRIu64 " of type \"%s\" is not supported for offline reading.", idTopLevel, szType );
+		goto ERROR_AFTER_NVL;
+	}
+
+	if( idTopLevel >= pReader->numTopLevel )
+	{
+		int *const p = realloc( pReader->afdTopLevel, ( idTopLevel + 1 ) * sizeof( int ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for top-level vdev list." );
+			goto ERROR_AFTER_NVL;
+		}
+
+		for( uint64_t u = pReader->numTopLevel; u <= idTopLevel; ++u )
+			p[ u ] = -1;
+
+		pReader->afdTopLevel = p;
+		pReader->numTopLevel = idTopLevel + 1;
+	}
+
+	if( pReader->afdTopLevel[ idTopLevel ] < 0 )
+	{
+		pReader->afdTopLevel[ idTopLevel ] = fd;
+		*pfKeep = true;
+	}
+
+ERROR_AFTER_NVL:
+	nvlist_free( nvl );
+	return fMember;
+}
+
+static bool OpenVDevs( mosreader_t *const pReader, const char *const szzVDevs, const char *const szPool, const uint64_t idPool )
+{
+	vdev_label_t *const aLabels = malloc( VDEV_LABELS / 2 * sizeof( vdev_label_t ) );
+	if( !aLabels )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for vdev labels." );
+		return false;
+	}
+
+	//The front labels suffice, every label holds the same uberblocks
+	for( const char *szVDev = szzVDevs; *szVDev; szVDev += strlen( szVDev ) + 1 )
+	{
+		const int fd = open( szVDev, O_RDONLY | O_CLOEXEC );
+		if( fd < 0 )
+		{
+			Log( LOG_WARNING, "Failed to open vdev \"%s\".", szVDev );
+			continue;
+		}
+
+		bool fKeep = false;
+		if( pread( fd, aLabels, VDEV_LABELS / 2 * sizeof( vdev_label_t ), 0 ) != VDEV_LABELS / 2 * sizeof( vdev_label_t ) )
+			Log( LOG_WARNING, "Failed to read labels of vdev \"%s\".", szVDev );
+		else
+			for( unsigned uLabel = 0; uLabel < VDEV_LABELS / 2; ++uLabel )
+				if( ScanLabel( pReader, szVDev, &aLabels[ uLabel ], szPool, idPool, fd, &fKeep ) )
+					break;
+
+		if( !fKeep )
+			close( fd );
+	}
+
+	free( aLabels );
+
+	if( pReader->ub.ub_magic != UBERBLOCK_MAGIC )
+	{
+		Log( LOG_ERR, "Found no uberblock of pool \"%s\".", szPool );
+		return false;
+	}
+
+	return true;
+}
+
+typedef struct moschild_s
+{
+	uint64_t idDir;
+	char szName[ ZFS_MAX_DATASET_NAME_LEN ];
+} moschild_t;
+
+typedef struct moschildren_s
+{
+	moschild_t *aChildren;
+	size_t numChildren;
+	size_t numAllocated;
+	bool fFailed;
+} moschildren_t;
+
+static bool CollectChild( const char *const szName, const unsigned numIntLength, const uint64_t numInts, const void *const pValue, void *const pUser )
+{
+	moschildren_t *const pChildren = pUser;
+
+	//Skip hidden directories ($MOS, $FREE, $ORIGIN) and temporary clones of receives
+	if( szName[ 0 ] == '$' || strchr( szName, '%' ) || numIntLength != sizeof( uint64_t ) || numInts != 1 || strlen( szName ) >= ZFS_MAX_DATASET_NAME_LEN )
+		return true;
+
+	if( pChildren->numChildren == pChildren->numAllocated )
+	{
+		const size_t numAllocated = pChildren->numAllocated ? pChildren->numAllocated * 2 : 16;
+		moschild_t *const p = realloc( pChildren->aChildren, numAllocated * sizeof( moschild_t ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for dataset list." );
+			pChildren->fFailed = true;
+			return false;
+		}
+
+		pChildren->aChildren = p;
+		pChildren->numAllocated = numAllocated;
+	}
+
+	moschild_t *const pChild = &pChildren->aChildren[ pChildren->numChildren++ ];
+	memcpy( &pChild->idDir, pValue, sizeof( uint64_t ) );
+	strcpy( pChild->szName, szName );
+	return true;
+}
+
+typedef struct moswalk_s
+{
+	mosreader_t *pReader;
+	pfnpooldataset_t pfnDataset;
+	void *pUser;
+	char szName[ ZFS_MAX_DATASET_NAME_LEN ];
+	struct
+	{
+		uint64_t idDir;
+		size_t lenName;
+	} aStack[ MOS_MAX_DEPTH ];	//Directories from the root to the current one, to name encryption roots
+	unsigned numDepth;
+	size_t numDatasets;
+} moswalk_t;
+
+/*!
+	\brief Determines the mountpoint of the DSL directory \p pDir from its local or received property, or by inheriting from \p szParentMountPoint.
+	\return The mountpoint (to be released using free), which may also be "none" or "legacy".
+*/
+static char *ResolveMountPoint( moswalk_t *const pWalk, const dsl_dir_phys_t *const pDir, const char *const szParentMountPoint )
+{
+	char *const szMountPoint = malloc( PATH_MAX );
+	if( !szMountPoint )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for mountpoint." );
+		return NULL;
+	}
+
+	bool fFound = false;
+	memset( szMountPoint, 0, PATH_MAX );
+	if( pDir->dd_props_zapobj )
+	{
+		if( !ZapLookup( pWalk->pReader, pDir->dd_props_zapobj, "mountpoint", 1, szMountPoint, PATH_MAX - 1, &fFound ) )
+			goto ERROR_AFTER_MOUNTPOINT;
+		if( !fFound && !ZapLookup( pWalk->pReader, pDir->dd_props_zapobj, "mountpoint$recvd", 1, szMountPoint, PATH_MAX - 1, &fFound ) )
+			goto ERROR_AFTER_MOUNTPOINT;
+	}
+
+	if( fFound )
+		return szMountPoint;
+
+	//Inherit by appending the last name component, the pool's root defaults to /<pool>
+	int iLength;
+	if( !szParentMountPoint )
+		iLength = snprintf( szMountPoint, PATH_MAX, "/%s", pWalk->szName );
+	else if( szParentMountPoint[ 0 ] != '/' )
+		iLength = snprintf( szMountPoint, PATH_MAX, "%s", szParentMountPoint );
+	else
+		iLength = snprintf( szMountPoint, PATH_MAX, "%s/%s", strcmp( szParentMountPoint, "/" ) ? szParentMountPoint : "", strrchr( pWalk->szName, '/' ) + 1 );
+
+	if( iLength < PATH_MAX )
+		return szMountPoint;
+
+	Log( LOG_ERR, "Mountpoint of dataset \"%s\" is too long.", pWalk->szName );
+ERROR_AFTER_MOUNTPOINT:
+	free( szMountPoint );
+	return NULL;
+}
+
+/*!
+	\brief Determines the name of the encryption root of the DSL directory \p idDir into \p szEncryptionRoot, or sets it empty if the directory is not encrypted.
+	\details The encryption root is always the directory itself or one of its ancestors on the walk stack.
+*/
+static bool ResolveEncryptionRoot( moswalk_t *const pWalk, const uint64_t idDir, const dnode_phys_t *const pdn, char szEncryptionRoot[ ZFS_MAX_DATASET_NAME_LEN ] )
+{
+	szEncryptionRoot[ 0 ] = '\0';
+
+	//Only directories with extensions (e.g. the key object) are ZAPs
+	if( !( pdn->dn_type & DMU_OT_NEWTYPE ) || ( pdn->dn_type & DMU_OT_BYTESWAP_MASK ) != DMU_BSWAP_ZAP )
+		return true;
+
+	uint64_t idKey;
+	bool fFound;
+	if( !ZapLookup( pWalk->pReader, idDir, DD_FIELD_CRYPTO_KEY_OBJ, sizeof( uint64_t ), &idKey, sizeof( idKey ), &fFound ) )
+		return false;
+	if( !fFound )
+		return true;
+
+	uint64_t idRootDir;
+	if( !ZapLookup( pWalk->pReader, idKey, DSL_CRYPTO_KEY_ROOT_DDOBJ, sizeof( uint64_t ), &idRootDir, sizeof( idRootDir ), &fFound ) )
+		return false;
+
+	for( unsigned u = 0; fFound && u < pWalk->numDepth; ++u )
+		if( pWalk->aStack[ u ].idDir == idRootDir )
+		{
+			memcpy( szEncryptionRoot, pWalk->szName, pWalk->aStack[ u ].lenName );
+			szEncryptionRoot[ pWalk->aStack[ u ].lenName ] = '\0';
+			return true;
+		}
+
+	Log( LOG_ERR, "Failed to find encryption root of dataset \"%s\".", pWalk->szName );
+	return false;
+}
+
+static bool WalkDir( moswalk_t *const pWalk, const uint64_t idDir, const char *const szParentMountPoint )
+{
+	dnode_phys_t dn;
+	if( !ReadDnode( pWalk->pReader, idDir, &dn ) )
+		return false;
+
+	const dsl_dir_phys_t *const pDir = GetBonus( &dn, sizeof( dsl_dir_phys_t ) );
+	if( dn.dn_bonustype != DMU_OT_DSL_DIR || !pDir )
+	{
+		Log( LOG_ERR, "MOS object %" PRIu64 " of dataset \"%s\" is not a DSL directory.", idDir, pWalk->szName );
+		return false;
+	}
+
+	if( pWalk->numDepth == MOS_MAX_DEPTH )
+	{
+		Log( LOG_ERR, "Dataset \"%s\" is nested too deeply.", pWalk->szName );
+		return false;
+	}
+
+	pWalk->aStack[ pWalk->numDepth ].idDir = idDir;
+	pWalk->aStack[ pWalk->numDepth ].lenName = strlen( pWalk->szName );
+	++pWalk->numDepth;
+
+	bool fSuccess = false;
+	char *const szMountPoint = ResolveMountPoint( pWalk, pDir, szParentMountPoint );
+	if( !szMountPoint )
+		goto ERROR_AFTER_STACK;
+
+	//canmount is not inherited
+	uint64_t eCanMount = ZFS_CANMOUNT_ON;
+	{
+		bool fFound = false;
+		if( pDir->dd_props_zapobj )
+		{
+			if( !ZapLookup( pWalk->pReader, pDir->dd_props_zapobj, "canmount", sizeof( uint64_t ), &eCanMount, sizeof( eCanMount ), &fFound ) )
+				goto ERROR_AFTER_MOUNTPOINT;
+			if( !fFound && !ZapLookup( pWalk->pReader, pDir->dd_props_zapobj, "canmount$recvd", sizeof( uint64_t ), &eCanMount, sizeof( eCanMount ), &fFound ) )
+				goto ERROR_AFTER_MOUNTPOINT;
+		}
+	}
+
+	char szEncryptionRoot[ ZFS_MAX_DATASET_NAME_LEN ];
+	if( !ResolveEncryptionRoot( pWalk, idDir, &dn, szEncryptionRoot ) )
+		goto ERROR_AFTER_MOUNTPOINT;
+
+	++pWalk->numDatasets;
+	if( !pWalk->pfnDataset( pWalk->szName, eCanMount == ZFS_CANMOUNT_ON && szMountPoint[ 0 ] == '/' ? szMountPoint : NULL, szEncryptionRoot[ 0 ] ? szEncryptionRoot : NULL, pWalk->pUser ) )
+		goto ERROR_AFTER_MOUNTPOINT;
+
+	//Collect the children first, so no ZAP blocks are held while descending
+	moschildren_t children = { 0 };
+	if( pDir->dd_child_dir_zapobj && ( !ZapForEach( pWalk->pReader, pDir->dd_child_dir_zapobj, CollectChild, &children ) || children.fFailed ) )
+		goto ERROR_AFTER_CHILDREN;
+
+	const size_t lenName = strlen( pWalk->szName );
+	for( size_t u = 0; u < children.numChildren; ++u )
+	{
+		if( lenName + 1 + strlen( children.aChildren[ u ].szName ) >= sizeof( pWalk->szName ) )
+		{
+			Log( LOG_ERR, "Name of child \"%s\" of dataset \"%s\" is too long.", children.aChildren[ u ].szName, pWalk->szName );
+			goto ERROR_AFTER_CHILDREN;
+		}
+
+		pWalk->szName[ lenName ] = '/';
+		strcpy( pWalk->szName + lenName + 1, children.aChildren[ u ].szName );
+		const bool fChild = WalkDir( pWalk, children.aChildren[ u ].idDir, szMountPoint );
+		pWalk->szName[ lenName ] = '\0';
+		if( !fChild )
+			goto ERROR_AFTER_CHILDREN;
+	}
+
+	fSuccess = true;
+
+ERROR_AFTER_CHILDREN:
+	free( children.aChildren );
+ERROR_AFTER_MOUNTPOINT:
+	free( szMountPoint );
+ERROR_AFTER_STACK:
+	--pWalk->numDepth;
+	return fSuccess;
+}
+
+/*!
+	\brief Reads the dataset tree of the pool \p szPool with id \p idPool directly from the vdevs \p szzVDevs, without importing it, and calls \p pfnDataset for each dataset, parents first.
+	\param szzVDevs A list of vdev paths. VDevs are separated with NULL-terminators, the list itself is finalized with a second NULL-terminators (i.e. doubly terminated at the end).
+	\details The pool must not be modified concurrently, i.e. call this before or during the import, not afterwards.
+		The result reflects the last synced transaction group and is advisory. Returning \c false from \p pfnDataset aborts the walk and fails the call.
+*/
+bool ReadPoolDatasets( zt_context_t *const pContext, const char *const szzVDevs, const char *const szPool, const uint64_t idPool, const pfnpooldataset_t pfnDataset, void *const pUser )
+{
+	CONTEXT_SCOPE( pContext );
+	mosreader_t reader = { 0 };
+	bool fSuccess = false;
+	if( !OpenVDevs( &reader, szzVDevs, szPool, idPool ) )
+		goto ERROR_AFTER_VDEVS;
+
+	//The root block pointer references the MOS object set, which starts with its meta dnode
+	{
+		if( BP_GET_TYPE( &reader.ub.ub_rootbp ) != DMU_OT_OBJSET )
+		{
+			Log( LOG_ERR, "Root block pointer of pool \"%s\" does not reference an object set.", szPool );
+			goto ERROR_AFTER_VDEVS;
+		}
+
+		size_t numSize;
+		void *const pObjset = ReadBlock( &reader, &reader.ub.ub_rootbp, &numSize );
+		if( !pObjset )
+			goto ERROR_AFTER_VDEVS;
+
+		if( numSize >= sizeof( dnode_phys_t ) )
+			memcpy( &reader.dnMeta, pObjset, sizeof( dnode_phys_t ) );
+		free( pObjset );
+
+		if( reader.dnMeta.dn_datablkszsec < DNODE_SIZE >> SPA_MINBLOCKSHIFT )
+		{
+			Log( LOG_ERR, "Invalid meta dnode of pool \"%s\".", szPool );
+			goto ERROR_AFTER_VDEVS;
+		}
+	}
+
+	uint64_t idRootDir;
+	bool fFound;
+	if( !ZapLookup( &reader, DMU_POOL_DIRECTORY_OBJECT, DMU_POOL_ROOT_DATASET, sizeof( uint64_t ), &idRootDir, sizeof( idRootDir ), &fFound ) )
+		goto ERROR_AFTER_CACHE;
+
+	if( !fFound )
+	{
+		Log( LOG_ERR, "Failed to find root dataset of pool \"%s\".", szPool );
+		goto ERROR_AFTER_CACHE;
+	}
+
+	moswalk_t walk = { .pReader = &reader, .pfnDataset = pfnDataset, .pUser = pUser };
+	if( strlcpy( walk.szName, szPool, sizeof( walk.szName ) ) >= sizeof( walk.szName ) )
+	{
+		Log( LOG_ERR, "Pool name \"%s\" is too long.", szPool );
+		goto ERROR_AFTER_CACHE;
+	}
+
+	if( ( fSuccess = WalkDir( &walk, idRootDir, NULL ) ) )
+		Log( LOG_INFO, "Read %zu datasets of pool \"%s\" at txg %" PRIu64 " from its vdevs.", walk.numDatasets, szPool, reader.ub.ub_txg );
+
+ERROR_AFTER_CACHE:
+	free( reader.pCache );
+ERROR_AFTER_VDEVS:
+	for( uint64_t u = 0; u < reader.numTopLevel; ++u )
+		if( reader.afdTopLevel[ u ] >= 0 )
+			close( reader.afdTopLevel[ u ] );
+	free( reader.afdTopLevel );
+	return fSuccess;
+}
+
+typedef struct mountpoints_s
+{
+	char **aszMountPoints;
+	size_t numMountPoints;
+	size_t numAllocated;
+} mountpoints_t;
+
+static bool CollectMountPoint( const char *const szDataset, const char *const szMountPoint, const char *const szEncryptionRoot, void *const pUser )
+{
+	(void) szEncryptionRoot;
+	mountpoints_t *const pMountPoints = pUser;
+	if( !szMountPoint || !strcmp( szMountPoint, "/" ) )
+		return true;
+
+	if( pMountPoints->numMountPoints == pMountPoints->numAllocated )
+	{
+		const size_t numAllocated = pMountPoints->numAllocated ? pMountPoints->numAllocated * 2 : 16;
+		char **const p = realloc( pMountPoints->aszMountPoints, numAllocated * sizeof( char * ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for mountpoint list." );
+			return false;
+		}
+
+		pMountPoints->aszMountPoints = p;
+		pMountPoints->numAllocated = numAllocated;
+	}
+
+	if( !( pMountPoints->aszMountPoints[ pMountPoints->numMountPoints ] = strdup( szMountPoint ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for mountpoint of dataset \"%s\".", szDataset );
+		return false;
+	}
+
+	++pMountPoints->numMountPoints;
+	return true;
+}
+
+/*!
+	\brief Orders paths like strcmp, except that '/' sorts before any other character. This way, all paths below a directory directly follow it.
+*/
+static int ComparePaths( const void *p1, const void *p2 )
+{
+	const unsigned char *sz1 = *(const unsigned char *const *) p1;
+	const unsigned char *sz2 = *(const unsigned char *const *) p2;
+	while( *sz1 && *sz1 == *sz2 )
+	{
+		++sz1;
+		++sz2;
+	}
+
+	const int i1 = *sz1 == '/' ? 1 : *sz1 ? *sz1 + 1 : 0;
+	const int i2 = *sz2 == '/' ? 1 : *sz2 ? *sz2 + 1 : 0;
+	return i1 - i2;
+}
+
+/*!
+	\brief Creates the outermost mountpoint directories of the pool \p szPool, read directly from its vdevs \p szzVDevs. Meant to run while the pool is imported.
+	\details Mountpoints below another dataset's mountpoint are left alone: they belong into that dataset once mounted, and MountAt requires empty directories.
+*/
+bool CreatePoolMountPoints( zt_context_t *const pContext, const char *const szzVDevs, const char *const szPool, const uint64_t idPool )
+{
+	CONTEXT_SCOPE( pContext );
+	mountpoints_t mountpoints = { 0 };
+	bool fSuccess = ReadPoolDatasets( pContext, szzVDevs, szPool, idPool, CollectMountPoint, &mountpoints );
+	if( fSuccess )
+	{
+		qsort( mountpoints.aszMountPoints, mountpoints.numMountPoints, sizeof( char * ), ComparePaths );
+
+		char szPath[ PATH_MAX ];
+		const char *szOuter = NULL;
+		size_t lenOuter = 0;
+		for( size_t u = 0; u < mountpoints.numMountPoints; ++u )
+		{
+			const char *const szMountPoint = mountpoints.aszMountPoints[ u ];
+			if( szOuter && !strncmp( szMountPoint, szOuter, lenOuter ) && ( szMountPoint[ lenOuter ] == '/' || !szMountPoint[ lenOuter ] ) )
+				continue;
+
+			szOuter = szMountPoint;
+			lenOuter = strlen( szMountPoint );
+
+			//MakePath shortens the path on error, use a copy
+			strcpy( szPath, szMountPoint );
+			if( MakePath( szPath, 0755 ) && errno != EEXIST )
+			{
+				Log( LOG_WARNING, "Failed to create mountpoint \"%s\".", szPath );
+				fSuccess = false;
+			}
+		}
+	}
+
+	for( size_t u = 0; u < mountpoints.numMountPoints; ++u )
+		free( mountpoints.aszMountPoints[ u ] );
+	free( mountpoints.aszMountPoints );
+	return fSuccess;
+}
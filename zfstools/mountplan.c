@@ -0,0 +1,689 @@
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <zfs_cmd.h>
+#include <syslog.h>
+
+#define PLAN_MAGIC		"zfstools-mountplan"
+#define PLAN_VERSION	2
+#define PLAN_NONE		"-"
+#define PROP_MOUNTPRIORITY	"org.zfstools:mountpriority"
+#define NO_PARENT		SIZE_MAX
+
+/*
+	A mount plan is the result of a full enumeration, written after a successful run:
+		zfstools-mountplan <version> <pool guid> <txg> <dataset count>
+		<canmount>\t<priority>\t<encryption root>\t<dataset>\t<mountpoint>
+	with one line per dataset in enumeration order (parents before children) and "-" for missing values.
+	On the next run, the plan is mounted right away while the pool is enumerated in the background. Afterwards, mounts that
+	are not backed by the enumeration are undone and missing ones are added, so the result matches MountPool.
+	The plan is only checked to belong to the pool by its guid. The txg is informational: the config txg of an imported pool only grows, and datasets
+	don't change it anyway. Neither is there a cheap way to tell whether datasets were added, removed or renamed since, so an outdated plan is
+	replayed as is and corrected by the reconciliation afterwards. The dataset count only detects truncated plans.
+	MountPool mounts through an empty plan, so all three ways of mounting a pool share the order of OrderMountPlan.
+
+	Datasets are mounted by descending PROP_MOUNTPRIORITY, which ZFS inherits like any user property. Each dataset is raised to the highest
+	priority among its descendants, so critical datasets are never mounted before their ancestors. Equal priorities keep the enumeration order.
+*/
+
+typedef struct planentry_s
+{
+	char *szDataset;
+	char *szMountPoint;		//NULL if the dataset is not to be mounted
+	char *szEncryptionRoot;	//NULL if the dataset is not encrypted
+	uint64_t eCanMount;
+	int64_t iPriority;		//Of PROP_MOUNTPRIORITY, 0 if unset
+} planentry_t;
+
+typedef struct mountplan_s
+{
+	planentry_t *aEntries;
+	size_t numEntries;
+	size_t numAllocated;
+	uint64_t idPool;
+	uint64_t uTxg;
+} mountplan_t;
+
+typedef struct planwalk_s
+{
+	zt_context_t *pContext;
+	const char *szPool;
+	mountplan_t *pPlan;
+	bool fSuccess;
+} planwalk_t;
+
+typedef struct planorder_s
+{
+	int64_t iPriority;	//Highest of the dataset and its descendants
+	size_t uIndex;		//Into the plan's entries
+	size_t uParent;		//Only valid before sorting
+} planorder_t;
+
+static planentry_t *AddPlanEntry( mountplan_t *const pPlan )
+{
+	if( pPlan->numEntries == pPlan->numAllocated )
+	{
+		const size_t numAllocated = pPlan->numAllocated ? pPlan->numAllocated * 2 : 64;
+		planentry_t *const p = realloc( pPlan->aEntries, numAllocated * sizeof( planentry_t ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for mount plan." );
+			return NULL;
+		}
+
+		pPlan->aEntries = p;
+		pPlan->numAllocated = numAllocated;
+	}
+
+	planentry_t *const pEntry = &pPlan->aEntries[ pPlan->numEntries++ ];
+	*pEntry = (planentry_t) { .eCanMount = ZFS_CANMOUNT_ON };
+	return pEntry;
+}
+
+static void FreeMountPlan( mountplan_t *const pPlan )
+{
+	for( size_t u = 0; u < pPlan->numEntries; ++u )
+	{
+		free( pPlan->aEntries[ u ].szDataset );
+		free( pPlan->aEntries[ u ].szMountPoint );
+		free( pPlan->aEntries[ u ].szEncryptionRoot );
+	}
+
+	free( pPlan->aEntries );
+	pPlan->aEntries = NULL;
+	pPlan->numEntries = pPlan->numAllocated = 0;
+}
+
+static bool StringsEqual( const char *const sz1, const char *const sz2 )
+{
+	return sz1 == sz2 || sz1 && sz2 && !strcmp( sz1, sz2 );
+}
+
+static bool MountPlansEqual( const mountplan_t *const pPlan1, const mountplan_t *const pPlan2 )
+{
+	if( pPlan1->numEntries != pPlan2->numEntries )
+		return false;
+
+	for( size_t u = 0; u < pPlan1->numEntries; ++u )
+	{
+		const planentry_t *const p1 = &pPlan1->aEntries[ u ];
+		const planentry_t *const p2 = &pPlan2->aEntries[ u ];
+		if( p1->eCanMount != p2->eCanMount || p1->iPriority != p2->iPriority || !StringsEqual( p1->szDataset, p2->szDataset ) || !StringsEqual( p1->szMountPoint, p2->szMountPoint ) || !StringsEqual( p1->szEncryptionRoot, p2->szEncryptionRoot ) )
+			return false;
+	}
+
+	return true;
+}
+
+/*!
+	\brief Fetches the guid and the config txg of the imported pool \p szPool.
+*/
+static bool GetPoolTxg( const int fdZFS, const char *const szPool, uint64_t *const pidPool, uint64_t *const puTxg )
+{
+	zfs_cmd_t zc = { 0 };
+	(void) strlcpy( zc.zc_name, szPool, sizeof( zc.zc_name ) );
+	zc.zc_nvlist_dst_size = CONFIG_BUF_MINSIZE;
+	zc.zc_nvlist_dst = (uint64_t) calloc( 1, zc.zc_nvlist_dst_size );
+	if( !zc.zc_nvlist_dst )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for pool statistics." );
+		return false;
+	}
+
+	while( lzc_ioctl_fd( fdZFS, ZFS_IOC_POOL_STATS, &zc ) == -1 )
+	{
+		if( errno != ENOMEM )
+		{
+			Log( LOG_ERR, "Failed to load statistics of pool \"%s\". Error code %d.", szPool, errno );
+			goto ERROR_AFTER_DST;
+		}
+
+		//If the destination buffer was too small, the kernel updated zc_nvlist_dst_size with the actual size needed
+		free( (void *) zc.zc_nvlist_dst );
+		if( !( zc.zc_nvlist_dst = (uint64_t) calloc( 1, zc.zc_nvlist_dst_size ) ) )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for pool statistics." );
+			return false;
+		}
+	}
+
+	nvlist_t *nvlConfig;
+	if( nvlist_unpack( (void *) zc.zc_nvlist_dst, zc.zc_nvlist_dst_size, &nvlConfig, 0 ) )
+	{
+		Log( LOG_ERR, "Failed to unpack statistics of pool \"%s\".", szPool );
+		goto ERROR_AFTER_DST;
+	}
+
+	if( nvlist_lookup_uint64( nvlConfig, ZPOOL_CONFIG_POOL_GUID, pidPool ) || nvlist_lookup_uint64( nvlConfig, ZPOOL_CONFIG_POOL_TXG, puTxg ) )
+	{
+		Log( LOG_ERR, "Failed to find guid and txg of pool \"%s\".", szPool );
+		nvlist_free( nvlConfig );
+		goto ERROR_AFTER_DST;
+	}
+
+	nvlist_free( nvlConfig );
+	free( (void *) zc.zc_nvlist_dst );
+	return true;
+
+ERROR_AFTER_DST:
+	free( (void *) zc.zc_nvlist_dst );
+	return false;
+}
+
+/*!
+	\brief Loads the plan at \p szPath, if it was written for the pool \p idPool.
+	\details Only the pool guid is checked. Whether the datasets changed since is left to ReconcileMounts.
+*/
+static bool LoadMountPlan( const char *const szPath, const uint64_t idPool, mountplan_t *const pPlan )
+{
+	FILE *const f = fopen( szPath, "re" );
+	if( !f )
+	{
+		if( errno != ENOENT )
+			Log( LOG_WARNING, "Failed to open mount plan \"%s\".", szPath );
+		return false;
+	}
+
+	char *szLine = NULL;
+	size_t numAllocated = 0;
+	unsigned uVersion;
+	size_t numDatasets;
+	if( getline( &szLine, &numAllocated, f ) <= 0 || sscanf( szLine, PLAN_MAGIC " %u %" SCNu64 " %" SCNu64 " %zu", &uVersion, &pPlan->idPool, &pPlan->uTxg, &numDatasets ) != 4 || uVersion != PLAN_VERSION )
+	{
+		Log( LOG_WARNING, "Ignoring mount plan \"%s\" with unknown format.", szPath );
+		goto ERROR_AFTER_FILE;
+	}
+
+	if( pPlan->idPool != idPool )
+	{
+		Log( LOG_INFO, "Ignoring mount plan \"%s\" of a different pool.", szPath );
+		goto ERROR_AFTER_FILE;
+	}
+
+	while( getline( &szLine, &numAllocated, f ) > 0 )
+	{
+		char *szSave;
+		const char *const szCanMount = strtok_r( szLine, "\t\n", &szSave );
+		const char *const szPriority = strtok_r( NULL, "\t\n", &szSave );
+		const char *const szEncryptionRoot = strtok_r( NULL, "\t\n", &szSave );
+		const char *const szDataset = strtok_r( NULL, "\t\n", &szSave );
+		const char *const szMountPoint = strtok_r( NULL, "\t\n", &szSave );
+		if( !szMountPoint )
+		{
+			Log( LOG_WARNING, "Ignoring corrupted mount plan \"%s\".", szPath );
+			goto ERROR_AFTER_ENTRIES;
+		}
+
+		planentry_t *const pEntry = AddPlanEntry( pPlan );
+		if( !pEntry )
+			goto ERROR_AFTER_ENTRIES;
+
+		pEntry->eCanMount = strtoull( szCanMount, NULL, 10 );
+		pEntry->iPriority = strtoll( szPriority, NULL, 10 );
+		if( !( pEntry->szDataset = strdup( szDataset ) )
+			|| strcmp( szMountPoint, PLAN_NONE ) && !( pEntry->szMountPoint = strdup( szMountPoint ) )
+			|| strcmp( szEncryptionRoot, PLAN_NONE ) && !( pEntry->szEncryptionRoot = strdup( szEncryptionRoot ) ) )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for mount plan." );
+			goto ERROR_AFTER_ENTRIES;
+		}
+	}
+
+	if( pPlan->numEntries != numDatasets )
+	{
+		Log( LOG_WARNING, "Ignoring truncated mount plan \"%s\".", szPath );
+		goto ERROR_AFTER_ENTRIES;
+	}
+
+	free( szLine );
+	fclose( f );
+	return true;
+
+ERROR_AFTER_ENTRIES:
+	FreeMountPlan( pPlan );
+ERROR_AFTER_FILE:
+	free( szLine );
+	fclose( f );
+	return false;
+}
+
+/*!
+	\brief Atomically replaces the plan at \p szPath with \p pPlan.
+*/
+static bool SaveMountPlan( const char *const szPath, const mountplan_t *const pPlan )
+{
+	//The format is line and tab based, so mountpoints containing either can't be stored
+	for( size_t u = 0; u < pPlan->numEntries; ++u )
+		if( pPlan->aEntries[ u ].szMountPoint && strpbrk( pPlan->aEntries[ u ].szMountPoint, "\t\n" ) )
+		{
+			Log( LOG_WARNING, "Not saving mount plan, mountpoint of dataset \"%s\" contains control characters.", pPlan->aEntries[ u ].szDataset );
+			return false;
+		}
+
+	char *szTemp;
+	if( asprintf( &szTemp, "%s.tmp", szPath ) < 0 )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for mount plan path." );
+		return false;
+	}
+
+	FILE *const f = fopen( szTemp, "we" );
+	if( !f )
+	{
+		Log( LOG_WARNING, "Failed to create mount plan \"%s\".", szTemp );
+		free( szTemp );
+		return false;
+	}
+
+	fprintf( f, PLAN_MAGIC " %u %" PRIu64 " %" PRIu64 " %zu\n", PLAN_VERSION, pPlan->idPool, pPlan->uTxg, pPlan->numEntries );
+	for( size_t u = 0; u < pPlan->numEntries; ++u )
+	{
+		const planentry_t *const pEntry = &pPlan->aEntries[ u ];
+		fprintf( f, "%" PRIu64 "\t%" PRId64 "\t%s\t%s\t%s\n", pEntry->eCanMount, pEntry->iPriority, pEntry->szEncryptionRoot ? pEntry->szEncryptionRoot : PLAN_NONE, pEntry->szDataset, pEntry->szMountPoint ? pEntry->szMountPoint : PLAN_NONE );
+	}
+
+	if( ferror( f ) | fclose( f ) || rename( szTemp, szPath ) )
+	{
+		Log( LOG_WARNING, "Failed to write mount plan \"%s\".", szPath );
+		(void) unlink( szTemp );
+		free( szTemp );
+		return false;
+	}
+
+	free( szTemp );
+	return true;
+}
+
+static bool CollectPlanEntry( const char *const szDataset, nvlist_t *const nvl, void *const pUser )
+{
+	planentry_t *const pEntry = AddPlanEntry( (mountplan_t *) pUser );
+	if( !pEntry )
+		return false;
+
+	if( !( pEntry->szDataset = strdup( szDataset ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for mount plan." );
+		return false;
+	}
+
+	if( !GetMountPoint( szDataset, nvl, NULL, 0, &pEntry->szMountPoint ) )
+		return false;
+
+	nvlist_t *nvlProp;
+	if( !nvlist_lookup_nvlist( nvl, "canmount", &nvlProp ) )
+		(void) nvlist_lookup_uint64( nvlProp, ZPROP_VALUE, &pEntry->eCanMount );
+
+	const char *szEncryptionRoot;
+	if( !nvlist_lookup_nvlist( nvl, "encryptionroot", &nvlProp ) && !nvlist_lookup_string( nvlProp, ZPROP_VALUE, &szEncryptionRoot ) && szEncryptionRoot[ 0 ] )
+		if( !( pEntry->szEncryptionRoot = strdup( szEncryptionRoot ) ) )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for mount plan." );
+			return false;
+		}
+
+	const char *szPriority;
+	if( !nvlist_lookup_nvlist( nvl, PROP_MOUNTPRIORITY, &nvlProp ) && !nvlist_lookup_string( nvlProp, ZPROP_VALUE, &szPriority ) )
+	{
+		char *pEnd;
+		errno = 0;
+		pEntry->iPriority = strtoll( szPriority, &pEnd, 10 );
+		if( errno || pEnd == szPriority || *pEnd )
+		{
+			Log( LOG_WARNING, "Ignoring invalid " PROP_MOUNTPRIORITY " \"%s\" of dataset \"%s\".", szPriority, szDataset );
+			pEntry->iPriority = 0;
+		}
+	}
+
+	return true;
+}
+
+static void *PlanWalkThread( void *const pArg )
+{
+	planwalk_t *const pWalk = pArg;
+	CONTEXT_SCOPE( pWalk->pContext );
+	pWalk->fSuccess = WalkPool( pWalk->pContext, pWalk->szPool, CollectPlanEntry, pWalk->pPlan );
+	return NULL;
+}
+
+static bool StartPlanWalk( planwalk_t *const pWalk, pthread_t *const pThread )
+{
+	if( !pthread_create( pThread, NULL, PlanWalkThread, pWalk ) )
+		return true;
+
+	Log( LOG_WARNING, "Failed to start background enumeration, enumerating after mounting the plan." );
+	return false;
+}
+
+static bool IsAncestor( const char *const szAncestor, const char *const szDataset )
+{
+	const size_t lenAncestor = strlen( szAncestor );
+	return !strncmp( szAncestor, szDataset, lenAncestor ) && szDataset[ lenAncestor ] == '/';
+}
+
+static int ComparePlanOrder( const void *p1, const void *p2 )
+{
+	const planorder_t *const pOrder1 = p1;
+	const planorder_t *const pOrder2 = p2;
+	if( pOrder1->iPriority != pOrder2->iPriority )
+		return pOrder1->iPriority > pOrder2->iPriority ? -1 : 1;
+
+	return pOrder1->uIndex < pOrder2->uIndex ? -1 : pOrder1->uIndex > pOrder2->uIndex;
+}
+
+/*!
+	\brief Determines the order in which the entries of \p pPlan are mounted.
+	\param pnumCritical	Receives the number of leading entries with a positive priority, i.e. the critical datasets and their ancestors. May be \c NULL.
+	\return The order, to be released using free, or \c NULL on error.
+*/
+static planorder_t *OrderMountPlan( const mountplan_t *const pPlan, size_t *const pnumCritical )
+{
+	planorder_t *const aOrder = malloc( pPlan->numEntries * sizeof( planorder_t ) + 1 );
+	if( !aOrder )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for mount order." );
+		return NULL;
+	}
+
+	//Parents are enumerated first, so the parent is the first ancestor on the chain of the previous dataset
+	for( size_t u = 0; u < pPlan->numEntries; ++u )
+	{
+		size_t uParent = u ? u - 1 : NO_PARENT;
+		while( uParent != NO_PARENT && !IsAncestor( pPlan->aEntries[ uParent ].szDataset, pPlan->aEntries[ u ].szDataset ) )
+			uParent = aOrder[ uParent ].uParent;
+
+		aOrder[ u ] = (planorder_t) { .iPriority = pPlan->aEntries[ u ].iPriority, .uIndex = u, .uParent = uParent };
+	}
+
+	//Children come after their parents, so a single backwards pass raises each dataset to the highest priority below it
+	for( size_t u = pPlan->numEntries; u--; )
+		if( aOrder[ u ].uParent != NO_PARENT && aOrder[ aOrder[ u ].uParent ].iPriority < aOrder[ u ].iPriority )
+			aOrder[ aOrder[ u ].uParent ].iPriority = aOrder[ u ].iPriority;
+
+	qsort( aOrder, pPlan->numEntries, sizeof( planorder_t ), ComparePlanOrder );
+
+	if( pnumCritical )
+		for( *pnumCritical = 0; *pnumCritical < pPlan->numEntries && aOrder[ *pnumCritical ].iPriority > 0; ++*pnumCritical );
+
+	return aOrder;
+}
+
+static int CompareMountEntries( const void *p1, const void *p2 )
+{
+	return strcmp( ( *(const mountentry_t *const *) p1 )->szDataset, ( *(const mountentry_t *const *) p2 )->szDataset );
+}
+
+/*!
+	\brief Makes the mounts in \p pMounted match \p pPlan: mounts not in \p pPlan (or at another mountpoint) are undone, missing ones are added.
+	\param numOrder	Only the first \p numOrder entries of \p aOrder are mounted, e.g. the critical ones.
+*/
+static bool ReconcileMounts( const mountplan_t *const pPlan, const planorder_t *const aOrder, const size_t numOrder, const mountset_t *const pExisting, mountlist_t *const pMounted )
+{
+	bool fSuccess = false;
+	const size_t numMounted = pMounted->numEntries;
+	const mountentry_t **const apSorted = malloc( numMounted * sizeof( mountentry_t * ) + 1 );
+	bool *const afKeep = calloc( numMounted + 1, sizeof( bool ) );
+	bool *const afDone = calloc( pPlan->numEntries + 1, sizeof( bool ) );
+	if( !apSorted || !afKeep || !afDone )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for mount plan." );
+		goto ERROR_AFTER_ARRAYS;
+	}
+
+	//Match the plan against the existing mounts
+	for( size_t u = 0; u < numMounted; ++u )
+		apSorted[ u ] = &pMounted->aEntries[ u ];
+	qsort( apSorted, numMounted, sizeof( mountentry_t * ), CompareMountEntries );
+
+	for( size_t u = 0; u < pPlan->numEntries; ++u )
+	{
+		const planentry_t *const pEntry = &pPlan->aEntries[ u ];
+		if( !pEntry->szMountPoint )
+			continue;
+
+		const mountentry_t key = { .szDataset = pEntry->szDataset };
+		const mountentry_t *const pKey = &key;
+		const mountentry_t **const ppFound = bsearch( &pKey, apSorted, numMounted, sizeof( mountentry_t * ), CompareMountEntries );
+		if( ppFound && !strcmp( ( *ppFound )->szMountPoint, pEntry->szMountPoint ) )
+		{
+			afKeep[ *ppFound - pMounted->aEntries ] = true;
+			afDone[ u ] = true;
+		}
+	}
+
+	//Undo stale mounts first, so their mountpoints are free again. Entries are moved over, not copied.
+	{
+		mountlist_t stale = { .aEntries = malloc( numMounted * sizeof( mountentry_t ) + 1 ), .numAllocated = numMounted };
+		if( !stale.aEntries )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for mount list." );
+			goto ERROR_AFTER_ARRAYS;
+		}
+
+		size_t numKept = 0;
+		for( size_t u = 0; u < numMounted; ++u )
+		{
+			const mountentry_t entry = pMounted->aEntries[ u ];
+			if( afKeep[ u ] )
+				pMounted->aEntries[ numKept++ ] = entry;
+			else
+			{
+				Log( LOG_INFO, "Dataset \"%s\" at \"%s\" is outdated in the mount plan.", entry.szDataset, entry.szMountPoint );
+				stale.aEntries[ stale.numEntries++ ] = entry;
+			}
+		}
+		pMounted->numEntries = numKept;
+
+		const bool fUnmounted = UnmountList( &stale, 0 );
+		MountListFree( &stale );
+		if( !fUnmounted )
+			goto ERROR_AFTER_ARRAYS;
+	}
+
+	//Add what's missing, in mount order
+	for( size_t u = 0; u < numOrder; ++u )
+	{
+		const size_t uIndex = aOrder[ u ].uIndex;
+		if( pPlan->aEntries[ uIndex ].szMountPoint && !afDone[ uIndex ] && !MountAt( pPlan->aEntries[ uIndex ].szDataset, pPlan->aEntries[ uIndex ].szMountPoint, false, pExisting, pMounted ) )
+			goto ERROR_AFTER_ARRAYS;
+	}
+
+	fSuccess = true;
+
+ERROR_AFTER_ARRAYS:
+	free( afDone );
+	free( afKeep );
+	free( apSorted );
+	return fSuccess;
+}
+
+/*!
+	\brief Mounts entry \p uIndex of \p pPlan, if it is to be mounted.
+*/
+static bool MountPlanEntry( const mountplan_t *const pPlan, const size_t uIndex, const mountset_t *const pExisting, mountlist_t *const pMounted )
+{
+	const planentry_t *const pEntry = &pPlan->aEntries[ uIndex ];
+	return !pEntry->szMountPoint || pEntry->eCanMount == ZFS_CANMOUNT_OFF || MountAt( pEntry->szDataset, pEntry->szMountPoint, false, pExisting, pMounted );
+}
+
+/*!
+	\brief Shared implementation of MountPool, MountPoolCached and MountPoolBackground. \p szPlanPath may be \c NULL to always enumerate the pool.
+	\details With \p fBackground, a daemon is forked off once the critical datasets are mounted, which mounts the rest and then exits.
+		The daemon never rolls back, as the datasets mounted before may be in use by then.
+*/
+bool MountPoolOrdered( zt_context_t *const pContext, const char *const szPool, const char *const szPlanPath, const bool fBackground )
+{
+	CONTEXT_SCOPE( pContext );
+	uint64_t idPool = 0, uTxg = 0;
+	if( szPlanPath && !GetPoolTxg( pContext->fdZFS, szPool, &idPool, &uTxg ) )
+		return false;
+
+	mountset_t existing;
+	if( !MountSetLoad( szPool, &existing ) )
+		return false;
+
+	mountplan_t cached = { 0 };
+	mountplan_t current = { .idPool = idPool, .uTxg = uTxg };
+	mountlist_t mounted = { 0 };
+	planwalk_t walk = { .pContext = pContext, .szPool = szPool, .pPlan = &current };
+	planorder_t *aOrder = NULL;
+	size_t numCritical;
+	pthread_t thread;
+	bool fThread = false;
+	bool fDaemon = false;
+
+	//Without a plan, the enumeration has to come first. With one, it runs alongside the mounts, but no other threads may run across the fork of fBackground.
+	bool fCached = szPlanPath && LoadMountPlan( szPlanPath, idPool, &cached );
+	if( !fCached )
+	{
+		(void) PlanWalkThread( &walk );
+		if( !walk.fSuccess )
+			goto ERROR_AFTER_PLANS;
+	}
+	else if( !fBackground )
+		fThread = StartPlanWalk( &walk, &thread );
+
+	const mountplan_t *const pFirst = fCached ? &cached : &current;
+	if( !( aOrder = OrderMountPlan( pFirst, &numCritical ) ) )
+		goto ERROR_AFTER_PLANS;
+
+	if( numCritical )
+		Log( LOG_INFO, "Mounting %zu priority datasets of pool \"%s\" first.", numCritical, szPool );
+	size_t uCritical = 0;
+	for( ; uCritical < numCritical; ++uCritical )
+		if( !MountPlanEntry( pFirst, aOrder[ uCritical ].uIndex, &existing, &mounted ) )
+		{
+			if( !fCached )
+				goto ERROR_AFTER_PLANS;
+			if( fBackground )
+				break;
+			Log( LOG_WARNING, "Deferring dataset \"%s\" until the pool is enumerated.", pFirst->aEntries[ aOrder[ uCritical ].uIndex ].szDataset );
+		}
+
+	//Returning early tells the caller the critical datasets are mounted, so they can't be deferred. Enumerate the pool now and mount them from the result instead.
+	if( uCritical < numCritical )
+	{
+		Log( LOG_WARNING, "Failed to mount dataset \"%s\" from the plan, enumerating pool \"%s\" first.", cached.aEntries[ aOrder[ uCritical ].uIndex ].szDataset, szPool );
+		fCached = false;
+		(void) PlanWalkThread( &walk );
+		free( aOrder );
+		aOrder = NULL;
+		if( !walk.fSuccess || !( aOrder = OrderMountPlan( &current, &numCritical ) ) || !ReconcileMounts( &current, aOrder, numCritical, &existing, &mounted ) )
+			goto ERROR_AFTER_PLANS;
+	}
+
+	if( fBackground )
+	{
+		//No other threads may run across the fork, so the background enumeration is only started by the daemon. The label reads an import left behind are waited for.
+		WaitForVDevReapers( );
+		const pid_t pid = fork( );
+		if( pid > 0 )
+		{
+			Log( LOG_INFO, "Mounted %zu priority datasets of pool \"%s\", mounting the rest in the background.", numCritical, szPool );
+			free( aOrder );
+			MountListFree( &mounted );
+			FreeMountPlan( &current );
+			FreeMountPlan( &cached );
+			MountSetFree( &existing );
+			return true;
+		}
+
+		if( pid < 0 )
+			Log( LOG_WARNING, "Failed to start background mounting, mounting all datasets of pool \"%s\" right away.", szPool );
+		else
+		{
+			(void) setsid( );
+			(void) signal( SIGPIPE, SIG_IGN );
+			fDaemon = true;
+		}
+	}
+
+	if( fCached )
+	{
+		if( fBackground )
+			fThread = StartPlanWalk( &walk, &thread );
+
+		Log( LOG_INFO, "Mounting %zu datasets from plan of txg %" PRIu64 ".", cached.numEntries - numCritical, cached.uTxg );
+		for( size_t u = numCritical; u < cached.numEntries; ++u )
+			if( !MountPlanEntry( &cached, aOrder[ u ].uIndex, &existing, &mounted ) )
+				Log( LOG_WARNING, "Deferring dataset \"%s\" until the pool is enumerated.", cached.aEntries[ aOrder[ u ].uIndex ].szDataset );
+
+		if( fThread )
+			(void) pthread_join( thread, NULL );
+		else
+			(void) PlanWalkThread( &walk );
+		fThread = false;
+
+		free( aOrder );
+		if( !walk.fSuccess || !( aOrder = OrderMountPlan( &current, NULL ) ) )
+			goto ERROR_AFTER_PLANS;
+	}
+
+	if( !ReconcileMounts( &current, aOrder, current.numEntries, &existing, &mounted ) )
+		goto ERROR_AFTER_PLANS;
+
+	if( szPlanPath && ( !fCached || !MountPlansEqual( &cached, &current ) ) )
+		(void) SaveMountPlan( szPlanPath, &current );
+
+	if( fDaemon )
+	{
+		Log( LOG_INFO, "Mounted the remaining datasets of pool \"%s\" in the background.", szPool );
+		_exit( EXIT_SUCCESS );
+	}
+
+	free( aOrder );
+	MountListFree( &mounted );
+	FreeMountPlan( &current );
+	FreeMountPlan( &cached );
+	MountSetFree( &existing );
+	return true;
+
+ERROR_AFTER_PLANS:
+	if( fThread )
+		(void) pthread_join( thread, NULL );
+	if( fDaemon )
+	{
+		Log( LOG_ERR, "Failed to mount the remaining datasets of pool \"%s\" in the background. Datasets mounted so far are left mounted.", szPool );
+		_exit( EXIT_FAILURE );
+	}
+
+	if( mounted.numEntries )
+	{
+		Log( LOG_WARNING, "Rolling back %zu mounted datasets of pool \"%s\".", mounted.numEntries, szPool );
+		(void) UnmountList( &mounted, 0 );
+	}
+	free( aOrder );
+	MountListFree( &mounted );
+	FreeMountPlan( &current );
+	FreeMountPlan( &cached );
+	MountSetFree( &existing );
+	return false;
+}
+
+/*!
+	\brief Like MountPool, but starts mounting from the plan cached at \p szPlanPath while the pool is enumerated in the background.
+	\details Once enumerated, the mounts are corrected to match the pool and the plan is updated if it changed. Failing to write the plan is not an error.
+		If mounting fails, all datasets mounted so far are unmounted again.
+*/
+bool MountPoolCached( zt_context_t *const pContext, const char *const szPool, const char *const szPlanPath )
+{
+	return MountPoolOrdered( pContext, szPool, szPlanPath, false );
+}
+
+/*!
+	\brief Like MountPool (or MountPoolCached if \p szPlanPath is not \c NULL), but returns as soon as the critical datasets are mounted, those with a positive
+		PROP_MOUNTPRIORITY and their ancestors. The remaining ones are mounted by a daemon forked off, which logs the outcome.
+	\details If mounting a critical dataset fails, all datasets mounted so far are unmounted again. If one fails to mount from the plan, the pool is enumerated first
+		and the critical datasets are mounted from the result instead. Failures of the daemon are not rolled back.
+	\note The daemon is forked off the calling thread. Threads of the library are finished before, including those an import leaves to wait for outstanding vdev label reads.
+		Apart from these, no other threads may be running. The idle helper threads of the C library's asynchronous I/O are left behind, the daemon doesn't use it.
+*/
+bool MountPoolBackground( zt_context_t *const pContext, const char *const szPool, const char *const szPlanPath )
+{
+	return MountPoolOrdered( pContext, szPool, szPlanPath, true );
+}
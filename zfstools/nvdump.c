@@ -0,0 +1,425 @@
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <math.h>
+
+#define DUMP_BUF_MINSIZE	65536
+#define JSON_MAX_EXACT		( ( UINT64_C( 1 ) << 53 ) - 1 )	//Largest integer parsers using doubles read exactly
+
+/*
+	The whole dump is built in a single growable buffer and written out with as few write calls as possible.
+	print_nvlist used one printf/putchar per indentation level and value, which does not scale to large pool configurations.
+*/
+
+typedef struct dumpbuf_s
+{
+	char *p;
+	size_t len;
+	size_t numAllocated;
+	bool fFailed;
+} dumpbuf_t;
+
+static bool BufReserve( dumpbuf_t *const pBuf, const size_t numChars )
+{
+	if( pBuf->fFailed )
+		return false;
+
+	if( pBuf->len + numChars <= pBuf->numAllocated )
+		return true;
+
+	size_t numAllocated = pBuf->numAllocated ? pBuf->numAllocated : DUMP_BUF_MINSIZE;
+	while( numAllocated < pBuf->len + numChars )
+		numAllocated *= 2;
+
+	char *const p = realloc( pBuf->p, numAllocated );
+	if( !p )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for nvlist dump." );
+		pBuf->fFailed = true;
+		return false;
+	}
+
+	pBuf->p = p;
+	pBuf->numAllocated = numAllocated;
+	return true;
+}
+
+static inline void BufAppend( dumpbuf_t *const pBuf, const char *const p, const size_t numChars )
+{
+	if( !BufReserve( pBuf, numChars ) )
+		return;
+
+	memcpy( pBuf->p + pBuf->len, p, numChars );
+	pBuf->len += numChars;
+}
+
+#define BufAppendLiteral( pBuf, sz )	BufAppend( pBuf, sz, sizeof( sz ) - 1 )
+
+static inline void BufIndent( dumpbuf_t *const pBuf, const unsigned uIndent )
+{
+	if( !BufReserve( pBuf, uIndent ) )
+		return;
+
+	memset( pBuf->p + pBuf->len, '\t', uIndent );
+	pBuf->len += uIndent;
+}
+
+static void BufDigits( dumpbuf_t *const pBuf, uint64_t u )
+{
+	char ab[ 20 ];
+	char *p = ab + sizeof( ab );
+	do
+	{
+		*--p = (char) ( '0' + u % 10 );
+		u /= 10;
+	} while( u );
+
+	BufAppend( pBuf, p, ab + sizeof( ab ) - p );
+}
+
+/*!
+	\brief Appends an integer of magnitude \p u. For JSON, integers beyond JSON_MAX_EXACT (e.g. guids) are quoted, so they don't lose precision.
+*/
+static void BufInteger( dumpbuf_t *const pBuf, const uint64_t u, const bool fNegative, const bool fJSON )
+{
+	const bool fQuote = fJSON && u > JSON_MAX_EXACT;
+	if( fQuote )
+		BufAppendLiteral( pBuf, "\"" );
+	if( fNegative )
+		BufAppendLiteral( pBuf, "-" );
+	BufDigits( pBuf, u );
+	if( fQuote )
+		BufAppendLiteral( pBuf, "\"" );
+}
+
+static void BufUInt64( dumpbuf_t *const pBuf, const uint64_t u, const bool fJSON )
+{
+	BufInteger( pBuf, u, false, fJSON );
+}
+
+static void BufInt64( dumpbuf_t *const pBuf, const int64_t i, const bool fJSON )
+{
+	BufInteger( pBuf, i < 0 ? -(uint64_t) i : (uint64_t) i, i < 0, fJSON );
+}
+
+static void BufDouble( dumpbuf_t *const pBuf, const double d, const bool fJSON )
+{
+	//JSON has no literals for NaN and infinity
+	if( fJSON && !isfinite( d ) )
+	{
+		BufAppendLiteral( pBuf, "null" );
+		return;
+	}
+
+	char ab[ 32 ];
+	const int numChars = snprintf( ab, sizeof( ab ), "%.17g", d );
+	if( numChars > 0 && numChars < sizeof( ab ) )
+		BufAppend( pBuf, ab, numChars );
+}
+
+/*!
+	\brief Appends \p sz as quoted string. For JSON, control characters, quotes and backslashes are escaped.
+*/
+static void BufString( dumpbuf_t *const pBuf, const char *const sz, const dumpformat_t eFormat )
+{
+	BufAppendLiteral( pBuf, "\"" );
+	if( eFormat != DUMP_JSON )
+	{
+		BufAppend( pBuf, sz, strlen( sz ) );
+		BufAppendLiteral( pBuf, "\"" );
+		return;
+	}
+
+	static const char s_abHex[ ] = "0123456789abcdef";
+	const char *pStart = sz;
+	for( const char *p = sz; ; ++p )
+	{
+		const unsigned char c = (unsigned char) *p;
+		if( c >= 0x20 && c != '"' && c != '\\' )
+			continue;
+
+		//Flush the unescaped run of characters
+		BufAppend( pBuf, pStart, p - pStart );
+		pStart = p + 1;
+
+		switch( c )
+		{
+		case '\0':
+			BufAppendLiteral( pBuf, "\"" );
+			return;
+		case '"':
+			BufAppendLiteral( pBuf, "\\\"" );
+			break;
+		case '\\':
+			BufAppendLiteral( pBuf, "\\\\" );
+			break;
+		case '\n':
+			BufAppendLiteral( pBuf, "\\n" );
+			break;
+		case '\t':
+			BufAppendLiteral( pBuf, "\\t" );
+			break;
+		default:
+			{
+				const char ab[ 6 ] = { '\\', 'u', '0', '0', s_abHex[ c >> 4 ], s_abHex[ c & 0xF ] };
+				BufAppend( pBuf, ab, sizeof( ab ) );
+			}
+		}
+	}
+}
+
+static void DumpNVListRecursive( dumpbuf_t *pBuf, nvlist_t *nvl, unsigned uIndent, dumpformat_t eFormat );
+
+/*!
+	\brief Appends the element separator and the indentation for the next array element.
+*/
+static inline void BufArrayElement( dumpbuf_t *const pBuf, const uint_t uElement, const unsigned uIndent )
+{
+	if( uElement )
+		BufAppendLiteral( pBuf, ",\n" );
+	BufIndent( pBuf, uIndent );
+}
+
+/*!
+	\brief Appends the value of a scalar or array nvpair.
+	\details Arrays are printed inline, except for nvlist arrays, which get one element per line.
+*/
+static void DumpNVPairValue( dumpbuf_t *const pBuf, nvpair_t *const nvp, const unsigned uIndent, const dumpformat_t eFormat )
+{
+	const bool fJSON = eFormat == DUMP_JSON;
+
+#define DUMP_SCALAR( type, fnValue, fnAppend, cast, szType )	\
+	{	\
+		type value;	\
+		(void) fnValue( nvp, &value );	\
+		fnAppend( pBuf, ( cast ) value, fJSON );	\
+		if( !fJSON )	\
+			BufAppendLiteral( pBuf, " (" szType ")" );	\
+		break;	\
+	}
+
+#define DUMP_ARRAY( type, fnValue, fnAppend, cast, szType )	\
+	{	\
+		type *aValues;	\
+		uint_t numValues;	\
+		(void) fnValue( nvp, &aValues, &numValues );	\
+		BufAppendLiteral( pBuf, "[ " );	\
+		for( uint_t u = 0; u < numValues; ++u )	\
+		{	\
+			if( u )	\
+				BufAppendLiteral( pBuf, ", " );	\
+			fnAppend( pBuf, ( cast ) aValues[ u ], fJSON );	\
+		}	\
+		BufAppendLiteral( pBuf, " ]" );	\
+		if( !fJSON )	\
+			BufAppendLiteral( pBuf, " (" szType ")" );	\
+		break;	\
+	}
+
+	switch( nvpair_type( nvp ) )
+	{
+	case DATA_TYPE_BOOLEAN:
+		BufAppendLiteral( pBuf, "true" );
+		break;
+	case DATA_TYPE_BOOLEAN_VALUE:
+		{
+			boolean_t f;
+			(void) nvpair_value_boolean_value( nvp, &f );
+			if( f )
+				BufAppendLiteral( pBuf, "true" );
+			else
+				BufAppendLiteral( pBuf, "false" );
+			break;
+		}
+	case DATA_TYPE_BYTE:			DUMP_SCALAR( uchar_t, nvpair_value_byte, BufUInt64, uint64_t, "byte" )
+	case DATA_TYPE_INT8:			DUMP_SCALAR( int8_t, nvpair_value_int8, BufInt64, int64_t, "int8" )
+	case DATA_TYPE_UINT8:			DUMP_SCALAR( uint8_t, nvpair_value_uint8, BufUInt64, uint64_t, "uint8" )
+	case DATA_TYPE_INT16:			DUMP_SCALAR( int16_t, nvpair_value_int16, BufInt64, int64_t, "int16" )
+	case DATA_TYPE_UINT16:			DUMP_SCALAR( uint16_t, nvpair_value_uint16, BufUInt64, uint64_t, "uint16" )
+	case DATA_TYPE_INT32:			DUMP_SCALAR( int32_t, nvpair_value_int32, BufInt64, int64_t, "int32" )
+	case DATA_TYPE_UINT32:			DUMP_SCALAR( uint32_t, nvpair_value_uint32, BufUInt64, uint64_t, "uint32" )
+	case DATA_TYPE_INT64:			DUMP_SCALAR( int64_t, nvpair_value_int64, BufInt64, int64_t, "int64" )
+	case DATA_TYPE_UINT64:			DUMP_SCALAR( uint64_t, nvpair_value_uint64, BufUInt64, uint64_t, "uint64" )
+	case DATA_TYPE_HRTIME:			DUMP_SCALAR( hrtime_t, nvpair_value_hrtime, BufInt64, int64_t, "hrtime" )
+	case DATA_TYPE_DOUBLE:			DUMP_SCALAR( double, nvpair_value_double, BufDouble, double, "double" )
+	case DATA_TYPE_BYTE_ARRAY:		DUMP_ARRAY( uchar_t, nvpair_value_byte_array, BufUInt64, uint64_t, "byte" )
+	case DATA_TYPE_INT8_ARRAY:		DUMP_ARRAY( int8_t, nvpair_value_int8_array, BufInt64, int64_t, "int8" )
+	case DATA_TYPE_UINT8_ARRAY:		DUMP_ARRAY( uint8_t, nvpair_value_uint8_array, BufUInt64, uint64_t, "uint8" )
+	case DATA_TYPE_INT16_ARRAY:		DUMP_ARRAY( int16_t, nvpair_value_int16_array, BufInt64, int64_t, "int16" )
+	case DATA_TYPE_UINT16_ARRAY:	DUMP_ARRAY( uint16_t, nvpair_value_uint16_array, BufUInt64, uint64_t, "uint16" )
+	case DATA_TYPE_INT32_ARRAY:		DUMP_ARRAY( int32_t, nvpair_value_int32_array, BufInt64, int64_t, "int32" )
+	case DATA_TYPE_UINT32_ARRAY:	DUMP_ARRAY( uint32_t, nvpair_value_uint32_array, BufUInt64, uint64_t, "uint32" )
+	case DATA_TYPE_INT64_ARRAY:		DUMP_ARRAY( int64_t, nvpair_value_int64_array, BufInt64, int64_t, "int64" )
+	case DATA_TYPE_UINT64_ARRAY:	DUMP_ARRAY( uint64_t, nvpair_value_uint64_array, BufUInt64, uint64_t, "uint64" )
+	case DATA_TYPE_BOOLEAN_ARRAY:
+		{
+			boolean_t *af;
+			uint_t numValues;
+			(void) nvpair_value_boolean_array( nvp, &af, &numValues );
+			BufAppendLiteral( pBuf, "[ " );
+			for( uint_t u = 0; u < numValues; ++u )
+			{
+				if( u )
+					BufAppendLiteral( pBuf, ", " );
+				if( af[ u ] )
+					BufAppendLiteral( pBuf, "true" );
+				else
+					BufAppendLiteral( pBuf, "false" );
+			}
+			BufAppendLiteral( pBuf, " ]" );
+			break;
+		}
+	case DATA_TYPE_STRING:
+		{
+			const char *sz;
+			(void) nvpair_value_string( nvp, &sz );
+			BufString( pBuf, sz, eFormat );
+			break;
+		}
+	case DATA_TYPE_STRING_ARRAY:
+		{
+			const char **asz;
+			uint_t numValues;
+			(void) nvpair_value_string_array( nvp, &asz, &numValues );
+			BufAppendLiteral( pBuf, "[ " );
+			for( uint_t u = 0; u < numValues; ++u )
+			{
+				if( u )
+					BufAppendLiteral( pBuf, ", " );
+				BufString( pBuf, asz[ u ], eFormat );
+			}
+			BufAppendLiteral( pBuf, " ]" );
+			break;
+		}
+	case DATA_TYPE_NVLIST:
+		{
+			nvlist_t *nvlChild;
+			(void) nvpair_value_nvlist( nvp, &nvlChild );
+			BufAppendLiteral( pBuf, "{\n" );
+			DumpNVListRecursive( pBuf, nvlChild, uIndent + 1, eFormat );
+			BufIndent( pBuf, uIndent );
+			BufAppendLiteral( pBuf, "}" );
+			break;
+		}
+	case DATA_TYPE_NVLIST_ARRAY:
+		{
+			nvlist_t **anvlChildren;
+			uint_t numChildren;
+			(void) nvpair_value_nvlist_array( nvp, &anvlChildren, &numChildren );
+			BufAppendLiteral( pBuf, "[\n" );
+			for( uint_t u = 0; u < numChildren; ++u )
+			{
+				BufArrayElement( pBuf, u, uIndent + 1 );
+				BufAppendLiteral( pBuf, "{\n" );
+				DumpNVListRecursive( pBuf, anvlChildren[ u ], uIndent + 2, eFormat );
+				BufIndent( pBuf, uIndent + 1 );
+				BufAppendLiteral( pBuf, "}" );
+			}
+			if( numChildren )
+				BufAppendLiteral( pBuf, "\n" );
+			BufIndent( pBuf, uIndent );
+			BufAppendLiteral( pBuf, "]" );
+			break;
+		}
+	default:
+		if( fJSON )
+			BufAppendLiteral( pBuf, "null" );
+		else
+		{
+			BufAppendLiteral( pBuf, "<unhandled type " );
+			BufInt64( pBuf, nvpair_type( nvp ), false );
+			BufAppendLiteral( pBuf, ">" );
+		}
+	}
+
+#undef DUMP_ARRAY
+#undef DUMP_SCALAR
+}
+
+static void DumpNVListRecursive( dumpbuf_t *const pBuf, nvlist_t *const nvl, const unsigned uIndent, const dumpformat_t eFormat )
+{
+	bool fFirst = true;
+	for( nvpair_t *nvp = NULL; nvp = nvlist_next_nvpair( nvl, nvp ); fFirst = false )
+	{
+		if( eFormat == DUMP_JSON && !fFirst )
+			BufAppendLiteral( pBuf, ",\n" );
+		BufIndent( pBuf, uIndent );
+
+		if( eFormat == DUMP_JSON )
+		{
+			BufString( pBuf, nvpair_name( nvp ), eFormat );
+			BufAppendLiteral( pBuf, ": " );
+		}
+		else
+		{
+			const char *const szName = nvpair_name( nvp );
+			BufAppend( pBuf, szName, strlen( szName ) );
+			BufAppendLiteral( pBuf, " = " );
+		}
+
+		DumpNVPairValue( pBuf, nvp, uIndent, eFormat );
+		if( eFormat != DUMP_JSON )
+			BufAppendLiteral( pBuf, "\n" );
+	}
+
+	if( eFormat == DUMP_JSON && !fFirst )
+		BufAppendLiteral( pBuf, "\n" );
+}
+
+/*!
+	\brief Serializes \p nvl into a single newly allocated buffer.
+	\param pLength	Receives the length of the returned text, excluding the terminating NULL.
+	\return The text (to be released using free) or \c NULL on error.
+*/
+char *FormatNVList( nvlist_t *const nvl, const dumpformat_t eFormat, size_t *const pLength )
+{
+	dumpbuf_t buf = { 0 };
+	if( eFormat == DUMP_JSON )
+		BufAppendLiteral( &buf, "{\n" );
+	DumpNVListRecursive( &buf, nvl, eFormat == DUMP_JSON ? 1 : 0, eFormat );
+	if( eFormat == DUMP_JSON )
+		BufAppendLiteral( &buf, "}\n" );
+	BufAppend( &buf, "", 1 );
+
+	if( buf.fFailed )
+	{
+		free( buf.p );
+		return NULL;
+	}
+
+	*pLength = buf.len - 1;
+	return buf.p;
+}
+
+/*!
+	\brief Serializes \p nvl and writes it to \p fd in one go.
+*/
+bool DumpNVList( const int fd, nvlist_t *const nvl, const dumpformat_t eFormat )
+{
+	size_t len;
+	char *const sz = FormatNVList( nvl, eFormat, &len );
+	if( !sz )
+		return false;
+
+	for( size_t uWritten = 0; uWritten < len; )
+	{
+		const ssize_t numWritten = write( fd, sz + uWritten, len - uWritten );
+		if( numWritten < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+
+			Log( LOG_ERR, "Failed to write nvlist dump." );
+			free( sz );
+			return false;
+		}
+		uWritten += numWritten;
+	}
+
+	free( sz );
+	return true;
+}
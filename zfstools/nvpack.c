@@ -0,0 +1,369 @@
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+	Sequential encoder for the NV_ENCODE_NATIVE nvlist stream, as produced by nvlist_pack and consumed by the kernel ioctls.
+	Layout: a 4 byte stream header, then per nvlist its version and flags, the nvpairs (each the in-memory nvpair_t, its name and value,
+	padded to 8 bytes) and 4 zero bytes as terminator. Embedded nvlists follow the nvpair that references them.
+*/
+
+#define NVS_HEADER_SIZE	4
+#define NVS_TERMINATOR_SIZE	4
+
+#ifndef NV_ALIGN
+#define NV_ALIGN( x )	( ( (size_t) ( x ) + 7 ) & ~(size_t) 7 )
+#endif
+
+static void NVPackBytes( nvpacker_t *const pPacker, const void *const p, const size_t numSize )
+{
+	if( pPacker->pBuffer )
+	{
+		if( p )
+			memcpy( pPacker->pBuffer + pPacker->numUsed, p, numSize );
+		else
+			memset( pPacker->pBuffer + pPacker->numUsed, 0, numSize );
+	}
+
+	pPacker->numUsed += numSize;
+}
+
+static void NVPackPairHeader( nvpacker_t *const pPacker, const char *const szName, const data_type_t eType, const uint_t numElements, const size_t numValue )
+{
+	const size_t numName = strlen( szName ) + 1;
+	const size_t uValueOffset = NV_ALIGN( sizeof( nvpair_t ) + numName );
+	const nvpair_t nvp =
+	{
+		.nvp_size = (int32_t) ( uValueOffset + NV_ALIGN( numValue ) ),
+		.nvp_name_sz = (int16_t) numName,
+		.nvp_value_elem = (int32_t) numElements,
+		.nvp_type = eType
+	};
+
+	NVPackBytes( pPacker, &nvp, sizeof( nvp ) );
+	NVPackBytes( pPacker, szName, numName );
+	NVPackBytes( pPacker, NULL, uValueOffset - sizeof( nvp ) - numName );
+}
+
+static void NVPackPairValue( nvpacker_t *const pPacker, const void *const p, const size_t numValue )
+{
+	NVPackBytes( pPacker, p, numValue );
+	NVPackBytes( pPacker, NULL, NV_ALIGN( numValue ) - numValue );
+}
+
+void NVPackHeader( nvpacker_t *const pPacker )
+{
+	const char ab[ NVS_HEADER_SIZE ] =
+	{
+		NV_ENCODE_NATIVE,
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		1,
+#else
+		0,
+#endif
+		0,
+		0
+	};
+	NVPackBytes( pPacker, ab, sizeof( ab ) );
+}
+
+void NVPackListBegin( nvpacker_t *const pPacker )
+{
+	const int32_t iVersion = NV_VERSION;
+	const uint32_t uFlags = NV_UNIQUE_NAME;
+	NVPackBytes( pPacker, &iVersion, sizeof( iVersion ) );
+	NVPackBytes( pPacker, &uFlags, sizeof( uFlags ) );
+}
+
+void NVPackListEnd( nvpacker_t *const pPacker )
+{
+	NVPackBytes( pPacker, NULL, NVS_TERMINATOR_SIZE );
+}
+
+void NVPackUInt16( nvpacker_t *const pPacker, const char *const szName, const uint16_t u )
+{
+	NVPackPairHeader( pPacker, szName, DATA_TYPE_UINT16, 1, sizeof( u ) );
+	NVPackPairValue( pPacker, &u, sizeof( u ) );
+}
+
+void NVPackUInt64( nvpacker_t *const pPacker, const char *const szName, const uint64_t u )
+{
+	NVPackPairHeader( pPacker, szName, DATA_TYPE_UINT64, 1, sizeof( u ) );
+	NVPackPairValue( pPacker, &u, sizeof( u ) );
+}
+
+void NVPackString( nvpacker_t *const pPacker, const char *const szName, const char *const sz )
+{
+	const size_t numValue = strlen( sz ) + 1;
+	NVPackPairHeader( pPacker, szName, DATA_TYPE_STRING, 1, numValue );
+	NVPackPairValue( pPacker, sz, numValue );
+}
+
+void NVPackUInt8Array( nvpacker_t *const pPacker, const char *const szName, const uint8_t *const au, const uint_t num )
+{
+	NVPackPairHeader( pPacker, szName, DATA_TYPE_UINT8_ARRAY, num, num );
+	NVPackPairValue( pPacker, au, num );
+}
+
+void NVPackUInt64Array( nvpacker_t *const pPacker, const char *const szName, const uint64_t *const au, const uint_t num )
+{
+	NVPackPairHeader( pPacker, szName, DATA_TYPE_UINT64_ARRAY, num, num * sizeof( uint64_t ) );
+	NVPackPairValue( pPacker, au, num * sizeof( uint64_t ) );
+}
+
+void NVPackNVList( nvpacker_t *const pPacker, const char *const szName )
+{
+	//The value is the nvlist_t itself with its private pointer cleared. The list contents follow the pair.
+	const nvlist_t nvl = { .nvl_version = NV_VERSION, .nvl_nvflag = NV_UNIQUE_NAME };
+	NVPackPairHeader( pPacker, szName, DATA_TYPE_NVLIST, 1, sizeof( nvl ) );
+	NVPackPairValue( pPacker, &nvl, sizeof( nvl ) );
+	NVPackListBegin( pPacker );
+}
+
+void NVPackNVListArray( nvpacker_t *const pPacker, const char *const szName, const uint_t num )
+{
+	//The value is an array of (cleared) pointers followed by the nvlist_t of each element
+	const nvlist_t nvl = { .nvl_version = NV_VERSION, .nvl_nvflag = NV_UNIQUE_NAME };
+	NVPackPairHeader( pPacker, szName, DATA_TYPE_NVLIST_ARRAY, num, num * ( sizeof( uint64_t ) + sizeof( nvl ) ) );
+	NVPackBytes( pPacker, NULL, num * sizeof( uint64_t ) );
+	for( uint_t u = 0; u < num; ++u )
+		NVPackBytes( pPacker, &nvl, sizeof( nvl ) );
+}
+
+/*!
+	\brief Appends \p nvl as embedded nvlist, i.e. the output of nvlist_pack without its stream header.
+	\param numPacked The size as returned by nvlist_size for NV_ENCODE_NATIVE.
+*/
+bool NVPackEmbedded( nvpacker_t *const pPacker, nvlist_t *const nvl, const size_t numPacked )
+{
+	if( pPacker->pBuffer )
+	{
+		//nvlist_pack always writes the stream header. Let it overwrite the bytes preceding the embedded list and restore them afterwards.
+		assert( pPacker->numUsed >= NVS_HEADER_SIZE );
+		char *pHeader = pPacker->pBuffer + pPacker->numUsed - NVS_HEADER_SIZE;
+		char abSaved[ NVS_HEADER_SIZE ];
+		memcpy( abSaved, pHeader, sizeof( abSaved ) );
+
+		size_t numSize = numPacked;
+		const int iError = nvlist_pack( nvl, &pHeader, &numSize, NV_ENCODE_NATIVE, 0 );
+		memcpy( pHeader, abSaved, sizeof( abSaved ) );
+		if( iError )
+			return false;
+	}
+
+	pPacker->numUsed += numPacked - NVS_HEADER_SIZE;
+	return true;
+}
+
+#ifndef NDEBUG
+/*!
+	\brief Debug check of a complete stream against libnvpair: it has to unpack, and packing the result again has to reproduce it byte for byte.
+	\details The kernel decodes the stream with the same code as nvlist_unpack, so a match means it reads exactly the list that was encoded.
+*/
+bool NVPackVerify( const char *const pBuffer, const size_t numSize )
+{
+	nvlist_t *nvl;
+	if( nvlist_unpack( (char *) pBuffer, numSize, &nvl, 0 ) )
+		return false;
+
+	size_t numRepacked;
+	char *pRepacked = NULL;
+	const bool fEqual = !nvlist_size( nvl, &numRepacked, NV_ENCODE_NATIVE ) && numRepacked == numSize && ( pRepacked = malloc( numSize ) )
+		&& !nvlist_pack( nvl, &pRepacked, &numRepacked, NV_ENCODE_NATIVE, 0 ) && !memcmp( pRepacked, pBuffer, numSize );
+	free( pRepacked );
+	nvlist_free( nvl );
+	return fEqual;
+}
+#endif
+
+/*
+	Lookups in a packed NV_ENCODE_NATIVE stream, to check a few values of a kernel-provided config without unpacking all of it.
+*/
+
+#define NVS_LIST_HEADER_SIZE	( sizeof( int32_t ) + sizeof( uint32_t ) )
+#define NVSCAN_MAX_DEPTH	64
+
+static const char *NVScanSkipList( const char *p, const char *pEnd, unsigned uDepth );
+
+//Reads the nvpair header at p. A zero nvp_size marks the end of the list.
+static bool NVScanPair( const char *const p, const char *const pEnd, nvpair_t *const pnvp )
+{
+	if( pEnd - p < (ptrdiff_t) sizeof( int32_t ) )
+		return false;
+
+	memcpy( &pnvp->nvp_size, p, sizeof( int32_t ) );
+	if( !pnvp->nvp_size )
+		return true;
+
+	if( pnvp->nvp_size < (int32_t) sizeof( nvpair_t ) || pEnd - p < pnvp->nvp_size )
+		return false;
+
+	memcpy( pnvp, p, sizeof( nvpair_t ) );
+	return pnvp->nvp_name_sz > 0 && NV_ALIGN( sizeof( nvpair_t ) + pnvp->nvp_name_sz ) <= (size_t) pnvp->nvp_size && !p[ sizeof( nvpair_t ) + pnvp->nvp_name_sz - 1 ];
+}
+
+//Returns the position after the pair at p, including the nvlists embedded behind it
+static const char *NVScanSkipPair( const char *p, const char *const pEnd, const nvpair_t *const pnvp, const unsigned uDepth )
+{
+	int32_t numLists = 0;
+	if( pnvp->nvp_type == DATA_TYPE_NVLIST )
+		numLists = 1;
+	else if( pnvp->nvp_type == DATA_TYPE_NVLIST_ARRAY )
+		numLists = pnvp->nvp_value_elem;
+
+	for( p += pnvp->nvp_size; p && numLists > 0; --numLists )
+		p = NVScanSkipList( p, pEnd, uDepth + 1 );
+	return p;
+}
+
+static const char *NVScanSkipList( const char *p, const char *const pEnd, const unsigned uDepth )
+{
+	if( uDepth > NVSCAN_MAX_DEPTH || pEnd - p < (ptrdiff_t) NVS_LIST_HEADER_SIZE )
+		return NULL;
+
+	for( p += NVS_LIST_HEADER_SIZE; p; )
+	{
+		nvpair_t nvp;
+		if( !NVScanPair( p, pEnd, &nvp ) )
+			return NULL;
+		if( !nvp.nvp_size )
+			return p + NVS_TERMINATOR_SIZE;
+		p = NVScanSkipPair( p, pEnd, &nvp, uDepth );
+	}
+
+	return NULL;
+}
+
+static const char *NVScanFind( const nvscan_t *const pScan, const char *const szName, const data_type_t eType, nvpair_t *const pnvp )
+{
+	if( pScan->pEnd - pScan->p < (ptrdiff_t) NVS_LIST_HEADER_SIZE )
+		return NULL;
+
+	for( const char *p = pScan->p + NVS_LIST_HEADER_SIZE; p; p = NVScanSkipPair( p, pScan->pEnd, pnvp, 0 ) )
+	{
+		if( !NVScanPair( p, pScan->pEnd, pnvp ) || !pnvp->nvp_size )
+			return NULL;
+		if( pnvp->nvp_type == eType && !strcmp( p + sizeof( nvpair_t ), szName ) )
+			return p;
+	}
+
+	return NULL;
+}
+
+#ifndef NDEBUG
+//Unpacks the list of pScan with libnvpair, so debug builds can compare each lookup against nvlist_lookup_*. Bytes after the list are ignored by the decoder.
+static nvlist_t *NVScanUnpack( const nvscan_t *const pScan )
+{
+	const size_t numSize = NVS_HEADER_SIZE + (size_t) ( pScan->pEnd - pScan->p );
+	char *const pBuffer = malloc( numSize );
+	if( !pBuffer )
+		return NULL;
+
+	NVPackHeader( &(nvpacker_t) { .pBuffer = pBuffer, .numUsed = 0 } );
+	memcpy( pBuffer + NVS_HEADER_SIZE, pScan->p, numSize - NVS_HEADER_SIZE );
+	nvlist_t *nvl;
+	if( nvlist_unpack( pBuffer, numSize, &nvl, 0 ) )
+		nvl = NULL;
+	free( pBuffer );
+	return nvl;
+}
+#endif
+
+/*!
+	\brief Prepares the lookup in the top-level nvlist of a packed buffer. Only native encoding in host byte order is supported.
+	\details The whole stream is walked once, so every pair and embedded list is known to lie within the buffer before any lookup.
+*/
+bool NVScanOpen( nvscan_t *const pScan, const void *const pBuffer, const size_t numSize )
+{
+	const char *const p = pBuffer;
+	if( numSize < NVS_HEADER_SIZE || p[ 0 ] != NV_ENCODE_NATIVE || p[ 1 ] != ( __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ) )
+		return false;
+
+	pScan->p = p + NVS_HEADER_SIZE;
+	pScan->pEnd = p + numSize;
+	if( !NVScanSkipList( pScan->p, pScan->pEnd, 0 ) )
+		return false;
+
+#ifndef NDEBUG
+	nvlist_t *const nvl = NVScanUnpack( pScan );
+	assert( nvl );
+	nvlist_free( nvl );
+#endif
+	return true;
+}
+
+static bool NVScanGetUInt64( const nvscan_t *const pScan, const char *const szName, uint64_t *const pu )
+{
+	nvpair_t nvp;
+	const char *const p = NVScanFind( pScan, szName, DATA_TYPE_UINT64, &nvp );
+	if( !p )
+		return false;
+
+	const size_t uValueOffset = NV_ALIGN( sizeof( nvpair_t ) + nvp.nvp_name_sz );
+	if( uValueOffset + sizeof( uint64_t ) > (size_t) nvp.nvp_size )
+		return false;
+
+	memcpy( pu, p + uValueOffset, sizeof( uint64_t ) );
+	return true;
+}
+
+bool NVScanLookupUInt64( const nvscan_t *const pScan, const char *const szName, uint64_t *const pu )
+{
+	const bool fFound = NVScanGetUInt64( pScan, szName, pu );
+#ifndef NDEBUG
+	nvlist_t *const nvl = NVScanUnpack( pScan );
+	uint64_t u;
+	assert( nvl && fFound == !nvlist_lookup_uint64( nvl, szName, &u ) && ( !fFound || u == *pu ) );
+	nvlist_free( nvl );
+#endif
+	return fFound;
+}
+
+static bool NVScanGetString( const nvscan_t *const pScan, const char *const szName, const char **const psz )
+{
+	nvpair_t nvp;
+	const char *const p = NVScanFind( pScan, szName, DATA_TYPE_STRING, &nvp );
+	if( !p )
+		return false;
+
+	const size_t uValueOffset = NV_ALIGN( sizeof( nvpair_t ) + nvp.nvp_name_sz );
+	if( uValueOffset >= (size_t) nvp.nvp_size || !memchr( p + uValueOffset, '\0', (size_t) nvp.nvp_size - uValueOffset ) )
+		return false;
+
+	*psz = p + uValueOffset;
+	return true;
+}
+
+/*!
+	\brief Looks up the string \p szName. \p psz points into the packed buffer.
+*/
+bool NVScanLookupString( const nvscan_t *const pScan, const char *const szName, const char **const psz )
+{
+	const bool fFound = NVScanGetString( pScan, szName, psz );
+#ifndef NDEBUG
+	nvlist_t *const nvl = NVScanUnpack( pScan );
+	const char *sz;
+	assert( nvl && fFound == !nvlist_lookup_string( nvl, szName, &sz ) && ( !fFound || !strcmp( sz, *psz ) ) );
+	nvlist_free( nvl );
+#endif
+	return fFound;
+}
+
+bool NVScanLookupNVList( const nvscan_t *const pScan, const char *const szName, nvscan_t *const pList )
+{
+	nvpair_t nvp;
+	const char *const p = NVScanFind( pScan, szName, DATA_TYPE_NVLIST, &nvp );
+#ifndef NDEBUG
+	nvlist_t *const nvl = NVScanUnpack( pScan );
+	nvlist_t *nvlList;
+	assert( nvl && !p == !!nvlist_lookup_nvlist( nvl, szName, &nvlList ) );
+	nvlist_free( nvl );
+#endif
+	if( !p )
+		return false;
+
+	//The contents of the embedded nvlist directly follow its pair
+	pList->p = p + nvp.nvp_size;
+	pList->pEnd = pScan->pEnd;
+	return true;
+}
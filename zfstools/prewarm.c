@@ -0,0 +1,218 @@
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <syslog.h>
+
+#define PREWARM_MAX_THREADS	8
+#define PREWARM_MAX_DEPTH	32
+#define PREWARM_BUFFER_SIZE	32768
+
+/*
+	Reading a directory pulls its ZAP blocks into the ARC, and a statx of each entry its dnode. Doing this right after mounting moves
+	the cold misses of the first directory walks (e.g. a service scanning its data directory) out of the boot critical path.
+	Each mounted dataset is one job. The walk stays on the dataset's own filesystem, so child datasets (which are jobs of their own)
+	and autofs triggers of lazily mounted datasets are neither walked twice nor mounted by accident.
+*/
+
+typedef struct prewarmjobs_s
+{
+	pthread_mutex_t mutex;
+	const mountlist_t *pList;
+	size_t uNext;
+	unsigned uDepth;
+	uint64_t numMaxBytes;
+	struct timespec tsDeadline;
+	bool fDeadline;
+	bool fExhausted;	//One of the budgets is used up
+	uint64_t numEntries;
+	uint64_t numBytes;
+	const zt_context_t *pContext;
+} prewarmjobs_t;
+
+static uint64_t ElapsedMilliseconds( const struct timespec *const ptsStart )
+{
+	struct timespec tsNow;
+	clock_gettime( CLOCK_MONOTONIC, &tsNow );
+	return (uint64_t) ( tsNow.tv_sec - ptsStart->tv_sec ) * 1000 + (uint64_t) ( ( tsNow.tv_nsec - ptsStart->tv_nsec ) / 1000000 );
+}
+
+/*!
+	\brief Adds the work of one directory read to the totals.
+	\return \c false if a budget is used up and the workers should stop.
+*/
+static bool PrewarmAccount( prewarmjobs_t *const pJobs, const size_t numBytes, const unsigned numEntries )
+{
+	struct timespec tsNow;
+	if( pJobs->fDeadline )
+		clock_gettime( CLOCK_MONOTONIC, &tsNow );
+
+	pthread_mutex_lock( &pJobs->mutex );
+	pJobs->numBytes += numBytes;
+	pJobs->numEntries += numEntries;
+	if( pJobs->numMaxBytes && pJobs->numBytes >= pJobs->numMaxBytes )
+		pJobs->fExhausted = true;
+	if( pJobs->fDeadline && ( tsNow.tv_sec > pJobs->tsDeadline.tv_sec || ( tsNow.tv_sec == pJobs->tsDeadline.tv_sec && tsNow.tv_nsec >= pJobs->tsDeadline.tv_nsec ) ) )
+		pJobs->fExhausted = true;
+	const bool fContinue = !pJobs->fExhausted;
+	pthread_mutex_unlock( &pJobs->mutex );
+	return fContinue;
+}
+
+/*!
+	\brief Reads the directory \p fd (closed on return) and stats its entries, descending \p uDepth more levels within the filesystem \p dev.
+	\param pBuffer	PREWARM_BUFFER_SIZE bytes for this level, followed by those of the levels below.
+	\return \c false if a budget is used up.
+*/
+static bool PrewarmDirectory( prewarmjobs_t *const pJobs, const int fd, const dev_t dev, const unsigned uDepth, char *const pBuffer )
+{
+	bool fContinue = true;
+	ssize_t numRead;
+	while( fContinue && ( numRead = getdents64( fd, pBuffer, PREWARM_BUFFER_SIZE ) ) > 0 )
+	{
+		unsigned numEntries = 0;
+		for( ssize_t i = 0; fContinue && i < numRead; )
+		{
+			const struct dirent64 *const pEntry = (const struct dirent64 *) ( pBuffer + i );
+			i += pEntry->d_reclen;
+			if( pEntry->d_name[ 0 ] == '.' && ( !pEntry->d_name[ 1 ] || ( pEntry->d_name[ 1 ] == '.' && !pEntry->d_name[ 2 ] ) ) )
+				continue;
+
+			struct statx stx;
+			if( statx( fd, pEntry->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE, &stx ) )
+				continue;
+			++numEntries;
+
+			//Other mounts (child datasets, autofs triggers) are left alone
+			if( !uDepth || !S_ISDIR( stx.stx_mode ) || makedev( stx.stx_dev_major, stx.stx_dev_minor ) != dev )
+				continue;
+
+			const int fdChild = openat( fd, pEntry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+			if( fdChild >= 0 )
+				fContinue = PrewarmDirectory( pJobs, fdChild, dev, uDepth - 1, pBuffer + PREWARM_BUFFER_SIZE );
+		}
+
+		fContinue = PrewarmAccount( pJobs, (size_t) numRead, numEntries ) && fContinue;
+	}
+
+	(void) close( fd );
+	return fContinue;
+}
+
+static void *PrewarmWorker( void *pArg )
+{
+	prewarmjobs_t *const pJobs = pArg;
+	CONTEXT_SCOPE( pJobs->pContext );
+	char *const pBuffers = malloc( (size_t) ( pJobs->uDepth + 1 ) * PREWARM_BUFFER_SIZE );
+	if( !pBuffers )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for prewarm buffers." );
+		return NULL;
+	}
+
+	for( ;; )
+	{
+		pthread_mutex_lock( &pJobs->mutex );
+		const size_t u = pJobs->uNext < pJobs->pList->numEntries && !pJobs->fExhausted ? pJobs->uNext++ : SIZE_MAX;
+		pthread_mutex_unlock( &pJobs->mutex );
+		if( u == SIZE_MAX )
+			break;
+
+		const mountentry_t *const pEntry = &pJobs->pList->aEntries[ u ];
+		const int fd = open( pEntry->szMountPoint, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+		struct statx stx;
+		if( fd < 0 || statx( fd, "", AT_EMPTY_PATH, STATX_TYPE, &stx ) )
+		{
+			Log( LOG_WARNING, "Failed to open mountpoint \"%s\" of dataset \"%s\" for prewarming. Error code %d.", pEntry->szMountPoint, pEntry->szDataset, errno );
+			if( fd >= 0 )
+				(void) close( fd );
+			continue;
+		}
+
+		if( !PrewarmDirectory( pJobs, fd, makedev( stx.stx_dev_major, stx.stx_dev_minor ), pJobs->uDepth, pBuffers ) )
+			break;
+	}
+
+	free( pBuffers );
+	return NULL;
+}
+
+/*!
+	\brief Reads the directory trees of all mounted datasets of \p szPool up to \p pOptions->uDepth levels, so their metadata is cached before it is used.
+	\param pStats	Receives what was warmed, may be \c NULL.
+	\return \c false if the mounts of the pool could not be determined. Directories that can't be read are skipped.
+	\details Datasets are processed in parallel. Once one of the budgets of \p pOptions is used up, the walk stops early.
+*/
+bool PrewarmPool( zt_context_t *const pContext, const char *const szPool, const zt_prewarmoptions_t *const pOptions, zt_prewarmstats_t *const pStats )
+{
+	CONTEXT_SCOPE( pContext );
+	struct timespec tsStart;
+	clock_gettime( CLOCK_MONOTONIC, &tsStart );
+
+	mountset_t mounts;
+	if( !MountSetLoad( szPool, &mounts ) )
+		return false;
+
+	prewarmjobs_t jobs =
+	{
+		.pList = &mounts.list,
+		.uDepth = pOptions->uDepth < PREWARM_MAX_DEPTH ? pOptions->uDepth : PREWARM_MAX_DEPTH,
+		.numMaxBytes = pOptions->numMaxBytes,
+		.tsDeadline = tsStart,
+		.fDeadline = pOptions->uMaxMilliseconds != 0,
+		.pContext = pContext
+	};
+	jobs.tsDeadline.tv_sec += pOptions->uMaxMilliseconds / 1000;
+	jobs.tsDeadline.tv_nsec += (long) ( pOptions->uMaxMilliseconds % 1000 ) * 1000000;
+	if( jobs.tsDeadline.tv_nsec >= 1000000000 )
+	{
+		++jobs.tsDeadline.tv_sec;
+		jobs.tsDeadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_init( &jobs.mutex, NULL );
+
+	long numThreads = sysconf( _SC_NPROCESSORS_ONLN );
+	if( numThreads < 1 )
+		numThreads = 1;
+	if( numThreads > PREWARM_MAX_THREADS )
+		numThreads = PREWARM_MAX_THREADS;
+	if( numThreads > mounts.list.numEntries )
+		numThreads = (long) mounts.list.numEntries;
+
+	pthread_t athread[ PREWARM_MAX_THREADS ];
+	long numStarted = 0;
+	for( ; numStarted < numThreads; ++numStarted )
+		if( pthread_create( &athread[ numStarted ], NULL, PrewarmWorker, &jobs ) )
+		{
+			Log( LOG_WARNING, "Failed to start prewarm thread. Continuing with %ld threads.", numStarted );
+			break;
+		}
+
+	//Without any worker thread, do the work on the calling thread
+	if( !numStarted && mounts.list.numEntries )
+		(void) PrewarmWorker( &jobs );
+
+	for( long i = 0; i < numStarted; ++i )
+		pthread_join( athread[ i ], NULL );
+
+	pthread_mutex_destroy( &jobs.mutex );
+
+	const uint64_t numMilliseconds = ElapsedMilliseconds( &tsStart );
+	Log( LOG_INFO, "Prewarmed %" PRIu64 " entries (%" PRIu64 " bytes of directories) of %zu datasets of pool \"%s\" in %" PRIu64 " ms%s.",
+		jobs.numEntries, jobs.numBytes, mounts.list.numEntries, szPool, numMilliseconds, jobs.fExhausted ? ", stopped by budget" : "" );
+
+	if( pStats )
+		*pStats = (zt_prewarmstats_t) { .numEntries = jobs.numEntries, .numBytes = jobs.numBytes, .numMilliseconds = numMilliseconds, .numDatasets = mounts.list.numEntries, .fExhausted = jobs.fExhausted };
+
+	MountSetFree( &mounts );
+	return true;
+}
@@ -0,0 +1,445 @@
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mount.h>
+#include <zfs_cmd.h>
+#include <syslog.h>
+
+#define MOUNTINFO_PATH		"/proc/self/mountinfo"
+#define UNMOUNT_MAX_THREADS	16
+#define NO_PARENT			SIZE_MAX
+
+bool MountListAdd( mountlist_t *const pList, const char *const szDataset, const char *const szMountPoint )
+{
+	if( pList->numEntries == pList->numAllocated )
+	{
+		const size_t numAllocated = pList->numAllocated ? pList->numAllocated * 2 : 32;
+		mountentry_t *const p = realloc( pList->aEntries, numAllocated * sizeof( mountentry_t ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for mount list." );
+			return false;
+		}
+
+		pList->aEntries = p;
+		pList->numAllocated = numAllocated;
+	}
+
+	mountentry_t *const pEntry = &pList->aEntries[ pList->numEntries ];
+	if( !( pEntry->szDataset = strdup( szDataset ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for mount list." );
+		return false;
+	}
+
+	if( !( pEntry->szMountPoint = strdup( szMountPoint ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for mount list." );
+		free( pEntry->szDataset );
+		return false;
+	}
+
+	++pList->numEntries;
+	return true;
+}
+
+void MountListFree( mountlist_t *const pList )
+{
+	for( size_t u = 0; u < pList->numEntries; ++u )
+	{
+		free( pList->aEntries[ u ].szDataset );
+		free( pList->aEntries[ u ].szMountPoint );
+	}
+
+	free( pList->aEntries );
+	*pList = (mountlist_t) { 0 };
+}
+
+/*!
+	\brief Decodes the octal escapes (e.g. "\040" for space) used by the kernel for paths in the mount table. Decodes in place.
+*/
+static char *UnescapeMountField( char *const sz )
+{
+	char *pOut = sz;
+	for( const char *p = sz; *p; ++pOut )
+	{
+		if( p[ 0 ] == '\\' && p[ 1 ] >= '0' && p[ 1 ] <= '3' && p[ 2 ] >= '0' && p[ 2 ] <= '7' && p[ 3 ] >= '0' && p[ 3 ] <= '7' )
+		{
+			*pOut = (char) ( ( p[ 1 ] - '0' ) << 6 | ( p[ 2 ] - '0' ) << 3 | ( p[ 3 ] - '0' ) );
+			p += 4;
+		}
+		else
+			*pOut = *p++;
+	}
+
+	*pOut = '\0';
+	return sz;
+}
+
+/*!
+	\brief Collects all currently mounted datasets of \p szPool (including mounted snapshots) from the mount table.
+*/
+static bool LoadPoolMounts( const char *const szPool, mountlist_t *const pList )
+{
+	FILE *const f = fopen( MOUNTINFO_PATH, "re" );
+	if( !f )
+	{
+		Log( LOG_ERR, "Failed to open mount table." );
+		return false;
+	}
+
+	const size_t lenPool = strlen( szPool );
+	char *szLine = NULL;
+	size_t numAllocated = 0;
+	while( getline( &szLine, &numAllocated, f ) > 0 )
+	{
+		//Layout: id parent major:minor root mountpoint options [optional fields...] - fstype source superoptions
+		char *szSave;
+		char *szMountPoint = NULL;
+		unsigned uField = 0;
+		char *szField = strtok_r( szLine, " \n", &szSave );
+		for( ; szField; szField = strtok_r( NULL, " \n", &szSave ), ++uField )
+		{
+			if( uField == 4 )
+				szMountPoint = szField;
+			else if( uField > 5 && !strcmp( szField, "-" ) )
+				break;
+		}
+
+		const char *const szType = strtok_r( NULL, " \n", &szSave );
+		char *const szSource = strtok_r( NULL, " \n", &szSave );
+		if( !szMountPoint || !szType || !szSource || strcmp( szType, MNTTYPE_ZFS ) )
+			continue;
+
+		UnescapeMountField( szSource );
+		if( strncmp( szSource, szPool, lenPool ) || szSource[ lenPool ] != '\0' && szSource[ lenPool ] != '/' && szSource[ lenPool ] != '@' )
+			continue;
+
+		if( !MountListAdd( pList, szSource, UnescapeMountField( szMountPoint ) ) )
+		{
+			free( szLine );
+			fclose( f );
+			MountListFree( pList );
+			return false;
+		}
+	}
+
+	free( szLine );
+	fclose( f );
+	return true;
+}
+
+static size_t HashDataset( const char *sz )
+{
+	//FNV-1a
+	uint64_t uHash = 14695981039346656037ULL;
+	for( ; *sz; ++sz )
+		uHash = ( uHash ^ (unsigned char) *sz ) * 1099511628211ULL;
+	return (size_t) uHash;
+}
+
+/*!
+	\brief Reads the mount table once and indexes the mounted datasets of \p szPool, so a repeated mount run can skip them.
+*/
+bool MountSetLoad( const char *const szPool, mountset_t *const pSet )
+{
+	*pSet = (mountset_t) { 0 };
+	if( !LoadPoolMounts( szPool, &pSet->list ) )
+		return false;
+
+	pSet->numSlots = 16;
+	while( pSet->numSlots < pSet->list.numEntries * 2 )
+		pSet->numSlots *= 2;
+
+	if( !( pSet->auSlots = calloc( pSet->numSlots, sizeof( size_t ) ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for mount table." );
+		MountListFree( &pSet->list );
+		return false;
+	}
+
+	//With stacked mounts, the topmost (last) one of a dataset wins
+	for( size_t u = 0; u < pSet->list.numEntries; ++u )
+	{
+		size_t uSlot = HashDataset( pSet->list.aEntries[ u ].szDataset ) & ( pSet->numSlots - 1 );
+		while( pSet->auSlots[ uSlot ] && strcmp( pSet->list.aEntries[ pSet->auSlots[ uSlot ] - 1 ].szDataset, pSet->list.aEntries[ u ].szDataset ) )
+			uSlot = ( uSlot + 1 ) & ( pSet->numSlots - 1 );
+		pSet->auSlots[ uSlot ] = u + 1;
+	}
+
+	return true;
+}
+
+/*!
+	\return The mountpoint of \p szDataset, or \c NULL if it was not mounted.
+*/
+const char *MountSetFind( const mountset_t *const pSet, const char *const szDataset )
+{
+	if( !pSet->list.numEntries )
+		return NULL;
+
+	for( size_t uSlot = HashDataset( szDataset ) & ( pSet->numSlots - 1 ); pSet->auSlots[ uSlot ]; uSlot = ( uSlot + 1 ) & ( pSet->numSlots - 1 ) )
+	{
+		const mountentry_t *const pEntry = &pSet->list.aEntries[ pSet->auSlots[ uSlot ] - 1 ];
+		if( !strcmp( pEntry->szDataset, szDataset ) )
+			return pEntry->szMountPoint;
+	}
+
+	return NULL;
+}
+
+void MountSetFree( mountset_t *const pSet )
+{
+	free( pSet->auSlots );
+	MountListFree( &pSet->list );
+	*pSet = (mountset_t) { 0 };
+}
+
+/*
+	Unmounting is ordered by mountpoint, not by dataset hierarchy, since mountpoints can be set freely.
+	Each mount depends on the closest mount whose mountpoint contains it (its parent). A mount can be unmounted once all mounts below it are gone,
+	so independent subtrees are processed in parallel, starting at the leaves.
+*/
+
+typedef struct unmountjob_s
+{
+	const mountentry_t *pEntry;
+	size_t uIndex;		//Position in the mount list, used as tie-breaker to keep stacked mounts in mount order
+	size_t uParent;
+	size_t numChildren;	//Number of child mounts that still need to be unmounted
+	bool fBlocked;
+} unmountjob_t;
+
+typedef struct unmountqueue_s
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unmountjob_t *aJobs;
+	size_t *auReady;
+	size_t numReady;
+	size_t numJobs;
+	size_t numDone;
+	int iFlags;
+	bool fFailed;
+	const zt_context_t *pContext;	//Of the thread calling UnmountList, for the messages of the workers
+} unmountqueue_t;
+
+/*!
+	\brief Orders paths so that a directory is immediately followed by its contents (i.e. '/' sorts before any other character).
+*/
+static int CompareUnmountJobs( const void *p1, const void *p2 )
+{
+	const unmountjob_t *const pJob1 = p1;
+	const unmountjob_t *const pJob2 = p2;
+	const unsigned char *sz1 = (const unsigned char *) pJob1->pEntry->szMountPoint;
+	const unsigned char *sz2 = (const unsigned char *) pJob2->pEntry->szMountPoint;
+	for( ; *sz1 && *sz1 == *sz2; ++sz1, ++sz2 );
+
+	if( *sz1 != *sz2 )
+	{
+		const unsigned c1 = *sz1 == '/' ? 1 : *sz1;
+		const unsigned c2 = *sz2 == '/' ? 1 : *sz2;
+		return c1 < c2 ? -1 : 1;
+	}
+
+	return pJob1->uIndex < pJob2->uIndex ? -1 : pJob1->uIndex > pJob2->uIndex;
+}
+
+/*!
+	\brief Checks if the mountpoint \p szParent contains (or equals) the mountpoint \p szChild.
+*/
+static bool ContainsMountPoint( const char *const szParent, const char *const szChild )
+{
+	const size_t lenParent = strlen( szParent );
+	if( lenParent == 1 && szParent[ 0 ] == '/' )
+		return szChild[ 0 ] == '/';
+
+	return !strncmp( szParent, szChild, lenParent ) && ( szChild[ lenParent ] == '\0' || szChild[ lenParent ] == '/' );
+}
+
+static void *UnmountWorker( void *pArg )
+{
+	unmountqueue_t *const pQueue = pArg;
+	CONTEXT_SCOPE( pQueue->pContext );
+	pthread_mutex_lock( &pQueue->mutex );
+	while( pQueue->numDone < pQueue->numJobs )
+	{
+		if( !pQueue->numReady )
+		{
+			pthread_cond_wait( &pQueue->cond, &pQueue->mutex );
+			continue;
+		}
+
+		unmountjob_t *const pJob = &pQueue->aJobs[ pQueue->auReady[ --pQueue->numReady ] ];
+		pthread_mutex_unlock( &pQueue->mutex );
+
+		const bool fSuccess = !umount2( pJob->pEntry->szMountPoint, pQueue->iFlags );
+		if( fSuccess )
+			Log( LOG_INFO, "Dataset \"%s\" unmounted from \"%s\".", pJob->pEntry->szDataset, pJob->pEntry->szMountPoint );
+		else
+			Log( LOG_ERR, "Failed to unmount dataset \"%s\" from \"%s\". Error code %d.", pJob->pEntry->szDataset, pJob->pEntry->szMountPoint, errno );
+
+		pthread_mutex_lock( &pQueue->mutex );
+		++pQueue->numDone;
+		if( fSuccess )
+		{
+			if( pJob->uParent != NO_PARENT )
+			{
+				unmountjob_t *const pParent = &pQueue->aJobs[ pJob->uParent ];
+				if( !--pParent->numChildren && !pParent->fBlocked )
+					pQueue->auReady[ pQueue->numReady++ ] = pJob->uParent;
+			}
+		}
+		else
+		{
+			//The parent mounts can never become unmountable. Account for them as done.
+			pQueue->fFailed = true;
+			for( size_t uParent = pJob->uParent; uParent != NO_PARENT && !pQueue->aJobs[ uParent ].fBlocked; uParent = pQueue->aJobs[ uParent ].uParent )
+			{
+				pQueue->aJobs[ uParent ].fBlocked = true;
+				++pQueue->numDone;
+			}
+		}
+
+		pthread_cond_broadcast( &pQueue->cond );
+	}
+	pthread_mutex_unlock( &pQueue->mutex );
+	return NULL;
+}
+
+/*!
+	\brief Unmounts all entries of \p pList, leaf-first and in parallel across independent subtrees.
+	\param iFlags	Flags passed to umount2 (e.g. \c MNT_FORCE).
+	\details Entries that can't be unmounted (and all mounts containing them) are left mounted, the remaining ones are still processed.
+*/
+bool UnmountList( const mountlist_t *const pList, const int iFlags )
+{
+	if( !pList->numEntries )
+		return true;
+
+	unmountqueue_t queue = { .numJobs = pList->numEntries, .iFlags = iFlags, .pContext = ContextCurrent( ) };
+	queue.aJobs = malloc( queue.numJobs * sizeof( unmountjob_t ) );
+	queue.auReady = malloc( queue.numJobs * sizeof( size_t ) );
+	if( !queue.aJobs || !queue.auReady )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for unmount jobs." );
+		free( queue.aJobs );
+		free( queue.auReady );
+		return false;
+	}
+
+	//Determine the parent of each mount. After sorting, the parent is always on the stack of currently open directories.
+	{
+		for( size_t u = 0; u < queue.numJobs; ++u )
+			queue.aJobs[ u ] = (unmountjob_t) { .pEntry = &pList->aEntries[ u ], .uIndex = u, .uParent = NO_PARENT };
+		qsort( queue.aJobs, queue.numJobs, sizeof( unmountjob_t ), CompareUnmountJobs );
+
+		size_t *const auStack = queue.auReady;	//Not yet in use, borrow it as stack
+		size_t numStack = 0;
+		for( size_t u = 0; u < queue.numJobs; ++u )
+		{
+			while( numStack && !ContainsMountPoint( queue.aJobs[ auStack[ numStack - 1 ] ].pEntry->szMountPoint, queue.aJobs[ u ].pEntry->szMountPoint ) )
+				--numStack;
+
+			if( numStack )
+			{
+				queue.aJobs[ u ].uParent = auStack[ numStack - 1 ];
+				++queue.aJobs[ auStack[ numStack - 1 ] ].numChildren;
+			}
+			auStack[ numStack++ ] = u;
+		}
+
+		for( size_t u = 0; u < queue.numJobs; ++u )
+			if( !queue.aJobs[ u ].numChildren )
+				queue.auReady[ queue.numReady++ ] = u;
+	}
+
+	pthread_mutex_init( &queue.mutex, NULL );
+	pthread_cond_init( &queue.cond, NULL );
+
+	long numThreads = sysconf( _SC_NPROCESSORS_ONLN );
+	if( numThreads < 1 )
+		numThreads = 1;
+	if( numThreads > UNMOUNT_MAX_THREADS )
+		numThreads = UNMOUNT_MAX_THREADS;
+	if( numThreads > queue.numReady )
+		numThreads = queue.numReady;
+
+	pthread_t athread[ UNMOUNT_MAX_THREADS ];
+	long numStarted = 0;
+	for( ; numStarted < numThreads; ++numStarted )
+		if( pthread_create( &athread[ numStarted ], NULL, UnmountWorker, &queue ) )
+		{
+			Log( LOG_WARNING, "Failed to start unmount thread. Continuing with %ld threads.", numStarted );
+			break;
+		}
+
+	//Without any worker thread, do the work on the calling thread
+	if( !numStarted )
+		(void) UnmountWorker( &queue );
+
+	for( long i = 0; i < numStarted; ++i )
+		pthread_join( athread[ i ], NULL );
+
+	pthread_cond_destroy( &queue.cond );
+	pthread_mutex_destroy( &queue.mutex );
+	free( queue.auReady );
+	free( queue.aJobs );
+	return !queue.fFailed;
+}
+
+/*!
+	\brief Unmounts all mounted datasets of the pool \p szPool.
+*/
+bool UnmountPool( zt_context_t *const pContext, const char *const szPool, const bool fForce )
+{
+	CONTEXT_SCOPE( pContext );
+	mountlist_t list = { 0 };
+	if( !LoadPoolMounts( szPool, &list ) )
+		return false;
+
+	const bool fSuccess = UnmountList( &list, fForce ? MNT_FORCE : 0 );
+	MountListFree( &list );
+	return fSuccess;
+}
+
+/*!
+	\brief Unmounts all datasets of the pool \p szPool, then exports it.
+*/
+bool ExportPool( zt_context_t *const pContext, const char *const szPool, const bool fForce )
+{
+	CONTEXT_SCOPE( pContext );
+	if( !UnmountPool( pContext, szPool, fForce ) )
+	{
+		Log( LOG_ERR, "Failed to export pool \"%s\": Not all datasets could be unmounted.", szPool );
+		return false;
+	}
+
+	zfs_cmd_t zc = { 0 };
+	(void) strlcpy( zc.zc_name, szPool, sizeof( zc.zc_name ) );
+	zc.zc_cookie = fForce;
+	zc.zc_guid = false;	//No hard force. For export, zc_guid is the hardforce flag, which would leave the labels claiming the pool is still active.
+
+	if( lzc_ioctl_fd( pContext->fdZFS, ZFS_IOC_POOL_EXPORT, &zc ) == -1 )
+	{
+		switch( errno )
+		{
+		case EBUSY:
+			Log( LOG_ERR, "Failed to export pool \"%s\": Pool is busy.", szPool );
+			break;
+		case EXDEV:
+			Log( LOG_ERR, "Failed to export pool \"%s\": A spare of the pool is in use by another pool.", szPool );
+			break;
+		default:
+			Log( LOG_ERR, "Failed to export pool \"%s\". Error code %d.", szPool, errno );
+		}
+		return false;
+	}
+
+	Log( LOG_INFO, "Pool \"%s\" exported.", szPool );
+	return true;
+}
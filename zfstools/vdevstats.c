@@ -0,0 +1,355 @@
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#define STATS_MAGIC		"zfstools-vdevstats"
+#define STATS_VERSION	1
+
+#define TIMING_BUCKETS		20		//Bucket 0 holds timings below TIMING_BUCKET_MIN, bucket i up to TIMING_BUCKET_MIN << i, the last one everything above
+#define TIMING_BUCKET_MIN	64		//Microseconds
+#define SLOW_FACTOR			4		//A timing this many times the p50 of the pool is reported
+#define SLOW_MIN			50000	//Microseconds a timing takes at least to be reported
+
+/*
+	The state file keeps a histogram per vdev path and step, across all runs:
+		zfstools-vdevstats <version> <bucket count> <vdev count>
+		<runs>\t<runs without valid label>\t<open buckets>\t<front read buckets>\t<back read buckets>\t<path>
+	with the buckets of each histogram separated by spaces. Vdevs missing from a run keep their histograms.
+*/
+
+typedef enum
+{
+	STEP_OPEN,
+	STEP_READFRONT,
+	STEP_READBACK,
+	STEP_COUNT
+} timingstep_t;
+
+static const char *const g_aszSteps[ STEP_COUNT ] = { "open", "front label read", "back label read" };
+
+typedef struct vdevhistogram_s
+{
+	char *szPath;
+	uint64_t numRuns;
+	uint64_t numInvalid;
+	uint64_t aauBuckets[ STEP_COUNT ][ TIMING_BUCKETS ];
+} vdevhistogram_t;
+
+typedef struct vdevstats_s
+{
+	vdevhistogram_t *aVDevs;
+	size_t numVDevs;
+	size_t numAllocated;
+} vdevstats_t;
+
+static unsigned GetTimingBucket( const uint32_t uMicroseconds )
+{
+	if( uMicroseconds < TIMING_BUCKET_MIN )
+		return 0;
+
+	const unsigned uBucket = 32 - (unsigned) __builtin_clz( uMicroseconds / TIMING_BUCKET_MIN );
+	return uBucket < TIMING_BUCKETS ? uBucket : TIMING_BUCKETS - 1;
+}
+
+/*!
+	\brief Returns the upper bound of the bucket holding the median of \p auBuckets, or 0 if it is empty.
+*/
+static uint64_t GetMedian( const uint64_t auBuckets[ TIMING_BUCKETS ] )
+{
+	uint64_t numTotal = 0;
+	for( unsigned u = 0; u < TIMING_BUCKETS; ++u )
+		numTotal += auBuckets[ u ];
+
+	uint64_t numBelow = 0;
+	for( unsigned u = 0; u < TIMING_BUCKETS; ++u )
+		if( ( numBelow += auBuckets[ u ] ) * 2 >= numTotal && numBelow )
+			return (uint64_t) TIMING_BUCKET_MIN << u;
+
+	return 0;
+}
+
+static const char *FormatMicroseconds( char szBuffer[ 32 ], const uint64_t uMicroseconds )
+{
+	if( uMicroseconds >= 1000000 )
+		snprintf( szBuffer, 32, "%.1f s", (double) uMicroseconds / 1000000 );
+	else if( uMicroseconds >= 1000 )
+		snprintf( szBuffer, 32, "%" PRIu64 " ms", uMicroseconds / 1000 );
+	else
+		snprintf( szBuffer, 32, "%" PRIu64 " us", uMicroseconds );
+	return szBuffer;
+}
+
+static void FreeVDevStats( vdevstats_t *const pStats )
+{
+	for( size_t u = 0; u < pStats->numVDevs; ++u )
+		free( pStats->aVDevs[ u ].szPath );
+
+	free( pStats->aVDevs );
+	*pStats = (vdevstats_t) { 0 };
+}
+
+/*!
+	\brief Returns the histograms of \p szPath, adding empty ones if there are none yet.
+*/
+static vdevhistogram_t *GetVDevHistogram( vdevstats_t *const pStats, const char *const szPath )
+{
+	for( size_t u = 0; u < pStats->numVDevs; ++u )
+		if( !strcmp( pStats->aVDevs[ u ].szPath, szPath ) )
+			return &pStats->aVDevs[ u ];
+
+	if( pStats->numVDevs == pStats->numAllocated )
+	{
+		const size_t numAllocated = pStats->numAllocated ? pStats->numAllocated * 2 : 16;
+		vdevhistogram_t *const p = realloc( pStats->aVDevs, numAllocated * sizeof( vdevhistogram_t ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for vdev statistics." );
+			return NULL;
+		}
+
+		pStats->aVDevs = p;
+		pStats->numAllocated = numAllocated;
+	}
+
+	vdevhistogram_t *const pVDev = &pStats->aVDevs[ pStats->numVDevs ];
+	*pVDev = (vdevhistogram_t) { .szPath = strdup( szPath ) };
+	if( !pVDev->szPath )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for vdev statistics." );
+		return NULL;
+	}
+
+	++pStats->numVDevs;
+	return pVDev;
+}
+
+/*!
+	\brief Parses TIMING_BUCKETS space separated counts from \p sz into \p au.
+*/
+static bool ParseBuckets( const char *sz, uint64_t au[ TIMING_BUCKETS ] )
+{
+	for( unsigned u = 0; u < TIMING_BUCKETS; ++u )
+	{
+		char *pEnd;
+		errno = 0;
+		au[ u ] = strtoull( sz, &pEnd, 10 );
+		if( errno || pEnd == sz )
+			return false;
+		sz = pEnd;
+	}
+
+	return !*sz;
+}
+
+/*!
+	\brief Loads the statistics at \p szPath into \p pStats. A missing file leaves them empty.
+*/
+static bool LoadVDevStats( const char *const szPath, vdevstats_t *const pStats )
+{
+	FILE *const f = fopen( szPath, "re" );
+	if( !f )
+	{
+		const bool fMissing = errno == ENOENT;
+		if( !fMissing )
+			Log( LOG_WARNING, "Failed to open vdev statistics \"%s\".", szPath );
+		return fMissing;
+	}
+
+	char *szLine = NULL;
+	size_t numAllocated = 0;
+	unsigned uVersion, numBuckets;
+	size_t numVDevs;
+	if( getline( &szLine, &numAllocated, f ) <= 0 || sscanf( szLine, STATS_MAGIC " %u %u %zu", &uVersion, &numBuckets, &numVDevs ) != 3 || uVersion != STATS_VERSION || numBuckets != TIMING_BUCKETS )
+	{
+		Log( LOG_WARNING, "Ignoring vdev statistics \"%s\" with unknown format.", szPath );
+		goto ERROR_AFTER_FILE;
+	}
+
+	while( getline( &szLine, &numAllocated, f ) > 0 )
+	{
+		char *szSave;
+		const char *const szRuns = strtok_r( szLine, "\t\n", &szSave );
+		const char *const szInvalid = strtok_r( NULL, "\t\n", &szSave );
+		const char *aszBuckets[ STEP_COUNT ];
+		for( unsigned u = 0; u < STEP_COUNT; ++u )
+			aszBuckets[ u ] = strtok_r( NULL, "\t\n", &szSave );
+		const char *const szVDev = strtok_r( NULL, "\t\n", &szSave );
+		if( !szVDev )
+		{
+			Log( LOG_WARNING, "Ignoring corrupted vdev statistics \"%s\".", szPath );
+			goto ERROR_AFTER_ENTRIES;
+		}
+
+		vdevhistogram_t *const pVDev = GetVDevHistogram( pStats, szVDev );
+		if( !pVDev )
+			goto ERROR_AFTER_ENTRIES;
+
+		pVDev->numRuns = strtoull( szRuns, NULL, 10 );
+		pVDev->numInvalid = strtoull( szInvalid, NULL, 10 );
+		for( unsigned u = 0; u < STEP_COUNT; ++u )
+			if( !ParseBuckets( aszBuckets[ u ], pVDev->aauBuckets[ u ] ) )
+			{
+				Log( LOG_WARNING, "Ignoring corrupted vdev statistics \"%s\".", szPath );
+				goto ERROR_AFTER_ENTRIES;
+			}
+	}
+
+	if( pStats->numVDevs != numVDevs )
+	{
+		Log( LOG_WARNING, "Ignoring truncated vdev statistics \"%s\".", szPath );
+		goto ERROR_AFTER_ENTRIES;
+	}
+
+	free( szLine );
+	fclose( f );
+	return true;
+
+ERROR_AFTER_ENTRIES:
+	FreeVDevStats( pStats );
+ERROR_AFTER_FILE:
+	free( szLine );
+	fclose( f );
+	return false;
+}
+
+/*!
+	\brief Atomically replaces the statistics at \p szPath with \p pStats.
+*/
+static bool SaveVDevStats( const char *const szPath, const vdevstats_t *const pStats )
+{
+	char *szTemp;
+	if( asprintf( &szTemp, "%s.tmp", szPath ) < 0 )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for vdev statistics path." );
+		return false;
+	}
+
+	FILE *const f = fopen( szTemp, "we" );
+	if( !f )
+	{
+		Log( LOG_WARNING, "Failed to create vdev statistics \"%s\".", szTemp );
+		free( szTemp );
+		return false;
+	}
+
+	fprintf( f, STATS_MAGIC " %u %u %zu\n", STATS_VERSION, TIMING_BUCKETS, pStats->numVDevs );
+	for( size_t uVDev = 0; uVDev < pStats->numVDevs; ++uVDev )
+	{
+		const vdevhistogram_t *const pVDev = &pStats->aVDevs[ uVDev ];
+		fprintf( f, "%" PRIu64 "\t%" PRIu64, pVDev->numRuns, pVDev->numInvalid );
+		for( unsigned uStep = 0; uStep < STEP_COUNT; ++uStep )
+			for( unsigned u = 0; u < TIMING_BUCKETS; ++u )
+				fprintf( f, u ? " %" PRIu64 : "\t%" PRIu64, pVDev->aauBuckets[ uStep ][ u ] );
+		fprintf( f, "\t%s\n", pVDev->szPath );
+	}
+
+	if( ferror( f ) | fclose( f ) || rename( szTemp, szPath ) )
+	{
+		Log( LOG_WARNING, "Failed to write vdev statistics \"%s\".", szPath );
+		(void) unlink( szTemp );
+		free( szTemp );
+		return false;
+	}
+
+	free( szTemp );
+	return true;
+}
+
+/*!
+	\brief Reports the label scan of the last import (or label dump) on \p pContext. Each step of a vdev that took at least SLOW_FACTOR times
+		the p50 of that step across all vdevs is logged as a warning, as are vdevs without a valid label.
+	\param szStatsPath	If not \c NULL, the scan is added to the histograms kept in this file, and the p50 is taken across all runs kept in it.
+		Otherwise, the p50 is the one of this scan.
+	\details Vdevs whose labels were not read, because they did not appear or the pool was complete without them, are left out.
+		Failing to load or write the statistics is not an error.
+*/
+bool ReportVDevTimings( zt_context_t *const pContext, const char *const szStatsPath )
+{
+	CONTEXT_SCOPE( pContext );
+	if( !pContext->numTimedVDevs )
+	{
+		Log( LOG_INFO, "No vdev label scan to report." );
+		return true;
+	}
+
+	vdevstats_t stats = { 0 };
+	if( szStatsPath )
+		(void) LoadVDevStats( szStatsPath, &stats );
+
+	//Add this scan, remembering where each vdev went
+	const zt_vdevtiming_t *const aTimings = pContext->aVDevTimings;
+	const char *szVDev = pContext->szzTimedVDevs;
+	const char *aszVDevs[ pContext->numTimedVDevs ];
+	for( unsigned uVDev = 0; uVDev < pContext->numTimedVDevs; ++uVDev, szVDev += strlen( szVDev ) + 1 )
+	{
+		aszVDevs[ uVDev ] = szVDev;
+		if( !aTimings[ uVDev ].fRead )
+			continue;
+
+		vdevhistogram_t *const pVDev = GetVDevHistogram( &stats, szVDev );
+		if( !pVDev )
+			goto ERROR_AFTER_STATS;
+
+		const zt_vdevtiming_t *const pTiming = &aTimings[ uVDev ];
+		const uint32_t auSteps[ STEP_COUNT ] = { pTiming->uOpen, pTiming->auRead[ 0 ], pTiming->auRead[ 1 ] };
+		++pVDev->numRuns;
+		pVDev->numInvalid += !pTiming->fValid;
+		for( unsigned uStep = 0; uStep < STEP_COUNT; ++uStep )
+			if( auSteps[ uStep ] != ZT_TIMING_NONE )
+				++pVDev->aauBuckets[ uStep ][ GetTimingBucket( auSteps[ uStep ] ) ];
+	}
+
+	//The p50 of each step across all vdevs. A single slow disk among many barely moves it.
+	uint64_t auMedians[ STEP_COUNT ];
+	for( unsigned uStep = 0; uStep < STEP_COUNT; ++uStep )
+	{
+		uint64_t auBuckets[ TIMING_BUCKETS ] = { 0 };
+		for( size_t u = 0; u < stats.numVDevs; ++u )
+			for( unsigned uBucket = 0; uBucket < TIMING_BUCKETS; ++uBucket )
+				auBuckets[ uBucket ] += stats.aVDevs[ u ].aauBuckets[ uStep ][ uBucket ];
+		auMedians[ uStep ] = GetMedian( auBuckets );
+	}
+
+	char szTiming[ 32 ], szMedian[ 32 ];
+	unsigned numRead = 0, numSlow = 0;
+	for( unsigned uVDev = 0; uVDev < pContext->numTimedVDevs; ++uVDev )
+	{
+		const zt_vdevtiming_t *const pTiming = &aTimings[ uVDev ];
+		if( !pTiming->fRead )
+			continue;
+
+		++numRead;
+		if( !pTiming->fValid )
+		{
+			const vdevhistogram_t *const pVDev = GetVDevHistogram( &stats, aszVDevs[ uVDev ] );
+			Log( LOG_WARNING, "VDev \"%s\" had no valid label (%" PRIu64 " of %" PRIu64 " runs).", aszVDevs[ uVDev ], pVDev->numInvalid, pVDev->numRuns );
+		}
+
+		const uint32_t auSteps[ STEP_COUNT ] = { pTiming->uOpen, pTiming->auRead[ 0 ], pTiming->auRead[ 1 ] };
+		for( unsigned uStep = 0; uStep < STEP_COUNT; ++uStep )
+			if( auSteps[ uStep ] != ZT_TIMING_NONE && auSteps[ uStep ] >= SLOW_MIN && auSteps[ uStep ] >= SLOW_FACTOR * auMedians[ uStep ] )
+			{
+				Log( LOG_WARNING, "VDev \"%s\" %s took %s, p50 %s.", aszVDevs[ uVDev ], g_aszSteps[ uStep ], FormatMicroseconds( szTiming, auSteps[ uStep ] ), FormatMicroseconds( szMedian, auMedians[ uStep ] ) );
+				++numSlow;
+			}
+	}
+
+	//Mapped labels have no read timings
+	const uint64_t uReadMedian = MAX( auMedians[ STEP_READFRONT ], auMedians[ STEP_READBACK ] );
+	Log( LOG_INFO, "Read labels of %u of %u vdevs, %u slow steps. p50 open %s, label read %s.", numRead, pContext->numTimedVDevs, numSlow,
+		FormatMicroseconds( szTiming, auMedians[ STEP_OPEN ] ), uReadMedian ? FormatMicroseconds( szMedian, uReadMedian ) : "not measured" );
+
+	if( szStatsPath )
+		(void) SaveVDevStats( szStatsPath, &stats );
+	FreeVDevStats( &stats );
+	return true;
+
+ERROR_AFTER_STATS:
+	FreeVDevStats( &stats );
+	return false;
+}
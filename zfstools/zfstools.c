@@ -1,27 +1,32 @@
-#include "zfstools.h"
+#include "internal.h"
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <aio.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <stdalign.h>
+#include <sys/inotify.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <zfs_cmd.h>
 #include <syslog.h>
 
-#define	VDEV_LABELS			4
-#define	VDEV_PHYS_SIZE		( 112 << 10 )
-#define	VDEV_PAD_SIZE		( 8 << 10 )
-#define	VDEV_UBERBLOCK_RING	( 128 << 10 )
-
-#define	ZEC_MAGIC	0x210da7ab10c7a11ULL
-
 #define	P2ALIGN_TYPED( x, align, type )	( (type) ( x ) & -(type) ( align ) )
-#define	PAGESIZE						( spl_pagesize( ) )
+#define	PAGESIZE						( (size_t) sysconf( _SC_PAGESIZE ) )
+
+#ifndef VDEV_WAIT_TIMEOUT
+#	define VDEV_WAIT_TIMEOUT	10	//Seconds to wait for missing vdevs to appear
+#endif
+#define VDEV_POLL_INTERVAL	10	//Milliseconds between checks for completed label reads while waiting for missing vdevs
+#define UNPACK_VDEVS_PER_THREAD	8	//Fewer vdevs per thread are not worth starting it
 
-#define	CONFIG_BUF_MINSIZE	262144
-#define MNTTYPE_ZFS			"zfs"
 
 #ifdef __FreeBSD__
 #	define PROP_ZONED	"jailed"
@@ -29,42 +34,6 @@
 #	define PROP_ZONED	"zoned"
 #endif
 
-extern size_t spl_pagesize( void );
-
-typedef struct zio_cksum
-{
-	uint64_t zc_word[ 4 ];
-} zio_cksum_t;
-
-typedef struct zio_eck
-{
-	uint64_t zec_magic;		//For validation, endianness
-	zio_cksum_t zec_cksum;	//256-bit checksum
-} zio_eck_t;
-
-typedef struct vdev_phys
-{
-	char vp_nvlist[ VDEV_PHYS_SIZE - sizeof( zio_eck_t ) ];
-	zio_eck_t vp_zbt;
-} vdev_phys_t;
-
-typedef struct vdev_boot_envblock
-{
-	uint64_t vbe_version;
-	char vbe_bootenv[ VDEV_PAD_SIZE - sizeof( uint64_t ) - sizeof( zio_eck_t ) ];
-	zio_eck_t vbe_zbt;
-} vdev_boot_envblock_t;
-static_assert( sizeof( vdev_boot_envblock_t ) == VDEV_PAD_SIZE );
-
-typedef struct vdev_label
-{
-	char vl_pad1[ VDEV_PAD_SIZE ];				//8K
-	vdev_boot_envblock_t vl_be;					//8K
-	vdev_phys_t vl_vdev_phys;					//112K
-	char vl_uberblock[ VDEV_UBERBLOCK_RING ];	//128K
-} vdev_label_t;
-static_assert( sizeof( vdev_label_t ) == 262144 );
-
 static unsigned CountStrings( const char *szz )
 {
 	unsigned numStrings = 0;
@@ -85,15 +54,14 @@ static unsigned CountStrings( const char *szz )
 */
 
 /*!
-	\brief Tries to unpack the vdev config from an io operation.
+	\brief Tries to unpack the vdev config from the front and back half of the labels, \p anumLabels[ u ] labels each.
 */
-static nvlist_t *VDevUnpackConfig( const struct aiocb aiocb[ 2 ] )
+static nvlist_t *VDevUnpackConfig( const vdev_label_t *const apLabels[ 2 ], const size_t anumLabels[ 2 ], nv_alloc_t *const nva )
 {
-	unsigned j = 0;
 	for( unsigned u = 0; u < 2; ++u )
 	{
-		const size_t numLabels = aio_return( (struct aiocb *) &aiocb[ u ] ) / sizeof( vdev_label_t );
-		const vdev_label_t *const aLabels = (const vdev_label_t *) aiocb[ u ].aio_buf;
+		const size_t numLabels = anumLabels[ u ];
+		const vdev_label_t *const aLabels = apLabels[ u ];
 		for( unsigned uLabel = 0; uLabel < numLabels; ++uLabel )
 		{
 			if( aLabels[ uLabel ].vl_vdev_phys.vp_zbt.zec_magic != ZEC_MAGIC )
@@ -102,7 +70,7 @@ static nvlist_t *VDevUnpackConfig( const struct aiocb aiocb[ 2 ] )
 			//TODO: Verify checksum
 
 			nvlist_t *nvl;
-			if( nvlist_unpack( (char *) aLabels[ uLabel ].vl_vdev_phys.vp_nvlist, sizeof( aLabels[ uLabel ].vl_vdev_phys.vp_nvlist ), &nvl, 0 ) )
+			if( nvlist_xunpack( (char *) aLabels[ uLabel ].vl_vdev_phys.vp_nvlist, sizeof( aLabels[ uLabel ].vl_vdev_phys.vp_nvlist ), &nvl, nva ) )
 				continue;
 
 			return nvl;
@@ -112,6 +80,13 @@ static nvlist_t *VDevUnpackConfig( const struct aiocb aiocb[ 2 ] )
 	return NULL;
 }
 
+static uint64_t MonotonicMicroseconds( void )
+{
+	struct timespec tsNow;
+	clock_gettime( CLOCK_MONOTONIC, &tsNow );
+	return (uint64_t) tsNow.tv_sec * 1000000 + (uint64_t) tsNow.tv_nsec / 1000;
+}
+
 static const char *GetVDevName( const char *const szzVDevs, unsigned uVDev )
 {
 	const char *szVDev = szzVDevs;
@@ -122,686 +97,1491 @@ static const char *GetVDevName( const char *const szzVDevs, unsigned uVDev )
 }
 
 /*!
-	\brief Loads the configuration from the VDevs given in \p szzVDevs.
-	\param szzVDevs A list of vdev paths. VDevs are separated with NULL-terminators, the list itself is finalized with a second NULL-terminators (i.e. doubly terminated at the end).
-	\details	Aside from errors that may occur from i/o or kernel communication, the function will purposely fail if a vdev is SPARE, L2CACHE or doesn't belong to the pool \p szPool with id \p pidPool.
+	\brief Waits until neither read of a vdev submitted by StartVDevRead is in progress anymore.
 */
-static bool LoadVDevConfigs( const char *const szzVDevs, const char *const szPool, uint64_t *const pidPool, const unsigned numVDevs, nvlist_t **const anvl )
+static void WaitVDevRead( const struct aiocb aiocb[ 2 ] )
 {
-	//Read all labels
-	vdev_label_t *aLabels;
-	struct aiocb *const aiocbs = alloca( numVDevs * ( VDEV_LABELS / 2 ) * sizeof( struct aiocb ) );
+	for( unsigned u = 0; u < 2; ++u )
 	{
-		if( posix_memalign( (void **) &aLabels, PAGESIZE, numVDevs * VDEV_LABELS * sizeof( vdev_label_t ) ) )
-		{
-			syslog( LOG_ERR, "Failed to allocate memory for vdev labels." );
-			return NULL;
-		}
+		const struct aiocb *const p = &aiocb[ u ];
+		while( aio_error( p ) == EINPROGRESS )
+			(void) aio_suspend( &p, 1, NULL );
+	}
+}
+
+/*!
+	\brief Opens \p szVDev and submits the reads of its VDEV_LABELS labels, without waiting for them to complete.
+	\param aiocb Receives the front half of the labels in the first, the back half in the second entry.
+	\param pBuffer Page aligned buffer of VDEV_LABELS labels to read into, or NULL to allocate one with posix_memalign.
+	\param apMapped For regular files, receives the mappings of the front and back half of the labels instead of submitting any reads.
+	\return 1 if the reads were submitted or the labels mapped, 0 if the device does not exist (yet), -1 on error.
+*/
+static int StartVDevRead( const char *const szVDev, struct aiocb aiocb[ 2 ], vdev_label_t *const pBuffer, const void *apMapped[ 2 ] )
+{
+	//TODO: error = blkid_dev_set_search(iter, (char *)"TYPE", (char *)"zfs_member");
+
+	struct stat64 statbuf;
+	if( stat64( szVDev, &statbuf ) != 0 )
+	{
+		if( errno == ENOENT || errno == ENOTDIR )
+			return 0;
+
+		Log( LOG_ERR, "Invalid device \"%s\".", szVDev );
+		return -1;
+	}
+
+	if( ( !S_ISREG( statbuf.st_mode ) && !S_ISBLK( statbuf.st_mode ) ) || ( S_ISREG( statbuf.st_mode ) && statbuf.st_size < SPA_MINDEVSIZE ) )
+	{
+		Log( LOG_ERR, "Invalid device \"%s\".", szVDev );
+		return -1;
+	}
 
-		int *const afd = alloca( numVDevs * sizeof( int ) );
-		struct aiocb **const aiocbps = alloca( numVDevs * ( VDEV_LABELS / 2 ) * sizeof( struct aiocb * ) );
-		memset( aiocbs, 0, numVDevs * ( VDEV_LABELS / 2 ) * sizeof( struct aiocb ) );
+	const size_t numHalf = VDEV_LABELS / 2 * sizeof( vdev_label_t );
 
-		//VDev labels are stored half at the beginning of the device, half at the end.
-		//Initialize all aiocb structures. Per vdev, one for the first VDEV_LABELS / 2 labels, the consecutive one for the remaining ones.
+	//File-backed vdevs (e.g. VM images or test pools) are mapped instead, which saves the buffer and copying the labels into it
+	if( S_ISREG( statbuf.st_mode ) )
+	{
+		const int fd = open( szVDev, O_RDONLY | O_CLOEXEC );
+		if( fd < 0 )
 		{
-			const char *szVDev = szzVDevs;
-			for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev, szVDev += strlen( szVDev ) + 1 )
-			{
-				//TODO: error = blkid_dev_set_search(iter, (char *)"TYPE", (char *)"zfs_member");
+			Log( LOG_ERR, "Failed to open vdev \"%s\".", szVDev );
+			return -1;
+		}
 
-				struct stat64 statbuf;
-				if( stat64( szVDev, &statbuf ) != 0 || ( !S_ISREG( statbuf.st_mode ) && !S_ISBLK( statbuf.st_mode ) ) || ( S_ISREG( statbuf.st_mode ) && statbuf.st_size < SPA_MINDEVSIZE ) )
-				{
-					syslog( LOG_ERR, "Invalid device \"%s\".", szVDev );
-					goto ERROR_WHILE_OPENING;
-				}
+		const size_t size = P2ALIGN_TYPED( statbuf.st_size, sizeof( vdev_label_t ), uint64_t );
+		void *const pFront = mmap( NULL, numHalf, PROT_READ, MAP_PRIVATE, fd, 0 );
+		void *const pBack = mmap( NULL, numHalf, PROT_READ, MAP_PRIVATE, fd, (off_t) ( size - numHalf ) );
+		close( fd );
+		if( pFront == MAP_FAILED || pBack == MAP_FAILED )
+		{
+			Log( LOG_ERR, "Failed to map vdev labels of \"%s\".", szVDev );
+			if( pFront != MAP_FAILED )
+				munmap( pFront, numHalf );
+			if( pBack != MAP_FAILED )
+				munmap( pBack, numHalf );
+			return -1;
+		}
 
-				//Open the file descriptor
-				const int fd = open( szVDev, O_RDONLY | O_DIRECT | O_CLOEXEC );
-				if( fd < 0 && errno == EINVAL )
-					*(int *) &fd = open( szVDev, O_RDONLY | O_CLOEXEC );
-				if( fd < 0 )
-				{
-					syslog( LOG_ERR, "Failed to open vdev \"%s\".", szVDev );
+		apMapped[ 0 ] = pFront;
+		apMapped[ 1 ] = pBack;
+		return 1;
+	}
 
-ERROR_WHILE_OPENING:
-					//Close already opened file descriptors
-					for( ; uVDev; --uVDev )
-						close( aiocbs[ ( uVDev - 1 ) * 2 ].aio_fildes );
+	//Open the file descriptor
+	int fd = open( szVDev, O_RDONLY | O_DIRECT | O_CLOEXEC );
+	if( fd < 0 && errno == EINVAL )
+		fd = open( szVDev, O_RDONLY | O_CLOEXEC );
+	if( fd < 0 )
+	{
+		Log( LOG_ERR, "Failed to open vdev \"%s\".", szVDev );
+		return -1;
+	}
 
-					free( aLabels );
-					return NULL;
-				}
+	//Fetch the size of the device
+	if( ioctl( fd, BLKGETSIZE64, &statbuf.st_size ) )
+	{
+		Log( LOG_ERR, "Failed to get blocksize for device \"%s\".", szVDev );
+		close( fd );
+		return -1;
+	}
 
-				//Fetch the size of the vdev
-				if( ioctl( fd, BLKGETSIZE64, &statbuf.st_size ) )
-				{
-					syslog( LOG_ERR, "Failed to get blocksize for device \"%s\".", szVDev );
-					close( fd );
-					goto ERROR_WHILE_OPENING;
-				}
+	const size_t size = P2ALIGN_TYPED( statbuf.st_size, sizeof( vdev_label_t ), uint64_t );
 
-				const size_t size = P2ALIGN_TYPED( statbuf.st_size, sizeof( vdev_label_t ), uint64_t );
-
-				struct aiocb *const p = &aiocbs[ uVDev * 2 ];
-				aiocbps[ uVDev * 2 ] = p;
-				aiocbps[ uVDev * 2 + 1 ] = p + 1;
-
-				p[ 0 ].aio_fildes = fd;
-				p[ 0 ].aio_offset = 0;
-				p[ 0 ].aio_buf = &aLabels[ uVDev * VDEV_LABELS ];
-				p[ 0 ].aio_nbytes = VDEV_LABELS / 2 * sizeof( vdev_label_t );
-				p[ 0 ].aio_lio_opcode = LIO_READ;
-				p[ 1 ].aio_fildes = fd;
-				p[ 1 ].aio_nbytes = p[ 0 ].aio_nbytes;
-				p[ 1 ].aio_offset = size - p[ 1 ].aio_nbytes;
-				p[ 1 ].aio_buf = (char *) p[ 0 ].aio_buf + p[ 0 ].aio_nbytes;
-				p[ 1 ].aio_lio_opcode = LIO_READ;
-			}
-		}
+	vdev_label_t *aLabels = pBuffer;
+	if( !aLabels && posix_memalign( (void **) &aLabels, PAGESIZE, VDEV_LABELS * sizeof( vdev_label_t ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for vdev labels of \"%s\".", szVDev );
+		close( fd );
+		return -1;
+	}
 
-		//Perform the io operations
-		if( lio_listio( LIO_WAIT, aiocbps, numVDevs * ( VDEV_LABELS / 2 ), NULL ) )
-		{
-			syslog( LOG_ERR, "Failed to fetch vdev labels." );
-			if( errno == EAGAIN || errno == EINTR || errno == EIO )
-			{
-				//A portion of the requests may have been submitted. Clean them up.
-				for( unsigned u = 0; u < VDEV_LABELS; ++u )
-				{
-					errno = 0;
-					switch( aio_error( &aiocbs[ u ] ) )
-					{
-					case EINVAL:
-						break;
-					case EINPROGRESS:
-						//This shouldn't be possible to encounter, die if we do.
-						assert( false );
-						//fallthrough
-					case EREMOTEIO:
-					case EAGAIN:
-					case EOPNOTSUPP:
-					case ENOSYS:
-					case 0:
-					default:
-						(void) aio_return( &aiocbs[ u ] );
-					}
-				}
-			}
+	//VDev labels are stored half at the beginning of the device, half at the end.
+	memset( aiocb, 0, 2 * sizeof( struct aiocb ) );
+	aiocb[ 0 ].aio_fildes = fd;
+	aiocb[ 0 ].aio_offset = 0;
+	aiocb[ 0 ].aio_buf = aLabels;
+	aiocb[ 0 ].aio_nbytes = numHalf;
+	aiocb[ 0 ].aio_lio_opcode = LIO_READ;
+	aiocb[ 1 ].aio_fildes = fd;
+	aiocb[ 1 ].aio_nbytes = aiocb[ 0 ].aio_nbytes;
+	aiocb[ 1 ].aio_offset = size - aiocb[ 1 ].aio_nbytes;
+	aiocb[ 1 ].aio_buf = (char *) aiocb[ 0 ].aio_buf + aiocb[ 0 ].aio_nbytes;
+	aiocb[ 1 ].aio_lio_opcode = LIO_READ;
+
+	struct aiocb *aiocbps[ 2 ] = { &aiocb[ 0 ], &aiocb[ 1 ] };
+	if( lio_listio( LIO_NOWAIT, aiocbps, 2, NULL ) )
+	{
+		Log( LOG_ERR, "Failed to fetch vdev labels of \"%s\".", szVDev );
 
-			//Cleanup and exit
-			for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev )
-				close( aiocbs[ uVDev * 2 ].aio_fildes );
+		//A portion of the requests may have been submitted. Let them finish before the buffer goes away.
+		WaitVDevRead( aiocb );
+		if( !pBuffer )
 			free( aLabels );
-			return NULL;
-		}
-
-		//Close vdev file descriptors
-		for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev )
-			close( aiocbs[ uVDev * 2 ].aio_fildes );
+		close( fd );
+		return -1;
 	}
 
-	//At this point, we have VDEV_LABELS / 2 sucessfull aio operation results, with VDEV_LABELS labels
+	return 1;
+}
+
+typedef enum
+{
+	VDEVREAD_MISSING,
+	VDEVREAD_PENDING,
+	VDEVREAD_MAPPED,	//Pending, but readily available
+	VDEVREAD_DONE
+} vdevread_t;
 
+/*!
+	\brief Watches the deepest existing directory of each vdev in \p aszVDevs that has not been started yet. Watching a directory twice is harmless.
+*/
+static bool WatchMissingVDevs( const int fdNotify, const char *const *const aszVDevs, const unsigned numVDevs, const uint8_t *const aeState )
+{
+	char szDir[ PATH_MAX ];
 	for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev )
 	{
-		const nvlist_t *nvl = anvl[ uVDev ] = VDevUnpackConfig( &aiocbs[ uVDev * 2 ] );
-		if( !nvl )
-		{
-			syslog( LOG_WARNING, "Failed to unpack vdev config for \"%s\".", GetVDevName( szzVDevs, uVDev ) );
+		if( aeState[ uVDev ] != VDEVREAD_MISSING )
 			continue;
-		}
 
-		//Ensure state is neither SPARE nor L2CACHE
+		const char *const szVDev = aszVDevs[ uVDev ];
+		if( strlcpy( szDir, szVDev, sizeof( szDir ) ) >= sizeof( szDir ) )
 		{
-			uint64_t eState;
-			if( nvlist_lookup_uint64( nvl, "state", &eState ) )
-			{
-				syslog( LOG_ERR, "Failed to lookup vdev state for \"%s\".", GetVDevName( szzVDevs, uVDev ) );
-				goto ERROR_WHILE_UNPACKING;
-			}
-
-			if( eState == POOL_STATE_SPARE || eState == POOL_STATE_L2CACHE )
-			{
-				syslog( LOG_ERR, "VDev state for \"%s\" indicates a Spare or L2Cache drive.", GetVDevName( szzVDevs, uVDev ) );
-				goto ERROR_WHILE_UNPACKING;
-			}
-		}
-
-		//Ensure the vdev belongs to the correct pool by name
-		{
-			const char *szVDevPool;
-			if( nvlist_lookup_string( nvl, "name", &szVDevPool ) )
-			{
-				syslog( LOG_ERR, "Failed to lookup vdev name for \"%s\".", GetVDevName( szzVDevs, uVDev ) );
-				goto ERROR_WHILE_UNPACKING;
-			}
-
-			if( strcmp( szPool, szVDevPool ) )
-			{
-				syslog( LOG_ERR, "VDev \"%s\" is a member of pool \"%s\", not \"%s\".", GetVDevName( szzVDevs, uVDev ), szVDevPool, szPool );
-				goto ERROR_WHILE_UNPACKING;
-			}
+			Log( LOG_ERR, "Path of vdev \"%s\" is too long.", szVDev );
+			return false;
 		}
 
-		//Ensure the vdev belongs to the correct pool by id
+		//Directories like /dev/disk/by-id may be created by udev later on, too
+		for( ;; )
 		{
-			uint64_t idVDevPool;
-			if( nvlist_lookup_uint64( nvl, "pool_guid", &idVDevPool ) )
-			{
-				syslog( LOG_ERR, "Failed to lookup vdev pool_guid for \"%s\".", GetVDevName( szzVDevs, uVDev ) );
-				goto ERROR_WHILE_UNPACKING;
-			}
+			char *const pSeparator = strrchr( szDir, '/' );
+			if( !pSeparator )
+				strcpy( szDir, "." );
+			else if( pSeparator == szDir )
+				szDir[ 1 ] = '\0';
+			else
+				pSeparator[ 0 ] = '\0';
+
+			if( inotify_add_watch( fdNotify, szDir, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR ) >= 0 )
+				break;
 
-#ifdef DISABLE_ID_CHECK
-			*pidPool = idVDevPool;
-#else
-			if( *pidPool != idVDevPool )
+			if( ( errno != ENOENT && errno != ENOTDIR ) || !strcmp( szDir, "/" ) || !strcmp( szDir, "." ) )
 			{
-				syslog( LOG_ERR, "VDev \"%s\" is a member of pool with id %" PRIu64 ", not %" PRIu64 ".", GetVDevName( szzVDevs, uVDev ), idVDevPool, *pidPool );
-				goto ERROR_WHILE_UNPACKING;
+				Log( LOG_ERR, "Failed to watch \"%s\" for vdev \"%s\".", szDir, szVDev );
+				return false;
 			}
-#endif
 		}
+	}
 
-		continue;
+	return true;
+}
 
-ERROR_WHILE_UNPACKING:
-		do
-		{
-			nvlist_free( anvl[ uVDev ] );
-		} while( uVDev-- );
-		free( aLabels );
+/*!
+	\brief Waits for any event on \p fdNotify until \p ptsDeadline (CLOCK_MONOTONIC), but at most \p iMaxWait milliseconds (if not negative), and drains all pending events.
+	\return \c false if the deadline passed.
+*/
+static bool WaitForVDevEvents( const int fdNotify, const struct timespec *const ptsDeadline, const long long iMaxWait )
+{
+	struct timespec tsNow;
+	clock_gettime( CLOCK_MONOTONIC, &tsNow );
+	const long long iRemaining = ( ptsDeadline->tv_sec - tsNow.tv_sec ) * 1000LL + ( ptsDeadline->tv_nsec - tsNow.tv_nsec ) / 1000000;
+	if( iRemaining <= 0 )
 		return false;
-	}
 
-	free( aLabels );
+	const long long iWait = iMaxWait >= 0 && iMaxWait < iRemaining ? iMaxWait : iRemaining;
+	struct pollfd pfd = { .fd = fdNotify, .events = POLLIN };
+	const int iResult = poll( &pfd, 1, (int) iWait );
+	if( iResult < 0 )
+		return errno == EINTR;
+	if( !iResult )
+		return iWait < iRemaining;
+
+	//The events themselves don't matter, all missing vdevs are checked again
+	alignas( struct inotify_event ) char abEvents[ 4096 ];
+	while( read( fdNotify, abEvents, sizeof( abEvents ) ) > 0 );
 	return true;
 }
 
+typedef enum
+{
+	VDEVSCAN_CONTINUE,
+	VDEVSCAN_DONE,	//No further vdev configs are needed
+	VDEVSCAN_ERROR
+} vdevscan_t;
+
 /*!
-	\brief	Loads all vdev configurations for the list \p szzVDevs, then creates the pool configuration associated with them.
-	\param szzVDevs A list of vdev paths. VDevs are separated with NULL-terminators, the list itself is finalized with a second NULL-terminators (i.e. doubly terminated at the end).
+	\brief Callback for ReadVDevConfigs, checking the config of vdev \p uVDev right after it was unpacked. Called from multiple threads at once, failures are reported by the callback.
 */
-static nvlist_t *LoadPoolConfig( const char *const szzVDevs, const char *const szPool, uint64_t *const pidPool )
-{
-	unsigned numVDevs = CountStrings( szzVDevs );
-	nvlist_t *anvlRedundant[ numVDevs ];
-	if( !LoadVDevConfigs( szzVDevs, szPool, pidPool, numVDevs, anvlRedundant ) )
-		return NULL;
+typedef bool ( *pfnvdevcheck_t )( unsigned uVDev, const nvlist_t *nvl, const void *pUser );
 
-	//At this point, we have one vdev config per physical device. All of these belong to the same pool, but not necessarily describe the same top-level vdev.
-	//The pool could for example consist of multiple raidz* vdevs, each with severel vdevs (one per disk).
-	//Make a unique set of top-level vdevs
+/*!
+	\brief Callback for ReadVDevConfigs, receiving the config of vdev \p uVDev as soon as its labels are read. \p nvl is \c NULL if no label is valid, otherwise it is owned by the callback.
+*/
+typedef vdevscan_t ( *pfnvdevconfig_t )( unsigned uVDev, nvlist_t *nvl, void *pUser );
 
-	unsigned uVDev = 0;	//Needed for cleanup
-	size_t numAllocated = 32;
-	struct tlvdev_s
-	{
-		uint64_t uTxg;
-		nvlist_t *nvl;
-	} *aTlVDev = calloc( numAllocated, sizeof( struct tlvdev_s ) );
-	if( !aTlVDev )
+/*!
+	\brief The label reads of ReadVDevConfigs, aeState holding a vdevread_t per vdev. Handed over to a reaper thread if the scan stops while reads are still in progress.
+*/
+typedef zt_vdevreads_t labelreads_t;
+
+_Static_assert( ZT_VDEV_LABELS_SIZE == VDEV_LABELS * sizeof( vdev_label_t ), "ZT_VDEV_LABELS_SIZE does not match the vdev labels" );
+
+/*!
+	\brief Prepares the label reads of the \p numVDevs vdevs in \p szzVDevs, in \p pStatic unless it is NULL or busy, otherwise in a single allocation.
+*/
+static labelreads_t *AcquireVDevReads( zt_vdevreads_t *const pStatic, const char *const szzVDevs, const unsigned numVDevs )
+{
+	if( pStatic && !atomic_flag_test_and_set( &pStatic->fBusy ) )
 	{
-		syslog( LOG_ERR, "Failed to allocate memory for top-level vdev list." );
-		goto ERROR_AFTER_VDEV;
+		//Only what the previous call may have left behind needs resetting
+		pStatic->numPending = 0;
+		memset( pStatic->apcbPending, 0, pStatic->numVDevs * 2 * sizeof( struct aiocb * ) );
+		memset( pStatic->apMapped, 0, pStatic->numVDevs * 2 * sizeof( void * ) );
+		memset( pStatic->aeState, VDEVREAD_MISSING, pStatic->numVDevs );
+		for( unsigned uVDev = 0; uVDev < pStatic->numVDevs; ++uVDev )
+			pStatic->aTimings[ uVDev ] = (zt_vdevtiming_t) { .uAppeared = ZT_TIMING_NONE, .auRead = { ZT_TIMING_NONE, ZT_TIMING_NONE } };
+		pStatic->uStarted = MonotonicMicroseconds( );
+		return pStatic;
 	}
 
-	//The array aTlVDev will contain the list of top-level vdevs (only the vdev_tree section of the disk's vdevs).
-	//Since we have multiple entries per top-level vdev in anvlRedundant, we pick the one with the highest transaction group. This is to prevent old disks re-inserted from corrupting the pool config.
-	//Further, we need the full disk vdev with highest overall transaction group to create the pool config. This is handled separately via uMaxTxg and nvlLatest.
-	uint64_t uMaxTxg = 0;
-	nvlist_t *nvlLatest = NULL;
-	for( ; uVDev < numVDevs; ++uVDev )
+	if( pStatic )
+		Log( LOG_INFO, "Static vdev reads are busy, allocating them instead." );
+
+	labelreads_t *const pReads = calloc( 1, sizeof( labelreads_t ) + numVDevs * ( 2 * ( sizeof( struct aiocb ) + sizeof( struct aiocb * ) + sizeof( void * ) ) +
+		sizeof( char * ) + sizeof( nvlist_t * ) + sizeof( zt_vdevtiming_t ) + sizeof( unsigned ) + sizeof( bool ) + sizeof( uint8_t ) ) );
+	if( !pReads )
 	{
-		if( !anvlRedundant[ uVDev ] )
-			continue;
+		Log( LOG_ERR, "Failed to allocate memory for vdev label reads." );
+		return NULL;
+	}
 
-		//Fetch the vdev tree from the disk vdev
-		nvlist_t *nvl;
-		if( nvlist_lookup_nvlist( anvlRedundant[ uVDev ], ZPOOL_CONFIG_VDEV_TREE, &nvl ) )
-		{
-			syslog( LOG_ERR, "Failed to lookup vdev_tree for \"%s\".", GetVDevName( szzVDevs, uVDev ) );
-			goto ERROR_AFTER_TLVDEV;
-		}
+	pReads->szzVDevs = szzVDevs;
+	pReads->numVDevs = numVDevs;
+	pReads->aiocbs = (struct aiocb *) &pReads[ 1 ];
+	pReads->apcbPending = (const struct aiocb **) &pReads->aiocbs[ numVDevs * 2 ];
+	pReads->apMapped = (const void **) &pReads->apcbPending[ numVDevs * 2 ];
+	const char **const aszVDevs = (const char **) &pReads->apMapped[ numVDevs * 2 ];
+	pReads->anvl = (nvlist_t **) &aszVDevs[ numVDevs ];
+	pReads->aTimings = (zt_vdevtiming_t *) &pReads->anvl[ numVDevs ];
+	pReads->auBatch = (unsigned *) &pReads->aTimings[ numVDevs ];
+	pReads->afValid = (bool *) &pReads->auBatch[ numVDevs ];
+	pReads->aeState = (uint8_t *) &pReads->afValid[ numVDevs ];
 
-		uint64_t idChild;
-		if( nvlist_lookup_uint64( nvl, "id", &idChild ) )
-		{
-			syslog( LOG_ERR, "Failed to lookup vdev child id for \"%s\".", GetVDevName( szzVDevs, uVDev ) );
-			goto ERROR_AFTER_TLVDEV;
-		}
+	const char *szVDev = szzVDevs;
+	for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev, szVDev += strlen( szVDev ) + 1 )
+	{
+		aszVDevs[ uVDev ] = szVDev;
+		pReads->aTimings[ uVDev ] = (zt_vdevtiming_t) { .uAppeared = ZT_TIMING_NONE, .auRead = { ZT_TIMING_NONE, ZT_TIMING_NONE } };
+	}
+	pReads->aszVDevs = aszVDevs;
+	pReads->uStarted = MonotonicMicroseconds( );
 
-		//If the child id is larger than the array we currently have, reserve some more space
-		if( idChild >= numAllocated )
-		{
-			const size_t numPrevious = numAllocated;
-			do
-			{
-				numAllocated += 32;
-			} while( idChild >= numAllocated );
+	return pReads;
+}
 
-			struct tlvdev_s *const p = realloc( aTlVDev, numAllocated * sizeof( struct tlvdev_s ) );
-			if( !p )
-			{
-				syslog( LOG_ERR, "Failed to allocate memory for top-level vdev list." );
-				goto ERROR_AFTER_TLVDEV;
-			}
+/*!
+	\brief Releases the label buffer (or mappings) and file descriptor of vdev \p uVDev, whose reads must not be in progress anymore.
+*/
+static void ReleaseVDevLabels( const labelreads_t *const pReads, const unsigned uVDev )
+{
+	if( pReads->aeState[ uVDev ] == VDEVREAD_MAPPED )
+	{
+		munmap( (void *) pReads->apMapped[ uVDev * 2 ], VDEV_LABELS / 2 * sizeof( vdev_label_t ) );
+		munmap( (void *) pReads->apMapped[ uVDev * 2 + 1 ], VDEV_LABELS / 2 * sizeof( vdev_label_t ) );
+		return;
+	}
 
-			aTlVDev = p;
-			memset( aTlVDev + numPrevious, 0, ( numAllocated - numPrevious ) * sizeof( struct tlvdev_s ) );
-		}
+	close( pReads->aiocbs[ uVDev * 2 ].aio_fildes );
+	if( !pReads->pLabels )
+		free( (void *) pReads->aiocbs[ uVDev * 2 ].aio_buf );
+}
 
-		//Check if this top-level vdev has a higher transaction group than what was previously found
-		uint64_t uTxg;
-		if( nvlist_lookup_uint64( anvlRedundant[ uVDev ], ZPOOL_CONFIG_POOL_TXG, &uTxg ) )
-		{
-			syslog( LOG_ERR, "Failed to lookup vdev txg for \"%s\".", GetVDevName( szzVDevs, uVDev ) );
-			goto ERROR_AFTER_TLVDEV;
-		}
+//Number of detached threads running ReapVDevReads, see WaitForVDevReapers
+static pthread_mutex_t g_mutexReapers = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_condReapers = PTHREAD_COND_INITIALIZER;
+static unsigned g_numReapers;
 
-		if( aTlVDev[ idChild ].uTxg >= uTxg )
-		{
-			//There is a vdev with same or larger transaction group already in the child slot. Therefore it also can't be the largest overall txg.
-			nvlist_free( anvlRedundant[ uVDev ] );
-			anvlRedundant[ uVDev-- ] = anvlRedundant[ --numVDevs ];	//Move the vdev from the back of the array into the current position, then shorten the array
-			continue;
-		}
+static void *ReapVDevReads( void *pArg )
+{
+	labelreads_t *const pReads = pArg;
+	for( unsigned uVDev = 0; uVDev < pReads->numVDevs; ++uVDev )
+	{
+		if( pReads->aeState[ uVDev ] == VDEVREAD_PENDING )
+			WaitVDevRead( &pReads->aiocbs[ uVDev * 2 ] );
+		if( pReads->aeState[ uVDev ] == VDEVREAD_PENDING || pReads->aeState[ uVDev ] == VDEVREAD_MAPPED )
+			ReleaseVDevLabels( pReads, uVDev );
+	}
 
-		//Transaction group is the current largest for this child, save a reference (not a copy yet!) to it.
-		aTlVDev[ idChild ].uTxg = uTxg;
-		aTlVDev[ idChild ].nvl = nvl;
+	if( pReads->fStatic )
+		atomic_flag_clear( &pReads->fBusy );
+	else
+		free( pReads );
+	return NULL;
+}
 
-		//Check if is the largest transaction group overall
-		if( uMaxTxg >= uTxg )
-			continue;
+static void *ReapVDevReadsDetached( void *pArg )
+{
+	(void) ReapVDevReads( pArg );
 
-		uMaxTxg = uTxg;
-		nvlLatest = anvlRedundant[ uVDev ];
-	}
-	uVDev = 0;	//Needed for cleanup
+	pthread_mutex_lock( &g_mutexReapers );
+	if( !--g_numReapers )
+		pthread_cond_broadcast( &g_condReapers );
+	pthread_mutex_unlock( &g_mutexReapers );
+	return NULL;
+}
 
-	//At this point, we have
-	//- nvlLatest as the latest overall disk vdev
-	//- aTlVDev as an array of references into the vdev_tree below vdevs in anvlRedundant
+/*!
+	\brief Waits until the label reads that ReadVDevConfigs left to detached threads are done and these threads have exited.
+*/
+void WaitForVDevReapers( void )
+{
+	pthread_mutex_lock( &g_mutexReapers );
+	while( g_numReapers )
+		pthread_cond_wait( &g_condReapers, &g_mutexReapers );
+	pthread_mutex_unlock( &g_mutexReapers );
+}
 
-	//Using nvlLatest, create the basic structure of the pool configuration
-	nvlist_t *nvlPool;
-	uint64_t numChildren;
-	uint64_t *auHoles;
-	uint_t numHoles = 0;
-	{
-		if( nvlist_alloc( &nvlPool, NV_UNIQUE_NAME, 0 ) )
-		{
-			syslog( LOG_ERR, "Failed to allocate pool nvlist." );
-			goto ERROR_AFTER_TLVDEV;
-		}
-		
-		//Copy version
-		{
-			uint64_t uVersion;
-			if( nvlist_lookup_uint64( nvlLatest, ZPOOL_CONFIG_VERSION, &uVersion ) )
-			{
-				syslog( LOG_ERR, "Failed to retrieve pool version." );
-				goto ERROR_AFTER_POOL;
-			}
+/*
+	Unpacking a label is a full nvlist_unpack of up to 112K, which adds up with hundreds of disks. The vdevs whose reads completed are therefore
+	unpacked and checked as a batch, by the calling thread and up to UNPACK_MAX_THREADS - 1 workers, each with an arena of its own.
+	Results go into per-vdev slots and are passed on in vdev order, so the outcome does not depend on the number of threads.
+*/
 
-			if( nvlist_add_uint64( nvlPool, ZPOOL_CONFIG_VERSION, uVersion ) )
-			{
-				syslog( LOG_ERR, "Failed to copy pool version." );
-				goto ERROR_AFTER_POOL;
-			}
-		}
+typedef struct unpackworker_s
+{
+	struct unpackpool_s *pPool;
+	nv_alloc_t *nva;
+	pthread_t thread;
+} unpackworker_t;
 
-		//Copy pool guid
-		{
-			if( nvlist_add_uint64( nvlPool, ZPOOL_CONFIG_POOL_GUID, *pidPool ) )
-			{
-				syslog( LOG_ERR, "Failed to copy pool pool_guid." );
-				goto ERROR_AFTER_POOL;
-			}
-		}
+typedef struct unpackpool_s
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t condWork;
+	pthread_cond_t condDone;
+	labelreads_t *pReads;
+	pfnvdevcheck_t pfnCheck;
+	const void *pUser;
+	zt_context_t *pContext;
+	nvlist_t **anvl;		//Per vdev, the unpacked config
+	unsigned *auBatch;		//Vdevs of the current batch, ascending
+	bool *afValid;			//Per vdev, whether the config passed pfnCheck
+	unsigned numBatch;
+	unsigned uNext;			//Next entry of auBatch to unpack
+	unsigned numDone;
+	unsigned numWorkers;	//Besides the calling thread
+	bool fStop;
+	unpackworker_t aWorkers[ UNPACK_MAX_THREADS - 1 ];
+} unpackpool_t;
 
-		//Copy pool name
+/*!
+	\brief Unpacks the config of vdev \p uVDev into \p nva, releases its labels and checks the config.
+*/
+static void UnpackVDevConfig( unpackpool_t *const pPool, const unsigned uVDev, nv_alloc_t *const nva )
+{
+	labelreads_t *const pReads = pPool->pReads;
+	const vdev_label_t *apLabels[ 2 ];
+	size_t anumLabels[ 2 ];
+	if( pReads->aeState[ uVDev ] == VDEVREAD_MAPPED )
+	{
+		apLabels[ 0 ] = pReads->apMapped[ uVDev * 2 ];
+		apLabels[ 1 ] = pReads->apMapped[ uVDev * 2 + 1 ];
+		anumLabels[ 0 ] = anumLabels[ 1 ] = VDEV_LABELS / 2;
+	}
+	else
+		for( unsigned u = 0; u < 2; ++u )
 		{
-			if( nvlist_add_string( nvlPool, ZPOOL_CONFIG_POOL_NAME, szPool ) )
-			{
-				syslog( LOG_ERR, "Failed to copy pool name." );
-				goto ERROR_AFTER_POOL;
-			}
+			apLabels[ u ] = (const vdev_label_t *) pReads->aiocbs[ uVDev * 2 + u ].aio_buf;
+			anumLabels[ u ] = (size_t) aio_return( &pReads->aiocbs[ uVDev * 2 + u ] ) / sizeof( vdev_label_t );
 		}
 
-		//Copy comment
-		{
-			const char *szComment;
-			if( !nvlist_lookup_string( nvlLatest, ZPOOL_CONFIG_COMMENT, &szComment ) )
-				if( nvlist_add_string( nvlPool, ZPOOL_CONFIG_COMMENT, szComment ) )
-					syslog( LOG_WARNING, "Failed to copy pool comment." );
-		}
+	//Unpacking copies the config, the labels are not needed afterwards
+	nvlist_t *const nvl = VDevUnpackConfig( apLabels, anumLabels, nva );
+	ReleaseVDevLabels( pReads, uVDev );
+	pReads->aeState[ uVDev ] = VDEVREAD_DONE;
+	if( !nvl )
+		Log( LOG_WARNING, "Failed to unpack vdev config for \"%s\".", pReads->aszVDevs[ uVDev ] );
+
+	pPool->anvl[ uVDev ] = nvl;
+	pPool->afValid[ uVDev ] = !nvl || !pPool->pfnCheck || pPool->pfnCheck( uVDev, nvl, pPool->pUser );
+	pReads->aTimings[ uVDev ].fRead = true;
+	pReads->aTimings[ uVDev ].fValid = nvl && pPool->afValid[ uVDev ];
+}
 
-		//Copy compatibility
-		{
-			const char *szCompatibility;
-			if( !nvlist_lookup_string( nvlLatest, ZPOOL_CONFIG_COMPATIBILITY, &szCompatibility ) )
-				if( nvlist_add_string( nvlPool, ZPOOL_CONFIG_COMPATIBILITY, szCompatibility ) )
-					syslog( LOG_WARNING, "Failed to copy pool compatibility." );
-		}
+//Unpacks entries of the current batch until none are left
+static void UnpackBatch( unpackpool_t *const pPool, nv_alloc_t *const nva )
+{
+	pthread_mutex_lock( &pPool->mutex );
+	while( pPool->uNext < pPool->numBatch )
+	{
+		const unsigned uVDev = pPool->auBatch[ pPool->uNext++ ];
+		pthread_mutex_unlock( &pPool->mutex );
+		UnpackVDevConfig( pPool, uVDev, nva );
+		pthread_mutex_lock( &pPool->mutex );
+		if( ++pPool->numDone == pPool->numBatch )
+			pthread_cond_signal( &pPool->condDone );
+	}
+	pthread_mutex_unlock( &pPool->mutex );
+}
 
-		//Copy state
+static void *UnpackWorker( void *pArg )
+{
+	unpackworker_t *const pWorker = pArg;
+	unpackpool_t *const pPool = pWorker->pPool;
+	CONTEXT_SCOPE( pPool->pContext );
+	pthread_mutex_lock( &pPool->mutex );
+	while( !pPool->fStop )
+	{
+		if( pPool->uNext < pPool->numBatch )
 		{
-			uint64_t eState;
-			if( nvlist_lookup_uint64( nvlLatest, ZPOOL_CONFIG_POOL_STATE, &eState ) )
-			{
-				syslog( LOG_ERR, "Failed to retrieve pool state." );
-				goto ERROR_AFTER_POOL;
-			}
-
-			if( nvlist_add_uint64( nvlPool, ZPOOL_CONFIG_POOL_STATE, eState ) )
-			{
-				syslog( LOG_ERR, "Failed to copy pool state." );
-				goto ERROR_AFTER_POOL;
-			}
+			pthread_mutex_unlock( &pPool->mutex );
+			UnpackBatch( pPool, pWorker->nva );
+			pthread_mutex_lock( &pPool->mutex );
 		}
+		else
+			pthread_cond_wait( &pPool->condWork, &pPool->mutex );
+	}
+	pthread_mutex_unlock( &pPool->mutex );
+	return NULL;
+}
 
-		//Copy hostid
+/*!
+	\brief Prepares the unpacking for the vdevs of \p pReads, into its per-vdev slots. Workers are only started for enough vdevs to be worth it.
+*/
+static void StartUnpackPool( unpackpool_t *const pPool, labelreads_t *const pReads, const pfnvdevcheck_t pfnCheck, const void *const pUser, zt_context_t *const pContext )
+{
+	const unsigned numVDevs = pReads->numVDevs;
+	*pPool = (unpackpool_t) { .pReads = pReads, .pfnCheck = pfnCheck, .pUser = pUser, .pContext = pContext, .anvl = pReads->anvl, .auBatch = pReads->auBatch, .afValid = pReads->afValid };
+	pthread_mutex_init( &pPool->mutex, NULL );
+	pthread_cond_init( &pPool->condWork, NULL );
+	pthread_cond_init( &pPool->condDone, NULL );
+
+	long numThreads = sysconf( _SC_NPROCESSORS_ONLN );
+	if( numThreads > UNPACK_MAX_THREADS )
+		numThreads = UNPACK_MAX_THREADS;
+	if( numThreads > numVDevs / UNPACK_VDEVS_PER_THREAD )
+		numThreads = numVDevs / UNPACK_VDEVS_PER_THREAD;
+
+	for( ; pPool->numWorkers + 1 < numThreads; ++pPool->numWorkers )
+	{
+		unpackworker_t *const pWorker = &pPool->aWorkers[ pPool->numWorkers ];
+		pWorker->pPool = pPool;
+		if( !( pWorker->nva = ContextWorkerArena( pContext, pPool->numWorkers + 1 ) ) || pthread_create( &pWorker->thread, NULL, UnpackWorker, pWorker ) )
 		{
-			uint64_t idHost;
-			if( !nvlist_lookup_uint64( nvlLatest, ZPOOL_CONFIG_HOSTID, &idHost ) )
-				if( nvlist_add_uint64( nvlPool, ZPOOL_CONFIG_HOSTID, idHost ) )
-				{
-					syslog( LOG_ERR, "Failed to copy pool hostid." );
-					goto ERROR_AFTER_POOL;
-				}
+			Log( LOG_WARNING, "Failed to start label unpack thread. Continuing with %u threads.", pPool->numWorkers + 1 );
+			break;
 		}
+	}
+}
 
-		//Copy hostname
-		{
-			const char *szHostName;
-			if( !nvlist_lookup_string( nvlLatest, ZPOOL_CONFIG_HOSTNAME, &szHostName ) )
-				if( nvlist_add_string( nvlPool, ZPOOL_CONFIG_HOSTNAME, szHostName ) )
-				{
-					syslog( LOG_ERR, "Failed to copy pool hostname." );
-					goto ERROR_AFTER_POOL;
-				}
-		}
+static void StopUnpackPool( unpackpool_t *const pPool )
+{
+	pthread_mutex_lock( &pPool->mutex );
+	pPool->fStop = true;
+	pthread_cond_broadcast( &pPool->condWork );
+	pthread_mutex_unlock( &pPool->mutex );
+	for( unsigned u = 0; u < pPool->numWorkers; ++u )
+		pthread_join( pPool->aWorkers[ u ].thread, NULL );
+
+	pthread_cond_destroy( &pPool->condDone );
+	pthread_cond_destroy( &pPool->condWork );
+	pthread_mutex_destroy( &pPool->mutex );
+}
 
-		//Copy hole_array
+/*!
+	\brief Unpacks the config of every vdev whose reads completed since the last call and passes it to \p pfnConfig, without waiting for further reads.
+*/
+static vdevscan_t CollectVDevReads( unpackpool_t *const pPool, const pfnvdevconfig_t pfnConfig, void *const pUser )
+{
+	labelreads_t *const pReads = pPool->pReads;
+	const uint64_t uNow = MonotonicMicroseconds( ) - pReads->uStarted;
+	bool fFailed = false;
+	unsigned numBatch = 0;
+	for( unsigned uVDev = 0; uVDev < pReads->numVDevs; ++uVDev )
+	{
+		struct aiocb *const aiocb = &pReads->aiocbs[ uVDev * 2 ];
+		if( pReads->aeState[ uVDev ] == VDEVREAD_PENDING )
 		{
-			if( !nvlist_lookup_uint64_array( nvlLatest, ZPOOL_CONFIG_HOLE_ARRAY, &auHoles, &numHoles ) )
-				if( nvlist_add_uint64_array( nvlPool, ZPOOL_CONFIG_HOLE_ARRAY, auHoles, numHoles ) )
+			//The time a read is noticed to be done stands in for its completion. Reads are collected whenever any completes, so this is close.
+			//A finished half is no longer waited for, otherwise aio_suspend would return right away until the other half is done as well.
+			zt_vdevtiming_t *const pTiming = &pReads->aTimings[ uVDev ];
+			for( unsigned u = 0; u < 2; ++u )
+				if( pTiming->auRead[ u ] == ZT_TIMING_NONE && aio_error( &aiocb[ u ] ) != EINPROGRESS )
 				{
-					syslog( LOG_ERR, "Failed to copy pool hole_array." );
-					goto ERROR_AFTER_POOL;
+					pTiming->auRead[ u ] = (uint32_t) ( uNow - pTiming->uAppeared - pTiming->uOpen );
+					pReads->apcbPending[ uVDev * 2 + u ] = NULL;
 				}
-		}
 
-		//Copy vdev_children
-		{
-			if( nvlist_lookup_uint64( nvlLatest, ZPOOL_CONFIG_VDEV_CHILDREN, &numChildren ) )
-			{
-				syslog( LOG_ERR, "Failed to retrieve pool vdev_children." );
-				goto ERROR_AFTER_POOL;
-			}
+			//Only parse the vdev once both halves are done
+			if( pTiming->auRead[ 0 ] == ZT_TIMING_NONE || pTiming->auRead[ 1 ] == ZT_TIMING_NONE )
+				continue;
 
-			if( nvlist_add_uint64( nvlPool, ZPOOL_CONFIG_VDEV_CHILDREN, numChildren ) )
+			if( aio_error( &aiocb[ 0 ] ) || aio_error( &aiocb[ 1 ] ) )
 			{
-				syslog( LOG_ERR, "Failed to copy pool vdev_children." );
-				goto ERROR_AFTER_POOL;
+				Log( LOG_ERR, "Failed to fetch vdev labels of \"%s\".", pReads->aszVDevs[ uVDev ] );
+				ReleaseVDevLabels( pReads, uVDev );
+				pReads->aeState[ uVDev ] = VDEVREAD_DONE;
+				--pReads->numPending;
+				fFailed = true;
+				continue;
 			}
 		}
+		else if( pReads->aeState[ uVDev ] != VDEVREAD_MAPPED )
+			continue;
+
+		pPool->auBatch[ numBatch++ ] = uVDev;
+		--pReads->numPending;
 	}
 
+	if( !numBatch )
+		return fFailed ? VDEVSCAN_ERROR : VDEVSCAN_CONTINUE;
+
+	//Hand the batch to the workers and help unpacking it
+	pthread_mutex_lock( &pPool->mutex );
+	pPool->numBatch = numBatch;
+	pPool->uNext = 0;
+	pPool->numDone = 0;
+	pthread_cond_broadcast( &pPool->condWork );
+	pthread_mutex_unlock( &pPool->mutex );
+
+	UnpackBatch( pPool, ContextWorkerArena( pPool->pContext, 0 ) );
+
+	pthread_mutex_lock( &pPool->mutex );
+	while( pPool->numDone < numBatch )
+		pthread_cond_wait( &pPool->condDone, &pPool->mutex );
+	pPool->numBatch = 0;
+	pthread_mutex_unlock( &pPool->mutex );
+
+	//Pass the configs on in vdev order
+	vdevscan_t eResult = fFailed ? VDEVSCAN_ERROR : VDEVSCAN_CONTINUE;
+	for( unsigned u = 0; u < numBatch; ++u )
 	{
-		//Fill holes with dummy vdevs
-		nvlist_t *anvlHoles[ numHoles ];
-		if( numHoles )
-		{
-			//At least one hole is present. Create a "template" (assigned to the first hole) that is copied for remaining holes.
-			nvlist_t *nvlHole;
-			if( nvlist_alloc( &nvlHole, NV_UNIQUE_NAME, 0 ) )
-			{
-				syslog( LOG_ERR, "Failed to allocate nvlist for pool holes." );
-				goto ERROR_AFTER_POOL;
-			}
+		const unsigned uVDev = pPool->auBatch[ u ];
+		if( eResult == VDEVSCAN_CONTINUE && !pPool->afValid[ uVDev ] )
+			eResult = VDEVSCAN_ERROR;
+
+		if( eResult == VDEVSCAN_CONTINUE )
+			eResult = pfnConfig( uVDev, pPool->anvl[ uVDev ], pUser );
+		else
+			nvlist_free( pPool->anvl[ uVDev ] );
+	}
 
-			if( nvlist_add_string( nvlHole, ZPOOL_CONFIG_TYPE, VDEV_TYPE_HOLE ) )
-			{
-				syslog( LOG_ERR, "Failed to set hole nvlist type." );
-				numHoles = 1;	//Only one hole to clean up
-				goto ERROR_AFTER_HOLES;
-			}
+	return eResult;
+}
 
-			if( nvlist_add_uint64( nvlHole, ZPOOL_CONFIG_GUID, 0ULL ) )
-			{
-				syslog( LOG_ERR, "Failed to set hole nvlist guid." );
-				numHoles = 1;	//Only one hole to clean up
-				goto ERROR_AFTER_HOLES;
-			}
+/*!
+	\brief Copies the timings of the label scan \p pReads to \p pContext for ReportVDevTimings, replacing those of the previous scan.
+*/
+static void KeepVDevTimings( zt_context_t *const pContext, const labelreads_t *const pReads )
+{
+	free( pContext->aVDevTimings );
+	pContext->aVDevTimings = NULL;
+	pContext->szzTimedVDevs = NULL;
+	pContext->numTimedVDevs = 0;
+
+	const char *pEnd = pReads->szzVDevs;
+	while( *pEnd )
+		pEnd += strlen( pEnd ) + 1;
+
+	const size_t numTimings = pReads->numVDevs * sizeof( zt_vdevtiming_t );
+	const size_t numNames = (size_t) ( pEnd - pReads->szzVDevs ) + 1;
+	char *const p = malloc( numTimings + numNames );
+	if( !p )
+	{
+		Log( LOG_WARNING, "Failed to allocate memory for vdev label timings." );
+		return;
+	}
 
-			aTlVDev[ auHoles[ 0 ] ].nvl = nvlHole;
+	memcpy( p, pReads->aTimings, numTimings );
+	memcpy( p + numTimings, pReads->szzVDevs, numNames );
+	pContext->aVDevTimings = (zt_vdevtiming_t *) p;
+	pContext->szzTimedVDevs = p + numTimings;
+	pContext->numTimedVDevs = pReads->numVDevs;
+}
 
-			for( unsigned uHole = 1; uHole < numHoles; ++uHole )
+/*!
+	\brief Reads and unpacks the configuration from the VDevs given in \p szzVDevs, passing each to \p pfnConfig in the order the reads complete.
+	\param szzVDevs A list of vdev paths. VDevs are separated with NULL-terminators, the list itself is finalized with a second NULL-terminators (i.e. doubly terminated at the end).
+	\param pStatic Optional preallocated reads of exactly the vdevs in \p szzVDevs. Used unless busy, in which case the reads are allocated as without it.
+	\param pfnCheck Optional check of each config, run by the unpacking threads. A failed check fails the whole read.
+	\details VDevs which don't exist yet (e.g. because udev is still creating their device nodes) are waited for using inotify, up to VDEV_WAIT_TIMEOUT seconds.
+		Reading the labels of each vdev starts as soon as it appears. Once \p pfnConfig returns VDEVSCAN_DONE, neither missing vdevs nor outstanding reads are waited for.
+		The configs are unpacked into the scratch arenas of \p pContext.
+*/
+static bool ReadVDevConfigs( zt_context_t *const pContext, const char *const szzVDevs, const unsigned numVDevs, zt_vdevreads_t *const pStatic, const pfnvdevcheck_t pfnCheck, const pfnvdevconfig_t pfnConfig, void *const pUser )
+{
+	labelreads_t *const pReads = AcquireVDevReads( pStatic, szzVDevs, numVDevs );
+	if( !pReads )
+		return false;
+
+	unpackpool_t pool;
+	StartUnpackPool( &pool, pReads, pfnCheck, pUser, pContext );
+
+	struct timespec tsDeadline;
+	clock_gettime( CLOCK_MONOTONIC, &tsDeadline );
+	tsDeadline.tv_sec += VDEV_WAIT_TIMEOUT;
+
+	bool fSuccess = false;
+	vdevscan_t eResult = VDEVSCAN_CONTINUE;
+	int fdNotify = -1;
+	for( unsigned numMissing = numVDevs; ; )
+	{
+		//Start reading every vdev that exists by now
+		for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev )
+		{
+			if( pReads->aeState[ uVDev ] != VDEVREAD_MISSING )
+				continue;
+
+			vdev_label_t *const pBuffer = pReads->pLabels ? (vdev_label_t *) ( pReads->pLabels + (size_t) uVDev * ZT_VDEV_LABELS_SIZE ) : NULL;
+			const uint64_t uBefore = MonotonicMicroseconds( );
+			switch( StartVDevRead( pReads->aszVDevs[ uVDev ], &pReads->aiocbs[ uVDev * 2 ], pBuffer, &pReads->apMapped[ uVDev * 2 ] ) )
 			{
-				nvlist_t *nvl;
-				if( nvlist_dup( nvlHole, &nvl, 0 ) )
+			case -1:
+				goto ERROR_WHILE_READING;
+			case 1:
+				pReads->aTimings[ uVDev ].uAppeared = (uint32_t) ( uBefore - pReads->uStarted );
+				pReads->aTimings[ uVDev ].uOpen = (uint32_t) ( MonotonicMicroseconds( ) - uBefore );
+				if( pReads->apMapped[ uVDev * 2 ] )
+					pReads->aeState[ uVDev ] = VDEVREAD_MAPPED;
+				else
 				{
-					syslog( LOG_ERR, "Failed to copy nvlist for pool holes." );
-					numHoles = uHole;	//Only clean up what was created so far
-					goto ERROR_AFTER_HOLES;
+					pReads->aeState[ uVDev ] = VDEVREAD_PENDING;
+					pReads->apcbPending[ uVDev * 2 ] = &pReads->aiocbs[ uVDev * 2 ];
+					pReads->apcbPending[ uVDev * 2 + 1 ] = &pReads->aiocbs[ uVDev * 2 + 1 ];
 				}
+				++pReads->numPending;
+				--numMissing;
+			}
+		}
 
-				if( nvlist_add_uint64( nvlHole, ZPOOL_CONFIG_ID, auHoles[ uHole ] ) )
-				{
-					syslog( LOG_ERR, "Failed to set hole nvlist config id %" PRIu64 ".", auHoles[ uHole ] );
-					numHoles = uHole;	//Only clean up what was created so far
-					goto ERROR_AFTER_HOLES;
-				}
+		//Vdevs that are already read may make the missing ones unnecessary
+		if( ( eResult = CollectVDevReads( &pool, pfnConfig, pUser ) ) != VDEVSCAN_CONTINUE )
+			goto ERROR_WHILE_READING;
 
-				aTlVDev[ auHoles[ uHole ] ].nvl = nvlHole;
-			}
+		if( !numMissing )
+			break;
 
-			//The template did not have the config id set (needed to be added per copy). Complete it.
-			if( nvlist_add_uint64( nvlHole, ZPOOL_CONFIG_ID, auHoles[ 0 ] ) )
+		//Watch first, then check again, so no vdev can appear unnoticed in between. While reads are in progress, wake up regularly to process them.
+		if( fdNotify < 0 )
+		{
+			if( ( fdNotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC ) ) < 0 )
 			{
-				syslog( LOG_ERR, "Failed to set hole nvlist config id %" PRIu64 ".", auHoles[ 0 ] );
-				goto ERROR_AFTER_HOLES;
+				Log( LOG_ERR, "Failed to initialize inotify to wait for vdevs." );
+				goto ERROR_WHILE_READING;
 			}
+
+			Log( LOG_INFO, "Waiting up to %d seconds for %u vdevs to appear.", VDEV_WAIT_TIMEOUT, numMissing );
+		}
+		else if( !WaitForVDevEvents( fdNotify, &tsDeadline, pReads->numPending ? VDEV_POLL_INTERVAL : -1 ) )
+		{
+			for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev )
+				if( pReads->aeState[ uVDev ] == VDEVREAD_MISSING )
+					Log( LOG_ERR, "VDev \"%s\" did not appear within %d seconds.", pReads->aszVDevs[ uVDev ], VDEV_WAIT_TIMEOUT );
+			goto ERROR_WHILE_READING;
 		}
 
-		//Compress the list of top-level vdevs in preparation for insertion into the pool config
-		unsigned numMissing = 0;
-		nvlist_t **const anvlChildren = (nvlist_t **) aTlVDev;
-		for( uint64_t uChild = 0; uChild < numChildren; ++uChild )
-			if( !( anvlChildren[ uChild ] = aTlVDev[ uChild ].nvl ) )
-				++numMissing;
+		if( !WatchMissingVDevs( fdNotify, pReads->aszVDevs, numVDevs, pReads->aeState ) )
+			goto ERROR_WHILE_READING;
+	}
 
+	//All vdevs are being read. Process them in the order they complete, so a slow disk doesn't hold up the others.
+	while( pReads->numPending )
+	{
+		if( aio_suspend( pReads->apcbPending, (int) numVDevs * 2, NULL ) && errno != EINTR && errno != EAGAIN )
 		{
-			//Fill missing children with dummy vdevs. This entails data loss and should not happen normally.
-			nvlist_t *anvlMissing[ numMissing ];
-			if( numMissing )
-			{
-				syslog( LOG_WARNING, "%u top-level vdevs are missing!", numMissing );
+			Log( LOG_ERR, "Failed to wait for vdev labels." );
+			goto ERROR_WHILE_READING;
+		}
 
-				for( unsigned uMissing = 0; uMissing < numMissing; ++uMissing )
-				{
-					nvlist_t *nvlMissing;
-					if( nvlist_alloc( &nvlMissing, NV_UNIQUE_NAME, 0 ) )
-					{
-						syslog( LOG_ERR, "Failed to allocate nvlist for missing top-level vdev." );
-						numMissing = uMissing;	//Only clean up what was created so far
-						goto ERROR_AFTER_MISSING;
-					}
-					anvlMissing[ uMissing ] = nvlMissing;	//Ensure cleanup will cover the config in case of error
+		if( ( eResult = CollectVDevReads( &pool, pfnConfig, pUser ) ) != VDEVSCAN_CONTINUE )
+			goto ERROR_WHILE_READING;
+	}
 
-					if( nvlist_add_string( nvlMissing, ZPOOL_CONFIG_TYPE, VDEV_TYPE_MISSING ) )
-					{
-						syslog( LOG_ERR, "Failed to set missing vdev type." );
-						numMissing = uMissing + 1;	//Only clean up what was created so far
-						goto ERROR_AFTER_MISSING;
-					}
+	fSuccess = true;
 
-					if( nvlist_add_uint64( nvlMissing, ZPOOL_CONFIG_GUID, 0ULL ) )
-					{
-						syslog( LOG_ERR, "Failed to set missing vdev guid." );
-						numMissing = uMissing + 1;	//Only clean up what was created so far
-						goto ERROR_AFTER_MISSING;
-					}
-				}
+ERROR_WHILE_READING:
+	if( eResult == VDEVSCAN_DONE )
+		fSuccess = true;
+	if( fdNotify >= 0 )
+		close( fdNotify );
+	StopUnpackPool( &pool );
+	KeepVDevTimings( pContext, pReads );
 
-				//Patch the missing vdevs
-				unsigned uMissing = 0;
-				for( uint64_t uChild = 0; uChild < numChildren; ++uChild )
-				{
-					if( anvlChildren[ uChild ] )
-						continue;
+	if( !pReads->numPending )
+	{
+		(void) ReapVDevReads( pReads );
+		return fSuccess;
+	}
 
-					anvlChildren[ uChild ] = anvlMissing[ uMissing++ ];
-				}
-			}
+	//Reads still in progress write into the label buffer. Let a detached thread wait for them instead of the caller.
+	if( eResult == VDEVSCAN_DONE )
+		Log( LOG_INFO, "Pool configuration complete, not waiting for the labels of %u more vdevs.", pReads->numPending );
 
-			//At this point, anvlChildren is a complete array of numChildren children. Create the pool side of the vdev configuration
+	for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev )
+		if( pReads->aeState[ uVDev ] == VDEVREAD_PENDING )
+			(void) aio_cancel( pReads->aiocbs[ uVDev * 2 ].aio_fildes, NULL );
 
-			//Create the root vdev
-			nvlist_t *nvlRoot;
-			if( nvlist_alloc( &nvlRoot, NV_UNIQUE_NAME, 0 ) )
-			{
-				syslog( LOG_ERR, "Failed to create root vdev." );
-				goto ERROR_AFTER_MISSING;
-			}
+	pthread_attr_t attr;
+	pthread_t thread;
+	bool fReaper = !pthread_attr_init( &attr );
+	if( fReaper )
+	{
+		(void) pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+		pthread_mutex_lock( &g_mutexReapers );
+		if( ( fReaper = !pthread_create( &thread, &attr, ReapVDevReadsDetached, pReads ) ) )
+			++g_numReapers;
+		pthread_mutex_unlock( &g_mutexReapers );
+		pthread_attr_destroy( &attr );
+	}
+	if( !fReaper )
+		(void) ReapVDevReads( pReads );
+	return fSuccess;
+}
 
-			//Add the array of children into the root vdev
-			if( nvlist_add_nvlist_array( nvlRoot, ZPOOL_CONFIG_CHILDREN, (const nvlist_t **) anvlChildren, numChildren ) )
-			{
-				syslog( LOG_ERR, "Failed to add children to root vdev." );
-				nvlist_free( nvlRoot );
-				goto ERROR_AFTER_MISSING;
-			}
+/*!
+	\brief Checks that the vdev config \p nvl of the vdev \p uVDev belongs to the pool \p szPool with id \p idPool.
+	\details The label of a SPARE or L2CACHE device names no pool, only its own guid. It passes here and is matched against the pool config after TRYIMPORT (see UpdateImportConfig).
+	\note Only reads its arguments, so it may run on several unpack threads at once.
+*/
+static bool ValidateVDevConfig( const char *const szzVDevs, const unsigned uVDev, const nvlist_t *const nvl, const char *const szPool, const uint64_t idPool )
+{
+	//Spare and L2ARC devices only need their guid
+	{
+		uint64_t eState;
+		if( nvlist_lookup_uint64( nvl, "state", &eState ) )
+		{
+			Log( LOG_ERR, "Failed to lookup vdev state for \"%s\".", GetVDevName( szzVDevs, uVDev ) );
+			return false;
+		}
 
-			//Cleanup of all temporary data - everything is now contained in nvlRoot and nvlPool
+		if( eState == POOL_STATE_SPARE || eState == POOL_STATE_L2CACHE )
+		{
+			uint64_t guid;
+			if( nvlist_lookup_uint64( nvl, ZPOOL_CONFIG_GUID, &guid ) )
 			{
-				for( unsigned uMissing = 0; uMissing < numMissing; ++uMissing )
-					nvlist_free( anvlMissing[ uMissing ] );
-				for( uint uHole = 0; uHole < numHoles; ++uHole )
-					nvlist_free( anvlHoles[ uHole ] );
-				free( aTlVDev );
-				for( ; uVDev < numVDevs; ++uVDev )
-					nvlist_free( anvlRedundant[ uVDev ] );
+				Log( LOG_ERR, "Failed to lookup guid of %s device \"%s\".", eState == POOL_STATE_SPARE ? "spare" : "cache", GetVDevName( szzVDevs, uVDev ) );
+				return false;
 			}
+			return true;
+		}
+	}
 
-			if( nvlist_add_string( nvlRoot, ZPOOL_CONFIG_TYPE, VDEV_TYPE_ROOT ) )
-			{
-				syslog( LOG_ERR, "Failed to set type of root vdev." );
-				goto ERROR_AFTER_ROOT;
-			}
-			
-			if( nvlist_add_uint64( nvlRoot, ZPOOL_CONFIG_ID, 0ULL ) )
-			{
-				syslog( LOG_ERR, "Failed to set id of root vdev." );
-				goto ERROR_AFTER_ROOT;
-			}
-			
-			if( nvlist_add_uint64( nvlRoot, ZPOOL_CONFIG_GUID, *pidPool ) )
+	//Ensure the vdev belongs to the correct pool by name
+	{
+		const char *szVDevPool;
+		if( nvlist_lookup_string( nvl, "name", &szVDevPool ) )
+		{
+			Log( LOG_ERR, "Failed to lookup vdev name for \"%s\".", GetVDevName( szzVDevs, uVDev ) );
+			return false;
+		}
+
+		if( strcmp( szPool, szVDevPool ) )
+		{
+			Log( LOG_ERR, "VDev \"%s\" is a member of pool \"%s\", not \"%s\".", GetVDevName( szzVDevs, uVDev ), szVDevPool, szPool );
+			return false;
+		}
+	}
+
+	//Ensure the vdev belongs to the correct pool by id
+	{
+		uint64_t idVDevPool;
+		if( nvlist_lookup_uint64( nvl, "pool_guid", &idVDevPool ) )
+		{
+			Log( LOG_ERR, "Failed to lookup vdev pool_guid for \"%s\".", GetVDevName( szzVDevs, uVDev ) );
+			return false;
+		}
+
+#ifdef DISABLE_ID_CHECK
+		(void) idVDevPool;
+		(void) idPool;
+#else
+		if( idPool != idVDevPool )
+		{
+			Log( LOG_ERR, "VDev \"%s\" is a member of pool with id %" PRIu64 ", not %" PRIu64 ".", GetVDevName( szzVDevs, uVDev ), idVDevPool, idPool );
+			return false;
+		}
+#endif
+	}
+
+	return true;
+}
+
+static bool IsHole( const uint64_t uChild, const uint64_t *const auHoles, const uint_t numHoles )
+{
+	for( uint_t uHole = 0; uHole < numHoles; ++uHole )
+		if( auHoles[ uHole ] == uChild )
+			return true;
+	return false;
+}
+
+typedef struct tlvdev_s
+{
+	uint64_t uTxg;
+	nvlist_t *nvl;
+	size_t numPacked;
+	unsigned uVDev;		//The vdev nvl was taken from
+} tlvdev_t;
+
+/*!
+	\brief A spare or L2ARC device among the vdevs.
+*/
+typedef struct auxvdev_s
+{
+	uint64_t guid;
+	const char *szPath;
+	bool fSpare;
+} auxvdev_t;
+
+/*!
+	\brief State of LoadPoolConfig while the vdev configs arrive.
+*/
+typedef struct poolscan_s
+{
+	const char *szzVDevs;
+	const char *szPool;
+	uint64_t *pidPool;
+	nvlist_t **anvl;		//Vdev configs kept, per vdev
+	bool *afCollected;		//Per vdev, whether its config arrived already
+	tlvdev_t *aTlVDev;		//References into anvl, per top-level vdev id
+	size_t numAllocated;
+	uint64_t uMaxTxg;
+	nvlist_t *nvlLatest;	//The vdev config with the highest txg overall
+	unsigned uLatest;		//The vdev nvlLatest was taken from
+	auxvdev_t *aAux;		//Spare and L2ARC devices, in vdev order
+	unsigned numAux;
+} poolscan_t;
+
+/*!
+	\brief Looks up the leaf with the path \p szPath in the vdev tree \p nvl.
+	\return The leaf, or \c NULL if the tree has no leaf of that path.
+*/
+static nvlist_t *FindVDevLeaf( nvlist_t *const nvl, const char *const szPath )
+{
+	nvlist_t **anvlChildren;
+	uint_t numChildren;
+	if( nvlist_lookup_nvlist_array( nvl, ZPOOL_CONFIG_CHILDREN, &anvlChildren, &numChildren ) )
+	{
+		const char *szLeaf;
+		return !nvlist_lookup_string( nvl, ZPOOL_CONFIG_PATH, &szLeaf ) && !strcmp( szLeaf, szPath ) ? nvl : NULL;
+	}
+
+	for( uint_t uChild = 0; uChild < numChildren; ++uChild )
+	{
+		nvlist_t *const nvlLeaf = FindVDevLeaf( anvlChildren[ uChild ], szPath );
+		if( nvlLeaf )
+			return nvlLeaf;
+	}
+	return NULL;
+}
+
+/*!
+	\brief Checks whether the vdev tree entry \p nvlLeaf is of a leaf the pool doesn't write its labels to anymore, i.e. one that can't have a newer config.
+*/
+static bool IsVDevLeafStale( const nvlist_t *const nvlLeaf )
+{
+	uint64_t u;
+	return ( !nvlist_lookup_uint64( nvlLeaf, ZPOOL_CONFIG_OFFLINE, &u ) && u ) || ( !nvlist_lookup_uint64( nvlLeaf, ZPOOL_CONFIG_FAULTED, &u ) && u ) ||
+		( !nvlist_lookup_uint64( nvlLeaf, ZPOOL_CONFIG_REMOVED, &u ) && u );
+}
+
+/*!
+	\brief Checks whether every top-level vdev of the latest config has a config of its own, i.e. the other vdevs are not needed anymore.
+	\details The configs of all top-level vdevs need to be of the latest txg. A top-level vdev with an older one may have been changed since, e.g. by a stale mirror member being read first.
+		Further, no leaf of a chosen top-level vdev may still be pending, as its label may hold a newer config. Leaves which are offline, faulted or removed are exempt, their labels are not written anymore.
+		Neither may any other vdev be pending. The vdev labels don't list the spare and L2ARC devices, so each of them could be one.
+*/
+static bool IsPoolScanComplete( const poolscan_t *const pScan )
+{
+	uint64_t numChildren;
+	if( nvlist_lookup_uint64( pScan->nvlLatest, ZPOOL_CONFIG_VDEV_CHILDREN, &numChildren ) )
+		return false;
+
+	uint64_t *auHoles;
+	uint_t numHoles;
+	if( nvlist_lookup_uint64_array( pScan->nvlLatest, ZPOOL_CONFIG_HOLE_ARRAY, &auHoles, &numHoles ) )
+		numHoles = 0;
+
+	for( uint64_t uChild = 0; uChild < numChildren; ++uChild )
+		if( !IsHole( uChild, auHoles, numHoles ) && ( uChild >= pScan->numAllocated || !pScan->aTlVDev[ uChild ].nvl || pScan->aTlVDev[ uChild ].uTxg < pScan->uMaxTxg ) )
+			return false;
+
+	unsigned uVDev = 0;
+	for( const char *szVDev = pScan->szzVDevs; *szVDev; szVDev += strlen( szVDev ) + 1, ++uVDev )
+	{
+		if( pScan->afCollected[ uVDev ] )
+			continue;
+
+		//A pending vdev which is no leaf of the vdev tree may be a spare or L2ARC device, which TRYIMPORT needs to know of
+		const nvlist_t *nvlLeaf = NULL;
+		for( uint64_t uChild = 0; uChild < numChildren && !nvlLeaf; ++uChild )
+			if( !IsHole( uChild, auHoles, numHoles ) )
+				nvlLeaf = FindVDevLeaf( pScan->aTlVDev[ uChild ].nvl, szVDev );
+
+		if( !nvlLeaf || !IsVDevLeafStale( nvlLeaf ) )
+			return false;
+	}
+
+	return true;
+}
+
+/*!
+	\brief Validates the config of a vdev on the unpack thread that unpacked it.
+*/
+static bool CheckPoolVDev( const unsigned uVDev, const nvlist_t *const nvl, const void *const pUser )
+{
+	const poolscan_t *const pScan = pUser;
+	return ValidateVDevConfig( pScan->szzVDevs, uVDev, nvl, pScan->szPool, *pScan->pidPool );
+}
+
+/*!
+	\brief Merges the top-level vdev of an already validated vdev config into the table of LoadPoolConfig.
+	\details Among configs with the same txg, the one of the lower vdev index wins. Together with ReadVDevConfigs handing over the configs of a batch in ascending order, the outcome doesn't depend on the number of unpack threads.
+*/
+static vdevscan_t CollectPoolVDev( const unsigned uVDev, nvlist_t *const nvlVDev, void *const pUser )
+{
+	poolscan_t *const pScan = pUser;
+	pScan->afCollected[ uVDev ] = true;
+	if( !nvlVDev )
+		return VDEVSCAN_CONTINUE;
+
+	pScan->anvl[ uVDev ] = nvlVDev;
+
+	//Spare and L2ARC devices are not part of the vdev tree. They are remembered for the config TRYIMPORT returns, but don't make the pool any more complete.
+	uint64_t eState;
+	if( !nvlist_lookup_uint64( nvlVDev, ZPOOL_CONFIG_POOL_STATE, &eState ) && ( eState == POOL_STATE_SPARE || eState == POOL_STATE_L2CACHE ) )
+	{
+		if( !( pScan->numAux % 8 ) )
+		{
+			auxvdev_t *const p = realloc( pScan->aAux, ( pScan->numAux + 8 ) * sizeof( auxvdev_t ) );
+			if( !p )
 			{
-				syslog( LOG_ERR, "Failed to set guid of root vdev." );
-				goto ERROR_AFTER_ROOT;
+				Log( LOG_ERR, "Failed to allocate memory for spare and cache device list." );
+				return VDEVSCAN_ERROR;
 			}
+			pScan->aAux = p;
+		}
+
+		auxvdev_t *const pAux = &pScan->aAux[ pScan->numAux++ ];
+		pAux->szPath = GetVDevName( pScan->szzVDevs, uVDev );
+		pAux->fSpare = eState == POOL_STATE_SPARE;
+		(void) nvlist_lookup_uint64( nvlVDev, ZPOOL_CONFIG_GUID, &pAux->guid );	//Checked by ValidateVDevConfig
+		nvlist_free( nvlVDev );
+		pScan->anvl[ uVDev ] = NULL;
+		return VDEVSCAN_CONTINUE;
+	}
+
+	//Fetch the vdev tree from the disk vdev
+	nvlist_t *nvl;
+	if( nvlist_lookup_nvlist( nvlVDev, ZPOOL_CONFIG_VDEV_TREE, &nvl ) )
+	{
+		Log( LOG_ERR, "Failed to lookup vdev_tree for \"%s\".", GetVDevName( pScan->szzVDevs, uVDev ) );
+		return VDEVSCAN_ERROR;
+	}
+
+	uint64_t idChild;
+	if( nvlist_lookup_uint64( nvl, "id", &idChild ) )
+	{
+		Log( LOG_ERR, "Failed to lookup vdev child id for \"%s\".", GetVDevName( pScan->szzVDevs, uVDev ) );
+		return VDEVSCAN_ERROR;
+	}
+
+	//If the child id is larger than the array we currently have, reserve some more space
+	if( idChild >= pScan->numAllocated )
+	{
+		size_t numAllocated = pScan->numAllocated;
+		do
+		{
+			numAllocated += 32;
+		} while( idChild >= numAllocated );
+
+		tlvdev_t *const p = realloc( pScan->aTlVDev, numAllocated * sizeof( tlvdev_t ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for top-level vdev list." );
+			return VDEVSCAN_ERROR;
+		}
+
+		memset( p + pScan->numAllocated, 0, ( numAllocated - pScan->numAllocated ) * sizeof( tlvdev_t ) );
+		pScan->aTlVDev = p;
+		pScan->numAllocated = numAllocated;
+	}
+
+	//Check if this top-level vdev has a higher transaction group than what was previously found
+	uint64_t uTxg;
+	if( nvlist_lookup_uint64( nvlVDev, ZPOOL_CONFIG_POOL_TXG, &uTxg ) )
+	{
+		Log( LOG_ERR, "Failed to lookup vdev txg for \"%s\".", GetVDevName( pScan->szzVDevs, uVDev ) );
+		return VDEVSCAN_ERROR;
+	}
+
+	const tlvdev_t *const pTlVDev = &pScan->aTlVDev[ idChild ];
+	if( pTlVDev->nvl && ( pTlVDev->uTxg > uTxg || ( pTlVDev->uTxg == uTxg && pTlVDev->uVDev < uVDev ) ) )
+	{
+		//There is a vdev with same or larger transaction group already in the child slot. Therefore it also can't be the largest overall txg.
+		nvlist_free( nvlVDev );
+		pScan->anvl[ uVDev ] = NULL;
+		return VDEVSCAN_CONTINUE;
+	}
+
+	//Transaction group is the current largest for this child, save a reference (not a copy yet!) to it.
+	pScan->aTlVDev[ idChild ].uTxg = uTxg;
+	pScan->aTlVDev[ idChild ].nvl = nvl;
+	pScan->aTlVDev[ idChild ].uVDev = uVDev;
+
+	//Check if is the largest transaction group overall
+	if( !pScan->nvlLatest || pScan->uMaxTxg < uTxg || ( pScan->uMaxTxg == uTxg && uVDev < pScan->uLatest ) )
+	{
+		pScan->uMaxTxg = uTxg;
+		pScan->nvlLatest = nvlVDev;
+		pScan->uLatest = uVDev;
+	}
+
+	return IsPoolScanComplete( pScan ) ? VDEVSCAN_DONE : VDEVSCAN_CONTINUE;
+}
+
+static unsigned long GetHostID( void )
+{
+	FILE *const f = fopen( "/proc/sys/kernel/spl/hostid", "re" );
+	if( !f )
+	{
+		Log( LOG_ERR, "Failed to open spl file for host id." );
+		return 0;
+	}
+
+	unsigned long uHostID;
+	if( fscanf( f, "%lx", &uHostID ) != 1 )
+	{
+		Log( LOG_ERR, "Failed to retrieve host id." );
+		uHostID = 0;
+	}
+
+	fclose( f );
+	return uHostID;
+}
+
+/*!
+	\brief	Loads the vdev configurations for the list \p szzVDevs, then creates the pool configuration associated with them.
+	\param szzVDevs A list of vdev paths. VDevs are separated with NULL-terminators, the list itself is finalized with a second NULL-terminators (i.e. doubly terminated at the end).
+	\return The pool configuration packed as NV_ENCODE_NATIVE, allocated with malloc. Its size is stored in \p pnumPacked.
+	\details	Aside from errors that may occur from i/o or kernel communication, the function will purposely fail if a vdev doesn't belong to the pool \p szPool with id \p pidPool.
+		SPARE and L2CACHE vdevs don't become part of the configuration, but are returned in \p paAux.
+		Vdevs are processed as their labels arrive. Once every top-level vdev has a config of the latest txg, only the leaves the pool doesn't write to anymore are not waited for (see IsPoolScanComplete).
+	\param pMMP	If not \c NULL, a pool last imported by another host and not exported is checked for activity first (see CheckPoolActivity). The result is stored here and passed on in the configuration.
+	\param pStatic	Optional preallocated reads of the vdevs in \p szzVDevs (see ReadVDevConfigs).
+	\param paAux	If not \c NULL, receives the spare and L2ARC devices found among the vdevs, allocated with malloc, and \p pnumAux their number.
+*/
+static char *LoadPoolConfig( zt_context_t *const pContext, const char *const szzVDevs, zt_vdevreads_t *const pStatic, const char *const szPool, uint64_t *const pidPool, mmpcheck_t *const pMMP,
+	auxvdev_t **const paAux, unsigned *const pnumAux, size_t *const pnumPacked )
+{
+	const unsigned numVDevs = pStatic ? pStatic->numVDevs : CountStrings( szzVDevs );
+	nvlist_t *anvlRedundant[ numVDevs ];
+	memset( anvlRedundant, 0, sizeof( anvlRedundant ) );
+	bool afCollected[ numVDevs ];
+	memset( afCollected, 0, sizeof( afCollected ) );
+
+	//At this point, we have one vdev config per physical device. All of these belong to the same pool, but not necessarily describe the same top-level vdev.
+	//The pool could for example consist of multiple raidz* vdevs, each with severel vdevs (one per disk).
+	//The array aTlVDev will contain the list of top-level vdevs (only the vdev_tree section of the disk's vdevs).
+	//Since we have multiple entries per top-level vdev in anvlRedundant, we pick the one with the highest transaction group. This is to prevent old disks re-inserted from corrupting the pool config.
+	//Further, we need the full disk vdev with highest overall transaction group to create the pool config. This is handled separately via uMaxTxg and nvlLatest.
+	//aTlVDev grows as the configs arrive, so nothing is allocated before the first read is submitted.
+	poolscan_t scan = { .szzVDevs = szzVDevs, .szPool = szPool, .pidPool = pidPool, .anvl = anvlRedundant, .afCollected = afCollected };
+	if( !ReadVDevConfigs( pContext, szzVDevs, numVDevs, pStatic, CheckPoolVDev, CollectPoolVDev, &scan ) )
+		goto ERROR_AFTER_TLVDEV;
+
+	if( !scan.nvlLatest )
+	{
+		Log( LOG_ERR, "None of the vdevs has a valid pool label." );
+		goto ERROR_AFTER_TLVDEV;
+	}
+
+#ifdef DISABLE_ID_CHECK
+	//Without an expected id, the pool is the one of the latest label
+	if( nvlist_lookup_uint64( scan.nvlLatest, "pool_guid", pidPool ) )
+	{
+		Log( LOG_ERR, "Failed to lookup pool_guid of the latest vdev config." );
+		goto ERROR_AFTER_TLVDEV;
+	}
+#endif
+
+	tlvdev_t *const aTlVDev = scan.aTlVDev;
+	const size_t numAllocated = scan.numAllocated;
+	nvlist_t *const nvlLatest = scan.nvlLatest;
+
+	//At this point, we have
+	//- nvlLatest as the latest overall disk vdev
+	//- aTlVDev as an array of references into the vdev_tree below vdevs in anvlRedundant
+	//Rather than assembling a pool nvlist from copies of these and packing it afterwards, the proto pool configuration is encoded directly into the buffer handed to the kernel.
+	//The chosen vdev_tree entries are packed in place from the vdev configs.
 
-			if( nvlist_add_nvlist( nvlPool, ZPOOL_CONFIG_VDEV_TREE, nvlRoot ) )
+	//Using nvlLatest, gather the basic properties of the pool configuration
+	uint64_t uVersion;
+	if( nvlist_lookup_uint64( nvlLatest, ZPOOL_CONFIG_VERSION, &uVersion ) )
+	{
+		Log( LOG_ERR, "Failed to retrieve pool version." );
+		goto ERROR_AFTER_TLVDEV;
+	}
+
+	uint64_t eState;
+	if( nvlist_lookup_uint64( nvlLatest, ZPOOL_CONFIG_POOL_STATE, &eState ) )
+	{
+		Log( LOG_ERR, "Failed to retrieve pool state." );
+		goto ERROR_AFTER_TLVDEV;
+	}
+
+	uint64_t numChildren;
+	if( nvlist_lookup_uint64( nvlLatest, ZPOOL_CONFIG_VDEV_CHILDREN, &numChildren ) )
+	{
+		Log( LOG_ERR, "Failed to retrieve pool vdev_children." );
+		goto ERROR_AFTER_TLVDEV;
+	}
+
+	const char *szComment;
+	if( nvlist_lookup_string( nvlLatest, ZPOOL_CONFIG_COMMENT, &szComment ) )
+		szComment = NULL;
+
+	const char *szCompatibility;
+	if( nvlist_lookup_string( nvlLatest, ZPOOL_CONFIG_COMPATIBILITY, &szCompatibility ) )
+		szCompatibility = NULL;
+
+	uint64_t idHost;
+	const bool fHostID = !nvlist_lookup_uint64( nvlLatest, ZPOOL_CONFIG_HOSTID, &idHost );
+
+	const char *szHostName;
+	if( nvlist_lookup_string( nvlLatest, ZPOOL_CONFIG_HOSTNAME, &szHostName ) )
+		szHostName = NULL;
+
+	uint64_t *auHoles;
+	uint_t numHoles;
+	if( nvlist_lookup_uint64_array( nvlLatest, ZPOOL_CONFIG_HOLE_ARRAY, &auHoles, &numHoles ) )
+	{
+		auHoles = NULL;
+		numHoles = 0;
+	}
+
+	//Determine the packed size of each top-level vdev. Holes and children without any vdev get placeholders, the latter entails data loss and should not happen normally.
+	unsigned numMissing = 0;
+	for( uint64_t uChild = 0; uChild < numChildren; ++uChild )
+	{
+		if( IsHole( uChild, auHoles, numHoles ) )
+			continue;
+
+		if( uChild >= numAllocated || !aTlVDev[ uChild ].nvl )
+		{
+			++numMissing;
+			continue;
+		}
+
+		if( nvlist_size( aTlVDev[ uChild ].nvl, &aTlVDev[ uChild ].numPacked, NV_ENCODE_NATIVE ) )
+		{
+			Log( LOG_ERR, "Failed to get size of top-level vdev %" PRIu64 ".", uChild );
+			goto ERROR_AFTER_TLVDEV;
+		}
+	}
+
+	if( numMissing )
+		Log( LOG_WARNING, "%u top-level vdevs are missing!", numMissing );
+
+	//The kernel checks a multihost pool for activity if it was last imported by another host and not exported. Waiting here instead allows faster polling.
+	mmpcheck_t mmp = { 0 };
+	if( pMMP && eState == POOL_STATE_ACTIVE )
+	{
+		const unsigned long uLocalHostID = GetHostID( );
+		if( uLocalHostID && uLocalHostID != ( fHostID ? idHost : 0 ) && !CheckPoolActivity( szzVDevs, szPool, &mmp ) )
+			goto ERROR_AFTER_TLVDEV;
+		*pMMP = mmp;
+	}
+
+	//Encode twice: the first pass only sums up the size, the second one writes into a buffer of exactly that size
+	nvpacker_t packer = { .pBuffer = NULL, .numUsed = 0 };
+	for( unsigned uPass = 0; uPass < 2; ++uPass )
+	{
+		if( uPass )
+		{
+			if( !( packer.pBuffer = malloc( packer.numUsed ) ) )
 			{
-				syslog( LOG_ERR, "Failed to add root vdev to pool config." );
-				nvlist_free( nvlRoot );
-				nvlist_free( nvlPool );
+				Log( LOG_ERR, "Failed to allocate memory for packed pool configuration." );
+				goto ERROR_AFTER_TLVDEV;
 			}
+			*pnumPacked = packer.numUsed;
+			packer.numUsed = 0;
+		}
 
-			nvlist_free( nvlRoot );
-			return nvlPool;
+		NVPackHeader( &packer );
+		NVPackListBegin( &packer );
+		NVPackUInt64( &packer, ZPOOL_CONFIG_VERSION, uVersion );
+		NVPackUInt64( &packer, ZPOOL_CONFIG_POOL_GUID, *pidPool );
+		NVPackString( &packer, ZPOOL_CONFIG_POOL_NAME, szPool );
+		if( szComment )
+			NVPackString( &packer, ZPOOL_CONFIG_COMMENT, szComment );
+		if( szCompatibility )
+			NVPackString( &packer, ZPOOL_CONFIG_COMPATIBILITY, szCompatibility );
+		NVPackUInt64( &packer, ZPOOL_CONFIG_POOL_STATE, eState );
+		if( fHostID )
+			NVPackUInt64( &packer, ZPOOL_CONFIG_HOSTID, idHost );
+		if( szHostName )
+			NVPackString( &packer, ZPOOL_CONFIG_HOSTNAME, szHostName );
+		if( numHoles )
+			NVPackUInt64Array( &packer, ZPOOL_CONFIG_HOLE_ARRAY, auHoles, numHoles );
+		NVPackUInt64( &packer, ZPOOL_CONFIG_VDEV_CHILDREN, numChildren );
+		if( mmp.uTxg )
+		{
+			NVPackUInt64( &packer, ZPOOL_CONFIG_TIMESTAMP, mmp.uTimestamp );
+			NVPackNVList( &packer, ZPOOL_CONFIG_LOAD_INFO );
+			NVPackUInt64( &packer, ZPOOL_CONFIG_MMP_TXG, mmp.uTxg );
+			NVPackUInt16( &packer, ZPOOL_CONFIG_MMP_SEQ, mmp.uSeq );
+			NVPackListEnd( &packer );
+		}
 
-ERROR_AFTER_ROOT:
-			nvlist_free( nvlRoot );
-			nvlist_free( nvlPool );
-			return NULL;
+		//The root vdev with all top-level vdevs as children
+		NVPackNVList( &packer, ZPOOL_CONFIG_VDEV_TREE );
+		NVPackString( &packer, ZPOOL_CONFIG_TYPE, VDEV_TYPE_ROOT );
+		NVPackUInt64( &packer, ZPOOL_CONFIG_ID, 0ULL );
+		NVPackUInt64( &packer, ZPOOL_CONFIG_GUID, *pidPool );
+		NVPackNVListArray( &packer, ZPOOL_CONFIG_CHILDREN, (uint_t) numChildren );
+		for( uint64_t uChild = 0; uChild < numChildren; ++uChild )
+		{
+			const bool fHole = IsHole( uChild, auHoles, numHoles );
+			if( !fHole && uChild < numAllocated && aTlVDev[ uChild ].nvl )
+			{
+				if( !NVPackEmbedded( &packer, aTlVDev[ uChild ].nvl, aTlVDev[ uChild ].numPacked ) )
+				{
+					Log( LOG_ERR, "Failed to pack top-level vdev %" PRIu64 ".", uChild );
+					goto ERROR_AFTER_PACKED;
+				}
+				continue;
+			}
 
-ERROR_AFTER_MISSING:
-			for( unsigned uMissing = 0; uMissing < numMissing; ++uMissing )
-				nvlist_free( anvlMissing[ uMissing ] );
+			NVPackListBegin( &packer );
+			NVPackString( &packer, ZPOOL_CONFIG_TYPE, fHole ? VDEV_TYPE_HOLE : VDEV_TYPE_MISSING );
+			NVPackUInt64( &packer, ZPOOL_CONFIG_ID, uChild );
+			NVPackUInt64( &packer, ZPOOL_CONFIG_GUID, 0ULL );
+			NVPackListEnd( &packer );
 		}
-ERROR_AFTER_HOLES:
-		for( uint uHole = 0; uHole < numHoles; ++uHole )
-			nvlist_free( anvlHoles[ uHole ] );
+		NVPackListEnd( &packer );	//vdev_tree
+		NVPackListEnd( &packer );	//Pool configuration
 	}
-ERROR_AFTER_POOL:
-	nvlist_free( nvlPool );
-ERROR_AFTER_TLVDEV:
+	assert( packer.numUsed == *pnumPacked );
+	assert( NVPackVerify( packer.pBuffer, packer.numUsed ) );
+
+	//Cleanup of all temporary data - everything is now contained in the packed configuration
 	free( aTlVDev );
-ERROR_AFTER_VDEV:
-	for( ; uVDev < numVDevs; ++uVDev )
+	for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev )
+		nvlist_free( anvlRedundant[ uVDev ] );
+	if( paAux )
+	{
+		*paAux = scan.aAux;
+		*pnumAux = scan.numAux;
+	}
+	else
+		free( scan.aAux );
+	return packer.pBuffer;
+
+ERROR_AFTER_PACKED:
+	free( packer.pBuffer );
+ERROR_AFTER_TLVDEV:
+	free( scan.aTlVDev );
+	free( scan.aAux );
+	for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev )
 		nvlist_free( anvlRedundant[ uVDev ] );
 	return NULL;
 }
 
-static unsigned long GetHostID( void )
+/*!
+	\brief Looks up \p szPool in the configurations of the imported pools.
+	\return 1 if the pool is imported, 0 if not and -1 on error, including a different pool of the same name being imported.
+*/
+static int IsPoolImported( const int fdZFS, const char *const szPool, const uint64_t idPool )
 {
-	FILE *const f = fopen( "/proc/sys/kernel/spl/hostid", "re" );
-	if( !f )
+	int iResult = -1;
+	zfs_cmd_t zc = { 0 };
+	zc.zc_nvlist_dst_size = CONFIG_BUF_MINSIZE;
+
+	for( ;; )
 	{
-		syslog( LOG_ERR, "Failed to open spl file for host id." );
-		return 0;
+		if( !( zc.zc_nvlist_dst = (uint64_t) calloc( 1, zc.zc_nvlist_dst_size ) ) )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for imported pool configurations." );
+			return -1;
+		}
+
+		//A zero generation always returns the configurations
+		zc.zc_cookie = 0;
+		if( lzc_ioctl_fd( fdZFS, ZFS_IOC_POOL_CONFIGS, &zc ) != -1 )
+			break;
+
+		free( (void *) zc.zc_nvlist_dst );
+		if( errno != ENOMEM )
+		{
+			Log( LOG_ERR, "Failed to retrieve imported pool configurations. Error code %d.", errno );
+			return -1;
+		}
+		//The kernel updated zc_nvlist_dst_size with the actual size needed
+	}
+
+	nvscan_t scanConfigs, scanPool;
+	if( !NVScanOpen( &scanConfigs, (void *) zc.zc_nvlist_dst, zc.zc_nvlist_dst_size ) )
+		Log( LOG_ERR, "Imported pool configurations are not natively encoded." );
+	else if( !NVScanLookupNVList( &scanConfigs, szPool, &scanPool ) )
+		iResult = 0;
+	else
+	{
+#ifdef DISABLE_ID_CHECK
+		(void) idPool;
+		iResult = 1;
+#else
+		uint64_t idImported;
+		if( !NVScanLookupUInt64( &scanPool, ZPOOL_CONFIG_POOL_GUID, &idImported ) )
+			Log( LOG_ERR, "Failed to retrieve pool_guid of imported pool \"%s\".", szPool );
+		else if( idImported != idPool )
+			Log( LOG_ERR, "A different pool named \"%s\" (id %" PRIu64 ") is already imported.", szPool, idImported );
+		else
+			iResult = 1;
+#endif
 	}
 
-	unsigned long uHostID;
-	if( fscanf( f, "%lx", &uHostID ) != 1 )
+	free( (void *) zc.zc_nvlist_dst );
+	return iResult;
+}
+
+/*!
+	\brief Points the spare or L2ARC devices in \p szArray of the vdev tree \p nvlRoot to the paths they were found at, matched by guid.
+	\details The pool config only keeps the paths the devices had when it was last written. Like zpool import, the paths are fixed up before IMPORT,
+		so a renamed device is still attached (and a persistent L2ARC rebuilt) right away. Devices of \p aAux not in the pool config are ignored.
+*/
+static bool UpdateAuxVDevPaths( nvlist_t *const nvlRoot, const char *const szArray, const bool fSpare, const auxvdev_t *const aAux, const unsigned numAux, bool *const afMatched )
+{
+	nvlist_t **anvl;
+	uint_t numEntries;
+	if( nvlist_lookup_nvlist_array( nvlRoot, szArray, &anvl, &numEntries ) )
+		return true;
+
+	for( uint_t uEntry = 0; uEntry < numEntries; ++uEntry )
 	{
-		syslog( LOG_ERR, "Failed to retrieve host id." );
-		uHostID = 0;
+		uint64_t guid;
+		if( nvlist_lookup_uint64( anvl[ uEntry ], ZPOOL_CONFIG_GUID, &guid ) )
+			continue;
+
+		for( unsigned uAux = 0; uAux < numAux; ++uAux )
+		{
+			if( aAux[ uAux ].fSpare != fSpare || aAux[ uAux ].guid != guid )
+				continue;
+
+			if( nvlist_add_string( anvl[ uEntry ], ZPOOL_CONFIG_PATH, aAux[ uAux ].szPath ) )
+				return false;
+			afMatched[ uAux ] = true;
+			break;
+		}
 	}
 
-	fclose( f );
-	return uHostID;
+	return true;
 }
 
 /*!
-	\param szzVDevs A list of vdev paths. VDevs are separated with NULL-terminators, the list itself is finalized with a second NULL-terminators (i.e. doubly terminated at the end).
+	\brief Updates the configuration returned by TRYIMPORT, which is passed to IMPORT in \p zc, with what was found before TRYIMPORT.
+	\details If \p pMMP holds a txg, the result of the activity check is added to the load_info. Otherwise IMPORT would check the pool for activity once more.
+		The kernel compares the values with the uberblock it loads, so a pool that changed in between is still checked.
+		The paths of the spare and L2ARC devices \p aAux are updated by UpdateAuxVDevPaths.
 */
-bool ImportPool( const int fdZFS, const char *const szzVDevs, const char *const szPool, uint64_t idPool )
+static bool UpdateImportConfig( zfs_cmd_t *const zc, const mmpcheck_t *const pMMP, const auxvdev_t *const aAux, const unsigned numAux, nv_alloc_t *const nva )
 {
-	//Load the configuration from the vdevs, then perform the first import step (TRYIMPORT)
-	nvlist_t *nvlPool = LoadPoolConfig( szzVDevs, szPool, &idPool );
-	if( !nvlPool )
+	nvlist_t *nvlPool;
+	if( nvlist_xunpack( (char *) zc->zc_nvlist_conf, zc->zc_nvlist_conf_size, &nvlPool, nva ) )
+	{
+		Log( LOG_ERR, "Failed to unpack proto-pool configuration." );
 		return false;
+	}
 
-	zfs_cmd_t zc = { 0 };
+	bool fSuccess = false;
+	nvlist_t *nvlLoadInfo;
+	if( pMMP->uTxg && ( nvlist_lookup_nvlist( nvlPool, ZPOOL_CONFIG_LOAD_INFO, &nvlLoadInfo )
+		|| nvlist_add_uint64( nvlLoadInfo, ZPOOL_CONFIG_MMP_TXG, pMMP->uTxg )
+		|| nvlist_add_uint16( nvlLoadInfo, ZPOOL_CONFIG_MMP_SEQ, pMMP->uSeq ) ) )
+	{
+		Log( LOG_ERR, "Failed to add activity check to pool configuration." );
+		goto ERROR_AFTER_POOL;
+	}
 
-	//Pack proto config and free the source
+	if( numAux )
 	{
-		static_assert( sizeof( size_t ) == sizeof( zc.zc_nvlist_conf_size ) );
-		if( nvlist_size( nvlPool, &zc.zc_nvlist_conf_size, NV_ENCODE_NATIVE ) )
+		nvlist_t *nvlRoot;
+		bool afMatched[ numAux ];
+		memset( afMatched, 0, sizeof( afMatched ) );
+		if( nvlist_lookup_nvlist( nvlPool, ZPOOL_CONFIG_VDEV_TREE, &nvlRoot )
+			|| !UpdateAuxVDevPaths( nvlRoot, ZPOOL_CONFIG_SPARES, true, aAux, numAux, afMatched )
+			|| !UpdateAuxVDevPaths( nvlRoot, ZPOOL_CONFIG_L2CACHE, false, aAux, numAux, afMatched ) )
 		{
-			syslog( LOG_ERR, "Failed to get size of pool configuration." );
-			goto ERROR_AFTER_POOL;	//zc_nvlist_conf and zc_nvlist_dst are both NULL, so free will just ignore them. 
+			Log( LOG_ERR, "Failed to update spare and cache devices of pool configuration." );
+			goto ERROR_AFTER_POOL;
 		}
 
-		if( !( zc.zc_nvlist_conf = (uint64_t) malloc( zc.zc_nvlist_conf_size ) ) )
-		{
-			syslog( LOG_ERR, "Failed to allocate memory for packed pool configuration." );
-			goto ERROR_AFTER_POOL;	//zc_nvlist_conf and zc_nvlist_dst are both NULL, so free will just ignore them.
-		}
+		for( unsigned uAux = 0; uAux < numAux; ++uAux )
+			if( !afMatched[ uAux ] )
+				Log( LOG_WARNING, "%s device \"%s\" is not part of the pool, ignoring it.", aAux[ uAux ].fSpare ? "Spare" : "Cache", aAux[ uAux ].szPath );
+	}
 
-		if( nvlist_pack( nvlPool, (char **) &zc.zc_nvlist_conf, &zc.zc_nvlist_conf_size, NV_ENCODE_NATIVE, 0 ) )
-		{
-			syslog( LOG_ERR, "Failed to pack pool configuration." );
-			goto ERROR_AFTER_CONF;
-		}
+	size_t numPacked;
+	char *pPacked;
+	if( nvlist_size( nvlPool, &numPacked, NV_ENCODE_NATIVE ) )
+	{
+		Log( LOG_ERR, "Failed to size pool configuration." );
+		goto ERROR_AFTER_POOL;
+	}
 
-		nvlist_free( nvlPool );
+	if( !( pPacked = malloc( numPacked ) ) )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for pool configuration." );
+		goto ERROR_AFTER_POOL;
+	}
+
+	if( nvlist_pack( nvlPool, &pPacked, &numPacked, NV_ENCODE_NATIVE, 0 ) )
+	{
+		Log( LOG_ERR, "Failed to pack pool configuration." );
+		free( pPacked );
+		goto ERROR_AFTER_POOL;
+	}
+
+	free( (void *) zc->zc_nvlist_conf );
+	zc->zc_nvlist_conf = (uint64_t) pPacked;
+	zc->zc_nvlist_conf_size = numPacked;
+	fSuccess = true;
+
+ERROR_AFTER_POOL:
+	nvlist_free( nvlPool );
+	return fSuccess;
+}
+
+/*!
+	\brief Implements ImportPool and ImportPoolStatic, \p pStatic being NULL for the former.
+*/
+static bool ImportPoolVDevs( zt_context_t *const pContext, const char *const szzVDevs, zt_vdevreads_t *const pStatic, const char *const szPool, uint64_t idPool )
+{
+	CONTEXT_SCOPE( pContext );
+	const int fdZFS = pContext->fdZFS;
+
+	switch( IsPoolImported( fdZFS, szPool, idPool ) )
+	{
+	case 1:
+		Log( LOG_INFO, "Pool \"%s\" is already imported.", szPool );
+		return true;
+	case -1:
+		return false;
 	}
 
+	//Load the configuration from the vdevs, then perform the first import step (TRYIMPORT)
+	mmpcheck_t mmp = { 0 };
+	auxvdev_t *aAux = NULL;
+	unsigned numAux = 0;
+	zfs_cmd_t zc = { 0 };
+	static_assert( sizeof( size_t ) == sizeof( zc.zc_nvlist_conf_size ) );
+	if( !( zc.zc_nvlist_conf = (uint64_t) LoadPoolConfig( pContext, szzVDevs, pStatic, szPool, &idPool, &mmp, &aAux, &numAux, &zc.zc_nvlist_conf_size ) ) )
+		goto ERROR_AFTER_ARENA;
+
 	//Allocate space for the nvlist returned by the kernel
 	uint64_t uDstSize = zc.zc_nvlist_dst_size = MAX( CONFIG_BUF_MINSIZE, zc.zc_nvlist_conf_size * 32 );
 	zc.zc_nvlist_dst = (uint64_t) calloc( 1, zc.zc_nvlist_dst_size );
 	if( !zc.zc_nvlist_dst )
 	{
-		syslog( LOG_ERR, "Failed to allocate memory for imported pool configuration." );
+		Log( LOG_ERR, "Failed to allocate memory for imported pool configuration." );
 		goto ERROR_AFTER_CONF;
 	}
 
@@ -816,124 +1596,127 @@ TRYIMPORT_CONFIG:
 			zc.zc_nvlist_dst = (uint64_t) calloc( 1, zc.zc_nvlist_dst_size );
 			if( !zc.zc_nvlist_dst )
 			{
-				syslog( LOG_ERR, "Failed to allocate memory for imported proto-pool configuration." );
+				Log( LOG_ERR, "Failed to allocate memory for imported proto-pool configuration." );
 				goto ERROR_AFTER_CONF;
 			}
 			uDstSize = zc.zc_nvlist_dst_size;
 			goto TRYIMPORT_CONFIG;
 		default:
-			syslog( LOG_ERR, "Failed to import proto-pool. Error code %d.", errno );
+			Log( LOG_ERR, "Failed to import proto-pool. Error code %d.", errno );
 			goto ERROR_AFTER_DST;
 		}
 
-	//Unpack the pool configuration
-	if( nvlist_unpack( (void *) zc.zc_nvlist_dst, zc.zc_nvlist_dst_size, &nvlPool, 0 ) )
+	//Check the few values needed directly in the packed configuration. It is passed on to IMPORT as is, so there is no need to unpack it.
+	nvscan_t scanPool;
+	if( !NVScanOpen( &scanPool, (void *) zc.zc_nvlist_dst, zc.zc_nvlist_dst_size ) )
 	{
-		syslog( LOG_ERR, "Failed to unpack imported pool configuration." );
+		Log( LOG_ERR, "Imported pool configuration is not natively encoded." );
 		goto ERROR_AFTER_DST;
 	}
 	
 	//Check for supported version
 	{
 		uint64_t uVersion;
-		if( nvlist_lookup_uint64( nvlPool, ZPOOL_CONFIG_VERSION, &uVersion ) )
+		if( !NVScanLookupUInt64( &scanPool, ZPOOL_CONFIG_VERSION, &uVersion ) )
 		{
-			syslog( LOG_ERR, "Failed to retrieve pool version." );
-			goto ERROR_AFTER_POOL;
+			Log( LOG_ERR, "Failed to retrieve pool version." );
+			goto ERROR_AFTER_DST;
 		}
 
 		if( !SPA_VERSION_IS_SUPPORTED( uVersion ) )
 		{
-			syslog( LOG_ERR, "Cannot import '%s': pool is formatted using an unsupported ZFS version", szPool );
-			goto ERROR_AFTER_POOL;
+			Log( LOG_ERR, "Cannot import '%s': pool is formatted using an unsupported ZFS version", szPool );
+			goto ERROR_AFTER_DST;
 		}
 	}
 
 	//Check if the pool is importable
 	{
-		nvlist_t *nvlLoadInfo;
-		if( nvlist_lookup_nvlist( nvlPool, ZPOOL_CONFIG_LOAD_INFO, &nvlLoadInfo ) )
+		nvscan_t scanLoadInfo;
+		if( !NVScanLookupNVList( &scanPool, ZPOOL_CONFIG_LOAD_INFO, &scanLoadInfo ) )
 		{
-			syslog( LOG_ERR, "Failed to retrieve load info from pool." );
-			goto ERROR_AFTER_POOL;
+			Log( LOG_ERR, "Failed to retrieve load info from pool." );
+			goto ERROR_AFTER_DST;
 		}
 
 		//Ensure that the pool belongs to the current system
 		{
 			uint64_t eState;
-			if( nvlist_lookup_uint64( nvlPool, ZPOOL_CONFIG_POOL_STATE, &eState ) )
+			if( !NVScanLookupUInt64( &scanPool, ZPOOL_CONFIG_POOL_STATE, &eState ) )
 			{
-				syslog( LOG_ERR, "Failed to retrieve pool state." );
-				goto ERROR_AFTER_POOL;
+				Log( LOG_ERR, "Failed to retrieve pool state." );
+				goto ERROR_AFTER_DST;
 			}
 
 			if( eState == POOL_STATE_EXPORTED )
 			{
 				uint64_t uHostID;
-				if( nvlist_lookup_uint64( nvlLoadInfo, ZPOOL_CONFIG_HOSTID, &uHostID ) )
+				if( !NVScanLookupUInt64( &scanLoadInfo, ZPOOL_CONFIG_HOSTID, &uHostID ) )
 				{
 					//The hostid on LOAD_INFO comes from the MOS label via spa_tryimport().
 					//If its not there then we're likely talking to an older kernel, so use the top one.
-					if( nvlist_lookup_uint64( nvlPool, ZPOOL_CONFIG_HOSTID, &uHostID ) )
+					if( !NVScanLookupUInt64( &scanPool, ZPOOL_CONFIG_HOSTID, &uHostID ) )
 					{
-						syslog( LOG_ERR, "Failed to retrieve hostid from pool." );
-						goto ERROR_AFTER_POOL;
+						Log( LOG_ERR, "Failed to retrieve hostid from pool." );
+						goto ERROR_AFTER_DST;
 					}
 				}
 
 				const unsigned long uLocalHostID = GetHostID( );
 				if( !uLocalHostID )
-					goto ERROR_AFTER_POOL;
+					goto ERROR_AFTER_DST;
 
 				if( uHostID != uLocalHostID )
 				{
-					syslog( LOG_ERR, "The pool \"%s\" was exported on a different system. Please use the zpool tool to import.", szPool );
-					goto ERROR_AFTER_POOL;
+					Log( LOG_ERR, "The pool \"%s\" was exported on a different system. Please use the zpool tool to import.", szPool );
+					goto ERROR_AFTER_DST;
 				}
 			}
 		}
 
-		//Check the Multi-Modifier Protection (MMP) state
+		//Check the Multi-Modifier Protection (MMP) state. It is only present if the kernel ran an activity check of its own.
 		{
 			uint64_t eMMP;
-			if( !nvlist_lookup_uint64( nvlLoadInfo, ZPOOL_CONFIG_MMP_STATE, &eMMP ) )
+			if( NVScanLookupUInt64( &scanLoadInfo, ZPOOL_CONFIG_MMP_STATE, &eMMP ) )
 			{
+				if( eMMP == MMP_STATE_NO_HOSTID )
+				{
+					Log( LOG_ERR, "The multihost pool \"%s\" can only be imported with a host id set (see zgenhostid).", szPool );
+					goto ERROR_AFTER_DST;
+				}
+
 				if( eMMP != MMP_STATE_INACTIVE )
 				{
-					syslog( LOG_ERR, "The pool has Multi-Mode Protection (MMP) enabled. This is currently not supported by this importer." );
-					goto ERROR_AFTER_POOL;
+					const char *szHostName;
+					uint64_t uHostID;
+					if( !NVScanLookupString( &scanLoadInfo, ZPOOL_CONFIG_MMP_HOSTNAME, &szHostName ) )
+						szHostName = "unknown";
+					if( !NVScanLookupUInt64( &scanLoadInfo, ZPOOL_CONFIG_MMP_HOSTID, &uHostID ) )
+						uHostID = 0;
+					Log( LOG_ERR, "The pool \"%s\" is in use by host \"%s\" (hostid %" PRIx64 ").", szPool, szHostName, uHostID );
+					goto ERROR_AFTER_DST;
 				}
+
+				//The kernel's own check results are in the load_info already
+				mmp.uTxg = 0;
 			}
 		}
 	}
 
-	//Pack pool config and free the source
+	//Hand the configuration returned by TRYIMPORT to IMPORT by swapping buffers. The proto config is no longer needed.
+	free( (void *) zc.zc_nvlist_conf );
+	zc.zc_nvlist_conf = zc.zc_nvlist_dst;
+	zc.zc_nvlist_conf_size = zc.zc_nvlist_dst_size;
+	if( !( zc.zc_nvlist_dst = (uint64_t) calloc( 1, uDstSize ) ) )
 	{
-		static_assert( sizeof( size_t ) == sizeof( zc.zc_nvlist_conf_size ) );
-		if( nvlist_size( nvlPool, &zc.zc_nvlist_conf_size, NV_ENCODE_NATIVE ) )
-		{
-			syslog( LOG_ERR, "Failed to get size of pool configuration." );
-			goto ERROR_AFTER_POOL;
-		}
-
-		void *const p = realloc( (void *) zc.zc_nvlist_conf, zc.zc_nvlist_conf_size );
-		if( !p )
-		{
-			syslog( LOG_ERR, "Failed to allocate memory for packed pool configuration." );
-			goto ERROR_AFTER_POOL;
-		}
-		zc.zc_nvlist_conf = (uint64_t) p;
-
-		if( nvlist_pack( nvlPool, (char **) &zc.zc_nvlist_conf, &zc.zc_nvlist_conf_size, NV_ENCODE_NATIVE, 0 ) )
-		{
-			syslog( LOG_ERR, "Failed to pack pool configuration." );
-			goto ERROR_AFTER_CONF;
-		}
-
-		nvlist_free( nvlPool );
+		Log( LOG_ERR, "Failed to allocate memory for imported pool configuration." );
+		goto ERROR_AFTER_CONF;
 	}
 
 	zc.zc_nvlist_dst_size = uDstSize;
+	if( ( mmp.uTxg || numAux ) && !UpdateImportConfig( &zc, &mmp, aAux, numAux, &pContext->nva ) )
+		goto ERROR_AFTER_DST;
+
 	zc.zc_guid = idPool;
 	(void) strlcpy( zc.zc_name, szPool, sizeof( zc.zc_name ) );
 
@@ -948,12 +1731,12 @@ IMPORT_CONFIG:
 			zc.zc_nvlist_dst = (uint64_t) calloc( 1, zc.zc_nvlist_dst_size );
 			if( !zc.zc_nvlist_dst )
 			{
-				syslog( LOG_ERR, "Failed to allocate memory for imported pool configuration." );
+				Log( LOG_ERR, "Failed to allocate memory for imported pool configuration." );
 				goto ERROR_AFTER_CONF;
 			}
 			goto IMPORT_CONFIG;
 		default:
-			syslog( LOG_ERR, "Failed to import pool. Error code %d.", errno );
+			Log( LOG_ERR, "Failed to import pool. Error code %d.", errno );
 			goto ERROR_AFTER_DST;
 		}
 
@@ -961,39 +1744,61 @@ IMPORT_CONFIG:
 #if 0
 	{
 		//Unpack the pool configuration
+		nvlist_t *nvlPool;
 		if( nvlist_unpack( (void *) zc.zc_nvlist_dst, zc.zc_nvlist_dst_size, &nvlPool, 0 ) )
 		{
-			syslog( LOG_ERR, "Failed to unpack imported pool configuration." );
+			Log( LOG_ERR, "Failed to unpack imported pool configuration." );
 			goto ERROR_AFTER_DST;
 		}
 
 		puts( "Imported configuration:" );
-		print_nvlist( nvlPool, 1 );
 		fflush( stdout );
+		(void) DumpNVList( STDOUT_FILENO, nvlPool, DUMP_TEXT );
 		nvlist_free( nvlPool );
 	}
 #endif
 
 	free( (void *) zc.zc_nvlist_dst );
 	free( (void *) zc.zc_nvlist_conf );
+	free( aAux );
+	ContextResetScratch( pContext );
 	return true;
 
-ERROR_AFTER_POOL:
-	nvlist_free( nvlPool );
 ERROR_AFTER_DST:
 	free( (void *) zc.zc_nvlist_dst );
 ERROR_AFTER_CONF:
 	free( (void *) zc.zc_nvlist_conf );
+ERROR_AFTER_ARENA:
+	free( aAux );
+	ContextResetScratch( pContext );
 	return false;
 }
 
+/*!
+	\param szzVDevs A list of vdev paths. VDevs are separated with NULL-terminators, the list itself is finalized with a second NULL-terminators (i.e. doubly terminated at the end).
+	\details If the pool is imported already (e.g. by a previous, partially failed run), nothing is done.
+*/
+bool ImportPool( zt_context_t *const pContext, const char *const szzVDevs, const char *const szPool, uint64_t idPool )
+{
+	return ImportPoolVDevs( pContext, szzVDevs, NULL, szPool, idPool );
+}
+
+/*!
+	\brief Like ImportPool, for vdevs defined at build time using ZT_VDEV_READS. Reads the labels into the static buffers of \p pReads,
+		so neither the vdev list is scanned nor memory is allocated before the first read is submitted.
+*/
+bool ImportPoolStatic( zt_context_t *const pContext, zt_vdevreads_t *const pReads, const char *const szPool, uint64_t idPool )
+{
+	return ImportPoolVDevs( pContext, pReads->szzVDevs, pReads, szPool, idPool );
+}
+
 /*!
 	\param zc	Command structure with pre-filled \c zc_name field and \c NULL or pre-allocated (using calloc) \c zc_nvlist_dst with matching \c zc_nvlist_dst_size field. Further fields dependent on \p uCommand.
 	\details	If the \p zc \c zc_nvlist_dst field is too small, it is re-allocated to a matching buffer (overriding \c zc_nvlist_dst_size).
 				If an error occurs, the \c zc_nvlist_dst field is freed.
 	\warning Manipulates and/or frees \p zc \c zc_nvlist_dst! See detailed function description for more info.
 */
-static nvlist_t *LoadStats( const int fdZFS, const unsigned long uCommand, zfs_cmd_t *const zc, const size_t uNameLength )
+static nvlist_t *LoadStats( const int fdZFS, const unsigned long uCommand, zfs_cmd_t *const zc, const size_t uNameLength, nv_alloc_t *const nva )
 {
 	/*
 		ZFS_IOC_DATASET_LIST_NEXT will use the member zc_name and return the next child dataset below.
@@ -1016,7 +1821,7 @@ TRYIMPORT_CONFIG:
 			zc->zc_nvlist_dst = (uint64_t) calloc( 1, zc->zc_nvlist_dst_size );
 			if( !zc->zc_nvlist_dst )
 			{
-				syslog( LOG_ERR, "Failed to allocate memory for dataset listing." );
+				Log( LOG_ERR, "Failed to allocate memory for dataset listing." );
 				return NULL;
 			}
 
@@ -1026,19 +1831,19 @@ TRYIMPORT_CONFIG:
 			uDstSize = zc->zc_nvlist_dst_size;
 			goto TRYIMPORT_CONFIG;
 		case ENOENT:
-			syslog( LOG_ERR, "Failed to list datasets: the underlying dataset has been removed." );
+			Log( LOG_ERR, "Failed to list datasets: the underlying dataset has been removed." );
 			free( (void *) zc->zc_nvlist_dst );
 			return NULL;
 		default:
-			syslog( LOG_ERR, "Failed to list datasets. Error code %d.", errno );
+			Log( LOG_ERR, "Failed to list datasets. Error code %d.", errno );
 			free( (void *) zc->zc_nvlist_dst );
 			return NULL;
 		}
 
 	nvlist_t *nvl;
-	if( nvlist_unpack( (void *) zc->zc_nvlist_dst, zc->zc_nvlist_dst_size, &nvl, 0 ) )
+	if( nvlist_xunpack( (void *) zc->zc_nvlist_dst, zc->zc_nvlist_dst_size, &nvl, nva ) )
 	{
-		syslog( LOG_ERR, "Failed to unpack imported pool configuration." );
+		Log( LOG_ERR, "Failed to unpack imported pool configuration." );
 		free( (void *) zc->zc_nvlist_dst );
 		return NULL;
 	}
@@ -1050,7 +1855,7 @@ TRYIMPORT_CONFIG:
 /*!
 	\param szPath	The path to create. On error, this string is shortened to the subpath that failed.
 */
-static int mkdirp( char *szPath, mode_t mode )
+int MakePath( char *szPath, mode_t mode )
 {
 	for( char *pSeparator = szPath[ 0 ] == '/' ? szPath + 1 : szPath; *pSeparator; ++pSeparator )
 	{
@@ -1067,27 +1872,33 @@ static int mkdirp( char *szPath, mode_t mode )
 	return mkdir( szPath, mode );
 }
 
-static bool MountDataset( const char *const szDataset, nvlist_t *const nvl, const char *const szAlternateRoot, const size_t lenAlternateRoot, const bool fReadonly )
+/*!
+	\brief Validates the properties \p nvl of \p szDataset and determines where the dataset is to be mounted.
+	\param pszMountPoint	Receives the mountpoint (to be released using free), or \c NULL if the dataset is not to be mounted (e.g. canmount=off or mountpoint=none).
+*/
+bool GetMountPoint( const char *const szDataset, nvlist_t *const nvl, const char *const szAlternateRoot, const size_t lenAlternateRoot, char **const pszMountPoint )
 {
+	*pszMountPoint = NULL;
+
 	//Ensure that the encryption key (if needed) is loaded
 	{
 		nvlist_t *nvlKeystatus;
 		if( nvlist_lookup_nvlist( (nvlist_t *) nvl, "keystatus", &nvlKeystatus ) )
 		{
-			syslog( LOG_ERR, "Failed to find keystatus property for dataset \"%s\".", szDataset );
+			Log( LOG_ERR, "Failed to find keystatus property for dataset \"%s\".", szDataset );
 			return false;
 		}
 
 		uint64_t eKeyStatus;
 		if( nvlist_lookup_uint64( nvlKeystatus, ZPROP_VALUE, &eKeyStatus ) )
 		{
-			syslog( LOG_ERR, "Failed to find keystatus value for dataset \"%s\".", szDataset );
+			Log( LOG_ERR, "Failed to find keystatus value for dataset \"%s\".", szDataset );
 			return false;
 		}
 
 		if( eKeyStatus == ZFS_KEYSTATUS_UNAVAILABLE )
 		{
-			syslog( LOG_ERR, "Dataset \"%s\" requires a key that isn't loaded.", szDataset );
+			Log( LOG_ERR, "Dataset \"%s\" requires a key that isn't loaded.", szDataset );
 			return false;
 		}
 	}
@@ -1100,7 +1911,7 @@ static bool MountDataset( const char *const szDataset, nvlist_t *const nvl, cons
 			uint64_t eCanMount;
 			if( nvlist_lookup_uint64( nvlCanMount, ZPROP_VALUE, &eCanMount ) )
 			{
-				syslog( LOG_ERR, "Failed to find canmount value for dataset \"%s\".", szDataset );
+				Log( LOG_ERR, "Failed to find canmount value for dataset \"%s\".", szDataset );
 				return false;
 			}
 
@@ -1114,7 +1925,7 @@ static bool MountDataset( const char *const szDataset, nvlist_t *const nvl, cons
 		nvlist_t *nvlRedacted;
 		if( !nvlist_lookup_nvlist( (nvlist_t *) nvl, "redacted", &nvlRedacted ) )
 		{
-			syslog( LOG_ERR, "Dataset \"%s\" is redacted. This feature is currently not supported by this importer.", szDataset );
+			Log( LOG_ERR, "Dataset \"%s\" is redacted. This feature is currently not supported by this importer.", szDataset );
 			return false;
 		}
 	}
@@ -1127,13 +1938,13 @@ static bool MountDataset( const char *const szDataset, nvlist_t *const nvl, cons
 			uint64_t fZoned;
 			if( nvlist_lookup_uint64( nvlZoned, ZPROP_VALUE, &fZoned ) )
 			{
-				syslog( LOG_ERR, "Failed to find zoned value for dataset \"%s\".", szDataset );
+				Log( LOG_ERR, "Failed to find zoned value for dataset \"%s\".", szDataset );
 				return false;
 			}
 
 			if( fZoned )
 			{
-				syslog( LOG_ERR, "Dataset \"%s\" is zoned. This feature is currently not supported by this importer.", szDataset );
+				Log( LOG_ERR, "Dataset \"%s\" is zoned. This feature is currently not supported by this importer.", szDataset );
 				return false;
 			}
 		}
@@ -1145,14 +1956,14 @@ static bool MountDataset( const char *const szDataset, nvlist_t *const nvl, cons
 		nvlist_t *nvlMountPoint;
 		if( nvlist_lookup_nvlist( (nvlist_t *) nvl, "mountpoint", &nvlMountPoint ) )
 		{
-			syslog( LOG_ERR, "Failed to find mountpoint property for dataset \"%s\".", szDataset );
+			Log( LOG_ERR, "Failed to find mountpoint property for dataset \"%s\".", szDataset );
 			return false;
 		}
 
 		const char *szValue;
 		if( nvlist_lookup_string( nvlMountPoint, ZPROP_VALUE, &szValue ) )
 		{
-			syslog( LOG_ERR, "Failed to find mountpoint value for dataset \"%s\".", szDataset );
+			Log( LOG_ERR, "Failed to find mountpoint value for dataset \"%s\".", szDataset );
 			return false;
 		}
 
@@ -1161,45 +1972,72 @@ static bool MountDataset( const char *const szDataset, nvlist_t *const nvl, cons
 
 		if( !strcmp( szValue, "legacy" ) )
 		{
-			syslog( LOG_ERR, "Dataset \"%s\" uses unsupported \"legacy\" mountpoint.", szDataset );
+			Log( LOG_ERR, "Dataset \"%s\" uses unsupported \"legacy\" mountpoint.", szDataset );
 			return false;
 		}
 
 		const char *szSource;
 		if( nvlist_lookup_string( nvlMountPoint, ZPROP_SOURCE, &szSource ) )
 		{
-			syslog( LOG_ERR, "Failed to find mountpoint source for dataset \"%s\".", szDataset );
+			Log( LOG_ERR, "Failed to find mountpoint source for dataset \"%s\".", szDataset );
 			return false;
 		}
 
 		if( !strcmp( szSource, ZPROP_SOURCE_VAL_RECVD ) )
 		{
-			syslog( LOG_ERR, "Failed to find mountpoint source for dataset \"%s\": Received datasets are currently not supported by this importer.", szDataset );
+			Log( LOG_ERR, "Failed to find mountpoint source for dataset \"%s\": Received datasets are currently not supported by this importer.", szDataset );
 			return false;
 		}
 
 		const char *const szRelativePath = szDataset + strlen( szSource );
 		if( strncmp( szDataset, szSource, strlen( szSource ) ) || szRelativePath[ 0 ] != '\0' && szRelativePath[ 0 ] != '/' )
 		{
-			syslog( LOG_ERR, "Mountpoint source for dataset \"%s\" is corrupted.", szDataset );
+			Log( LOG_ERR, "Mountpoint source for dataset \"%s\" is corrupted.", szDataset );
 			return false;
 		}
 
 		const size_t lenValue = strlen( szValue );
 		const size_t lenRelativePath = strlen( szRelativePath );
-		szMountPoint = alloca( lenAlternateRoot + lenValue + lenRelativePath + 1 );
+		if( !( szMountPoint = malloc( lenAlternateRoot + lenValue + lenRelativePath + 1 ) ) )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for mountpoint of dataset \"%s\".", szDataset );
+			return false;
+		}
 		memcpy( szMountPoint, szAlternateRoot, lenAlternateRoot );
 		memcpy( szMountPoint + lenAlternateRoot, szValue, lenValue );
 		memcpy( szMountPoint + lenAlternateRoot + lenValue, szRelativePath, lenRelativePath );
 		szMountPoint[ lenAlternateRoot + lenValue + lenRelativePath ] = '\0';
 	}
 
+	*pszMountPoint = szMountPoint;
+	return true;
+}
+
+/*!
+	\brief Mounts \p szDataset at \p szMountPoint. The path is created if needed, an existing directory must be empty.
+	\param pMounted	If not \c NULL, the dataset is appended to this list once mounted.
+	\param pExisting	Datasets mounted before the operation started. These are skipped, and not added to \p pMounted. May be \c NULL.
+*/
+bool MountAt( const char *const szDataset, char *const szMountPoint, const bool fReadonly, const mountset_t *const pExisting, mountlist_t *const pMounted )
+{
+	if( pExisting )
+	{
+		const char *const szMounted = MountSetFind( pExisting, szDataset );
+		if( szMounted )
+		{
+			if( strcmp( szMounted, szMountPoint ) )
+				Log( LOG_WARNING, "Dataset \"%s\" is already mounted at \"%s\" instead of \"%s\".", szDataset, szMounted, szMountPoint );
+			NotifyMounted( szDataset, szMounted );
+			return true;
+		}
+	}
+
 	//Ensure the path exists
-	if( mkdirp( szMountPoint, 0755 ) )
+	if( MakePath( szMountPoint, 0755 ) )
 	{
 		if( errno != EEXIST )
 		{
-			syslog( LOG_ERR, "Failed to create path for mountpoint: \"%s\".", szMountPoint );
+			Log( LOG_ERR, "Failed to create path for mountpoint: \"%s\".", szMountPoint );
 			return false;
 		}
 
@@ -1208,7 +2046,7 @@ static bool MountDataset( const char *const szDataset, nvlist_t *const nvl, cons
 			DIR *const dir = opendir( szMountPoint );
 			if( !dir )
 			{
-				syslog( LOG_ERR, "Failed to check if directory \"%s\" is empty.", szMountPoint );
+				Log( LOG_ERR, "Failed to check if directory \"%s\" is empty.", szMountPoint );
 				return false;
 			}
 
@@ -1216,7 +2054,7 @@ static bool MountDataset( const char *const szDataset, nvlist_t *const nvl, cons
 			for( struct dirent *pDirEnt; pDirEnt = readdir( dir ); )
 				if( ++numEntries > 2 )
 				{
-					syslog( LOG_ERR, "Mounting directory \"%s\" is not empty.", szMountPoint );
+					Log( LOG_ERR, "Mounting directory \"%s\" is not empty.", szMountPoint );
 					closedir( dir );
 					return false;
 				}
@@ -1225,95 +2063,275 @@ static bool MountDataset( const char *const szDataset, nvlist_t *const nvl, cons
 		}
 	}
 
-	if( mount( szDataset, szMountPoint, MNTTYPE_ZFS, 0, NULL ) )
+	if( mount( szDataset, szMountPoint, MNTTYPE_ZFS, fReadonly ? MS_RDONLY : 0, NULL ) )
 	{
-		syslog( LOG_ERR, "Failed to mount dataset \"%s\".", szDataset );
+		Log( LOG_ERR, "Failed to mount dataset \"%s\".", szDataset );
 		return false;
 	}
 
-	syslog( LOG_INFO, "Dataset \"%s\" mounted at \"%s\".", szDataset, szMountPoint );
+	Log( LOG_INFO, "Dataset \"%s\" mounted at \"%s\".", szDataset, szMountPoint );
+
+	if( pMounted && !MountListAdd( pMounted, szDataset, szMountPoint ) )
+	{
+		//Without an entry, the mount couldn't be rolled back later on. Undo it right away.
+		(void) umount2( szMountPoint, 0 );
+		return false;
+	}
 
 	//TODO: zfs_share_one
 
+	NotifyMounted( szDataset, szMountPoint );
 	return true;
 }
 
-/*!
-	\param zc	Command structure with pre-filled \c zc_name field and \c NULL or pre-allocated (using calloc) \c zc_nvlist_dst with matching \c zc_nvlist_dst_size field.
-	\details If the \p zc \c zc_nvlist_dst field is too small, it is re-allocated to a matching buffer (overriding \c zc_nvlist_dst_size).
-		If an error occurs, the \c zc_nvlist_dst field is freed.
-	\warning Manipulates and/or frees \p zc \c zc_nvlist_dst! See detailed function description for more info.
+/*
+	The dataset iterator walks the pool depth-first (parents before children) without recursion.
+	Each stack frame holds the name length of a dataset whose children are being listed and the cookie of the next child.
+	The name of the current dataset is kept in zc_name, so truncating it to a frame's length restores that frame's parent name.
 */
-static bool MountChildren( const int fdZFS, zfs_cmd_t *const zc, const uint16_t uNameLength )
+
+typedef struct datasetframe_s
 {
-	static_assert( UINT16_MAX >= sizeof( zc->zc_name ) );
-	for( nvlist_t *nvl; nvl = LoadStats( fdZFS, ZFS_IOC_DATASET_LIST_NEXT, zc, uNameLength ); )
-	{
-		if( !MountDataset( zc->zc_name, nvl, NULL, 0, false ) )
-			goto ERROR_AFTER_NVL;
-		nvlist_free( nvl );
+	uint64_t uCookie;
+	uint16_t uNameLength;
+} datasetframe_t;
 
-		//Mount all children of the current dataset
-		const uint64_t uCookie = zc->zc_cookie;
-		zc->zc_cookie = 0;	//Start with the first child
-		if( !MountChildren( fdZFS, zc, (uint16_t) strlen( zc->zc_name ) ) )
+struct zt_datasetiter_s
+{
+	zt_context_t *pContext;
+	zfs_cmd_t zc;
+	nv_alloc_t nva;
+	datasetframe_t *aFrames;
+	size_t numFrames;
+	size_t numAllocated;
+	bool fRootPending;
+	bool fFailed;
+};
+
+static bool PushDatasetFrame( zt_datasetiter_t *const pIter, const uint16_t uNameLength )
+{
+	if( pIter->numFrames == pIter->numAllocated )
+	{
+		const size_t numAllocated = pIter->numAllocated ? pIter->numAllocated * 2 : 16;
+		datasetframe_t *const p = realloc( pIter->aFrames, numAllocated * sizeof( datasetframe_t ) );
+		if( !p )
+		{
+			Log( LOG_ERR, "Failed to allocate memory for dataset iterator." );
 			return false;
+		}
 
-		//All children processed. Restore the command structure for this dataset to find the next sibling
-		zc->zc_cookie = uCookie;
-		zc->zc_name[ uNameLength ] = '\0';
-		continue;
-
-ERROR_AFTER_NVL:
-		nvlist_free( nvl );
-		free( (void *) zc->zc_nvlist_dst );
-		return false;
+		pIter->aFrames = p;
+		pIter->numAllocated = numAllocated;
 	}
 
-	return errno == ESRCH;	//ESRCH indicates no more children -> Success
+	pIter->aFrames[ pIter->numFrames++ ] = (datasetframe_t) { .uCookie = 0, .uNameLength = uNameLength };
+	return true;
 }
 
-bool MountPool( int fdZFS, const char *const szPool )
+/*!
+	\brief Starts iterating over the root dataset of the imported pool \p szPool and all its descendants, parents before children.
+	\return The iterator, to be released using ZT_DatasetIterClose, or \c NULL on error.
+*/
+zt_datasetiter_t *ZT_DatasetIterOpen( zt_context_t *const pContext, const char *const szPool )
 {
-	zfs_cmd_t zc = { 0 };
+	CONTEXT_SCOPE( pContext );
+	static_assert( UINT16_MAX >= sizeof( ( (zfs_cmd_t *) NULL )->zc_name ) );
+	zt_datasetiter_t *const pIter = calloc( 1, sizeof( zt_datasetiter_t ) );
+	if( !pIter )
+	{
+		Log( LOG_ERR, "Failed to allocate memory for dataset iterator." );
+		return NULL;
+	}
+
+	//The stats of one dataset at a time live in this arena
+	if( !ArenaInit( &pIter->nva, ARENA_BLOCK_SIZE ) )
+		goto ERROR_AFTER_ITER;
+
+	if( strlcpy( pIter->zc.zc_name, szPool, sizeof( pIter->zc.zc_name ) ) >= sizeof( pIter->zc.zc_name ) )
+	{
+		Log( LOG_ERR, "Pool name \"%s\" is too long.", szPool );
+		goto ERROR_AFTER_ARENA;
+	}
 
 	//Allocate space for the nvlist returned by the kernel
-	zc.zc_nvlist_dst_size = MAX( CONFIG_BUF_MINSIZE, 256 * 1024 );
-	zc.zc_nvlist_dst = (uint64_t) calloc( 1, zc.zc_nvlist_dst_size );
-	if( !zc.zc_nvlist_dst )
+	pIter->zc.zc_nvlist_dst_size = MAX( CONFIG_BUF_MINSIZE, 256 * 1024 );
+	pIter->zc.zc_nvlist_dst = (uint64_t) calloc( 1, pIter->zc.zc_nvlist_dst_size );
+	if( !pIter->zc.zc_nvlist_dst )
 	{
-		syslog( LOG_ERR, "Failed to allocate memory for imported pool configuration." );
-		return false;
+		Log( LOG_ERR, "Failed to allocate memory for dataset listing." );
+		goto ERROR_AFTER_ARENA;
 	}
 
-	//Mount the root dataset
-	const size_t lenName = strlcpy( zc.zc_name, szPool, sizeof( zc.zc_name ) );
+	pIter->pContext = pContext;
+	pIter->fRootPending = true;
+	return pIter;
+
+ERROR_AFTER_ARENA:
+	nv_alloc_fini( &pIter->nva );
+ERROR_AFTER_ITER:
+	free( pIter );
+	return NULL;
+}
+
+/*!
+	\brief Advances \p pIter to the next dataset.
+	\param pszDataset	Receives the name of the dataset.
+	\param pnvl	Receives the properties of the dataset, as returned by the kernel.
+	\return \c false once all datasets were returned or on error. Use ZT_DatasetIterClose to tell these apart.
+	\details Both \p pszDataset and \p pnvl are only valid until the next call on \p pIter. Memory use only depends on the depth of the dataset tree.
+*/
+bool ZT_DatasetIterNext( zt_datasetiter_t *const pIter, const char **const pszDataset, nvlist_t **const pnvl )
+{
+	CONTEXT_SCOPE( pIter->pContext );
+	if( pIter->fFailed )
+		return false;
+
+	//Release the previous dataset's stats
+	nv_alloc_reset( &pIter->nva );
+
+	zfs_cmd_t *const zc = &pIter->zc;
+	if( pIter->fRootPending )
 	{
+		pIter->fRootPending = false;
+
 		//Reload the dataset to ensure that the key is now loaded
-		nvlist_t *const nvlDataset = LoadStats( fdZFS, ZFS_IOC_OBJSET_STATS, &zc, lenName );
-		if( !nvlDataset )
-			return false;	//LoadStats will clean up zc_nvlist_dst on error
+		const uint16_t uNameLength = (uint16_t) strlen( zc->zc_name );
+		nvlist_t *const nvl = LoadStats( pIter->pContext->fdZFS, ZFS_IOC_OBJSET_STATS, zc, uNameLength, &pIter->nva );
+		if( !nvl )
+			goto ERROR_AFTER_DST;	//LoadStats will clean up zc_nvlist_dst on error
 
-		if( !MountDataset( szPool, nvlDataset, NULL, 0, false ) )
+		if( !PushDatasetFrame( pIter, uNameLength ) )
+			goto ERROR;
+
+		*pszDataset = zc->zc_name;
+		*pnvl = nvl;
+		return true;
+	}
+
+	while( pIter->numFrames )
+	{
+		//Restore the command structure to list the next child of the frame's dataset
+		datasetframe_t *const pFrame = &pIter->aFrames[ pIter->numFrames - 1 ];
+		zc->zc_name[ pFrame->uNameLength ] = '\0';
+		zc->zc_cookie = pFrame->uCookie;
+
+		nvlist_t *const nvl = LoadStats( pIter->pContext->fdZFS, ZFS_IOC_DATASET_LIST_NEXT, zc, pFrame->uNameLength, &pIter->nva );
+		if( !nvl )
 		{
-			nvlist_free( nvlDataset );
-			free( (void *) zc.zc_nvlist_dst );
-			return false;
+			if( errno != ESRCH )
+				goto ERROR_AFTER_DST;	//LoadStats will clean up zc_nvlist_dst on error
+
+			//ESRCH indicates no more children
+			--pIter->numFrames;
+			continue;
 		}
 
-		nvlist_free( nvlDataset );
+		//Remember where to continue with the siblings, then descend into the children of this dataset
+		pFrame->uCookie = zc->zc_cookie;
+		if( !PushDatasetFrame( pIter, (uint16_t) strlen( zc->zc_name ) ) )
+			goto ERROR;
+
+		*pszDataset = zc->zc_name;
+		*pnvl = nvl;
+		return true;
 	}
 
-	if( !MountChildren( fdZFS, &zc, lenName ) )
-		return false;	//MountChildren (or specifically, LoadStats) will clean up zc_nvlist_dst on error
+	return false;
 
-	free( (void *) zc.zc_nvlist_dst );
-	return true;
+ERROR_AFTER_DST:
+	zc->zc_nvlist_dst = 0;
+ERROR:
+	pIter->fFailed = true;
+	return false;
+}
+
+/*!
+	\brief Releases \p pIter.
+	\return \c false if an error occured during iteration, \c true otherwise (even if the iteration was not finished).
+*/
+bool ZT_DatasetIterClose( zt_datasetiter_t *const pIter )
+{
+	const bool fSuccess = !pIter->fFailed;
+	free( (void *) pIter->zc.zc_nvlist_dst );
+	free( pIter->aFrames );
+	nv_alloc_fini( &pIter->nva );
+	free( pIter );
+	return fSuccess;
+}
+
+/*!
+	\brief Calls \p pfnDataset for the root dataset of \p szPool and all its descendants, parents before children.
+	\details The walk stops as soon as \p pfnDataset returns \c false. The nvlist passed to \p pfnDataset is only valid during the call.
+*/
+bool WalkPool( zt_context_t *const pContext, const char *const szPool, const pfnwalk_t pfnDataset, void *const pUser )
+{
+	zt_datasetiter_t *const pIter = ZT_DatasetIterOpen( pContext, szPool );
+	if( !pIter )
+		return false;
+
+	const char *szDataset;
+	nvlist_t *nvl;
+	while( ZT_DatasetIterNext( pIter, &szDataset, &nvl ) )
+		if( !pfnDataset( szDataset, nvl, pUser ) )
+		{
+			(void) ZT_DatasetIterClose( pIter );
+			return false;
+		}
+
+	return ZT_DatasetIterClose( pIter );
+}
+
+/*!
+	\details Datasets are mounted by descending org.zfstools:mountpriority, see MountPoolOrdered.
+		If mounting any dataset fails, all datasets mounted so far are unmounted again. Datasets that were mounted before (e.g. by a previous, partially failed run) are skipped and left alone.
+*/
+bool MountPool( zt_context_t *const pContext, const char *const szPool )
+{
+	return MountPoolOrdered( pContext, szPool, NULL, false );
 }
 
-bool LoadPoolKey( const char *const szEncryptionRoot, const char abKey[ 32 ] )
+bool LoadPoolKey( zt_context_t *const pContext, const char *const szEncryptionRoot, const char abKey[ 32 ] )
 {
-	const int iRet = lzc_load_key( szEncryptionRoot, false, (char *) abKey, 32 );
+	CONTEXT_SCOPE( pContext );
+
+	zfs_cmd_t zc = { 0 };
+	if( strlcpy( zc.zc_name, szEncryptionRoot, sizeof( zc.zc_name ) ) >= sizeof( zc.zc_name ) )
+	{
+		Log( LOG_ERR, "Encryption root name \"%s\" is too long.", szEncryptionRoot );
+		return false;
+	}
+
+	//The arguments are { hidden_args: { wkeydata: key } }, as built by lzc_load_key. The hidden arguments are never logged by the kernel.
+	nvpacker_t packer = { .pBuffer = NULL, .numUsed = 0 };
+	char abPacked[ 256 ];
+	for( unsigned uPass = 0; uPass < 2; ++uPass )
+	{
+		if( uPass )
+		{
+			assert( packer.numUsed <= sizeof( abPacked ) );
+			packer.pBuffer = abPacked;
+			packer.numUsed = 0;
+		}
+
+		NVPackHeader( &packer );
+		NVPackListBegin( &packer );
+		NVPackNVList( &packer, ZPOOL_HIDDEN_ARGS );
+		NVPackUInt8Array( &packer, "wkeydata", (const uint8_t *) abKey, 32 );
+		NVPackListEnd( &packer );
+		NVPackListEnd( &packer );
+	}
+
+	zc.zc_nvlist_src = (uint64_t) abPacked;
+	zc.zc_nvlist_src_size = packer.numUsed;
+	const int iRet = lzc_ioctl_fd( pContext->fdZFS, ZFS_IOC_LOAD_KEY, &zc ) == -1 ? errno : 0;
+	explicit_bzero( abPacked, sizeof( abPacked ) );
+	if( iRet == EEXIST )
+	{
+		//E.g. loaded by a previous run
+		Log( LOG_INFO, "Key for encryption root \"%s\" is already loaded.", szEncryptionRoot );
+		return true;
+	}
+
 	if( iRet )
 	{
 		const char *szError;
@@ -1325,9 +2343,6 @@ bool LoadPoolKey( const char *const szEncryptionRoot, const char abKey[ 32 ] )
 		case EINVAL:
 			szError = "Invalid parameters provided.";
 			break;
-		case EEXIST:
-			szError = "Key already loaded.";
-			break;
 		case EBUSY:
 			szError = "Dataset is busy.";
 			break;
@@ -1338,82 +2353,94 @@ bool LoadPoolKey( const char *const szEncryptionRoot, const char abKey[ 32 ] )
 			szError = "Dataset uses an unsupported encryption suite.";
 			break;
 		default:
-			syslog( LOG_ERR, "Failed to load key for encryption root \"%s\": Unknown error %d.", szEncryptionRoot, iRet );
+			Log( LOG_ERR, "Failed to load key for encryption root \"%s\": Unknown error %d.", szEncryptionRoot, iRet );
 			return false;
 		}
-		syslog( LOG_ERR, "Failed to load key for encryption root \"%s\": %s", szEncryptionRoot, szError );
+		Log( LOG_ERR, "Failed to load key for encryption root \"%s\": %s", szEncryptionRoot, szError );
 		return false;
 	}
 
 	return true;
 }
 
-void print_nvlist( nvlist_t *nvl, int indent )
+static vdevscan_t StoreVDevConfig( const unsigned uVDev, nvlist_t *const nvl, void *const pUser )
+{
+	nvlist_t **const anvl = pUser;
+	anvl[ uVDev ] = nvl;
+	return VDEVSCAN_CONTINUE;
+}
+
+/*!
+	\brief Writes the raw (unvalidated) label configuration of every vdev in \p szzVDevs to \p fd, keyed by vdev path.
+	\param szzVDevs A list of vdev paths. VDevs are separated with NULL-terminators, the list itself is finalized with a second NULL-terminators (i.e. doubly terminated at the end).
+*/
+bool DumpVDevLabels( zt_context_t *const pContext, const int fd, const char *const szzVDevs, const dumpformat_t eFormat )
 {
-	nvpair_t *nvp = NULL;
-	while( nvp = nvlist_next_nvpair( nvl, nvp ) )
+	CONTEXT_SCOPE( pContext );
+	nv_alloc_t *const nva = &pContext->nva;
+
+	bool fSuccess = false;
+	const unsigned numVDevs = CountStrings( szzVDevs );
+	nvlist_t *anvl[ numVDevs ];
+	memset( anvl, 0, sizeof( anvl ) );
+	if( !ReadVDevConfigs( pContext, szzVDevs, numVDevs, NULL, NULL, StoreVDevConfig, anvl ) )
+		goto ERROR_AFTER_VDEV;
+
+	nvlist_t *nvlLabels;
+	if( nvlist_xalloc( &nvlLabels, NV_UNIQUE_NAME, nva ) )
 	{
-		for( int i = 0; i < indent; i++ )
-			putchar( '\t' );
-		const char *name = nvpair_name( nvp );
+		Log( LOG_ERR, "Failed to allocate nvlist for vdev labels." );
+		goto ERROR_AFTER_VDEV;
+	}
 
-		switch( nvpair_type( nvp ) )
+	{
+		const char *szVDev = szzVDevs;
+		for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev, szVDev += strlen( szVDev ) + 1 )
 		{
-		case DATA_TYPE_STRING:
-			{
-				const char *value;
-				nvpair_value_string( nvp, &value );
-				printf( "%s = \"%s\"\n", name, value );
-				break;
-			}
-		case DATA_TYPE_UINT32:
-			{
-				uint32_t value;
-				nvpair_value_uint32( nvp, &value );
-				printf( "%s = %u (uint32)\n", name, (unsigned) value );
-				break;
-			}
-		case DATA_TYPE_UINT64:
-			{
-				uint64_t value;
-				nvpair_value_uint64( nvp, &value );
-				printf( "%s = %llu (uint64)\n", name, (unsigned long long) value );
-				break;
-			}
-		case DATA_TYPE_NVLIST:
-			{
-				nvlist_t *child;
-				nvpair_value_nvlist( nvp, &child );
-				printf( "%s = {\n", name );
-				print_nvlist( child, indent + 1 );
-				for( int i = 0; i < indent; i++ )
-					putchar( '\t' );
-				printf( "}\n" );
-				break;
-			}
-		case DATA_TYPE_NVLIST_ARRAY:
+			if( !anvl[ uVDev ] )
+				continue;
+
+			if( nvlist_add_nvlist( nvlLabels, szVDev, anvl[ uVDev ] ) )
 			{
-				nvlist_t **array;
-				uint_t nelem;
-				nvpair_value_nvlist_array( nvp, &array, &nelem );
-				printf( "%s = [\n", name );
-				for( uint_t i = 0; i < nelem; i++ )
-				{
-					for( int j = 0; j < indent + 1; j++ )
-						putchar('\t');
-					printf( "{\n" );
-					print_nvlist( array[i], indent + 2 );
-					for( int j = 0; j < indent + 1; j++ )
-						putchar( '\t' );
-					printf( "}%s\n", (i == nelem - 1) ? "" : "," );
-				}
-				for( int i = 0; i < indent; i++ )
-					putchar( '\t' );
-				printf( "]\n" );
-				break;
+				Log( LOG_ERR, "Failed to add vdev label of \"%s\" to dump.", szVDev );
+				goto ERROR_AFTER_LABELS;
 			}
-		default:
-			printf( "%s = <unhandled type %d>\n", name, nvpair_type( nvp ) );
 		}
 	}
-}
\ No newline at end of file
+
+	fSuccess = DumpNVList( fd, nvlLabels, eFormat );
+
+ERROR_AFTER_LABELS:
+	nvlist_free( nvlLabels );
+ERROR_AFTER_VDEV:
+	for( unsigned uVDev = 0; uVDev < numVDevs; ++uVDev )
+		nvlist_free( anvl[ uVDev ] );
+	ContextResetScratch( pContext );
+	return fSuccess;
+}
+
+/*!
+	\brief Writes the pool configuration that would be passed to TRYIMPORT to \p fd.
+	\param szzVDevs A list of vdev paths. VDevs are separated with NULL-terminators, the list itself is finalized with a second NULL-terminators (i.e. doubly terminated at the end).
+*/
+bool DumpPoolConfig( zt_context_t *const pContext, const int fd, const char *const szzVDevs, const char *const szPool, uint64_t idPool, const dumpformat_t eFormat )
+{
+	CONTEXT_SCOPE( pContext );
+	nv_alloc_t *const nva = &pContext->nva;
+
+	//Dump exactly what ImportPool would pass to the kernel
+	bool fSuccess = false;
+	size_t numPacked;
+	char *const pPacked = LoadPoolConfig( pContext, szzVDevs, NULL, szPool, &idPool, NULL, NULL, NULL, &numPacked );
+	if( pPacked )
+	{
+		nvlist_t *nvlPool;
+		if( nvlist_xunpack( pPacked, numPacked, &nvlPool, nva ) )
+			Log( LOG_ERR, "Failed to unpack pool configuration." );
+		else
+			fSuccess = DumpNVList( fd, nvlPool, eFormat );
+		free( pPacked );
+	}
+	ContextResetScratch( pContext );
+	return fSuccess;
+}
@@ -1,8 +1,167 @@
+#pragma once
 #include <libzfs_core.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <aio.h>
 
-bool ImportPool( int fdZFS, const char *szzVDevs, const char *szPool, uint64_t idPool );
-bool MountPool( int fdZFS, const char *szPool );
-bool LoadPoolKey( const char *szEncryptionRoot, const char abKey[ 32 ] );
+typedef enum
+{
+	DUMP_TEXT,
+	DUMP_JSON
+} dumpformat_t;
 
-void print_nvlist( nvlist_t *nvl, int indent );
\ No newline at end of file
+typedef struct zt_context_s zt_context_t;
+typedef struct zt_datasetiter_s zt_datasetiter_t;
+
+/*!
+	\brief Receives the messages of a context. \p iPriority is a syslog priority (e.g. \c LOG_ERR).
+	\note Called from whichever thread produced the message, including worker threads of the library.
+*/
+typedef void ( *pfnlog_t )( int iPriority, const char *szMessage, void *pUser );
+
+/*!
+	\brief Called as soon as \p szDataset is available at \p szMountPoint, either because it was mounted or because it already was, so dependent services need not wait for the rest of the pool.
+	\note Called from whichever thread mounted the dataset, including the daemon of MountPoolLazy. If the mount operation fails later on, datasets reported before may be unmounted again.
+*/
+typedef void ( *pfnmounted_t )( const char *szDataset, const char *szMountPoint, void *pUser );
+
+/*!
+	\brief Options for ZT_ContextCreate.
+*/
+typedef struct zt_options_s
+{
+	int fdZFS;			//Handle to the ZFS device, left open by ZT_ContextDestroy. If negative, the context opens its own.
+	bool fNoDevice;		//Don't open the ZFS device, for contexts only reading vdevs (ReadPoolDatasets, CreatePoolMountPoints, DumpVDevLabels, DumpPoolConfig)
+	pfnlog_t pfnLog;	//If NULL, messages go to syslog
+	void *pLogUser;
+	pfnmounted_t pfnMounted;	//Optional
+	void *pMountedUser;
+} zt_options_t;
+
+/*!
+	\brief Callback for LoadPoolKeys, loading the key of \p szEncryptionRoot (e.g. using LoadPoolKey with \p pContext). May be called from multiple threads at once.
+*/
+typedef bool ( *pfnloadkey_t )( zt_context_t *pContext, const char *szEncryptionRoot, void *pUser );
+
+/*!
+	\brief Callback for ReadPoolDatasets. \p szMountPoint is \c NULL if the dataset is not mounted automatically, \p szEncryptionRoot if it is not encrypted.
+*/
+typedef bool ( *pfnpooldataset_t )( const char *szDataset, const char *szMountPoint, const char *szEncryptionRoot, void *pUser );
+
+/*!
+	\brief Limits for PrewarmPool. A budget of 0 is unlimited.
+*/
+typedef struct zt_prewarmoptions_s
+{
+	unsigned uDepth;			//Directory levels read below each mountpoint, 0 for the mountpoint only
+	uint64_t numMaxBytes;		//Budget of directory entry bytes read, over all datasets
+	unsigned uMaxMilliseconds;	//Time budget
+} zt_prewarmoptions_t;
+
+/*!
+	\brief What PrewarmPool warmed.
+*/
+typedef struct zt_prewarmstats_s
+{
+	uint64_t numEntries;		//Directory entries whose metadata was read
+	uint64_t numBytes;			//Directory entry bytes read
+	uint64_t numMilliseconds;
+	size_t numDatasets;
+	bool fExhausted;			//The walk was stopped by a budget
+} zt_prewarmstats_t;
+
+#define ZT_VDEV_LABELS_SIZE	( 4 * 256 * 1024 )	//Bytes of the labels of one vdev
+#define ZT_TIMING_NONE		UINT32_MAX			//A step of zt_vdevtiming_t that did not happen
+
+/*!
+	\brief How reading the labels of one vdev went, in microseconds. Reported by ReportVDevTimings.
+*/
+typedef struct zt_vdevtiming_s
+{
+	uint32_t uAppeared;		//Since the scan started, when the vdev was opened
+	uint32_t uOpen;			//Opening the vdev and submitting its reads (or mapping its labels)
+	uint32_t auRead[ 2 ];	//From submission until the front and back half of the labels arrived. Not measured for mapped labels.
+	bool fRead;				//The labels were unpacked, i.e. the scan did not stop before
+	bool fValid;			//A valid label was found and passed validation
+} zt_vdevtiming_t;
+
+/*!
+	\brief State of reading the labels of a list of vdevs. Defined statically using ZT_VDEV_READS if the vdevs are known at build time,
+		so ImportPoolStatic neither scans the vdev list nor allocates anything before the first read.
+	\note Used by one call at a time. A call finding it busy (e.g. while reads of a previous call still complete in the background) allocates its own.
+*/
+typedef struct zt_vdevreads_s
+{
+	const char *szzVDevs;				//The vdev paths, separated and doubly terminated by NULL-terminators
+	const char *const *aszVDevs;		//The same paths as array
+	unsigned numVDevs;
+	unsigned numPending;
+	struct aiocb *aiocbs;				//Per vdev, one for the front half of the labels, the consecutive one for the back half
+	const struct aiocb **apcbPending;	//For aio_suspend, NULL for reads that are not in progress
+	const void **apMapped;				//Per vdev, the front and back half of the labels of a file-backed vdev
+	uint8_t *aeState;					//Per vdev, how far reading it got
+	char *pLabels;						//ZT_VDEV_LABELS_SIZE per vdev and page aligned, or NULL to allocate them per vdev
+	nvlist_t **anvl;					//Per vdev, the unpacked config
+	unsigned *auBatch;					//Vdevs unpacked together
+	bool *afValid;						//Per vdev, whether the config passed validation
+	zt_vdevtiming_t *aTimings;			//Per vdev
+	uint64_t uStarted;					//CLOCK_MONOTONIC microseconds when the scan started
+	bool fStatic;
+	atomic_flag fBusy;
+} zt_vdevreads_t;
+
+/*!
+	\brief Defines the static zt_vdevreads_t \p name for the vdev path array \p aszPaths, with \p szzPaths listing the same paths doubly terminated.
+*/
+#define ZT_VDEV_READS( name, szzPaths, aszPaths ) \
+	enum { name##_numVDevs = sizeof( aszPaths ) / sizeof( aszPaths[ 0 ] ) }; \
+	static struct aiocb name##_aiocbs[ name##_numVDevs * 2 ]; \
+	static const struct aiocb *name##_apcbPending[ name##_numVDevs * 2 ]; \
+	static const void *name##_apMapped[ name##_numVDevs * 2 ]; \
+	static uint8_t name##_aeState[ name##_numVDevs ]; \
+	static _Alignas( 4096 ) char name##_abLabels[ name##_numVDevs * ZT_VDEV_LABELS_SIZE ]; \
+	static nvlist_t *name##_anvl[ name##_numVDevs ]; \
+	static unsigned name##_auBatch[ name##_numVDevs ]; \
+	static bool name##_afValid[ name##_numVDevs ]; \
+	static zt_vdevtiming_t name##_aTimings[ name##_numVDevs ]; \
+	static zt_vdevreads_t name = \
+	{ \
+		.szzVDevs = szzPaths, .aszVDevs = aszPaths, .numVDevs = name##_numVDevs, \
+		.aiocbs = name##_aiocbs, .apcbPending = name##_apcbPending, .apMapped = name##_apMapped, .aeState = name##_aeState, .pLabels = name##_abLabels, \
+		.anvl = name##_anvl, .auBatch = name##_auBatch, .afValid = name##_afValid, .aTimings = name##_aTimings, .fStatic = true, .fBusy = ATOMIC_FLAG_INIT \
+	}
+
+/*
+	A context owns the handle to the ZFS device, the scratch memory of imports and dumps, and the logger. There is no process-wide state,
+	so contexts are independent of each other and may be used from different threads at the same time.
+	Calls on the same context may overlap, except for ImportPool, ImportPoolStatic, DumpVDevLabels and DumpPoolConfig which use the context's scratch memory.
+	ReportVDevTimings reports the label scan of the last of these calls, so it must not overlap with them either.
+	A dataset iterator belongs to one thread at a time.
+*/
+zt_context_t *ZT_ContextCreate( const zt_options_t *pOptions );
+void ZT_ContextDestroy( zt_context_t *pContext );
+
+bool ImportPool( zt_context_t *pContext, const char *szzVDevs, const char *szPool, uint64_t idPool );
+bool ImportPoolStatic( zt_context_t *pContext, zt_vdevreads_t *pReads, const char *szPool, uint64_t idPool );
+bool ReportVDevTimings( zt_context_t *pContext, const char *szStatsPath );
+bool MountPool( zt_context_t *pContext, const char *szPool );
+bool MountPoolLazy( zt_context_t *pContext, const char *szPool );
+bool MountPoolCached( zt_context_t *pContext, const char *szPool, const char *szPlanPath );
+bool MountPoolBackground( zt_context_t *pContext, const char *szPool, const char *szPlanPath );
+bool PrewarmPool( zt_context_t *pContext, const char *szPool, const zt_prewarmoptions_t *pOptions, zt_prewarmstats_t *pStats );
+bool UnmountPool( zt_context_t *pContext, const char *szPool, bool fForce );
+bool ExportPool( zt_context_t *pContext, const char *szPool, bool fForce );
+bool ReadPoolDatasets( zt_context_t *pContext, const char *szzVDevs, const char *szPool, uint64_t idPool, pfnpooldataset_t pfnDataset, void *pUser );
+bool CreatePoolMountPoints( zt_context_t *pContext, const char *szzVDevs, const char *szPool, uint64_t idPool );
+zt_datasetiter_t *ZT_DatasetIterOpen( zt_context_t *pContext, const char *szPool );
+bool ZT_DatasetIterNext( zt_datasetiter_t *pIter, const char **pszDataset, nvlist_t **pnvl );
+bool ZT_DatasetIterClose( zt_datasetiter_t *pIter );
+
+bool LoadPoolKey( zt_context_t *pContext, const char *szEncryptionRoot, const char abKey[ 32 ] );
+bool LoadPoolKeys( zt_context_t *pContext, const char *szPool, pfnloadkey_t pfnLoadKey, void *pUser );
+
+char *FormatNVList( nvlist_t *nvl, dumpformat_t eFormat, size_t *pLength );
+bool DumpNVList( int fd, nvlist_t *nvl, dumpformat_t eFormat );
+bool DumpVDevLabels( zt_context_t *pContext, int fd, const char *szzVDevs, dumpformat_t eFormat );
+bool DumpPoolConfig( zt_context_t *pContext, int fd, const char *szzVDevs, const char *szPool, uint64_t idPool, dumpformat_t eFormat );